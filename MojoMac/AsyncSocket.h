@@ -13,6 +13,7 @@
 @class AsyncSocket;
 @class AsyncReadPacket;
 @class AsyncWritePacket;
+@class AsyncSocketEventLoop;
 
 extern NSString *const AsyncSocketException;
 extern NSString *const AsyncSocketErrorDomain;
@@ -67,6 +68,12 @@ typedef enum AsyncSocketError AsyncSocketError;
  * If the connectToAddress:error: method was called, the delegate will be able to access and configure the
  * CFSocket and CFSocketNativeHandle (BSD socket) as desired prior to connection. You will be able to access and
  * configure the CFReadStream and CFWriteStream in the onSocket:didConnectToHost:port: method.
+ * 
+ * For a socket accepted by a listening socket that uses the event loop (see setUsesEventLoop:),
+ * this method is called before it's known whether the socket will have streams at all.
+ * So getCFReadStream and getCFWriteStream always return NULL here, even if the socket then falls back to streams
+ * (because startTLS was called from this method). Such a socket's streams may be configured in
+ * onSocket:didConnectToHost:port: instead.
 **/
 - (BOOL)onSocketWillConnect:(AsyncSocket *)sock;
 
@@ -116,6 +123,8 @@ typedef enum AsyncSocketError AsyncSocketError;
 	CFRunLoopSourceRef theSource4;     // For theSocket4
 	CFRunLoopSourceRef theSource6;     // For theSocket6
 	CFRunLoopRef theRunLoop;
+	AsyncSocketEventLoop *theEventLoop; // Used instead of the streams, if set (see setUsesEventLoop:)
+	int theSocketErrno;                 // From the last failed read or write, when using the event loop
 	CFSocketContext theContext;
 	NSArray *theRunLoopModes;
 	
@@ -125,6 +134,7 @@ typedef enum AsyncSocketError AsyncSocketError;
 	AsyncReadPacket *theCurrentRead;
 	NSTimer *theReadTimer;
 	NSMutableData *partialReadBuffer;
+	CFIndex partialReadOffset;         // Bytes at the front of partialReadBuffer that have already been read
 	
 	NSMutableArray *theWriteQueue;
 	AsyncWritePacket *theCurrentWrite;
@@ -156,6 +166,7 @@ typedef enum AsyncSocketError AsyncSocketError;
 - (void)setUserData:(long)userData;
 
 /* Don't use these to read or write. And don't close them, either! */
+/* The streams are NULL for sockets on the event loop (see setUsesEventLoop:). */
 - (CFSocketRef)getCFSocket;
 - (CFReadStreamRef)getCFReadStream;
 - (CFWriteStreamRef)getCFWriteStream;
@@ -317,6 +328,26 @@ typedef enum AsyncSocketError AsyncSocketError;
 **/
 - (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag;
 
+/**
+ * Writes part of a file to the socket, and calls the delegate when finished.
+ * 
+ * Sockets on the event loop (see setUsesEventLoop:) send the file with sendfile, straight from the file system cache,
+ * without it ever being copied into the application. Other sockets read the file in chunks, and write it as usual.
+ * 
+ * The file handle is retained until the write completes. Its current file offset is neither used nor changed.
+ * If you pass in a nil file handle or a zero length, this method does nothing and the delegate will not be called.
+**/
+- (void)writeFile:(NSFileHandle *)fileHandle
+		   offset:(UInt64)offset
+		   length:(UInt64)length
+	  withTimeout:(NSTimeInterval)timeout
+			  tag:(long)tag;
+
+/**
+ * Returns whether writeFile:offset:length:withTimeout:tag: sends files without copying them.
+**/
+- (BOOL)canWriteFilesWithoutCopying;
+
 /**
  * Returns progress of current read or write, from 0.0 to 1.0, or NaN if no read/write (use isnan() to check).
  * "tag", "done" and "total" will be filled in if they aren't NULL.
@@ -364,6 +395,26 @@ typedef enum AsyncSocketError AsyncSocketError;
 **/
 - (void)enablePreBuffering;
 
+/**
+ * Every connected socket normally has a CFReadStream and a CFWriteStream, each of which is a separate run loop source,
+ * with its own buffers. That's fine for a handful of connections, but a server holding open thousands of idle
+ * keep-alive connections pays for every one of them.
+ * 
+ * If the event loop is used, sockets accepted by this (listening) socket skip the streams.
+ * Instead their native sockets are made non-blocking, and added to a kqueue shared by all such sockets on the
+ * same run loop, which is itself a single run loop source. Readiness is edge-triggered, so an idle connection costs
+ * nothing at all until data arrives. The delegate methods are the same either way.
+ * 
+ * A few things require the streams, and so don't work on the event loop:
+ * - Securing an accepted socket with startTLS, unless it's called from onSocketWillConnect:,
+ *   in which case that socket falls back to using streams. (This is how HTTPConnection sets up HTTPS.)
+ * - Configuring the streams from onSocketWillConnect:, as getCFReadStream and getCFWriteStream return NULL.
+ * 
+ * This setting has no effect on outgoing connections. The default is NO.
+**/
+- (BOOL)usesEventLoop;
+- (void)setUsesEventLoop:(BOOL)flag;
+
 /**
  * When you create an AsyncSocket, it is added to the runloop of the current thread.
  * So for manually created sockets, it is easiest to simply create the socket on the thread you intend to use it.
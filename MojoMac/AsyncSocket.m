@@ -13,6 +13,11 @@
 #import <netinet/in.h>
 #import <arpa/inet.h>
 #import <netdb.h>
+#import <sys/event.h>
+#import <sys/uio.h>
+#import <fcntl.h>
+#import <unistd.h>
+#import <pthread.h>
 
 #if TARGET_OS_IPHONE
 // Note: You may need to add the CFNetwork Framework to your project
@@ -27,6 +32,11 @@
 #define WRITEQUEUE_CAPACITY 5           // Initial capacity
 #define READALL_CHUNKSIZE	256         // Incremental increase in buffer size
 #define WRITE_CHUNKSIZE    (1024 * 4)   // Limit on size of each write pass
+#define SECURE_WRITE_CHUNKSIZE (1024 * 16) // Limit on size of each write pass once secured (a full TLS record)
+#define PREBUFFER_CHUNKSIZE (1024 * 16) // Size of each pre-buffered read (see enablePreBuffering)
+#define EVENTLOOP_BATCH_SIZE  64        // Maximum number of kqueue events handled per pass
+#define WRITEV_MAX_IOVECS     32        // Maximum number of write packets gathered into a single writev
+#define WRITEV_MAX_LENGTH    (1024 * 64)  // Stop gathering write packets once this many bytes are gathered
 
 NSString *const AsyncSocketException = @"AsyncSocketException";
 NSString *const AsyncSocketErrorDomain = @"AsyncSocketErrorDomain";
@@ -48,6 +58,10 @@ enum AsyncSocketFlags
 	kClosingWithError        = 1 <<  8,  // If set, the socket is being closed due to an error
 	kDequeueReadScheduled    = 1 <<  9,  // If set, a maybeDequeueRead operation is already scheduled
 	kDequeueWriteScheduled   = 1 << 10,  // If set, a maybeDequeueWrite operation is already scheduled
+	kUseEventLoop            = 1 << 11,  // If set, accepted sockets use the event loop instead of streams
+	kSocketCanRead           = 1 << 12,  // If set, the event loop socket hasn't returned EAGAIN since it was readable
+	kSocketCanWrite          = 1 << 13,  // If set, the event loop socket hasn't returned EAGAIN since it was writable
+	kDidSecure               = 1 << 14,  // If set, TLS has been successfully started
 };
 
 @interface AsyncSocket (Private)
@@ -73,6 +87,16 @@ enum AsyncSocketFlags
 - (BOOL)openStreamsAndReturnError:(NSError **)errPtr;
 - (void)doStreamOpen;
 - (BOOL)setSocketFromStreamsAndReturnError:(NSError **)errPtr;
+- (BOOL)setSocketFromNative:(CFSocketNativeHandle)native error:(NSError **)errPtr;
+
+// Event Loop Implementation
+- (BOOL)isTLSQueued;
+- (BOOL)attachNativeToEventLoop:(CFSocketNativeHandle)native runLoop:(NSRunLoop *)runLoop error:(NSError **)errPtr;
+- (void)doEventLoopOpen;
+- (CFSocketNativeHandle)nativeSocket;
+- (BOOL)isRunLoopInSocketMode;
+- (void)doSocketReadable;
+- (void)doSocketWritable;
 
 // Disconnect Implementation
 - (void)closeWithError:(NSError *)err;
@@ -82,6 +106,9 @@ enum AsyncSocketFlags
 
 // Errors
 - (NSError *)getErrnoError;
+- (NSError *)errorFromErrno:(int)code;
+- (NSError *)getReadError;
+- (NSError *)getWriteError;
 - (NSError *)getAbortError;
 - (NSError *)getStreamError;
 - (NSError *)getSocketError;
@@ -102,6 +129,9 @@ enum AsyncSocketFlags
 - (UInt16)addressPort:(CFDataRef)cfaddr;
 
 // Reading
+- (BOOL)socketHasBytesAvailable;
+- (CFIndex)readFromSocket:(UInt8 *)buffer maxLength:(CFIndex)length;
+- (void)compactPartialReadBuffer;
 - (void)doBytesAvailable;
 - (void)completeCurrentRead;
 - (void)endCurrentRead;
@@ -111,9 +141,13 @@ enum AsyncSocketFlags
 
 // Writing
 - (void)doSendBytes;
+- (int)gatherWritesIntoVector:(struct iovec *)vector;
+- (void)doSendGatheredBytes;
+- (void)doSendFileBytes;
 - (void)completeCurrentWrite;
 - (void)endCurrentWrite;
 - (void)scheduleDequeueWrite;
+- (void)startWriteTimeout;
 - (void)maybeDequeueWrite;
 - (void)maybeScheduleDisconnect;
 - (void)doWriteTimeout:(NSTimer *)timer;
@@ -140,11 +174,41 @@ enum AsyncSocketFlags
 static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, const void *, void *);
 static void MyCFReadStreamCallback(CFReadStreamRef stream, CFStreamEventType type, void *pInfo);
 static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType type, void *pInfo);
+static void MyCFFileDescriptorCallback(CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void *pInfo);
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Returns the index of the first occurrence of the term within the given bytes, or -1 if there isn't one.
+ * 
+ * Rather than comparing the term at every offset, we use memchr to skip straight to each occurrence of its first byte.
+ * The libc memchr is vectorized (SSE2 on Intel), and the first byte of a term (such as the CR of a CRLF)
+ * is usually rare in the data, so this is much faster for anything more than a few bytes.
+**/
+static CFIndex AsyncSocketFindTerm(const UInt8 *bytes, CFIndex length, const UInt8 *term, CFIndex termLength)
+{
+	const UInt8 *p = bytes;
+	const UInt8 *end = bytes + length;
+	
+	while((end - p) >= termLength)
+	{
+		p = memchr(p, term[0], (end - p) - termLength + 1);
+		
+		if(p == NULL) break;
+		
+		if(memcmp(p, term, termLength) == 0)
+		{
+			return p - bytes;
+		}
+		
+		p++;
+	}
+	
+	return -1;
+}
+
 /**
  * The AsyncReadPacket encompasses the instructions for any given read.
  * The content of a read packet allows the code to determine if we're:
@@ -171,6 +235,7 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 	  	 maxLength:(CFIndex)m;
 
 - (unsigned)readLengthForTerm;
+- (unsigned)readLengthForTermInPreBuffer:(const UInt8 *)preBytes length:(CFIndex)preLength;
 
 - (unsigned)prebufferReadLengthForTerm;
 - (CFIndex)searchForTermAfterPreBuffering:(CFIndex)numBytes;
@@ -247,6 +312,56 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 		return result;
 }
 
+/**
+ * For read packets with a set terminator, returns the length of data that can be taken from the given pre-buffer
+ * in one go: up to and including the first term, or the entire pre-buffer if it doesn't contain a term.
+ * Either way, it won't go over the maxLength.
+ * 
+ * This takes into account a partial term at the end of the packet buffer, which the pre-buffer may complete.
+ * It is assumed the terminator has not already been read.
+**/
+- (unsigned)readLengthForTermInPreBuffer:(const UInt8 *)preBytes length:(CFIndex)preLength
+{
+	NSAssert(term != nil, @"Searching for term in data when there is no term.");
+	
+	const UInt8 *termBytes = [term bytes];
+	CFIndex termLength = [term length];
+	
+	CFIndex result = -1;
+	
+	// First check for a term that began in the packet buffer, with the start of the pre-buffer as its remainder.
+	// The longer the partial term already read, the earlier the term starts, so we check those first.
+	
+	CFIndex j = MIN(termLength - 1, bytesDone);
+	
+	while(j > 0)
+	{
+		const void *subBuffer = [buffer bytes] + bytesDone - j;
+		
+		if((termLength - j <= preLength) &&
+		   (memcmp(subBuffer, termBytes, j) == 0) && (memcmp(preBytes, termBytes + j, termLength - j) == 0))
+		{
+			result = termLength - j;
+			break;
+		}
+		
+		j--;
+	}
+	
+	// Otherwise look for the term within the pre-buffer itself
+	if(result < 0)
+	{
+		CFIndex termIndex = AsyncSocketFindTerm(preBytes, preLength, termBytes, termLength);
+		
+		result = (termIndex >= 0) ? (termIndex + termLength) : preLength;
+	}
+	
+	if(maxLength > 0)
+		return MIN(result, (maxLength - bytesDone));
+	else
+		return result;
+}
+
 /**
  * Assuming pre-buffering is enabled, returns the amount of data that can be read
  * without going over the maxLength.
@@ -254,9 +369,9 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 - (unsigned)prebufferReadLengthForTerm
 {
 	if(maxLength > 0)
-		return MIN(READALL_CHUNKSIZE, (maxLength - bytesDone));
+		return MIN(PREBUFFER_CHUNKSIZE, (maxLength - bytesDone));
 	else
-		return READALL_CHUNKSIZE;
+		return PREBUFFER_CHUNKSIZE;
 }
 
 /**
@@ -280,16 +395,11 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 	
 	CFIndex i = MAX(0, (CFIndex)(bytesDone - numBytes - [term length] + 1));
 	
-	while(i + [term length] <= bytesDone)
+	CFIndex termIndex = AsyncSocketFindTerm([buffer bytes] + i, bytesDone - i, [term bytes], [term length]);
+	
+	if(termIndex >= 0)
 	{
-		const void *subBuffer = [buffer bytes] + i;
-		
-		if(memcmp(subBuffer, [term bytes], [term length]) == 0)
-		{
-			return bytesDone - (i + [term length]);
-		}
-		
-		i++;
+		return bytesDone - (i + termIndex + [term length]);
 	}
 	
 	return -1;
@@ -348,6 +458,45 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 #pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * The AsyncFilePacket is a write packet whose data comes from a file, rather than a buffer.
+ * Its buffer is nil, and the bytesDone are counted from the fileOffset.
+**/
+@interface AsyncFilePacket : AsyncWritePacket
+{
+  @public
+	NSFileHandle *fileHandle;
+	UInt64 fileOffset;
+	UInt64 fileLength;
+}
+- (id)initWithFileHandle:(NSFileHandle *)f offset:(UInt64)o length:(UInt64)l timeout:(NSTimeInterval)t tag:(long)i;
+@end
+
+@implementation AsyncFilePacket
+
+- (id)initWithFileHandle:(NSFileHandle *)f offset:(UInt64)o length:(UInt64)l timeout:(NSTimeInterval)t tag:(long)i
+{
+	if((self = [super initWithData:nil timeout:t tag:i]))
+	{
+		fileHandle = [f retain];
+		fileOffset = o;
+		fileLength = l;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[fileHandle release];
+	[super dealloc];
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 /**
  * The AsyncSpecialPacket encompasses special instructions for interruptions in the read/write queues.
  * This class my be altered to support more than just TLS in the future.
@@ -383,6 +532,188 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 #pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * The AsyncSocketEventLoop watches the native sockets of many AsyncSockets with a single kqueue,
+ * which is added to the run loop as a single source.
+ * There's one per run loop, shared by all the sockets on that run loop that use the event loop.
+ * 
+ * Sockets are registered edge-triggered (EV_CLEAR), so an event is only delivered when a socket becomes readable
+ * (or writable) again. The socket remembers this, and keeps reading (or writing) until it gets EAGAIN.
+ * 
+ * Sockets may be added from another thread (when moving a socket to this run loop),
+ * but events are only ever delivered on the run loop's own thread.
+**/
+@interface AsyncSocketEventLoop : NSObject
+{
+	int kq;
+	CFFileDescriptorRef kqDescriptor;
+	CFRunLoopSourceRef kqSource;
+	
+	pthread_mutex_t lock;
+	CFMutableSetRef sockets;  // Registered AsyncSockets (not retained)
+}
++ (AsyncSocketEventLoop *)eventLoopForRunLoop:(CFRunLoopRef)runLoop;
+- (id)initWithRunLoop:(CFRunLoopRef)runLoop;
+- (BOOL)addSocket:(AsyncSocket *)socket native:(CFSocketNativeHandle)native;
+- (void)removeSocket:(AsyncSocket *)socket native:(CFSocketNativeHandle)native;
+- (void)doKqueueEvents;
+@end
+
+@implementation AsyncSocketEventLoop
+
+// The event loop for each run loop, keyed by CFRunLoop.
+// Event loops are never removed, as they're cheap when idle, and threads with run loops tend to live long anyway.
+static CFMutableDictionaryRef eventLoops;
+
++ (AsyncSocketEventLoop *)eventLoopForRunLoop:(CFRunLoopRef)runLoop
+{
+	AsyncSocketEventLoop *eventLoop;
+	
+	@synchronized(self)
+	{
+		if(eventLoops == NULL)
+		{
+			eventLoops = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+												   &kCFTypeDictionaryKeyCallBacks, &kCFTypeDictionaryValueCallBacks);
+		}
+		
+		eventLoop = (AsyncSocketEventLoop *)CFDictionaryGetValue(eventLoops, runLoop);
+		if(eventLoop == nil)
+		{
+			eventLoop = [[AsyncSocketEventLoop alloc] initWithRunLoop:runLoop];
+			if(eventLoop)
+			{
+				CFDictionarySetValue(eventLoops, runLoop, eventLoop);
+				[eventLoop release];
+			}
+		}
+	}
+	
+	return eventLoop;
+}
+
+- (id)initWithRunLoop:(CFRunLoopRef)runLoop
+{
+	if((self = [super init]))
+	{
+		kq = kqueue();
+		if(kq < 0)
+		{
+			NSLog(@"AsyncSocketEventLoop couldn't create kqueue: %s", strerror(errno));
+			
+			[self release];
+			return nil;
+		}
+		
+		pthread_mutex_init(&lock, NULL);
+		sockets = CFSetCreateMutable(kCFAllocatorDefault, 0, NULL);
+		
+		// The kqueue descriptor becomes readable whenever it has events waiting
+		CFFileDescriptorContext context = {0, self, NULL, NULL, NULL};
+		
+		kqDescriptor = CFFileDescriptorCreate(kCFAllocatorDefault, kq, true, MyCFFileDescriptorCallback, &context);
+		kqSource = CFFileDescriptorCreateRunLoopSource(kCFAllocatorDefault, kqDescriptor, 0);
+		
+		// The sockets check their own run loop modes when they get an event
+		CFRunLoopAddSource(runLoop, kqSource, kCFRunLoopCommonModes);
+		CFFileDescriptorEnableCallBacks(kqDescriptor, kCFFileDescriptorReadCallBack);
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	if(kqSource)
+	{
+		CFRunLoopSourceInvalidate(kqSource);
+		CFRelease(kqSource);
+	}
+	if(kqDescriptor)
+	{
+		// Closes the kqueue, since it was created with closeOnInvalidate
+		CFFileDescriptorInvalidate(kqDescriptor);
+		CFRelease(kqDescriptor);
+	}
+	if(sockets)
+	{
+		CFRelease(sockets);
+		pthread_mutex_destroy(&lock);
+	}
+	[super dealloc];
+}
+
+- (BOOL)addSocket:(AsyncSocket *)socket native:(CFSocketNativeHandle)native
+{
+	struct kevent changes[2];
+	EV_SET(&changes[0], native, EVFILT_READ,  EV_ADD | EV_CLEAR, 0, 0, socket);
+	EV_SET(&changes[1], native, EVFILT_WRITE, EV_ADD | EV_CLEAR, 0, 0, socket);
+	
+	pthread_mutex_lock(&lock);
+	CFSetAddValue(sockets, socket);
+	pthread_mutex_unlock(&lock);
+	
+	if(kevent(kq, changes, 2, NULL, 0, NULL) < 0)
+	{
+		pthread_mutex_lock(&lock);
+		CFSetRemoveValue(sockets, socket);
+		pthread_mutex_unlock(&lock);
+		
+		return NO;
+	}
+	
+	return YES;
+}
+
+- (void)removeSocket:(AsyncSocket *)socket native:(CFSocketNativeHandle)native
+{
+	struct kevent changes[2];
+	EV_SET(&changes[0], native, EVFILT_READ,  EV_DELETE, 0, 0, NULL);
+	EV_SET(&changes[1], native, EVFILT_WRITE, EV_DELETE, 0, 0, NULL);
+	
+	kevent(kq, changes, 2, NULL, 0, NULL);
+	
+	pthread_mutex_lock(&lock);
+	CFSetRemoveValue(sockets, socket);
+	pthread_mutex_unlock(&lock);
+}
+
+- (void)doKqueueEvents
+{
+	struct kevent events[EVENTLOOP_BATCH_SIZE];
+	struct timespec timeout = {0, 0};
+	
+	int count = kevent(kq, NULL, 0, events, EVENTLOOP_BATCH_SIZE, &timeout);
+	
+	int i;
+	for(i = 0; i < count; i++)
+	{
+		AsyncSocket *socket = (AsyncSocket *)events[i].udata;
+		
+		// An earlier socket in the batch (or its delegate) may have closed, or even released, this one
+		pthread_mutex_lock(&lock);
+		BOOL isRegistered = CFSetContainsValue(sockets, socket);
+		pthread_mutex_unlock(&lock);
+		
+		if(!isRegistered) continue;
+		
+		[[socket retain] autorelease];
+		
+		if(events[i].filter == EVFILT_READ)
+			[socket doSocketReadable];
+		else if(events[i].filter == EVFILT_WRITE)
+			[socket doSocketWritable];
+	}
+	
+	// If there were more events than fit in the batch, the kqueue is still readable, and we'll be called right back
+	CFFileDescriptorEnableCallBacks(kqDescriptor, kCFFileDescriptorReadCallBack);
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 @implementation AsyncSocket
 
 - (id)init
@@ -411,6 +742,8 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 		theRunLoop = NULL;
 		theReadStream = NULL;
 		theWriteStream = NULL;
+		theEventLoop = nil;
+		theSocketErrno = 0;
 		
 		theConnectTimer = nil;
 		
@@ -418,7 +751,8 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 		theCurrentRead = nil;
 		theReadTimer = nil;
 		
-		partialReadBuffer = [[NSMutableData alloc] initWithCapacity:READALL_CHUNKSIZE];
+		partialReadBuffer = [[NSMutableData alloc] initWithCapacity:PREBUFFER_CHUNKSIZE];
+		partialReadOffset = 0;
 		
 		theWriteQueue = [[NSMutableArray alloc] initWithCapacity:WRITEQUEUE_CAPACITY];
 		theCurrentWrite = nil;
@@ -526,6 +860,8 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 	if (!theCurrentWrite) return NAN;
 	CFIndex d = theCurrentWrite->bytesDone;
 	CFIndex t = [theCurrentWrite->buffer length];
+	if ([theCurrentWrite isKindOfClass:[AsyncFilePacket class]])
+		t = ((AsyncFilePacket *)theCurrentWrite)->fileLength;
 	if (tag != NULL)   *tag = theCurrentWrite->tag;
 	if (done != NULL)  *done = d;
 	if (total != NULL) *total = t;
@@ -611,6 +947,22 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 	theFlags |= kEnablePreBuffering;
 }
 
+/**
+ * See the header file for a full explanation of the event loop.
+**/
+- (BOOL)usesEventLoop
+{
+	return (theFlags & kUseEventLoop) ? YES : NO;
+}
+
+- (void)setUsesEventLoop:(BOOL)flag
+{
+	if(flag)
+		theFlags |= kUseEventLoop;
+	else
+		theFlags &= ~kUseEventLoop;
+}
+
 /**
  * See the header file for a full explanation of this method.
 **/
@@ -651,6 +1003,24 @@ static void MyCFWriteStreamCallback(CFWriteStreamRef stream, CFStreamEventType t
 	
 	theRunLoop = [runLoop getCFRunLoop];
 	
+	if(theEventLoop)
+	{
+		CFSocketNativeHandle native = [self nativeSocket];
+		
+		[theEventLoop removeSocket:self native:native];
+		[theEventLoop release];
+		
+		theEventLoop = [[AsyncSocketEventLoop eventLoopForRunLoop:theRunLoop] retain];
+		
+		if(![theEventLoop addSocket:self native:native])
+		{
+			[theEventLoop release];
+			theEventLoop = nil;
+			
+			return NO;
+		}
+	}
+	
 	if(theReadTimer) [self runLoopAddTimer:theReadTimer];
 	if(theWriteTimer) [self runLoopAddTimer:theWriteTimer];
 	
@@ -1231,14 +1601,55 @@ Failed:
 			runLoop = [theDelegate onSocket:self wantsRunLoopForNewSocket:newSocket];
 		
 		BOOL pass = YES;
+		BOOL useEventLoop = NO;
 		
-		if(pass && ![newSocket createStreamsFromNative:newNative error:nil]) pass = NO;
-		if(pass && ![newSocket attachStreamsToRunLoop:runLoop error:nil])    pass = NO;
-		if(pass && ![newSocket configureStreamsAndReturnError:nil])          pass = NO;
-		if(pass && ![newSocket openStreamsAndReturnError:nil])               pass = NO;
+		if(theFlags & kUseEventLoop)
+		{
+			// Ask the delegate first, as securing the connection from onSocketWillConnect: requires streams.
+			if(![newSocket configureStreamsAndReturnError:nil])
+			{
+				// Nothing owns the native socket yet, so we have to close it ourselves
+				close(newNative);
+				pass = NO;
+			}
+			
+			useEventLoop = ![newSocket isTLSQueued];
+		}
+		
+		if(useEventLoop)
+		{
+			if(pass && ![newSocket attachNativeToEventLoop:newNative runLoop:runLoop error:nil]) pass = NO;
+		}
+		else
+		{
+			if(pass && ![newSocket createStreamsFromNative:newNative error:nil]) pass = NO;
+			if(pass && ![newSocket attachStreamsToRunLoop:runLoop error:nil])    pass = NO;
+			
+			if(!(theFlags & kUseEventLoop))
+			{
+				if(pass && ![newSocket configureStreamsAndReturnError:nil])      pass = NO;
+			}
+			
+			if(pass && ![newSocket openStreamsAndReturnError:nil])               pass = NO;
+		}
 		
 		if(pass)
+		{
 			newSocket->theFlags |= kDidPassConnectMethod;
+			
+			if(useEventLoop)
+			{
+				// There's no stream to tell us it opened, so we do it ourselves, on the socket's own run loop.
+				NSRunLoop *socketRunLoop = (runLoop == nil) ? [NSRunLoop currentRunLoop] : runLoop;
+				
+				[socketRunLoop performSelector:@selector(doEventLoopOpen)
+				                        target:newSocket
+				                      argument:nil
+				                         order:0
+				                         modes:theRunLoopModes];
+				CFRunLoopWakeUp([socketRunLoop getCFRunLoop]);
+			}
+		}
 		else {
 			// No NSError, but errors will still get logged from the above functions.
 			[newSocket close];
@@ -1490,6 +1901,15 @@ Failed:
 	CFDataGetBytes(nativeProp, CFRangeMake(0, CFDataGetLength(nativeProp)), (UInt8 *)&native);
 	CFRelease(nativeProp);
 	
+	return [self setSocketFromNative:native error:errPtr];
+}
+
+/**
+ * Wraps the given (connected) native socket in a CFSocket, without any callbacks,
+ * and sets it as either theSocket4 or theSocket6.
+**/
+- (BOOL)setSocketFromNative:(CFSocketNativeHandle)native error:(NSError **)errPtr
+{
 	CFSocketRef theSocket = CFSocketCreateWithNative(kCFAllocatorDefault, native, 0, NULL, NULL);
 	if(theSocket == NULL)
 	{
@@ -1524,6 +1944,150 @@ Failed:
 	return YES;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Event Loop Implementation
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Returns whether startTLS has been called, but not yet acted upon.
+**/
+- (BOOL)isTLSQueued
+{
+	Class SpecialPacketClass = [AsyncSpecialPacket class];
+	
+	unsigned i, count = [theReadQueue count];
+	for(i = 0; i < count; i++)
+	{
+		if([[theReadQueue objectAtIndex:i] isKindOfClass:SpecialPacketClass])
+		{
+			return YES;
+		}
+	}
+	return NO;
+}
+
+/**
+ * Sets up the given (accepted) native socket to be read and written directly, on the event loop of the given run loop.
+ * This is used instead of createStreamsFromNative:, attachStreamsToRunLoop: and openStreamsAndReturnError:.
+**/
+- (BOOL)attachNativeToEventLoop:(CFSocketNativeHandle)native runLoop:(NSRunLoop *)runLoop error:(NSError **)errPtr
+{
+	// From here on, the native socket is closed when theSocket4 or theSocket6 is invalidated
+	if(![self setSocketFromNative:native error:errPtr])
+	{
+		NSLog(@"AsyncSocket %p couldn't create socket from accepted socket", self);
+		return NO;
+	}
+	
+	// Reads and writes must return EAGAIN, instead of blocking the run loop
+	int flags = fcntl(native, F_GETFL, 0);
+	if((flags < 0) || (fcntl(native, F_SETFL, flags | O_NONBLOCK) < 0))
+	{
+		NSError *err = [self getErrnoError];
+		
+		NSLog(@"AsyncSocket %p couldn't make accepted socket non-blocking: %@", self, err);
+		
+		if (errPtr) *errPtr = err;
+		return NO;
+	}
+	
+#ifdef SO_NOSIGPIPE
+	// The streams do this for us: writing to a closed connection should fail with EPIPE, not kill the process
+	int nosigpipe = 1;
+	setsockopt(native, SOL_SOCKET, SO_NOSIGPIPE, &nosigpipe, sizeof(nosigpipe));
+#endif
+	
+	theRunLoop = (runLoop == nil) ? CFRunLoopGetCurrent() : [runLoop getCFRunLoop];
+	
+	theEventLoop = [[AsyncSocketEventLoop eventLoopForRunLoop:theRunLoop] retain];
+	
+	if((theEventLoop == nil) || ![theEventLoop addSocket:self native:native])
+	{
+		NSError *err = [self getErrnoError];
+		
+		NSLog(@"AsyncSocket %p couldn't add accepted socket to event loop: %@", self, err);
+		
+		[theEventLoop release];
+		theEventLoop = nil;
+		
+		if (errPtr) *errPtr = err;
+		return NO;
+	}
+	
+	// Assume the socket is ready until told otherwise.
+	// The first read or write will either succeed, or get EAGAIN and wait for the next event.
+	theFlags |= (kSocketCanRead | kSocketCanWrite);
+	
+	return YES;
+}
+
+/**
+ * The event loop counterpart to doStreamOpen.
+ * Called on the socket's run loop once an accepted socket has been added to the event loop.
+**/
+- (void)doEventLoopOpen
+{
+	// The socket may have been closed in the meantime
+	if(theEventLoop == nil) return;
+	
+	if ([theDelegate respondsToSelector:@selector(onSocket:didConnectToHost:port:)])
+	{
+		[theDelegate onSocket:self didConnectToHost:[self connectedHost] port:[self connectedPort]];
+	}
+	
+	// Immediately deal with any already-queued requests.
+	[self maybeDequeueRead];
+	[self maybeDequeueWrite];
+}
+
+- (CFSocketNativeHandle)nativeSocket
+{
+	return CFSocketGetNative([self getCFSocket]);
+}
+
+/**
+ * The event loop delivers events in every mode,
+ * so this is used to check whether the run loop is currently running in one of the socket's modes.
+**/
+- (BOOL)isRunLoopInSocketMode
+{
+	if([theRunLoopModes containsObject:NSRunLoopCommonModes]) return YES;
+	
+	NSString *currentMode = [(NSString *)CFRunLoopCopyCurrentMode(theRunLoop) autorelease];
+	
+	return [theRunLoopModes containsObject:currentMode];
+}
+
+/**
+ * Called by the event loop when the native socket becomes readable (or reaches the end of the stream).
+**/
+- (void)doSocketReadable
+{
+	theFlags |= kSocketCanRead;
+	
+	if(theCurrentRead == nil) return;
+	
+	if([self isRunLoopInSocketMode])
+		[self doBytesAvailable];
+	else
+		[self performSelector:@selector(doBytesAvailable) withObject:nil afterDelay:0 inModes:theRunLoopModes];
+}
+
+/**
+ * Called by the event loop when the native socket becomes writable.
+**/
+- (void)doSocketWritable
+{
+	theFlags |= kSocketCanWrite;
+	
+	if(theCurrentWrite == nil) return;
+	
+	if([self isRunLoopInSocketMode])
+		[self doSendBytes];
+	else
+		[self performSelector:@selector(doSendBytes) withObject:nil afterDelay:0 inModes:theRunLoopModes];
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Disconnect Implementation
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1555,6 +2119,7 @@ Failed:
 		// We never finished the current read.
 		// We need to move its data into the front of the partial read buffer.
 		
+		[self compactPartialReadBuffer];
 		[partialReadBuffer replaceBytesInRange:NSMakeRange(0, 0)
 									 withBytes:[theCurrentRead->buffer bytes]
 										length:theCurrentRead->bytesDone];
@@ -1587,7 +2152,8 @@ Failed:
 	[self emptyQueues];
 	
 	// Clear partialReadBuffer (pre-buffer and also unreadData buffer in case of error)
-	[partialReadBuffer replaceBytesInRange:NSMakeRange(0, [partialReadBuffer length]) withBytes:NULL length:0];
+	[partialReadBuffer setLength:0];
+	partialReadOffset = 0;
 	
 	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(disconnect) object:nil];
 	
@@ -1613,6 +2179,14 @@ Failed:
 		theWriteStream = NULL;
 	}
 	
+	// Leave the event loop (before the native socket is closed below).
+	if (theEventLoop != nil)
+	{
+		[theEventLoop removeSocket:self native:[self nativeSocket]];
+		[theEventLoop release];
+		theEventLoop = nil;
+	}
+	
 	// Close sockets.
 	if (theSocket4 != NULL)
 	{
@@ -1654,8 +2228,8 @@ Failed:
 		}
 	}
 	
-	// Clear all flags (except the pre-buffering flag, which should remain as is)
-	theFlags &= kEnablePreBuffering;
+	// Clear all flags (except the pre-buffering and event loop flags, which should remain as is)
+	theFlags &= (kEnablePreBuffering | kUseEventLoop);
 }
 
 /**
@@ -1745,11 +2319,14 @@ Failed:
 	// Ensure this method will only return data in the event of an error
 	if(!(theFlags & kClosingWithError)) return nil;
 	
-	if(theReadStream == NULL) return nil;
+	if(theReadStream == NULL && theEventLoop == nil) return nil;
+	
+	// We return the buffer itself, so it mustn't have any already read bytes at the front
+	[self compactPartialReadBuffer];
 	
 	CFIndex totalBytesRead = [partialReadBuffer length];
 	BOOL error = NO;
-	while(!error && CFReadStreamHasBytesAvailable(theReadStream))
+	while(!error && [self socketHasBytesAvailable])
 	{
 		[partialReadBuffer increaseLengthBy:READALL_CHUNKSIZE];
 		
@@ -1758,7 +2335,7 @@ Failed:
 		
 		// Read data into packet buffer
 		UInt8 *packetbuf = (UInt8 *)( [partialReadBuffer mutableBytes] + totalBytesRead );
-		CFIndex bytesRead = CFReadStreamRead(theReadStream, packetbuf, bytesToRead);
+		CFIndex bytesRead = [self readFromSocket:packetbuf maxLength:bytesToRead];
 		
 		// Check results
 		if(bytesRead < 0)
@@ -1786,10 +2363,43 @@ Failed:
 **/
 - (NSError *)getErrnoError
 {
-	NSString *errorMsg = [NSString stringWithUTF8String:strerror(errno)];
+	return [self errorFromErrno:errno];
+}
+
+/**
+ * Returns nil for zero, which is how the end of the stream is reported for sockets on the event loop.
+ * (The same as errorFromCFStreamError: does for the streams.)
+**/
+- (NSError *)errorFromErrno:(int)code
+{
+	if (code == 0) return nil;
+	
+	NSString *errorMsg = [NSString stringWithUTF8String:strerror(code)];
 	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errorMsg forKey:NSLocalizedDescriptionKey];
 	
-	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:userInfo];
+}
+
+/**
+ * Returns the error for the last failed read, from either the read stream or the event loop socket.
+**/
+- (NSError *)getReadError
+{
+	if (theEventLoop != nil)
+		return [self errorFromErrno:theSocketErrno];
+	else
+		return [self errorFromCFStreamError:CFReadStreamGetError(theReadStream)];
+}
+
+/**
+ * Returns the error for the last failed write, from either the write stream or the event loop socket.
+**/
+- (NSError *)getWriteError
+{
+	if (theEventLoop != nil)
+		return [self errorFromErrno:theSocketErrno];
+	else
+		return [self errorFromCFStreamError:CFWriteStreamGetError(theWriteStream)];
 }
 
 /**
@@ -1944,7 +2554,10 @@ Failed:
 
 - (BOOL)isConnected
 {
-	return [self isSocketConnected] && [self areStreamsConnected];
+	if(theEventLoop != nil)
+		return [self isSocketConnected];
+	else
+		return [self isSocketConnected] && [self areStreamsConnected];
 }
 
 - (NSString *)connectedHost
@@ -2204,21 +2817,28 @@ Failed:
 		[ms appendString: @"no current write, "];
 	else
 	{
+		UInt64 writeLength = [theCurrentWrite->buffer length];
+		if ([theCurrentWrite isKindOfClass:[AsyncFilePacket class]])
+			writeLength = ((AsyncFilePacket *)theCurrentWrite)->fileLength;
+		
 		int percentDone;
-		if ([theCurrentWrite->buffer length] != 0)
+		if (writeLength != 0)
 			percentDone = (float)theCurrentWrite->bytesDone /
-						  (float)[theCurrentWrite->buffer length] * 100.0F;
+						  (float)writeLength * 100.0F;
 		else
 			percentDone = 100.0F;
 
-		[ms appendString: [NSString stringWithFormat:@"currently written %u (%d%%), ",
-			(unsigned int)[theCurrentWrite->buffer length],
+		[ms appendString: [NSString stringWithFormat:@"currently written %llu (%d%%), ",
+			writeLength,
 			theCurrentWrite->bytesDone ? percentDone : 0]];
 	}
 	
 	[ms appendString:[NSString stringWithFormat:@"read stream %p %s, ", theReadStream, statstr[rs]]];
 	[ms appendString:[NSString stringWithFormat:@"write stream %p %s", theWriteStream, statstr[ws]]];
 	
+	if(theEventLoop != nil)
+		[ms appendString:[NSString stringWithFormat:@", event loop %p", theEventLoop]];
+	
 	if(theFlags & kDisconnectAfterReads)
 	{
 		if(theFlags & kDisconnectAfterWrites)
@@ -2331,7 +2951,7 @@ Failed:
 	theFlags &= ~kDequeueReadScheduled;
 	
 	// If we're not currently processing a read AND we have an available read stream
-	if((theCurrentRead == nil) && (theReadStream != NULL))
+	if((theCurrentRead == nil) && (theReadStream != NULL || theEventLoop != nil))
 	{
 		if([theReadQueue count] > 0)
 		{
@@ -2385,7 +3005,64 @@ Failed:
 **/
 - (BOOL)hasBytesAvailable
 {
-	return ([partialReadBuffer length] > 0) || CFReadStreamHasBytesAvailable(theReadStream);
+	return ([partialReadBuffer length] > 0) || [self socketHasBytesAvailable];
+}
+
+/**
+ * Returns whether the read stream, or the event loop socket, may have bytes available.
+ * This ignores the pre-buffer.
+**/
+- (BOOL)socketHasBytesAvailable
+{
+	if(theEventLoop == nil)
+	{
+		return CFReadStreamHasBytesAvailable(theReadStream);
+	}
+	
+	// Edge-triggered, so we can't know for sure until read returns EAGAIN
+	return (theFlags & kSocketCanRead) ? YES : NO;
+}
+
+/**
+ * Reads from the read stream, or the event loop socket, ignoring the pre-buffer.
+ * Returns the number of bytes read (possibly zero), or -1 on error or at the end of the stream.
+**/
+- (CFIndex)readFromSocket:(UInt8 *)buffer maxLength:(CFIndex)length
+{
+	if(theEventLoop == nil)
+	{
+		return CFReadStreamRead(theReadStream, buffer, length);
+	}
+	
+	ssize_t result = read([self nativeSocket], buffer, length);
+	
+	if(result > 0)
+	{
+		return result;
+	}
+	if(result < 0 && (errno == EAGAIN || errno == EINTR))
+	{
+		// Once drained, we won't hear from the event loop again until more data arrives
+		if(errno == EAGAIN) theFlags &= ~kSocketCanRead;
+		
+		return 0;
+	}
+	
+	// Either an error, or the remote end closed the connection (result == 0, reported as a nil error)
+	theSocketErrno = (result < 0) ? errno : 0;
+	return -1;
+}
+
+/**
+ * Removes the already read bytes from the front of the partialReadBuffer.
+**/
+- (void)compactPartialReadBuffer
+{
+	if(partialReadOffset > 0)
+	{
+		[partialReadBuffer replaceBytesInRange:NSMakeRange(0, partialReadOffset) withBytes:NULL length:0];
+		partialReadOffset = 0;
+	}
 }
 
 /**
@@ -2397,19 +3074,34 @@ Failed:
 	if([partialReadBuffer length] > 0)
 	{
 		// Determine the maximum amount of data to read
-		CFIndex bytesToRead = MIN(length, [partialReadBuffer length]);
+		CFIndex bytesToRead = MIN(length, [partialReadBuffer length] - partialReadOffset);
 		
 		// Copy the bytes from the buffer
-		memcpy(buffer, [partialReadBuffer bytes], bytesToRead);
+		memcpy(buffer, [partialReadBuffer bytes] + partialReadOffset, bytesToRead);
 		
-		// Remove the copied bytes from the buffer
-		[partialReadBuffer replaceBytesInRange:NSMakeRange(0, bytesToRead) withBytes:NULL length:0];
+		// Skip over the copied bytes, rather than removing them from the front of the buffer.
+		// Removing them would move all the remaining bytes every time, which adds up to quadratic copying when
+		// a big pre-buffered read (such as a batch of pipelined requests) is taken a line at a time.
+		partialReadOffset += bytesToRead;
+		
+		if(partialReadOffset == [partialReadBuffer length])
+		{
+			// All read, so we can start again from the front, for free
+			[partialReadBuffer setLength:0];
+			partialReadOffset = 0;
+		}
+		else if(partialReadOffset > ([partialReadBuffer length] / 2))
+		{
+			// More than half of the buffer has been read, so it's worth moving the rest down.
+			// Each byte is moved at most once for every byte read before it, so the copying stays linear.
+			[self compactPartialReadBuffer];
+		}
 		
 		return bytesToRead;
 	}
 	else
 	{
-		return CFReadStreamRead(theReadStream, buffer, length);
+		return [self readFromSocket:buffer maxLength:length];
 	}
 }
 
@@ -2420,7 +3112,7 @@ Failed:
 {
 	// If data is available on the stream, but there is no read request, then we don't need to process the data yet.
 	// Also, if there is a read request, but no read stream setup yet, we can't process any data yet.
-	if(theCurrentRead != nil && theReadStream != NULL)
+	if(theCurrentRead != nil && (theReadStream != NULL || theEventLoop != nil))
 	{
 		CFIndex totalBytesRead = 0;
 		
@@ -2449,9 +3141,20 @@ Failed:
 			if(theCurrentRead->term != nil)
 			{
 				// If we already have data pre-buffered, we obviously don't want to pre-buffer it again.
-				// So in this case we'll just read as usual.
+				// Instead we take everything up to (and including) the term from the pre-buffer in one go.
+				// So once a batch of lines has been pre-buffered, each of them is a single copy, with no further reads.
 				
-				if(([partialReadBuffer length] > 0) || !(theFlags & kEnablePreBuffering))
+				if([partialReadBuffer length] > 0)
+				{
+					const UInt8 *preBytes = [partialReadBuffer bytes] + partialReadOffset;
+					CFIndex preLength = [partialReadBuffer length] - partialReadOffset;
+					
+					unsigned maxToRead = [theCurrentRead readLengthForTermInPreBuffer:preBytes length:preLength];
+					
+					unsigned bufInc = maxToRead - ([theCurrentRead->buffer length] - theCurrentRead->bytesDone);
+					[theCurrentRead->buffer increaseLengthBy:bufInc];
+				}
+				else if(!(theFlags & kEnablePreBuffering))
 				{
 					unsigned maxToRead = [theCurrentRead readLengthForTerm];
 					
@@ -2561,8 +3264,7 @@ Failed:
 
 		if(socketError)
 		{
-			CFStreamError err = CFReadStreamGetError(theReadStream);
-			[self closeWithError:[self errorFromCFStreamError:err]];
+			[self closeWithError:[self getReadError]];
 			return;
 		}
 		if(maxoutError)
@@ -2625,6 +3327,32 @@ Failed:
 	[packet release];
 }
 
+- (void)writeFile:(NSFileHandle *)fileHandle
+		   offset:(UInt64)offset
+		   length:(UInt64)length
+	  withTimeout:(NSTimeInterval)timeout
+			  tag:(long)tag
+{
+	if (fileHandle == nil || length == 0) return;
+	if (theFlags & kForbidReadsWrites) return;
+	
+	AsyncFilePacket *packet = [[AsyncFilePacket alloc] initWithFileHandle:fileHandle
+																   offset:offset
+																   length:length
+																  timeout:timeout
+																	  tag:tag];
+	
+	[theWriteQueue addObject:packet];
+	[self scheduleDequeueWrite];
+	
+	[packet release];
+}
+
+- (BOOL)canWriteFilesWithoutCopying
+{
+	return (theEventLoop != nil);
+}
+
 - (void)scheduleDequeueWrite
 {
 	if((theFlags & kDequeueWriteScheduled) == 0)
@@ -2634,6 +3362,19 @@ Failed:
 	}
 }
 
+- (void)startWriteTimeout
+{
+	if(theCurrentWrite->timeout >= 0.0)
+	{
+		theWriteTimer = [NSTimer timerWithTimeInterval:theCurrentWrite->timeout
+												target:self
+											  selector:@selector(doWriteTimeout:)
+											  userInfo:nil
+											   repeats:NO];
+		[self runLoopAddTimer:theWriteTimer];
+	}
+}
+
 // Start a new write.
 - (void)maybeDequeueWrite
 {
@@ -2641,7 +3382,7 @@ Failed:
 	theFlags &= ~kDequeueWriteScheduled;
 	
 	// If we're not currently processing a write AND we have an available write stream
-	if((theCurrentWrite == nil) && (theWriteStream != NULL))
+	if((theCurrentWrite == nil) && (theWriteStream != NULL || theEventLoop != nil))
 	{
 		if([theWriteQueue count] > 0)
 		{
@@ -2658,15 +3399,7 @@ Failed:
 			else
 			{
 				// Start time-out timer
-				if(theCurrentWrite->timeout >= 0.0)
-				{
-					theWriteTimer = [NSTimer timerWithTimeInterval:theCurrentWrite->timeout
-															target:self
-														  selector:@selector(doWriteTimeout:)
-														  userInfo:nil
-														   repeats:NO];
-					[self runLoopAddTimer:theWriteTimer];
-				}
+				[self startWriteTimeout];
 				
 				// Immediately write, if possible
 				[self doSendBytes];
@@ -2691,14 +3424,29 @@ Failed:
 
 - (void)doSendBytes
 {
+	if([theCurrentWrite isKindOfClass:[AsyncFilePacket class]])
+	{
+		[self doSendFileBytes];
+		return;
+	}
+	
+	if((theCurrentWrite != nil) && (theEventLoop != nil))
+	{
+		[self doSendGatheredBytes];
+		return;
+	}
+	
 	if((theCurrentWrite != nil) && (theWriteStream != NULL))
 	{
 		BOOL done = NO, error = NO;
 		while (!done && !error && CFWriteStreamCanAcceptBytes(theWriteStream))
 		{
 			// Figure out what to write.
+			// Once secured, each write becomes (at least) one TLS record, with its own header, padding and MAC.
+			// So we write in chunks of a full record, rather than paying for four times as many records.
+			CFIndex chunkSize = (theFlags & kDidSecure) ? SECURE_WRITE_CHUNKSIZE : WRITE_CHUNKSIZE;
 			CFIndex bytesRemaining = [theCurrentWrite->buffer length] - theCurrentWrite->bytesDone;
-			CFIndex bytesToWrite = (bytesRemaining < WRITE_CHUNKSIZE) ? bytesRemaining : WRITE_CHUNKSIZE;
+			CFIndex bytesToWrite = (bytesRemaining < chunkSize) ? bytesRemaining : chunkSize;
 			UInt8 *writestart = (UInt8 *)([theCurrentWrite->buffer bytes] + theCurrentWrite->bytesDone);
 
 			// Write.
@@ -2724,13 +3472,223 @@ Failed:
 
 		if(error)
 		{
-			CFStreamError err = CFWriteStreamGetError(theWriteStream);
-			[self closeWithError:[self errorFromCFStreamError:err]];
+			[self closeWithError:[self getWriteError]];
 			return;
 		}
 	}
 }
 
+/**
+ * Fills in the given vector (of WRITEV_MAX_IOVECS entries) with the unwritten part of the current write,
+ * followed by the writes queued behind it, up to roughly WRITEV_MAX_LENGTH bytes.
+ * Returns the number of entries used.
+**/
+- (int)gatherWritesIntoVector:(struct iovec *)vector
+{
+	Class WritePacketClass = [AsyncWritePacket class];
+	
+	AsyncWritePacket *packet = theCurrentWrite;
+	unsigned i = 0, queued = [theWriteQueue count];
+	
+	int count = 0;
+	CFIndex total = 0;
+	
+	while(packet != nil)
+	{
+		CFIndex length = [packet->buffer length] - packet->bytesDone;
+		
+		vector[count].iov_base = (void *)([packet->buffer bytes] + packet->bytesDone);
+		vector[count].iov_len = length;
+		
+		count++;
+		total += length;
+		
+		if((count == WRITEV_MAX_IOVECS) || (total >= WRITEV_MAX_LENGTH)) break;
+		
+		// Writes queued behind a startTLS have to wait for it, so we stop at anything that isn't a plain write.
+		// (Files are sent on their own, with sendfile.)
+		packet = nil;
+		if(i < queued)
+		{
+			id next = [theWriteQueue objectAtIndex:i++];
+			if([next isMemberOfClass:WritePacketClass])
+			{
+				packet = next;
+			}
+		}
+	}
+	
+	return count;
+}
+
+/**
+ * The event loop counterpart to doSendBytes.
+ * 
+ * Rather than writing one packet at a time, the current write and the writes queued behind it are gathered into
+ * a single writev. The bytes written are then credited to the packets in order, and each packet is completed
+ * (with its own onSocket:didWriteDataWithTag:) as soon as it's fully written. The next packet is started right away,
+ * instead of waiting for a scheduled maybeDequeueWrite.
+ * 
+ * So an HTTP response queued as a header, a chunk size line, a body and a footer costs one system call, not four.
+**/
+- (void)doSendGatheredBytes
+{
+	BOOL didCompleteWrite = NO;
+	
+	while((theCurrentWrite != nil) && (theFlags & kSocketCanWrite))
+	{
+		struct iovec vector[WRITEV_MAX_IOVECS];
+		int count = [self gatherWritesIntoVector:vector];
+		
+		ssize_t result = writev([self nativeSocket], vector, count);
+		
+		if(result < 0)
+		{
+			if(errno == EINTR) continue;
+			
+			if(errno == EAGAIN)
+			{
+				// Once full, we won't hear from the event loop again until there's room
+				theFlags &= ~kSocketCanWrite;
+				break;
+			}
+			
+			theSocketErrno = errno;
+			[self closeWithError:[self getWriteError]];
+			return;
+		}
+		
+		// Credit the bytes written to the packets, in the order they were gathered
+		CFIndex bytesWritten = result;
+		
+		while(theCurrentWrite != nil)
+		{
+			CFIndex bytesRemaining = [theCurrentWrite->buffer length] - theCurrentWrite->bytesDone;
+			CFIndex bytesCredited = MIN(bytesRemaining, bytesWritten);
+			
+			theCurrentWrite->bytesDone += bytesCredited;
+			bytesWritten -= bytesCredited;
+			
+			if(bytesCredited < bytesRemaining) break;
+			
+			[self completeCurrentWrite];
+			didCompleteWrite = YES;
+			
+			// Move straight on to the next plain write, if there is one.
+			// Note: The delegate may have disconnected us, in which case the queue is empty.
+			if(theEventLoop == nil || [theWriteQueue count] == 0) break;
+			
+			AsyncWritePacket *nextWrite = [theWriteQueue objectAtIndex:0];
+			if(![nextWrite isMemberOfClass:[AsyncWritePacket class]]) break;
+			
+			theCurrentWrite = [nextWrite retain];
+			[theWriteQueue removeObjectAtIndex:0];
+			
+			[self startWriteTimeout];
+		}
+	}
+	
+	// Anything else (startTLS, disconnectAfterWriting) is left to maybeDequeueWrite
+	if(didCompleteWrite && (theCurrentWrite == nil) && (theEventLoop != nil))
+	{
+		[self scheduleDequeueWrite];
+	}
+}
+
+/**
+ * Sends the current write, which is an AsyncFilePacket.
+ * 
+ * On the event loop, the file is sent with sendfile, so its bytes go straight from the file system cache to the socket.
+ * Otherwise there's no native socket to send to, so the file is read in chunks and written to the stream as usual.
+**/
+- (void)doSendFileBytes
+{
+	AsyncFilePacket *packet = (AsyncFilePacket *)theCurrentWrite;
+	int fd = [packet->fileHandle fileDescriptor];
+	
+	BOOL done = NO, error = NO;
+	
+	if(theEventLoop != nil)
+	{
+		while(!done && !error && (theFlags & kSocketCanWrite))
+		{
+			off_t length = packet->fileLength - packet->bytesDone;
+			
+			int result = sendfile(fd, [self nativeSocket], packet->fileOffset + packet->bytesDone, &length, NULL, 0);
+			
+			// The length is set to the number of bytes sent, even if sendfile fails part way through
+			packet->bytesDone += length;
+			
+			if(result < 0)
+			{
+				if(errno == EAGAIN)
+				{
+					// Once full, we won't hear from the event loop again until there's room
+					theFlags &= ~kSocketCanWrite;
+					break;
+				}
+				else if(errno != EINTR)
+				{
+					theSocketErrno = errno;
+					error = YES;
+				}
+			}
+			else if(length == 0)
+			{
+				// The file is shorter than it was when the write was queued
+				[self closeWithError:[self errorFromErrno:EIO]];
+				return;
+			}
+			
+			done = (packet->bytesDone == packet->fileLength);
+		}
+	}
+	else if(theWriteStream != NULL)
+	{
+		UInt8 chunk[SECURE_WRITE_CHUNKSIZE];
+		
+		while(!done && !error && CFWriteStreamCanAcceptBytes(theWriteStream))
+		{
+			CFIndex chunkSize = (theFlags & kDidSecure) ? SECURE_WRITE_CHUNKSIZE : WRITE_CHUNKSIZE;
+			UInt64 bytesRemaining = packet->fileLength - packet->bytesDone;
+			CFIndex bytesToWrite = (bytesRemaining < chunkSize) ? (CFIndex)bytesRemaining : chunkSize;
+			
+			ssize_t bytesRead = pread(fd, chunk, bytesToWrite, packet->fileOffset + packet->bytesDone);
+			
+			if(bytesRead <= 0)
+			{
+				// The file couldn't be read, or is shorter than it was when the write was queued
+				[self closeWithError:[self errorFromErrno:((bytesRead < 0) ? errno : EIO)]];
+				return;
+			}
+			
+			// Only part of the chunk may be accepted, in which case the rest is simply read again next time
+			CFIndex bytesWritten = CFWriteStreamWrite(theWriteStream, chunk, bytesRead);
+			
+			if(bytesWritten < 0)
+			{
+				bytesWritten = 0;
+				error = YES;
+			}
+			
+			packet->bytesDone += bytesWritten;
+			done = (packet->bytesDone == packet->fileLength);
+		}
+	}
+	
+	if(done)
+	{
+		[self completeCurrentWrite];
+		if (!error) [self scheduleDequeueWrite];
+	}
+	
+	if(error)
+	{
+		[self closeWithError:[self getWriteError]];
+		return;
+	}
+}
+
 // Ends current write and calls delegate.
 - (void)completeCurrentWrite
 {
@@ -2799,6 +3757,13 @@ Failed:
 	
 	if([theCurrentRead isKindOfClass:SpecialPacketClass] && [theCurrentWrite isKindOfClass:SpecialPacketClass])
 	{
+		if(theEventLoop != nil)
+		{
+			// TLS is done by the streams, which sockets on the event loop don't have.
+			[self onTLSStarted:NO];
+			return;
+		}
+		
 		theFlags |= kStartingTLS;
 		
 		AsyncSpecialPacket *tlsPacket = (AsyncSpecialPacket *)theCurrentRead;
@@ -2819,6 +3784,8 @@ Failed:
 {
 	theFlags &= ~kStartingTLS;
 	
+	if(flag) theFlags |= kDidSecure;
+	
 	if([theDelegate respondsToSelector:@selector(onSocket:didSecure:)])
 	{
 		[theDelegate onSocket:self didSecure:flag];
@@ -2928,6 +3895,19 @@ static void MyCFSocketCallback (CFSocketRef sref, CFSocketCallBackType type, CFD
 	[pool release];
 }
 
+/**
+ * This is the callback we setup for the kqueue of AsyncSocketEventLoop.
+ * This method does nothing but forward the call to it's Objective-C counterpart
+**/
+static void MyCFFileDescriptorCallback (CFFileDescriptorRef fdref, CFOptionFlags callBackTypes, void *pInfo)
+{
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	
+	[(AsyncSocketEventLoop *)pInfo doKqueueEvents];
+	
+	[pool release];
+}
+
 /**
  * This is the callback we setup for CFReadStream.
  * This method does nothing but forward the call to it's Objective-C counterpart
@@ -12,6 +12,9 @@
 
 @class AsyncSendPacket;
 @class AsyncReceivePacket;
+@class AsyncUdpBufferPool;
+struct AsyncUdpDatagram;
+struct sockaddr;
 
 extern NSString *const AsyncUdpSocketException;
 extern NSString *const AsyncUdpSocketErrorDomain;
@@ -58,7 +61,17 @@ typedef enum AsyncUdpSocketError AsyncUdpSocketError;
 	NSString *cachedConnectedHost;
 	UInt16 cachedConnectedPort;
 	
+	struct sockaddr *connectedAddress;      // The address we connected to, compared against received datagrams
+	struct sockaddr *lastSourceAddress;     // Source of the last datagram received while not connected
+	NSString *lastSourceHost;               // String form of lastSourceAddress
+	
 	UInt32 maxReceiveBufferSize;
+	
+	AsyncUdpBufferPool *receiveBufferPool;  // Recycles the buffers handed to the delegate
+	struct AsyncUdpDatagram *receiveBatch;  // Buffer, length and source address of each datagram read from the socket
+	UInt32 receiveBatchCount;
+	UInt32 receiveBatchIndex;               // Next datagram to be handed to a receive operation
+	int receiveBatchErrno;                  // Error that cut the last batch short, reported once the batch is drained
 }
 
 /**
@@ -196,6 +209,19 @@ typedef enum AsyncUdpSocketError AsyncUdpSocketError;
 **/
 - (BOOL)enableBroadcast:(BOOL)flag error:(NSError **)errPtr;
 
+/**
+ * By default, the OS is free to fragment outgoing datagrams that are larger than the path mtu.
+ * Enabling this sets the "don't fragment" bit on all outgoing datagrams, and disables the OS's own
+ * path mtu handling on the socket. Datagrams that are too large for the path will be dropped
+ * (or fail to send with EMSGSIZE) instead of being fragmented.
+ * 
+ * This is needed for packetization layer path mtu discovery (RFC 4821),
+ * where the application probes the path with progressively larger datagrams.
+ * 
+ * Returns NO if the OS does not support the option.
+**/
+- (BOOL)enableDontFragment:(BOOL)flag error:(NSError **)errPtr;
+
 /**
  * Asynchronously sends the given data, with the given timeout and tag.
  * 
@@ -206,6 +232,24 @@ typedef enum AsyncUdpSocketError AsyncUdpSocketError;
 **/
 - (BOOL)sendData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag;
 
+/**
+ * Sends the given bytes, with the given timeout and tag, without requiring an NSData object.
+ * The bytes are not retained, so the caller may reuse the buffer as soon as this method returns.
+ * 
+ * This method may only be used with a connected socket.
+ * 
+ * If nothing else is waiting to be sent, the bytes are sent immediately (without blocking),
+ * and sentImmediately is set to YES. In this case the delegate is NOT informed via onUdpSocket:didSendDataWithTag:.
+ * Otherwise the bytes are copied and queued just as with sendData:withTimeout:tag:, and the delegate is informed as usual.
+ * 
+ * Returns NO under the same circumstances as sendData:withTimeout:tag:.
+**/
+- (BOOL)sendBytes:(const void *)bytes
+           length:(unsigned)length
+      withTimeout:(NSTimeInterval)timeout
+              tag:(long)tag
+  sentImmediately:(BOOL *)sentPtr;
+
 /**
  * Asynchronously sends the given data, with the given timeout and tag, to the given host and port.
  * 
@@ -280,6 +324,33 @@ typedef enum AsyncUdpSocketError AsyncUdpSocketError;
 - (UInt32)maxReceiveBufferSize;
 - (void)setMaxReceiveBufferSize:(UInt32)max;
 
+/**
+ * Note on batching:
+ * 
+ * When the socket becomes readable, several datagrams are read at once (until the socket is empty, or the batch is full)
+ * into a buffer owned by the socket, and subsequent receive operations are satisfied from it without more system calls.
+ * Likewise, once the socket is writeable, all the queued send operations are sent in one go,
+ * rather than one per pass through the run loop.
+ * 
+ * Each datagram is read into a buffer of maxReceiveBufferSize, which is handed to the delegate as is (without copying).
+ * Once the delegate releases the data, the buffer goes back into a pool owned by the socket, to be used again.
+ * So the data passed to onUdpSocket:didReceiveData:... is best copied if it's going to be kept around for a while.
+**/
+
+/**
+ * Gets/Sets whether received datagrams are read into pooled buffers. The default is YES.
+ * If NO, a new buffer is allocated for every datagram, and freed when the delegate releases the data.
+**/
+- (BOOL)usesReceiveBufferPool;
+- (void)setUsesReceiveBufferPool:(BOOL)flag;
+
+/**
+ * Returns the number of receive buffers taken from the pool (hits),
+ * and the number that had to be allocated because the pool was empty (misses).
+**/
+- (UInt64)receiveBufferPoolHits;
+- (UInt64)receiveBufferPoolMisses;
+
 /**
  * When you create an AsyncUdpSocket, it is added to the runloop of the current thread.
  * So it is easiest to simply create the socket on the thread you intend to use it.
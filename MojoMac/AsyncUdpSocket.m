@@ -15,6 +15,7 @@
 #import <sys/ioctl.h>
 #import <net/if.h>
 #import <netdb.h>
+#import <pthread.h>
 
 #if TARGET_OS_IPHONE
 // Note: You may need to add the CFNetwork Framework to your project
@@ -27,6 +28,10 @@
 
 #define DEFAULT_MAX_RECEIVE_BUFFER_SIZE 9216
 
+#define RECEIVE_BATCH_SIZE  16   // Max datagrams read from the socket per readable event
+
+#define RECEIVE_BUFFER_POOL_CAPACITY 64   // Max idle buffers kept in the receive buffer pool
+
 NSString *const AsyncUdpSocketException = @"AsyncUdpSocketException";
 NSString *const AsyncUdpSocketErrorDomain = @"AsyncUdpSocketErrorDomain";
 
@@ -40,18 +45,51 @@ enum AsyncUdpSocketFlags
 {
 	kDidBind                 = 1 <<  0,  // If set, bind has been called.
 	kDidConnect              = 1 <<  1,  // If set, connect has been called.
-	kSock4CanAcceptBytes     = 1 <<  2,  // If set, we know socket4 can accept bytes. If unset, it's unknown.
-	kSock6CanAcceptBytes     = 1 <<  3,  // If set, we know socket6 can accept bytes. If unset, it's unknown.
-	kSock4HasBytesAvailable  = 1 <<  4,  // If set, we know socket4 has bytes available. If unset, it's unknown.
-	kSock6HasBytesAvailable  = 1 <<  5,  // If set, we know socket6 has bytes available. If unset, it's unknown.
-	kForbidSendReceive       = 1 <<  6,  // If set, no new send or receive operations are allowed to be queued.
-	kCloseAfterSends         = 1 <<  7,  // If set, close as soon as no more sends are queued.
-	kCloseAfterReceives      = 1 <<  8,  // If set, close as soon as no more receives are queued.
-	kDidClose                = 1 <<  9,  // If set, the socket has been closed, and should not be used anymore.
-	kDequeueSendScheduled    = 1 << 10,  // If set, a maybeDequeueSend operation is already scheduled.
-	kDequeueReceiveScheduled = 1 << 11,  // If set, a maybeDequeueReceive operation is already scheduled.
-	kFlipFlop                = 1 << 12,  // Used to alternate between IPv4 and IPv6 sockets.
+	kForbidSendReceive       = 1 <<  2,  // If set, no new send or receive operations are allowed to be queued.
+	kCloseAfterSends         = 1 <<  3,  // If set, close as soon as no more sends are queued.
+	kCloseAfterReceives      = 1 <<  4,  // If set, close as soon as no more receives are queued.
+	kDidClose                = 1 <<  5,  // If set, the socket has been closed, and should not be used anymore.
+	kDequeueSendScheduled    = 1 <<  6,  // If set, a maybeDequeueSend operation is already scheduled.
+	kDequeueReceiveScheduled = 1 <<  7,  // If set, a maybeDequeueReceive operation is already scheduled.
+	kFlipFlop                = 1 <<  8,  // Used to alternate between IPv4 and IPv6 sockets.
+};
+
+/**
+ * A datagram that's been read into the receive batch buffer, but not yet handed to a receive operation.
+**/
+struct AsyncUdpDatagram
+{
+	UInt8 *bytes;   // Buffer from the receive buffer pool, or NULL if it's been handed to the delegate
+	UInt32 size;    // Size of the buffer
+	UInt32 length;  // Length of the datagram
+	struct sockaddr_storage address;
 };
+typedef struct AsyncUdpDatagram AsyncUdpDatagram;
+
+/**
+ * Compares the host and port of two addresses.
+ * Anything else in the structures (such as the padding in a sockaddr_in) is ignored.
+**/
+static BOOL AsyncUdpAddressesEqual(const struct sockaddr *a, const struct sockaddr *b)
+{
+	if(a->sa_family != b->sa_family) return NO;
+	
+	if(a->sa_family == AF_INET)
+	{
+		const struct sockaddr_in *a4 = (const struct sockaddr_in *)a;
+		const struct sockaddr_in *b4 = (const struct sockaddr_in *)b;
+		
+		return (a4->sin_port == b4->sin_port) && (a4->sin_addr.s_addr == b4->sin_addr.s_addr);
+	}
+	else
+	{
+		const struct sockaddr_in6 *a6 = (const struct sockaddr_in6 *)a;
+		const struct sockaddr_in6 *b6 = (const struct sockaddr_in6 *)b;
+		
+		return (a6->sin6_port == b6->sin6_port) &&
+		       (memcmp(&a6->sin6_addr, &b6->sin6_addr, sizeof(struct in6_addr)) == 0);
+	}
+}
 
 @interface AsyncUdpSocket (Private)
 
@@ -65,6 +103,10 @@ enum AsyncUdpSocketFlags
 - (NSString *)addressHost4:(struct sockaddr_in *)pSockaddr4;
 - (NSString *)addressHost6:(struct sockaddr_in6 *)pSockaddr6;
 - (NSString *)addressHost:(struct sockaddr *)pSockaddr;
+- (NSString *)sourceHost:(struct sockaddr *)pSockaddr;
+
+// Connecting
+- (void)setConnectedAddress:(NSData *)address;
 
 // Disconnect Implementation
 - (void)emptyQueues;
@@ -74,6 +116,7 @@ enum AsyncUdpSocketFlags
 
 // Errors
 - (NSError *)getErrnoError;
+- (NSError *)getErrorWithErrno:(int)code;
 - (NSError *)getSocketError;
 - (NSError *)getIPv4UnavailableError;
 - (NSError *)getIPv6UnavailableError;
@@ -87,8 +130,8 @@ enum AsyncUdpSocketFlags
 - (UInt16)localPort:(CFSocketRef)socket;
 
 // Sending
-- (BOOL)canAcceptBytes:(CFSocketRef)sockRef;
 - (void)scheduleDequeueSend;
+- (void)startSendTimeout;
 - (void)maybeDequeueSend;
 - (void)doSend:(CFSocketRef)sockRef;
 - (void)completeCurrentSend;
@@ -97,12 +140,13 @@ enum AsyncUdpSocketFlags
 - (void)doSendTimeout:(NSTimer *)timer;
 
 // Receiving
-- (BOOL)hasBytesAvailable:(CFSocketRef)sockRef;
 - (void)scheduleDequeueReceive;
 - (void)maybeDequeueReceive;
+- (void)startNextReceive;
 - (void)doReceive4;
 - (void)doReceive6;
 - (void)doReceive:(CFSocketRef)sockRef;
+- (BOOL)fillReceiveBatch:(CFSocketRef)sockRef;
 - (BOOL)maybeCompleteCurrentReceive;
 - (void)failCurrentReceive:(NSError *)error;
 - (void)endCurrentReceive;
@@ -165,7 +209,7 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 @public
 	NSTimeInterval timeout;
 	long tag;
-	NSMutableData *buffer;
+	NSData *buffer;
 	NSString *host;
 	UInt16 port;
 }
@@ -201,6 +245,218 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 #pragma mark -
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * The AsyncUdpBufferPool keeps the buffers that received datagrams are read into, so they can be used again
+ * instead of being allocated and freed for every datagram.
+ * 
+ * All buffers in the pool are the same size. If a buffer of a different size is checked in (because the
+ * maxReceiveBufferSize changed), it's simply freed.
+ * 
+ * The data handed to the delegate may be released on another thread, so the pool is protected by a lock.
+**/
+@interface AsyncUdpBufferPool : NSObject
+{
+@public
+	pthread_mutex_t lock;
+	UInt8 **buffers;
+	UInt32 count;
+	UInt32 capacity;
+	UInt32 bufferSize;
+	UInt64 hits;
+	UInt64 misses;
+}
+- (id)initWithCapacity:(UInt32)capacity;
+- (void)setCapacity:(UInt32)capacity;
+- (UInt8 *)checkOutBufferOfSize:(UInt32)size;
+- (void)checkInBuffer:(UInt8 *)buffer size:(UInt32)size;
+- (UInt32)capacity;
+- (UInt64)hits;
+- (UInt64)misses;
+@end
+
+@implementation AsyncUdpBufferPool
+
+- (id)initWithCapacity:(UInt32)c
+{
+	if((self = [super init]))
+	{
+		pthread_mutex_init(&lock, NULL);
+		
+		buffers = malloc(RECEIVE_BUFFER_POOL_CAPACITY * sizeof(UInt8 *));
+		count = 0;
+		capacity = MIN(c, RECEIVE_BUFFER_POOL_CAPACITY);
+		bufferSize = 0;
+		hits = 0;
+		misses = 0;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	UInt32 i;
+	for(i = 0; i < count; i++)
+	{
+		free(buffers[i]);
+	}
+	free(buffers);
+	
+	pthread_mutex_destroy(&lock);
+	[super dealloc];
+}
+
+- (void)setCapacity:(UInt32)c
+{
+	pthread_mutex_lock(&lock);
+	
+	capacity = MIN(c, RECEIVE_BUFFER_POOL_CAPACITY);
+	
+	while(count > capacity)
+	{
+		free(buffers[--count]);
+	}
+	
+	pthread_mutex_unlock(&lock);
+}
+
+- (UInt8 *)checkOutBufferOfSize:(UInt32)size
+{
+	UInt8 *buffer = NULL;
+	
+	pthread_mutex_lock(&lock);
+	
+	if(size != bufferSize)
+	{
+		// The buffers we have are the wrong size now
+		while(count > 0)
+		{
+			free(buffers[--count]);
+		}
+		bufferSize = size;
+	}
+	
+	if(count > 0)
+	{
+		buffer = buffers[--count];
+		hits++;
+	}
+	else
+	{
+		misses++;
+	}
+	
+	pthread_mutex_unlock(&lock);
+	
+	if(buffer == NULL)
+	{
+		buffer = malloc(size);
+	}
+	
+	return buffer;
+}
+
+- (void)checkInBuffer:(UInt8 *)buffer size:(UInt32)size
+{
+	pthread_mutex_lock(&lock);
+	
+	if((size == bufferSize) && (count < capacity))
+	{
+		buffers[count++] = buffer;
+		buffer = NULL;
+	}
+	
+	pthread_mutex_unlock(&lock);
+	
+	free(buffer);
+}
+
+/**
+ * The counters are modified on the socket's thread, but may be read from any thread.
+**/
+- (UInt32)capacity
+{
+	pthread_mutex_lock(&lock);
+	UInt32 result = capacity;
+	pthread_mutex_unlock(&lock);
+	
+	return result;
+}
+
+- (UInt64)hits
+{
+	pthread_mutex_lock(&lock);
+	UInt64 result = hits;
+	pthread_mutex_unlock(&lock);
+	
+	return result;
+}
+
+- (UInt64)misses
+{
+	pthread_mutex_lock(&lock);
+	UInt64 result = misses;
+	pthread_mutex_unlock(&lock);
+	
+	return result;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The AsyncUdpPooledData is the data handed to the delegate for a received datagram.
+ * It wraps a buffer from the receive buffer pool, and returns the buffer to the pool when it's deallocated.
+**/
+@interface AsyncUdpPooledData : NSData
+{
+	AsyncUdpBufferPool *pool;
+	UInt8 *buffer;
+	UInt32 bufferSize;
+	UInt32 length;
+}
+- (id)initWithPool:(AsyncUdpBufferPool *)pool buffer:(UInt8 *)buffer size:(UInt32)size length:(UInt32)length;
+@end
+
+@implementation AsyncUdpPooledData
+
+- (id)initWithPool:(AsyncUdpBufferPool *)p buffer:(UInt8 *)b size:(UInt32)s length:(UInt32)l
+{
+	if((self = [super init]))
+	{
+		pool = [p retain];
+		buffer = b;
+		bufferSize = s;
+		length = l;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[pool checkInBuffer:buffer size:bufferSize];
+	[pool release];
+	[super dealloc];
+}
+
+- (NSUInteger)length
+{
+	return length;
+}
+
+- (const void *)bytes
+{
+	return buffer;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 @implementation AsyncUdpSocket
 
 - (id)initWithDelegate:(id)delegate userData:(long)userData enableIPv4:(BOOL)enableIPv4 enableIPv6:(BOOL)enableIPv6
@@ -212,6 +468,16 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 		theUserData = userData;
 		maxReceiveBufferSize = DEFAULT_MAX_RECEIVE_BUFFER_SIZE;
 		
+		receiveBufferPool = [[AsyncUdpBufferPool alloc] initWithCapacity:RECEIVE_BUFFER_POOL_CAPACITY];
+		receiveBatch = NULL;
+		receiveBatchCount = 0;
+		receiveBatchIndex = 0;
+		receiveBatchErrno = 0;
+		
+		connectedAddress = NULL;
+		lastSourceAddress = NULL;
+		lastSourceHost = nil;
+		
 		theSendQueue = [[NSMutableArray alloc] initWithCapacity:SENDQUEUE_CAPACITY];
 		theCurrentSend = nil;
 		theSendTimer = nil;
@@ -323,6 +589,22 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	[theRunLoopModes release];
 	[cachedLocalHost release];
 	[cachedConnectedHost release];
+	[lastSourceHost release];
+	free(connectedAddress);
+	free(lastSourceAddress);
+	if(receiveBatch)
+	{
+		UInt32 i;
+		for(i = 0; i < RECEIVE_BATCH_SIZE; i++)
+		{
+			if(receiveBatch[i].bytes)
+			{
+				[receiveBufferPool checkInBuffer:receiveBatch[i].bytes size:receiveBatch[i].size];
+			}
+		}
+		free(receiveBatch);
+	}
+	[receiveBufferPool release];
 	[NSObject cancelPreviousPerformRequestsWithTarget:theDelegate selector:@selector(onUdpSocketDidClose:) object:self];
 	[NSObject cancelPreviousPerformRequestsWithTarget:self];
 	[super dealloc];
@@ -410,6 +692,26 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	maxReceiveBufferSize = max;
 }
 
+- (BOOL)usesReceiveBufferPool
+{
+	return [receiveBufferPool capacity] > 0;
+}
+
+- (void)setUsesReceiveBufferPool:(BOOL)flag
+{
+	[receiveBufferPool setCapacity:(flag ? RECEIVE_BUFFER_POOL_CAPACITY : 0)];
+}
+
+- (UInt64)receiveBufferPoolHits
+{
+	return [receiveBufferPool hits];
+}
+
+- (UInt64)receiveBufferPoolMisses
+{
+	return [receiveBufferPool misses];
+}
+
 /**
  * See the header file for a full explanation of this method.
 **/
@@ -745,6 +1047,41 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	}
 }
 
+/**
+ * Returns the host string for the source address of a received datagram.
+ * 
+ * Converting an address to a string is comparatively expensive, and datagrams tend to arrive in long runs from
+ * the same host. So on a connected socket we simply return the connected host (all datagrams come from it),
+ * and otherwise we reuse the string from the last datagram if it came from the same place.
+**/
+- (NSString *)sourceHost:(struct sockaddr *)pSockaddr
+{
+	if(connectedAddress)
+	{
+		return [self connectedHost];
+	}
+	
+	if(lastSourceAddress == NULL)
+	{
+		lastSourceAddress = malloc(sizeof(struct sockaddr_storage));
+		lastSourceAddress->sa_family = AF_UNSPEC;
+	}
+	else if(AsyncUdpAddressesEqual(lastSourceAddress, pSockaddr))
+	{
+		return lastSourceHost;
+	}
+	
+	if(pSockaddr->sa_family == AF_INET)
+		memcpy(lastSourceAddress, pSockaddr, sizeof(struct sockaddr_in));
+	else
+		memcpy(lastSourceAddress, pSockaddr, sizeof(struct sockaddr_in6));
+	
+	[lastSourceHost release];
+	lastSourceHost = [[self addressHost:pSockaddr] retain];
+	
+	return lastSourceHost;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Socket Implementation:
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -922,6 +1259,7 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 				return NO;
 			}
 			theFlags |= kDidConnect;
+			[self setConnectedAddress:address4];
 			
 			// We're connected to an IPv4 address, so no need for the IPv6 socket
 			[self closeSocket6];
@@ -948,6 +1286,7 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 				return NO;
 			}
 			theFlags |= kDidConnect;
+			[self setConnectedAddress:address6];
 			
 			// We're connected to an IPv6 address, so no need for the IPv4 socket
 			[self closeSocket4];
@@ -1002,6 +1341,7 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 				return NO;
 			}
 			theFlags |= kDidConnect;
+			[self setConnectedAddress:remoteAddr];
 			
 			// We're connected to an IPv4 address, so no need for the IPv6 socket
 			[self closeSocket6];
@@ -1027,6 +1367,7 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 				return NO;
 			}
 			theFlags |= kDidConnect;
+			[self setConnectedAddress:remoteAddr];
 			
 			// We're connected to an IPv6 address, so no need for the IPv4 socket
 			[self closeSocket4];
@@ -1053,6 +1394,20 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	return NO;
 }
 
+/**
+ * Keeps a copy of the address we connected to,
+ * so the source of each received datagram can be checked against it without converting either one to a string.
+**/
+- (void)setConnectedAddress:(NSData *)address
+{
+	if(connectedAddress == NULL)
+	{
+		connectedAddress = malloc(sizeof(struct sockaddr_storage));
+	}
+	
+	memcpy(connectedAddress, [address bytes], MIN([address length], sizeof(struct sockaddr_storage)));
+}
+
 /**
  * Join multicast group
  *
@@ -1229,6 +1584,55 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	return YES;
 }
 
+- (BOOL)enableDontFragment:(BOOL)flag error:(NSError **)errPtr
+{
+	int error = 0;
+	
+	if (theSocket4)
+	{
+	#if defined(IP_DONTFRAG)
+		int value = flag ? 1 : 0;
+		if (setsockopt(CFSocketGetNative(theSocket4), IPPROTO_IP, IP_DONTFRAG,
+		               (const void *)&value, sizeof(value)) < 0)
+		{
+			error = errno;
+		}
+	#elif defined(IP_MTU_DISCOVER) && defined(IP_PMTUDISC_PROBE)
+		// IP_PMTUDISC_PROBE sets DF, but ignores the kernel's cached path mtu,
+		// which is exactly what we want when doing our own probing.
+		int value = flag ? IP_PMTUDISC_PROBE : IP_PMTUDISC_DONT;
+		if (setsockopt(CFSocketGetNative(theSocket4), IPPROTO_IP, IP_MTU_DISCOVER,
+		               (const void *)&value, sizeof(value)) < 0)
+		{
+			error = errno;
+		}
+	#else
+		error = ENOPROTOOPT;
+	#endif
+	}
+	
+	if (theSocket6 && !error)
+	{
+	#if defined(IPV6_DONTFRAG)
+		int value = flag ? 1 : 0;
+		if (setsockopt(CFSocketGetNative(theSocket6), IPPROTO_IPV6, IPV6_DONTFRAG,
+		               (const void *)&value, sizeof(value)) < 0)
+		{
+			error = errno;
+		}
+	#endif
+		// IPv6 routers never fragment, so there's nothing to disable if the option is missing.
+	}
+	
+	if(error)
+	{
+		if(errPtr) *errPtr = [self getErrorWithErrno:error];
+		return NO;
+	}
+	
+	return YES;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark Disconnect Implementation:
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -1241,6 +1645,11 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	[theSendQueue removeAllObjects];
 	[theReceiveQueue removeAllObjects];
 	
+	// Discard any datagrams we've read but not delivered
+	receiveBatchCount = 0;
+	receiveBatchIndex = 0;
+	receiveBatchErrno = 0;
+	
 	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(maybeDequeueSend) object:nil];
 	[NSObject cancelPreviousPerformRequestsWithTarget:self selector:@selector(maybeDequeueReceive) object:nil];
 	
@@ -1369,10 +1778,18 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 **/
 - (NSError *)getErrnoError
 {
-	NSString *errorMsg = [NSString stringWithUTF8String:strerror(errno)];
+	return [self getErrorWithErrno:errno];
+}
+
+/**
+ * Returns a standard error object for the given errno value.
+**/
+- (NSError *)getErrorWithErrno:(int)code
+{
+	NSString *errorMsg = [NSString stringWithUTF8String:strerror(code)];
 	NSDictionary *userInfo = [NSDictionary dictionaryWithObject:errorMsg forKey:NSLocalizedDescriptionKey];
 	
-	return [NSError errorWithDomain:NSPOSIXErrorDomain code:errno userInfo:userInfo];
+	return [NSError errorWithDomain:NSPOSIXErrorDomain code:code userInfo:userInfo];
 }
 
 /**
@@ -1710,6 +2127,47 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	return YES;
 }
 
+- (BOOL)sendBytes:(const void *)bytes
+           length:(unsigned)length
+      withTimeout:(NSTimeInterval)timeout
+              tag:(long)tag
+  sentImmediately:(BOOL *)sentPtr
+{
+	if(sentPtr) *sentPtr = NO;
+	
+	if((bytes == NULL) || (length == 0)) return NO;
+	if(theFlags & kForbidSendReceive) return NO;
+	if(theFlags & kDidClose) return NO;
+	
+	// This method is only for connected sockets
+	if(![self isConnected]) return NO;
+	
+	if((theCurrentSend == nil) && ([theSendQueue count] == 0))
+	{
+		// Nothing is queued, so we can send without worrying about ordering.
+		// If the socket buffer is full, or anything else goes wrong, we fall back to the queue below,
+		// which will wait for the socket to become writeable, and report any errors to the delegate.
+		
+		CFSocketRef theSocket = theSocket4 ? theSocket4 : theSocket6;
+		CFSocketNativeHandle theNativeSocket = CFSocketGetNative(theSocket);
+		
+		int result = send(theNativeSocket, bytes, length, MSG_DONTWAIT);
+		
+		if(result >= 0)
+		{
+			// If it wasn't bound before, it's bound now
+			theFlags |= kDidBind;
+			
+			if(sentPtr) *sentPtr = YES;
+			return YES;
+		}
+	}
+	
+	NSData *data = [NSData dataWithBytes:bytes length:length];
+	
+	return [self sendData:data withTimeout:timeout tag:tag];
+}
+
 - (BOOL)sendData:(NSData *)data toHost:(NSString *)host port:(UInt16)port withTimeout:(NSTimeInterval)timeout tag:(long)tag
 {
 	if((data == nil) || ([data length] == 0)) return NO;
@@ -1762,36 +2220,6 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	return YES;
 }
 
-- (BOOL)canAcceptBytes:(CFSocketRef)sockRef
-{
-	if(sockRef == theSocket4)
-	{
-		if(theFlags & kSock4CanAcceptBytes) return YES;
-	}
-	else
-	{
-		if(theFlags & kSock6CanAcceptBytes) return YES;
-	}
-	
-	CFSocketNativeHandle theNativeSocket = CFSocketGetNative(sockRef);
-	
-	if(theNativeSocket == 0)
-	{
-		NSLog(@"Error - Could not get CFSocketNativeHandle from CFSocketRef");
-		return NO;
-	} 
-	
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(theNativeSocket, &fds);
-	
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 0;
-	
-	return select(FD_SETSIZE, NULL, &fds, NULL, &timeout) > 0;
-}
-
 - (CFSocketRef)socketForPacket:(AsyncSendPacket *)packet
 {
 	if(!theSocket4)
@@ -1814,6 +2242,23 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	}
 }
 
+/**
+ * Starts the time-out timer for the current send, which runs from the moment the send is dequeued.
+**/
+- (void)startSendTimeout
+{
+	if(theCurrentSend->timeout >= 0.0)
+	{
+		theSendTimer = [NSTimer timerWithTimeInterval:theCurrentSend->timeout
+											   target:self 
+											 selector:@selector(doSendTimeout:)
+											 userInfo:nil
+											  repeats:NO];
+		
+		[self runLoopAddTimer:theSendTimer];
+	}
+}
+
 /**
  * This method starts a new send, if needed.
  * It is called when a user requests a send.
@@ -1832,16 +2277,7 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 			[theSendQueue removeObjectAtIndex:0];
 			
 			// Start time-out timer.
-			if(theCurrentSend->timeout >= 0.0)
-			{
-				theSendTimer = [NSTimer timerWithTimeInterval:theCurrentSend->timeout
-													   target:self 
-													 selector:@selector(doSendTimeout:)
-													 userInfo:nil
-													  repeats:NO];
-				
-				[self runLoopAddTimer:theSendTimer];
-			}
+			[self startSendTimeout];
 			
 			// Immediately send, if possible.
 			[self doSend:[self socketForPacket:theCurrentSend]];
@@ -1864,11 +2300,14 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 }
 
 /**
- * This method is called when a new read is taken from the read queue or when new data becomes available on the stream.
+ * This method is called when a new send is taken from the send queue or when the socket becomes writeable.
+ * 
+ * Sends as many queued packets as the socket will take, one after another,
+ * rather than going back through the run loop (and checking whether the socket is writeable) for each one.
 **/
 - (void)doSend:(CFSocketRef)theSocket
 {
-	if(theCurrentSend != nil)
+	while(theCurrentSend != nil)
 	{
 		if(theSocket != [self socketForPacket:theCurrentSend])
 		{
@@ -1876,51 +2315,60 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 			return;
 		}
 		
-		if([self canAcceptBytes:theSocket])
+		int result;
+		CFSocketNativeHandle theNativeSocket = CFSocketGetNative(theSocket);
+		
+		const void *buf  = [theCurrentSend->buffer bytes];
+		unsigned bufSize = [theCurrentSend->buffer length];
+		
+		if([self isConnected])
 		{
-			int result;
-			CFSocketNativeHandle theNativeSocket = CFSocketGetNative(theSocket);
-			
-			const void *buf  = [theCurrentSend->buffer bytes];
-			unsigned bufSize = [theCurrentSend->buffer length];
-			
-			if([self isConnected])
-			{
-				result = send(theNativeSocket, buf, bufSize, 0);
-			}
-			else
-			{
-				const void *dst  = [theCurrentSend->address bytes];
-				unsigned dstSize = [theCurrentSend->address length];
-				
-				result = sendto(theNativeSocket, buf, bufSize, 0, dst, dstSize);
-			}
-			
-			if(theSocket == theSocket4)
-				theFlags &= ~kSock4CanAcceptBytes;
-			else
-				theFlags &= ~kSock6CanAcceptBytes;
-			
-			if(result < 0)
-			{
-				[self failCurrentSend:[self getErrnoError]];
-			}
-			else
-			{
-				// If it wasn't bound before, it's bound now
-				theFlags |= kDidBind;
-				
-				[self completeCurrentSend];
-			}
-			
-			[self scheduleDequeueSend];
+			result = send(theNativeSocket, buf, bufSize, MSG_DONTWAIT);
 		}
 		else
 		{
+			const void *dst  = [theCurrentSend->address bytes];
+			unsigned dstSize = [theCurrentSend->address length];
+			
+			result = sendto(theNativeSocket, buf, bufSize, MSG_DONTWAIT, dst, dstSize);
+		}
+		
+		if((result < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			// The socket buffer is full.
 			// Request notification when the socket is ready to send more data
 			CFSocketEnableCallBacks(theSocket, kCFSocketReadCallBack | kCFSocketWriteCallBack);
+			return;
+		}
+		
+		if(result < 0)
+		{
+			[self failCurrentSend:[self getErrnoError]];
+		}
+		else
+		{
+			// If it wasn't bound before, it's bound now
+			theFlags |= kDidBind;
+			
+			[self completeCurrentSend];
+		}
+		
+		// Move straight on to the next packet (unless the delegate closed us in the meantime)
+		
+		if((theCurrentSend == nil) && ([theSendQueue count] > 0) && !(theFlags & kDidClose))
+		{
+			theCurrentSend = [[theSendQueue objectAtIndex:0] retain];
+			[theSendQueue removeObjectAtIndex:0];
+			
+			[self startSendTimeout];
+			
+			// The next packet may be going out over the other socket
+			theSocket = [self socketForPacket:theCurrentSend];
 		}
 	}
+	
+	// Nothing left to send. This takes care of closing the socket if we were asked to close after sending.
+	[self scheduleDequeueSend];
 }
 
 - (void)completeCurrentSend
@@ -1988,36 +2436,6 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	[packet release];
 }
 
-- (BOOL)hasBytesAvailable:(CFSocketRef)sockRef
-{
-	if(sockRef == theSocket4)
-	{
-		if(theFlags & kSock4HasBytesAvailable) return YES;
-	}
-	else
-	{
-		if(theFlags & kSock6HasBytesAvailable) return YES;
-	}
-	
-	CFSocketNativeHandle theNativeSocket = CFSocketGetNative(sockRef);
-	
-	if(theNativeSocket == 0)
-	{
-		NSLog(@"Error - Could not get CFSocketNativeHandle from CFSocketRef");
-		return NO;
-	} 
-	
-	fd_set fds;
-	FD_ZERO(&fds);
-	FD_SET(theNativeSocket, &fds);
-	
-	struct timeval timeout;
-	timeout.tv_sec = 0;
-	timeout.tv_usec = 0;
-	
-	return select(FD_SETSIZE, &fds, NULL, NULL, &timeout) > 0;
-}
-
 /**
  * Puts a maybeDequeueReceive on the run loop.
 **/
@@ -2043,20 +2461,7 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 		if([theReceiveQueue count] > 0)
 		{
 			// Dequeue next receive packet
-			theCurrentReceive = [[theReceiveQueue objectAtIndex:0] retain];
-			[theReceiveQueue removeObjectAtIndex:0];
-			
-			// Start time-out timer.
-			if (theCurrentReceive->timeout >= 0.0)
-			{
-				theReceiveTimer = [NSTimer timerWithTimeInterval:theCurrentReceive->timeout
-														  target:self
-														selector:@selector(doReceiveTimeout:)
-														userInfo:nil
-														 repeats:NO];
-				
-				[self runLoopAddTimer:theReceiveTimer];
-			}
+			[self startNextReceive];
 			
 			// Immediately receive, if possible
 			// We always check both sockets so we don't ever starve one of them.
@@ -2092,6 +2497,27 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	}
 }
 
+/**
+ * Dequeues the next receive packet, and starts its time-out timer.
+**/
+- (void)startNextReceive
+{
+	theCurrentReceive = [[theReceiveQueue objectAtIndex:0] retain];
+	[theReceiveQueue removeObjectAtIndex:0];
+	
+	// Start time-out timer.
+	if (theCurrentReceive->timeout >= 0.0)
+	{
+		theReceiveTimer = [NSTimer timerWithTimeInterval:theCurrentReceive->timeout
+												  target:self
+												selector:@selector(doReceiveTimeout:)
+												userInfo:nil
+												 repeats:NO];
+		
+		[self runLoopAddTimer:theReceiveTimer];
+	}
+}
+
 - (void)doReceive4
 {
 	if(theSocket4) [self doReceive:theSocket4];
@@ -2102,140 +2528,168 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	if(theSocket6) [self doReceive:theSocket6];
 }
 
+/**
+ * Hands received datagrams to the current receive operation (and those queued after it),
+ * reading a new batch from the socket once the previous one has been used up.
+ * 
+ * At most one batch is read from the socket per call, so a busy socket can't starve the other one.
+**/
 - (void)doReceive:(CFSocketRef)theSocket
 {
-	if (theCurrentReceive != nil)
+	BOOL didFillBatch = NO;
+	
+	while(theCurrentReceive != nil)
 	{
-		BOOL appIgnoredReceivedData;
-		BOOL userIgnoredReceivedData;
+		if(receiveBatchIndex == receiveBatchCount)
+		{
+			if(receiveBatchErrno != 0)
+			{
+				// The last batch was cut short by an error, which we can now report
+				int err = receiveBatchErrno;
+				receiveBatchErrno = 0;
+				
+				[self failCurrentReceive:[self getErrorWithErrno:err]];
+				[self scheduleDequeueReceive];
+				return;
+			}
+			
+			if(didFillBatch)
+			{
+				// Give the other socket a turn.
+				// If there's still more data waiting, the run loop will call us back once it's done so.
+				CFSocketEnableCallBacks(theSocket, kCFSocketReadCallBack | kCFSocketWriteCallBack);
+				return;
+			}
+			
+			if(![self fillReceiveBatch:theSocket])
+			{
+				// Nothing available yet (or the receive failed)
+				return;
+			}
+			didFillBatch = YES;
+		}
+		
+		AsyncUdpDatagram *datagram = &receiveBatch[receiveBatchIndex];
+		receiveBatchIndex++;
 		
-		do
+		struct sockaddr *source = (struct sockaddr *)&datagram->address;
+		
+		if(connectedAddress && !AsyncUdpAddressesEqual(connectedAddress, source))
 		{
-			// Set or reset ignored variables.
-			// If the app or user ignores the received data, we'll continue this do-while loop.
-			appIgnoredReceivedData = NO;
-			userIgnoredReceivedData = NO;
+			// The user connected to an address, and the received data doesn't match the address.
+			// This may happen if the data is received by the kernel prior to the connect call.
+			continue;
+		}
+		
+		UInt16 port;
+		
+		if(source->sa_family == AF_INET)
+			port = ntohs(((struct sockaddr_in *)source)->sin_port);
+		else
+			port = ntohs(((struct sockaddr_in6 *)source)->sin6_port);
+		
+		// Hand the buffer itself to the delegate. It goes back into the pool once the data is released.
+		theCurrentReceive->buffer = [[AsyncUdpPooledData alloc] initWithPool:receiveBufferPool
+		                                                              buffer:datagram->bytes
+		                                                                size:datagram->size
+		                                                              length:datagram->length];
+		datagram->bytes = NULL;
+		theCurrentReceive->host = [[self sourceHost:source] retain];
+		theCurrentReceive->port = port;
+		
+		BOOL finished = [self maybeCompleteCurrentReceive];
 		
-			if([self hasBytesAvailable:theSocket])
+		if(finished)
+		{
+			// Move straight on to the next receive packet, if the delegate has already queued one.
+			// Otherwise this takes care of closing the socket if we were asked to close after receiving.
+			
+			if((theCurrentReceive == nil) && ([theReceiveQueue count] > 0) && !(theFlags & kDidClose))
 			{
-				int result;
-				CFSocketNativeHandle theNativeSocket = CFSocketGetNative(theSocket);
-				
-				// Allocate buffer for recvfrom operation.
-				// If the operation is successful, we'll realloc the buffer to the appropriate size,
-				// and create an NSData wrapper around it without needing to copy any bytes around.
-				void *buf = malloc(maxReceiveBufferSize);
-				size_t bufSize = maxReceiveBufferSize;
-				
-				if(theSocket == theSocket4)
-				{
-					struct sockaddr_in sockaddr4;
-					socklen_t sockaddr4len = sizeof(sockaddr4);
-					
-					result = recvfrom(theNativeSocket, buf, bufSize, 0, (struct sockaddr *)&sockaddr4, &sockaddr4len);
-					
-					if(result >= 0)
-					{
-						NSString *host = [self addressHost4:&sockaddr4];
-						UInt16 port = ntohs(sockaddr4.sin_port);
-						
-						if([self isConnected] && ![self isConnectedToHost:host port:port])
-						{
-							// The user connected to an address, and the received data doesn't match the address.
-							// This may happen if the data is received by the kernel prior to the connect call.
-							appIgnoredReceivedData = YES;
-						}
-						else
-						{
-							if(result != bufSize)
-							{
-								buf = realloc(buf, result);
-							}
-							theCurrentReceive->buffer = [[NSData alloc] initWithBytesNoCopy:buf
-																					 length:result
-																			   freeWhenDone:YES];
-							theCurrentReceive->host = [host retain];
-							theCurrentReceive->port = port;
-						}
-					}
-					
-					theFlags &= ~kSock4HasBytesAvailable;
-				}
-				else
-				{
-					struct sockaddr_in6 sockaddr6;
-					socklen_t sockaddr6len = sizeof(sockaddr6);
-					
-					result = recvfrom(theNativeSocket, buf, bufSize, 0, (struct sockaddr *)&sockaddr6, &sockaddr6len);
-					
-					if(result >= 0)
-					{
-						NSString *host = [self addressHost6:&sockaddr6];
-						UInt16 port = ntohs(sockaddr6.sin6_port);
-						
-						if([self isConnected] && ![self isConnectedToHost:host port:port])
-						{
-							// The user connected to an address, and the received data doesn't match the address.
-							// This may happen if the data is received by the kernel prior to the connect call.
-							appIgnoredReceivedData = YES;
-						}
-						else
-						{
-							if(result != bufSize)
-							{
-								buf = realloc(buf, result);
-							}
-							theCurrentReceive->buffer = [[NSData alloc] initWithBytesNoCopy:buf
-																					 length:result
-																			   freeWhenDone:YES];
-							theCurrentReceive->host = [host retain];
-							theCurrentReceive->port = port;
-						}
-					}
-					
-					theFlags &= ~kSock6HasBytesAvailable;
-				}
-				
-				// Check to see if we need to free our alloc'd buffer
-				// If the buffer is non-nil, this means it has taken ownership of the buffer
-				if(theCurrentReceive->buffer == nil)
-				{
-					free(buf);
-				}
-				
-				if(result < 0)
-				{
-					[self failCurrentReceive:[self getErrnoError]];
-					[self scheduleDequeueReceive];
-				}
-				else if(!appIgnoredReceivedData)
-				{
-					BOOL finished = [self maybeCompleteCurrentReceive];
-					
-					if(finished)
-					{
-						[self scheduleDequeueReceive];
-					}
-					else
-					{
-						[theCurrentReceive->buffer release];
-						[theCurrentReceive->host release];
-						
-						theCurrentReceive->buffer = nil;
-						theCurrentReceive->host = nil;
-						
-						userIgnoredReceivedData = YES;
-					}
-				}
+				[self startNextReceive];
 			}
 			else
 			{
-				// Request notification when the socket is ready to receive more data
-				CFSocketEnableCallBacks(theSocket, kCFSocketReadCallBack | kCFSocketWriteCallBack);
+				[self scheduleDequeueReceive];
 			}
+		}
+		else
+		{
+			// The user ignored the data, so the current receive is still waiting for a datagram
+			
+			[theCurrentReceive->buffer release];
+			[theCurrentReceive->host release];
 			
-		} while(appIgnoredReceivedData || userIgnoredReceivedData);
+			theCurrentReceive->buffer = nil;
+			theCurrentReceive->host = nil;
+		}
+	}
+}
+
+/**
+ * Reads as many datagrams as are available from the socket, up to RECEIVE_BATCH_SIZE, into the receive batch buffer.
+ * 
+ * Returns YES if any datagrams were read.
+ * Otherwise either asks to be notified when data arrives, or fails the current receive, and returns NO.
+**/
+- (BOOL)fillReceiveBatch:(CFSocketRef)theSocket
+{
+	if(receiveBatch == NULL)
+	{
+		receiveBatch = calloc(RECEIVE_BATCH_SIZE, sizeof(AsyncUdpDatagram));
+	}
+	
+	CFSocketNativeHandle theNativeSocket = CFSocketGetNative(theSocket);
+	
+	receiveBatchCount = 0;
+	receiveBatchIndex = 0;
+	
+	while(receiveBatchCount < RECEIVE_BATCH_SIZE)
+	{
+		AsyncUdpDatagram *datagram = &receiveBatch[receiveBatchCount];
+		
+		if(datagram->bytes && (datagram->size != maxReceiveBufferSize))
+		{
+			// The maxReceiveBufferSize has changed since this buffer was taken from the pool
+			[receiveBufferPool checkInBuffer:datagram->bytes size:datagram->size];
+			datagram->bytes = NULL;
+		}
+		if(datagram->bytes == NULL)
+		{
+			datagram->bytes = [receiveBufferPool checkOutBufferOfSize:maxReceiveBufferSize];
+			datagram->size = maxReceiveBufferSize;
+		}
+		
+		socklen_t addressLength = sizeof(datagram->address);
+		
+		int result = recvfrom(theNativeSocket, datagram->bytes, datagram->size, MSG_DONTWAIT,
+		                      (struct sockaddr *)&datagram->address, &addressLength);
+		
+		if(result < 0)
+		{
+			if((errno == EAGAIN) || (errno == EWOULDBLOCK))
+			{
+				// The socket is empty. Request notification when the socket is ready to receive more data.
+				CFSocketEnableCallBacks(theSocket, kCFSocketReadCallBack | kCFSocketWriteCallBack);
+			}
+			else if(receiveBatchCount > 0)
+			{
+				// Report the error once the datagrams we did get have been delivered
+				receiveBatchErrno = errno;
+			}
+			else
+			{
+				[self failCurrentReceive:[self getErrnoError]];
+				[self scheduleDequeueReceive];
+			}
+			break;
+		}
+		
+		datagram->length = result;
+		receiveBatchCount++;
 	}
+	
+	return receiveBatchCount > 0;
 }
 
 - (BOOL)maybeCompleteCurrentReceive
@@ -2307,17 +2761,9 @@ static void MyCFSocketCallback(CFSocketRef, CFSocketCallBackType, CFDataRef, con
 	switch (type)
 	{
 		case kCFSocketReadCallBack:
-			if(sock == theSocket4)
-				theFlags |= kSock4HasBytesAvailable;
-			else
-				theFlags |= kSock6HasBytesAvailable;
 			[self doReceive:sock];
 			break;
 		case kCFSocketWriteCallBack:
-			if(sock == theSocket4)
-				theFlags |= kSock4CanAcceptBytes;
-			else
-				theFlags |= kSock6CanAcceptBytes;
 			[self doSend:sock];
 			break;
 		default:
@@ -20,6 +20,8 @@
 	NSMutableArray *availableRemoteTcpSockets;
 	NSMutableArray *availableRemoteUdpSockets;
 	NSMutableArray *availableRemoteProxySockets;
+	NSMutableArray *pendingRemoteConnections;
+	NSMutableArray *remoteMultiplexers;
 	NSMutableArray *stuntSockets;
 	NSMutableArray *stunSockets;
 	NSMutableArray *turnSockets;
@@ -5,6 +5,7 @@
 #import "MojoXMPPClient.h"
 #import "STUNSocket.h"
 #import "PseudoTcp.h"
+#import "PseudoTcpNetworkThread.h"
 #import "PseudoAsyncSocket.h"
 #import "TURNSocket.h"
 
@@ -43,6 +44,9 @@
 - (void)startSTUNT:(unsigned int)backupPlans;
 - (void)startSTUN:(unsigned int)backupPlans;
 - (void)startTURN:(unsigned int)backupPlans;
+- (void)configureRemotePseudoTcp:(PseudoTcp *)ptcp;
+- (void)attachRemoteUdpSocket:(PseudoAsyncSocket *)connectedSocket;
+- (PseudoAsyncSocket *)remoteSocketWithPseudoSocket:(id <PseudoTcpSocket>)socket;
 @end
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -106,6 +110,8 @@
 	availableRemoteTcpSockets   = [[NSMutableArray alloc] initWithCapacity:4];
 	availableRemoteUdpSockets   = [[NSMutableArray alloc] initWithCapacity:4];
 	availableRemoteProxySockets = [[NSMutableArray alloc] initWithCapacity:4];
+	pendingRemoteConnections    = [[NSMutableArray alloc] initWithCapacity:1];
+	remoteMultiplexers          = [[NSMutableArray alloc] initWithCapacity:1];
 	stuntSockets                = [[NSMutableArray alloc] initWithCapacity:4];
 	stunSockets                 = [[NSMutableArray alloc] initWithCapacity:4];
 	turnSockets                 = [[NSMutableArray alloc] initWithCapacity:4];	
@@ -185,6 +191,20 @@
 		[currentSocket disconnect];
 	}
 	
+	for(i = 0; i < [pendingRemoteConnections count]; i++)
+	{
+		PseudoTcpThreadedConnection *currentConnection = [pendingRemoteConnections objectAtIndex:i];
+		[currentConnection setDelegate:nil];
+		[currentConnection close];
+	}
+	
+	for(i = 0; i < [remoteMultiplexers count]; i++)
+	{
+		PseudoTcpThreadedConnection *currentConnection = [remoteMultiplexers objectAtIndex:i];
+		[currentConnection setDelegate:nil];
+		[currentConnection close];
+	}
+	
 	// Any existing STUNT, STUN, or TURN sockets may be holding a reference to us as a delegate
 	
 	for(i = 0; i < [stuntSockets count]; i++)
@@ -233,6 +253,8 @@
 	[availableRemoteTcpSockets release];
 	[availableRemoteUdpSockets release];
 	[availableRemoteProxySockets release];
+	[pendingRemoteConnections release];
+	[remoteMultiplexers release];
 	[stuntSockets release];
 	[stunSockets release];
 	[turnSockets release];
@@ -545,6 +567,18 @@
 		// We only keep a reference to those sockets which are available for use
 		[availableRemoteProxySockets removeObjectAtIndex:0];
 	}
+	else if([remoteMultiplexers count] > 0)
+	{
+		DDLogInfo(@"GatewayHTTPServer: OPENING NEW STREAM ON PREVIOUS CONNECTION (UDP)");
+		
+		// We already have a UDP flow to the remote host, so there's no need for another NAT traversal.
+		// We simply open another stream over it.
+		PseudoTcpThreadedConnection *multiplexedConnection = [remoteMultiplexers objectAtIndex:0];
+		
+		PseudoAsyncSocket *remoteSocket = [self remoteSocketWithPseudoSocket:[multiplexedConnection openSocket]];
+		
+		[connection setRemoteSocket:(AsyncSocket *)remoteSocket];
+	}
 	else
 	{
 		if(remoteHost)
@@ -946,23 +980,74 @@
 	DDLogInfo(@"GatewayHTTPServer: CONNECTION READY (STUN)");
 	stunSuccessCount++;
 	
-	// We need to create a Pseudo TCP socket on top of the UDP socket
-	PseudoTcp *ptcp = [[[PseudoTcp alloc] initWithUdpSocket:socket] autorelease];
+	// We need to create a Pseudo TCP socket on top of the UDP socket.
+	// It runs on the network thread, so song downloads aren't held up while the main thread is busy.
+	PseudoTcpThreadedConnection *connection;
+	connection = [[[PseudoTcpThreadedConnection alloc] initWithUdpSocket:socket
+	                                                       networkThread:[PseudoTcpNetworkThread sharedNetworkThread]] autorelease];
+	
+	if(connection == nil)
+	{
+		// Let's try something else
+		[stunSockets removeObject:sender];
+		[self waitStunTimeout:nil];
+		return;
+	}
+	
+	[connection configurePseudoTcpWithSelector:@selector(configureRemotePseudoTcp:) target:self];
+	[connection setDelegate:self];
+	
+	[pendingRemoteConnections addObject:connection];
 	
 	// Start the Pseudo TCP connection to get it going
-	[ptcp activeOpen];
+	[connection activeOpen];
 	
-	// And then we need to disguise the Pseudo TCP socket in an asynchronous
-	// wrapper so it can be used just like a TCP AsyncSocket instance.
-	PseudoAsyncSocket *connectedSocket = [[[PseudoAsyncSocket alloc] initWithPseudoTcp:ptcp] autorelease];
+	// Remove the stuntSocket from our array of stunt sockets - we no longer need it
+	[stunSockets removeObject:sender];
 	
-	// Mark the connected socket as being a direct UDP connection
-	[connectedSocket setUserData:PROTOCOL_UDP];
+	// Remove the waitStunTimer
+	if([waitStunTimers count] > 0)
+	{
+		[[waitStunTimers objectAtIndex:0] invalidate];
+		[waitStunTimers removeObjectAtIndex:0];
+	}
+}
+
+/**
+ * Called when any of our STUN sockets fail.
+**/
+- (void)stunSocketDidFail:(STUNSocket *)sender
+{
+	DDLogInfo(@"GatewayHTTPServer: STUN FAILED");
+	stunFailureCount++;
 	
-	// Ensure the connected socket is running in all common run loop modes
-	[connectedSocket setRunLoopModes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+	// Remove the stunSocket from our array of stun sockets - we no longer need it
+	[stunSockets removeObject:sender];
 	
-	// We need to attach the connected socket to a connection that's waiting for one
+	// Let's try something else
+	[self waitStunTimeout:nil];
+}
+
+/**
+ * Configures the Pseudo TCP socket for a new remote connection.
+ * This is invoked on the network thread, and must not touch anything but the socket.
+**/
+- (void)configureRemotePseudoTcp:(PseudoTcp *)ptcp
+{
+	// We'll be downloading songs over this connection, so allow a large receive window
+	[ptcp setMaxReceiveBufferSize:(1024 * 1024 * 2)];
+	
+	// Offer to multiplex streams over the Pseudo TCP socket, so future connections can reuse the UDP flow.
+	// Whether the remote host agrees isn't known until the connection is open (see threadedConnectionDidOpen:).
+	[ptcp setMultiplexing:YES];
+}
+
+/**
+ * Attaches a newly connected UDP socket to a connection that's waiting for one,
+ * or saves it for later use if there aren't any.
+**/
+- (void)attachRemoteUdpSocket:(PseudoAsyncSocket *)connectedSocket
+{
 	unsigned int i;
 	BOOL done = NO;
 	
@@ -977,7 +1062,7 @@
 		}
 	}
 	
-	// It's possible that the gateway connection closed before the stunt procedure finished
+	// It's possible that the gateway connection closed before the stun procedure finished
 	// If this ever happens, save the connected socket for later use
 	if(!done)
 	{
@@ -985,31 +1070,91 @@
 		
 		[availableRemoteUdpSockets addObject:connectedSocket];
 	}
+}
+
+/**
+ * Wraps a socket from one of our Pseudo TCP connections (the connection itself, or one of its streams)
+ * in a PseudoAsyncSocket, so it can be used just like a TCP AsyncSocket instance.
+**/
+- (PseudoAsyncSocket *)remoteSocketWithPseudoSocket:(id <PseudoTcpSocket>)socket
+{
+	PseudoAsyncSocket *remoteSocket = [[[PseudoAsyncSocket alloc] initWithPseudoSocket:socket] autorelease];
 	
-	// Remove the stuntSocket from our array of stunt sockets - we no longer need it
-	[stunSockets removeObject:sender];
+	// Mark the socket as being a direct UDP connection
+	[remoteSocket setUserData:PROTOCOL_UDP];
 	
-	// Remove the waitStunTimer
-	if([waitStunTimers count] > 0)
+	// Ensure the socket is running in all common run loop modes
+	[remoteSocket setRunLoopModes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+	
+	return remoteSocket;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark PseudoTcpThreadedConnection Delegate Methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Called when the Pseudo TCP connection we started after a successful STUN procedure is open.
+ * We now know whether the remote host understands multiplexing.
+**/
+- (void)threadedConnectionDidOpen:(PseudoTcpThreadedConnection *)sender
+{
+	if([sender isMultiplexed])
 	{
-		[[waitStunTimers objectAtIndex:0] invalidate];
-		[waitStunTimers removeObjectAtIndex:0];
+		DDLogInfo(@"GatewayHTTPServer: CONNECTION OPEN (STUN, MULTIPLEXED)");
+		
+		// We multiplex streams over the Pseudo TCP socket, so future connections can reuse the UDP flow
+		[remoteMultiplexers addObject:sender];
+	}
+	else
+	{
+		// The remote host is an older version, which doesn't understand the multiplexing framing.
+		// So we use the Pseudo TCP socket itself, for this connection only.
+		DDLogInfo(@"GatewayHTTPServer: CONNECTION OPEN (STUN)");
+	}
+	
+	// And then we need to open a stream (or take the connection itself),
+	// and disguise it in an asynchronous wrapper so it can be used just like a TCP AsyncSocket instance.
+	PseudoTcpThreadedSocket *socket = [sender openSocket];
+	
+	// The wrapper retains the socket, which keeps a connection that isn't multiplexed open
+	[pendingRemoteConnections removeObject:sender];
+	
+	if(socket)
+	{
+		[self attachRemoteUdpSocket:[self remoteSocketWithPseudoSocket:socket]];
 	}
 }
 
 /**
- * Called when any of our STUN sockets fail.
+ * Called if the Pseudo TCP connection we started after a successful STUN procedure fails to open,
+ * or when the UDP flow underneath one of our multiplexed connections has closed.
+ * Any sockets using its streams will be disconnected, and removed from our lists in onSocketDidDisconnect:.
 **/
-- (void)stunSocketDidFail:(STUNSocket *)sender
+- (void)threadedConnectionDidClose:(PseudoTcpThreadedConnection *)sender
 {
-	DDLogInfo(@"GatewayHTTPServer: STUN FAILED");
-	stunFailureCount++;
+	if([remoteMultiplexers containsObject:sender])
+	{
+		DDLogInfo(@"GatewayHTTPServer: MULTIPLEXED CONNECTION CLOSED (STUN)");
+		
+		[remoteMultiplexers removeObject:sender];
+		return;
+	}
 	
-	// Remove the stunSocket from our array of stun sockets - we no longer need it
-	[stunSockets removeObject:sender];
+	DDLogInfo(@"GatewayHTTPServer: CONNECTION FAILED TO OPEN (STUN)");
 	
-	// Let's try something else
-	[self waitStunTimeout:nil];
+	[pendingRemoteConnections removeObject:sender];
+	
+	// If a connection is still waiting for a remote socket, fall back to the proxy
+	unsigned int i;
+	for(i = 0; i < [connections count]; i++)
+	{
+		if([[connections objectAtIndex:i] remoteSocket] == nil)
+		{
+			[self startTURN:PROTOCOL_NONE];
+			break;
+		}
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -140,6 +140,11 @@ static NSOperationQueue *operationQueue;
 	return filePath;
 }
 
+- (NSFileHandle *)fileHandle
+{
+	return fileHandle;
+}
+
 - (BOOL)isAsynchronous
 {
 	return YES;
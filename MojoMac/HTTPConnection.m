@@ -65,6 +65,9 @@
 - (CFHTTPMessageRef)newMultiRangeResponse:(UInt64)contentLength;
 - (NSData *)chunkedTransferSizeLineForLength:(unsigned int)length;
 - (NSData *)chunkedTransferFooter;
+- (BOOL)sendResponseBodyFromFileToOffset:(UInt64)endOffset;
+- (void)continueSendingStandardResponseBody;
+- (void)continueSendingSingleRangeResponseBody;
 @end
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -781,36 +784,7 @@ static NSMutableArray *recentNonces;
 		if(!isRangeRequest)
 		{
 			// Regular request
-			NSData *data = [httpResponse readDataOfLength:READ_CHUNKSIZE];
-			
-			if([data length] > 0)
-			{
-				[responseDataSizes addObject:[NSNumber numberWithUnsignedInt:[data length]]];
-				
-				if(isChunked)
-				{
-					NSData *chunkSize = [self chunkedTransferSizeLineForLength:[data length]];
-					[asyncSocket writeData:chunkSize withTimeout:WRITE_HEAD_TIMEOUT tag:HTTP_PARTIAL_RESPONSE_HEADER];
-					
-					[asyncSocket writeData:data withTimeout:WRITE_BODY_TIMEOUT tag:HTTP_PARTIAL_RESPONSE_BODY];
-					
-					if([httpResponse isDone])
-					{
-						NSData *footer = [self chunkedTransferFooter];
-						[asyncSocket writeData:footer withTimeout:WRITE_HEAD_TIMEOUT tag:HTTP_RESPONSE];
-					}
-					else
-					{
-						NSData *footer = [AsyncSocket CRLFData];
-						[asyncSocket writeData:footer withTimeout:WRITE_HEAD_TIMEOUT tag:HTTP_PARTIAL_RESPONSE_HEADER];
-					}
-				}
-				else
-				{
-					long tag = [httpResponse isDone] ? HTTP_RESPONSE : HTTP_PARTIAL_RESPONSE_BODY;
-					[asyncSocket writeData:data withTimeout:WRITE_BODY_TIMEOUT tag:tag];
-				}
-			}
+			[self continueSendingStandardResponseBody];
 		}
 		else
 		{
@@ -823,17 +797,7 @@ static NSMutableArray *recentNonces;
 				
 				[httpResponse setOffset:range.location];
 				
-				unsigned int bytesToRead = range.length < READ_CHUNKSIZE ? range.length : READ_CHUNKSIZE;
-				
-				NSData *data = [httpResponse readDataOfLength:bytesToRead];
-				
-				if([data length] > 0)
-				{
-					[responseDataSizes addObject:[NSNumber numberWithUnsignedInt:[data length]]];
-					
-					long tag = [data length] == range.length ? HTTP_RESPONSE : HTTP_PARTIAL_RANGE_RESPONSE_BODY;
-					[asyncSocket writeData:data withTimeout:WRITE_BODY_TIMEOUT tag:tag];
-				}
+				[self continueSendingSingleRangeResponseBody];
 			}
 			else
 			{
@@ -1001,6 +965,47 @@ static NSMutableArray *recentNonces;
 	return result;
 }
 
+/**
+ * If the response is a file, and the socket can send files without copying them,
+ * queues the rest of the response body (up to the given offset) as a single file write, with a tag of HTTP_RESPONSE.
+ * 
+ * The file is then sent straight from the file system cache by the kernel. It's never read into memory,
+ * so there's no need to keep the write queue small, as we do for data.
+ * 
+ * Returns YES if the response body is being sent from the file (in which case there's nothing more to do),
+ * or NO if it must be read and sent as data.
+**/
+- (BOOL)sendResponseBodyFromFileToOffset:(UInt64)endOffset
+{
+	if(![asyncSocket canWriteFilesWithoutCopying]) return NO;
+	if(![httpResponse respondsToSelector:@selector(fileHandle)]) return NO;
+	
+	if([httpResponse respondsToSelector:@selector(isChunked)] && [httpResponse isChunked]) return NO;
+	
+	NSFileHandle *fileHandle = [httpResponse fileHandle];
+	if(fileHandle == nil) return NO;
+	
+	UInt64 offset = [httpResponse offset];
+	
+	if(offset < endOffset)
+	{
+		// The file isn't held in memory, so it doesn't count towards the writeQueueSize.
+		// But the HTTP_RESPONSE tag still expects an entry for it.
+		[responseDataSizes addObject:[NSNumber numberWithUnsignedInt:0]];
+		
+		[asyncSocket writeFile:fileHandle
+						offset:offset
+						length:(endOffset - offset)
+				   withTimeout:WRITE_BODY_TIMEOUT
+						   tag:HTTP_RESPONSE];
+		
+		// Move the response past what we've queued, so it's done
+		[httpResponse setOffset:endOffset];
+	}
+	
+	return YES;
+}
+
 /**
  * Sends more data, if needed, without growing the write queue over its approximate size limit.
  * The last chunk of the response body will be sent with a tag of HTTP_RESPONSE.
@@ -1023,6 +1028,8 @@ static NSMutableArray *recentNonces;
 	// This provides an easy way for the HTTPResponse object to throttle its data allocation in step with the rate
 	// at which the socket is able to send it.
 	
+	if([self sendResponseBodyFromFileToOffset:[httpResponse contentLength]]) return;
+	
 	unsigned int writeQueueSize = [self writeQueueSize];
 	
 	if(writeQueueSize >= READ_CHUNKSIZE) return;
@@ -1095,6 +1102,8 @@ static NSMutableArray *recentNonces;
 	
 	DDRange range = [[ranges objectAtIndex:0] ddrangeValue];
 	
+	if([self sendResponseBodyFromFileToOffset:(range.location + range.length)]) return;
+	
 	UInt64 offset = [httpResponse offset];
 	UInt64 bytesRead = offset - range.location;
 	UInt64 bytesLeft = range.length - bytesRead;
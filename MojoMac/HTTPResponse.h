@@ -42,6 +42,13 @@
 // Important: You should read the discussion at the bottom of this header.
 - (BOOL)isChunked;
 
+// If the response is simply the contents of a file, implement this method and return a file handle for it.
+// The connection may then have the socket send the file itself (using sendfile) instead of calling readDataOfLength.
+// The file handle is never read from. The file is sent from the current offset, and the connection then calls
+// setOffset: with the end of each range it has queued, so the handle's offset is advanced past it
+// (as with HTTPFileResponse, which seeks the handle in setOffset:).
+- (NSFileHandle *)fileHandle;
+
 #endif
 
 @end
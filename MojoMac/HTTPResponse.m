@@ -61,6 +61,11 @@
 	return filePath;
 }
 
+- (NSFileHandle *)fileHandle
+{
+	return fileHandle;
+}
+
 @end
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -16,6 +16,10 @@
 		// Initialize underlying asynchronous tcp/ip socket
 		asyncSocket = [[AsyncSocket alloc] initWithDelegate:self];
 		
+		// Accepted connections skip the read and write streams, and share a single kqueue per run loop instead.
+		// So idle keep-alive connections cost next to nothing. (HTTPS connections still get streams.)
+		[asyncSocket setUsesEventLoop:YES];
+		
 		// Use default connection class of HTTPConnection
 		connectionClass = [HTTPConnection self];
 		
@@ -9,6 +9,9 @@
 	NSMutableArray *turnConnections;
 	NSMutableArray *stunConnections;
 	NSMutableArray *stuntConnections;
+	
+	NSMutableArray *pendingConnections;
+	NSMutableArray *multiplexers;
 }
 
 + (MojoXMPPClient *)sharedInstance;
@@ -7,6 +7,8 @@
 #import "STUNSocket.h"
 #import "TURNSocket.h"
 #import "PseudoTcp.h"
+#import "PseudoTcpCongestionControl.h"
+#import "PseudoTcpNetworkThread.h"
 #import "PseudoAsyncSocket.h"
 #import "MojoHTTPServer.h"
 #import "ITunesSearch.h"
@@ -29,6 +31,8 @@
 - (BOOL)isSearchQuery:(XMPPIQ *)iq;
 - (void)handleSearchQuery:(XMPPIQ *)iq;
 
+- (void)configurePseudoTcp:(PseudoTcp *)ptcp;
+
 @end
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -86,6 +90,9 @@ static MojoXMPPClient *sharedInstance;
 		turnConnections  = [[NSMutableArray alloc] initWithCapacity:4];
 		stunConnections  = [[NSMutableArray alloc] initWithCapacity:4];
 		stuntConnections = [[NSMutableArray alloc] initWithCapacity:4];
+		
+		pendingConnections = [[NSMutableArray alloc] initWithCapacity:4];
+		multiplexers       = [[NSMutableArray alloc] initWithCapacity:4];
 	}
 	return self;
 }
@@ -97,6 +104,19 @@ static MojoXMPPClient *sharedInstance;
 	[stunConnections release];
 	[stuntConnections release];
 	
+	NSUInteger i;
+	for(i = 0; i < [pendingConnections count]; i++)
+	{
+		[[pendingConnections objectAtIndex:i] setDelegate:nil];
+	}
+	[pendingConnections release];
+	
+	for(i = 0; i < [multiplexers count]; i++)
+	{
+		[[multiplexers objectAtIndex:i] setDelegate:nil];
+	}
+	[multiplexers release];
+	
 	[super dealloc];
 }
 
@@ -912,24 +932,49 @@ static MojoXMPPClient *sharedInstance;
 
 - (void)stunSocket:(STUNSocket *)sender didSucceed:(AsyncUdpSocket *)socket
 {
-	// We need to create a Pseudo TCP socket on top of the UDP socket
-	PseudoTcp *ptcp = [[[PseudoTcp alloc] initWithUdpSocket:socket] autorelease];
+	// We need to create a Pseudo TCP socket on top of the UDP socket.
+	// It runs on the network thread, so songs keep streaming while the main thread is busy.
+	PseudoTcpThreadedConnection *connection;
+	connection = [[[PseudoTcpThreadedConnection alloc] initWithUdpSocket:socket
+	                                                       networkThread:[PseudoTcpNetworkThread sharedNetworkThread]] autorelease];
 	
-	// And we need to start the Pseudo TCP connection
-	[ptcp passiveOpen];
+	if(connection)
+	{
+		[connection configurePseudoTcpWithSelector:@selector(configurePseudoTcp:) target:self];
+		[connection setDelegate:self];
+		
+		[pendingConnections addObject:connection];
+		
+		// And we need to start the Pseudo TCP connection
+		[connection passiveOpen];
+	}
+	else
+	{
+		NSLog(@"Incoming STUN connection failed to open!");
+	}
 	
-	// And then we need to disguise the Pseudo TCP socket in an asynchronous
-	// wrapper so it can be used just like a TCP AsyncSocket instance.
-	PseudoAsyncSocket *connectedSocket = [[[PseudoAsyncSocket alloc] initWithPseudoTcp:ptcp] autorelease];
+	// And we're now done with the stun socket, so we can go ahead and remove it
+	[stunConnections removeObject:sender];
+}
+
+/**
+ * Configures the Pseudo TCP socket for an incoming connection.
+ * This is invoked on the network thread, and must not touch anything but the socket.
+**/
+- (void)configurePseudoTcp:(PseudoTcp *)ptcp
+{
+	// We'll be serving songs over this connection, so allow a large send window
+	[ptcp setMaxSendBufferSize:(1024 * 1024 * 2)];
 	
-	// Ensure the connected socket is running in all common run loop modes
-	[connectedSocket setRunLoopModes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+	// Remote peers are often far away, where NewReno takes ages to open up the congestion window
+	[ptcp setCongestionControl:[[[PseudoTcpCubic alloc] init] autorelease]];
 	
-	// Attach the connection to the server
-	[[MojoHTTPServer sharedInstance] addConnection:connectedSocket];
+	// And over lossy paths, let them rebuild lost segments rather than stall waiting for retransmissions
+	[ptcp setForwardErrorCorrection:YES];
 	
-	// And we're now done with the stun socket, so we can go ahead and remove it
-	[stunConnections removeObject:sender];
+	// Newer remote hosts multiplex their connections over the Pseudo TCP socket.
+	// Whether this one does isn't known until the connection is open (see threadedConnectionDidOpen:).
+	[ptcp setMultiplexing:YES];
 }
 
 - (void)stunSocketDidFail:(STUNSocket *)sender
@@ -941,6 +986,62 @@ static MojoXMPPClient *sharedInstance;
 	[stunConnections removeObject:sender];
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark PseudoTcpThreadedConnection Delegate Methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)threadedConnectionDidOpen:(PseudoTcpThreadedConnection *)sender
+{
+	if([sender isMultiplexed])
+	{
+		// The remote host multiplexes its connections over the Pseudo TCP socket.
+		// Each stream it opens will be handed to us via threadedConnection:didAcceptSocket:
+		[multiplexers addObject:sender];
+	}
+	else
+	{
+		// The remote host is an older version, which uses the Pseudo TCP socket for a single connection.
+		PseudoTcpThreadedSocket *socket = [sender openSocket];
+		
+		if(socket)
+		{
+			[self threadedConnection:sender didAcceptSocket:socket];
+		}
+	}
+	
+	// The socket's wrapper retains it, which keeps a connection that isn't multiplexed open
+	[pendingConnections removeObject:sender];
+}
+
+- (void)threadedConnection:(PseudoTcpThreadedConnection *)sender didAcceptSocket:(PseudoTcpThreadedSocket *)socket
+{
+	// We need to disguise the socket in an asynchronous
+	// wrapper so it can be used just like a TCP AsyncSocket instance.
+	PseudoAsyncSocket *connectedSocket = [[[PseudoAsyncSocket alloc] initWithPseudoSocket:socket] autorelease];
+	
+	// Ensure the connected socket is running in all common run loop modes
+	[connectedSocket setRunLoopModes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+	
+	// Attach the connection to the server
+	[[MojoHTTPServer sharedInstance] addConnection:connectedSocket];
+}
+
+- (void)threadedConnectionDidClose:(PseudoTcpThreadedConnection *)sender
+{
+	if([pendingConnections containsObject:sender])
+	{
+		// The connection never opened
+		NSLog(@"Incoming STUN connection failed to open!");
+		
+		[pendingConnections removeObject:sender];
+	}
+	else
+	{
+		// The UDP flow is gone, along with all of its streams, so we can go ahead and remove it
+		[multiplexers removeObject:sender];
+	}
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark TURN Delegate Methods
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -5,8 +5,9 @@
 **/
 
 #import <Foundation/Foundation.h>
+#import "PseudoTcp.h"
 
-@class PseudoTcp;
+@class PseudoTcpStream;
 @class PseudoAsyncSocket;
 @class PseudoAsyncReadPacket;
 @class PseudoAsyncWritePacket;
@@ -27,6 +28,12 @@
 
 - (void)onSocket:(PseudoAsyncSocket *)sock didReadPartialDataOfLength:(CFIndex)partialLength tag:(long)tag;
 
+/**
+ * Called when data arrives while there are no reads queued, if the delegate implements it.
+ * The delegate may then process the data in place, via peekBytes: and consumeBytes:.
+**/
+- (void)onSocketHasBytesAvailable:(PseudoAsyncSocket *)sock;
+
 - (void)onSocket:(PseudoAsyncSocket *)sock didWriteDataWithTag:(long)tag;
 
 @end
@@ -35,7 +42,7 @@
 
 @interface PseudoAsyncSocket : NSObject
 {
-	PseudoTcp *pseudoSocket;
+	id <PseudoTcpSocket> pseudoSocket;  // PseudoTcp or PseudoTcpStream
 	
 	NSMutableArray *theReadQueue;
 	PseudoAsyncReadPacket *theCurrentRead;
@@ -53,6 +60,8 @@
 }
 
 - (id)initWithPseudoTcp:(PseudoTcp *)socket;
+- (id)initWithPseudoTcpStream:(PseudoTcpStream *)stream;
+- (id)initWithPseudoSocket:(id <PseudoTcpSocket>)socket;
 
 - (id)delegate;
 - (BOOL)canSafelySetDelegate;
@@ -66,6 +75,7 @@
 //- (CFWriteStreamRef)getCFWriteStream;
 
 - (PseudoTcp *)getPseudoTcp;
+- (PseudoTcpStream *)getPseudoTcpStream;
 
 //- (BOOL)acceptOnPort:(UInt16)port error:(NSError **)errPtr;
 //- (BOOL)acceptOnAddress:(NSString *)hostaddr port:(UInt16)port error:(NSError **)errPtr;
@@ -96,6 +106,20 @@
 
 - (void)readDataWithTimeout:(NSTimeInterval)timeout tag:(long)tag;
 
+/**
+ * Zero-copy reading.
+ * Rather than having the data copied into an NSData by one of the read methods above,
+ * the data can be processed straight out of the underlying socket's receive buffer.
+ * 
+ * peekBytes: returns the length of the contiguous region of data at the front of the buffer, and points bytesPtr at it.
+ * There may be more data available once the region has been consumed.
+ * consumeBytes: removes the given number of bytes from the front of the buffer.
+ * 
+ * These methods may only be used while there are no reads queued. Otherwise peekBytes: returns zero.
+**/
+- (NSUInteger)peekBytes:(const void **)bytesPtr;
+- (void)consumeBytes:(NSUInteger)length;
+
 - (void)writeData:(NSData *)data withTimeout:(NSTimeInterval)timeout tag:(long)tag;
 
 - (float)progressOfReadReturningTag:(long *)tag bytesDone:(CFIndex *)done total:(CFIndex *)total;
@@ -6,6 +6,7 @@
 
 #import "PseudoAsyncSocket.h"
 #import "PseudoTcp.h"
+#import "PseudoTcpMultiplexer.h"
 #import "AsyncSocket.h"
 
 // Debug levels: 0-off, 1-error, 2-warn, 3-info, 4-verbose
@@ -286,6 +287,23 @@ enum AsyncSocketFlags
 @implementation PseudoAsyncSocket
 
 - (id)initWithPseudoTcp:(PseudoTcp *)socket
+{
+	return [self initWithPseudoSocket:socket];
+}
+
+/**
+ * Wraps a single stream of a PseudoTcpMultiplexer.
+ * The stream has the same interface as a PseudoTcp socket, so the two are used interchangeably.
+**/
+- (id)initWithPseudoTcpStream:(PseudoTcpStream *)stream
+{
+	return [self initWithPseudoSocket:stream];
+}
+
+/**
+ * Wraps any other socket with the same interface as PseudoTcp, such as a PseudoTcpThreadedSocket.
+**/
+- (id)initWithPseudoSocket:(id <PseudoTcpSocket>)socket
 {
 	if((self = [super init]))
 	{
@@ -376,7 +394,20 @@ enum AsyncSocketFlags
 
 - (PseudoTcp *)getPseudoTcp
 {
-	return pseudoSocket;
+	if([pseudoSocket isKindOfClass:[PseudoTcpStream class]])
+		return [[(PseudoTcpStream *)pseudoSocket multiplexer] pseudoTcp];
+	else if([pseudoSocket isKindOfClass:[PseudoTcp class]])
+		return (PseudoTcp *)pseudoSocket;
+	else
+		return nil;
+}
+
+- (PseudoTcpStream *)getPseudoTcpStream
+{
+	if([pseudoSocket isKindOfClass:[PseudoTcpStream class]])
+		return (PseudoTcpStream *)pseudoSocket;
+	else
+		return nil;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -920,6 +951,40 @@ enum AsyncSocketFlags
 	[buffer release];
 }
 
+- (NSUInteger)peekBytes:(const void **)bytesPtr
+{
+	if((theCurrentRead != nil) || ([theReadQueue count] > 0)) return 0;
+	
+	// Any pre-buffered data comes first
+	if([partialReadBuffer length] > 0)
+	{
+		if(bytesPtr) *bytesPtr = [partialReadBuffer bytes];
+		return [partialReadBuffer length];
+	}
+	
+	const UInt8 *bytes = NULL;
+	UInt32 length = [pseudoSocket peekBytes:&bytes];
+	
+	if(bytesPtr) *bytesPtr = bytes;
+	return length;
+}
+
+- (void)consumeBytes:(NSUInteger)length
+{
+	if((theCurrentRead != nil) || ([theReadQueue count] > 0)) return;
+	
+	if([partialReadBuffer length] > 0)
+	{
+		NSUInteger bytesToConsume = MIN(length, [partialReadBuffer length]);
+		
+		[partialReadBuffer replaceBytesInRange:NSMakeRange(0, bytesToConsume) withBytes:NULL length:0];
+	}
+	else
+	{
+		[pseudoSocket consumeBytes:(UInt32)length];
+	}
+}
+
 /**
  * Puts a maybeDequeueRead on the run loop. 
  * An assumption here is that selectors will be performed consecutively within their priority.
@@ -1341,7 +1406,7 @@ enum AsyncSocketFlags
 #pragma mark PseudoTcp Delegate Methods
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-- (void)onPseudoTcpDidOpen:(PseudoTcp *)sock
+- (void)onPseudoTcpDidOpen:(id <PseudoTcpSocket>)sock
 {
 	if([theDelegate respondsToSelector:@selector(onSocket:didConnectToHost:port:)])
 	{
@@ -1351,17 +1416,27 @@ enum AsyncSocketFlags
 	}
 }
 
-- (void)onPseudoTcpHasBytesAvailable:(PseudoTcp *)sock
+- (void)onPseudoTcpHasBytesAvailable:(id <PseudoTcpSocket>)sock
 {
 	// User doesn't expect to complete reads/writes after calling close
 	if(!(theFlags & kClosing))
 	{
 		DDLogInfo(@"PseudoAsyncSocket: onPseudoTcpHasBytesAvailable:");
-		[self doBytesAvailable];
+		
+		if((theCurrentRead == nil) && ([theReadQueue count] == 0) &&
+		   [theDelegate respondsToSelector:@selector(onSocketHasBytesAvailable:)])
+		{
+			// The delegate would like to process the data in place
+			[theDelegate onSocketHasBytesAvailable:self];
+		}
+		else
+		{
+			[self doBytesAvailable];
+		}
 	}
 }
 
-- (void)onPseudoTcpCanAcceptBytes:(PseudoTcp *)sock
+- (void)onPseudoTcpCanAcceptBytes:(id <PseudoTcpSocket>)sock
 {
 	// User doesn't expect to complete reads/writes after calling close
 	if(!(theFlags & kClosing))
@@ -1371,13 +1446,13 @@ enum AsyncSocketFlags
 	}
 }
 
-- (void)onPseudoTcp:(PseudoTcp *)sock willCloseWithError:(NSError *)err
+- (void)onPseudoTcp:(id <PseudoTcpSocket>)sock willCloseWithError:(NSError *)err
 {
 	DDLogInfo(@"PseudoAsyncSocket: onPseudoTcp:willCloseWithError:");
 	[self closeWithError:err];
 }
 
-- (void)onPseudoTcpDidClose:(PseudoTcp *)sock
+- (void)onPseudoTcpDidClose:(id <PseudoTcpSocket>)sock
 {
 	DDLogInfo(@"PseudoAsyncSocket: onPseudoTcpDidClose:");
 	
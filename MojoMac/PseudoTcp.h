@@ -5,11 +5,67 @@
 **/
 
 #import <Foundation/Foundation.h>
+#import "PseudoTcpTimerWheel.h"
 
 @class AsyncUdpSocket;
+@protocol PseudoTcpCongestionControl;
 
+struct PseudoTcpRange;
+struct PseudoTcpSegment;
+struct PseudoTcpFecGroup;
 
-@interface PseudoTcp : NSObject
+/**
+ * Running totals for a connection, for diagnostics and benchmarking.
+ * Only data segments are counted (not SYNs, acks, window probes or parity packets), except where noted.
+**/
+struct PseudoTcpStatistics
+{
+	UInt64 bytesSent;              // Data bytes sent, including retransmissions
+	UInt64 bytesRetransmitted;
+	UInt32 segmentsSent;           // Data segments sent for the first time
+	UInt32 segmentsRetransmitted;
+	UInt32 timeouts;               // Retransmission timer expirations
+	UInt32 parityPacketsSent;
+	UInt32 segmentsRebuilt;        // Segments rebuilt from the parity packets we've received
+	NSTimeInterval srtt;           // Smoothed round trip time, or zero if there hasn't been a sample yet
+	UInt32 maximumSegmentSize;
+	UInt32 congestionWindow;
+};
+typedef struct PseudoTcpStatistics PseudoTcpStatistics;
+
+/**
+ * The interface shared by PseudoTcp and the streams of a PseudoTcpMultiplexer.
+ * This is everything the PseudoAsyncSocket needs, so it can wrap either one.
+**/
+@protocol PseudoTcpSocket <NSObject>
+
+- (AsyncUdpSocket *)udpSocket;
+
+- (id)delegate;
+- (void)setDelegate:(id)delegate;
+
+- (BOOL)canAcceptBytes;
+- (UInt32)writeData:(NSData *)data atOffset:(UInt32)offset withMaxLength:(UInt32)length;
+
+- (BOOL)hasBytesAvailable;
+- (UInt32)read:(UInt8 *)buffer maxLength:(UInt32)length;
+
+/**
+ * Zero-copy reading: peekBytes: returns the contiguous region of data at the front of the receive buffer
+ * (which may be less than all the data available), and consumeBytes: removes bytes from the front once processed.
+**/
+- (UInt32)peekBytes:(const UInt8 **)bytesPtr;
+- (void)consumeBytes:(UInt32)length;
+
+- (void)closeAfterWriting;
+
+- (void)setRunLoopModes:(NSArray *)modes;
+- (NSArray *)runLoopModes;
+
+@end
+
+
+@interface PseudoTcp : NSObject <PseudoTcpSocket>
 {
 	AsyncUdpSocket *udpSocket;
 	id delegate;
@@ -17,47 +73,109 @@
 	Byte flags;
 	Byte state;
 	
-	NSMutableArray *recvBuffer;
-	NSMutableArray *recvOutOfOrderBuffer;
+	UInt8 *recvBuffer;
+	UInt32 recvBufferCapacity;
 	UInt32 recvBufferOffset;
 	UInt32 recvBufferSize;
 	UInt32 recvSequence;
 	
-	NSTimer *ackTimer;
+	struct PseudoTcpRange *recvOutOfOrderBuffer;
+	UInt32 recvOutOfOrderHead;       // Index of the first range (ranges are drained from the front)
+	UInt32 recvOutOfOrderCount;
+	UInt32 recvOutOfOrderCapacity;
+	
+	PseudoTcpTimer ackTimer;
 	UInt32 unackedPackets;
 	
-	NSMutableArray *sendBuffer;
+	UInt8 *sendBuffer;
+	UInt32 sendBufferCapacity;
+	UInt32 sendBufferHead;
 	UInt32 sendBufferOffset;
 	UInt32 sendBufferSize;
 	UInt32 sendSequence;
 	UInt32 sendWindow;
 	
-	NSMutableArray *retransmissionQueue;
+	UInt8 *datagramBuffer;           // Outgoing packets are encoded here
+	UInt32 datagramBufferCapacity;
+	
+	struct PseudoTcpSegment *retransmissionQueue;
+	UInt32 retransmissionQueueHead;
+	UInt32 retransmissionQueueCount;
+	UInt32 retransmissionQueueCapacity;
+	UInt32 retransmissionQueueResendIndex;
 	UInt32 retransmissionQueueSize;
 	UInt32 retransmissionQueueEffectiveSize;
+	UInt32 retransmissionQueueSackedCount;
 	UInt32 lastAck;
 	UInt16 lastAckCount;
 	
 	BOOL receiverSupportsSack;
+	BOOL receiverSupportsSackBlocks;
 	
-	NSTimer *retransmissionTimer;
+	// RFC 1323
+	UInt8 sendWindowScale;  // Shift count applied to windows advertised by the remote host
+	UInt8 recvWindowScale;  // Shift count applied to windows we advertise
+	
+	// RFC 7323
+	BOOL receiverSupportsTimestamps;
+	UInt32 tsRecent;       // Timestamp to echo back to the remote host
+	UInt32 tsLastAckSent;  // Acknowledgement number of the last ack we sent
+	
+	// RFC 4821
+	UInt32 mss;               // Current maximum segment size (data bytes per packet)
+	UInt32 mssMax;            // Largest segment size both we and the remote host can handle
+	UInt32 mssSearchHigh;     // Upper bound of the segment sizes still worth probing
+	UInt32 mssProbeSize;      // Size of the outstanding path mtu probe, or zero if there isn't one
+	UInt64 mssSearchTime;     // When the last path mtu search completed (monotonic nanoseconds)
+	UInt16 consecutiveTimeouts;
+	
+	PseudoTcpTimer retransmissionTimer;
 	
 	// RFC 2581
-	UInt32 cwnd;      // Congestion window
-	UInt32 ssthresh;  // Slow start threshold size
+	id <PseudoTcpCongestionControl> congestionControl;
+	UInt32 cwndInflation;  // Temporary window inflation during NewReno fast recovery (without sack)
 	
 	// RFC 2988
 	NSTimeInterval srtt;    // Smoothed round trip time
 	NSTimeInterval rttvar;  // Rtt variance
 	NSTimeInterval rto;     // Retransmission timeout
 	
+	// RFC 3522
+	BOOL checkSpuriousTimeout;    // Set after a timeout, until the next ack for new data arrives
+	UInt32 retransmitTimestamp;   // Our timestamp on the first retransmission after the timeout
+	
 	// RFC 3782
 	UInt32 recover;
 	
-	NSTimer *persistTimer;  // Empty window probing
+	PseudoTcpTimer persistTimer;  // Empty window probing
+	
+	PseudoTcpTimer keepAliveTimer;
+	UInt64 lastPacketTime;  // Monotonic nanoseconds
+	
+	// Pacing
+	float pacingGain;
+	double pacingTokens;    // Bytes we may send right now (may be negative after sending a large segment)
+	UInt64 pacingTime;      // When the tokens were last refilled (monotonic nanoseconds)
+	PseudoTcpTimer pacingTimer;
 	
-	NSTimer *keepAliveTimer;
-	NSDate *lastPacketTime;
+	// Forward error correction
+	BOOL forwardErrorCorrection;      // Whether we may send parity packets at all
+	BOOL receiverSupportsFec;
+	BOOL fecActive;                   // Whether the measured loss rate currently calls for parity packets
+	float lossRate;                   // Smoothed fraction of data segments lost on the path
+	UInt32 lossSampleSent;
+	UInt32 lossSampleLost;
+	struct PseudoTcpFecGroup *fecGroup;  // Segments covered by the next parity packet
+	UInt8 *fecRecoveryBuffer;         // Missing segments are rebuilt here
+	UInt32 fecRecoveryBufferCapacity;
+	
+	// Stream multiplexing
+	BOOL multiplexing;                  // Whether we offer to multiplex streams over the connection
+	BOOL receiverSupportsMultiplexing;  // Whether both hosts offered it
+	
+	PseudoTcpStatistics statistics;
+	
+	PseudoTcpTimerWheel *timerWheel;
 }
 
 - (id)initWithUdpSocket:(AsyncUdpSocket *)udpSock;
@@ -67,6 +185,29 @@
 - (id)delegate;
 - (void)setDelegate:(id)delegate;
 
+- (UInt32)maxReceiveBufferSize;
+- (void)setMaxReceiveBufferSize:(UInt32)max;
+
+- (UInt32)maxSendBufferSize;
+- (void)setMaxSendBufferSize:(UInt32)max;
+
+- (UInt32)maximumSegmentSize;
+
+- (id <PseudoTcpCongestionControl>)congestionControl;
+- (void)setCongestionControl:(id <PseudoTcpCongestionControl>)congestionControl;
+
+- (float)pacingGain;
+- (void)setPacingGain:(float)gain;
+
+- (BOOL)forwardErrorCorrection;
+- (void)setForwardErrorCorrection:(BOOL)flag;
+
+- (BOOL)multiplexing;
+- (void)setMultiplexing:(BOOL)flag;
+- (BOOL)receiverSupportsMultiplexing;
+
+- (PseudoTcpStatistics)statistics;
+
 - (void)activeOpen;
 - (void)passiveOpen;
 
@@ -76,6 +217,9 @@
 - (BOOL)hasBytesAvailable;
 - (UInt32)read:(UInt8 *)buffer maxLength:(UInt32)length;
 
+- (UInt32)peekBytes:(const UInt8 **)bytesPtr;
+- (void)consumeBytes:(UInt32)length;
+
 - (void)closeAfterWriting;
 
 - (void)setRunLoopModes:(NSArray *)modes;
@@ -89,14 +233,14 @@
 
 @interface PseudoTcp (PsuedoTcpDelegate)
 
-- (void)onPseudoTcpDidOpen:(PseudoTcp *)sock;
+- (void)onPseudoTcpDidOpen:(id <PseudoTcpSocket>)sock;
 
-- (void)onPseudoTcpHasBytesAvailable:(PseudoTcp *)sock;
+- (void)onPseudoTcpHasBytesAvailable:(id <PseudoTcpSocket>)sock;
 
-- (void)onPseudoTcpCanAcceptBytes:(PseudoTcp *)sock;
+- (void)onPseudoTcpCanAcceptBytes:(id <PseudoTcpSocket>)sock;
 
-- (void)onPseudoTcp:(PseudoTcp *)sock willCloseWithError:(NSError *)err;
+- (void)onPseudoTcp:(id <PseudoTcpSocket>)sock willCloseWithError:(NSError *)err;
 
-- (void)onPseudoTcpDidClose:(PseudoTcp *)sock;
+- (void)onPseudoTcpDidClose:(id <PseudoTcpSocket>)sock;
 
 @end
@@ -6,6 +6,7 @@
 
 #import "PseudoTcp.h"
 #import "PseudoTcpPacket.h"
+#import "PseudoTcpCongestionControl.h"
 #import "AsyncUdpSocket.h"
 #import "TigerSupport.h"
 
@@ -30,20 +31,56 @@
 #define ACK_TIMEOUT          0.10
 #define KEEP_ALIVE_TIMEOUT  25.00
 
+// The number of duplicate acks (or sacked segments) that indicate a segment was lost, as per RFC 6675
+#define DUP_THRESH  3
+
 // Minimum MTU for IP is 576
 // Default TCP MTU is 536, which is 576 minus 20 bytes for IP header and minus 20 bytes for TCP header
 // We need 20 bytes for IP header, 8 bytes for UDP header, and 12 bytes for TCP header
 #define DEFAULT_MTU  536
 
-// Define sizes of our send and receive buffers
+// Path mtu discovery (RFC 4821).
+// Every connection starts out with a segment size of DEFAULT_MTU, which is guaranteed to work,
+// and probes upwards from there, up to the mtu of the local interface and the mss of the remote host.
+#define IP_UDP_OVERHEAD          48      // IPv6 header (40) plus UDP header (8). IPv4 only needs 28.
+#define FALLBACK_LINK_MTU        1500    // Assumed link mtu if the udp socket can't tell us
+#define MSS_SEARCH_GRANULARITY   32      // Stop searching once we're within this many bytes of the upper bound
+#define MSS_SEARCH_INTERVAL      600.0   // Seconds to wait before searching for a larger path mtu again
+#define MSS_BLACK_HOLE_TIMEOUTS  2       // Consecutive timeouts before falling back to DEFAULT_MTU
+
+// Define default sizes of our send and receive buffers.
+// These may be changed per connection (up to MAX_BUFFER_SIZE) via setMaxReceiveBufferSize: and setMaxSendBufferSize:.
+// Windows larger than 65535 bytes require the window scale option to be negotiated with the remote host.
 #if TARGET_OS_IPHONE
   #define RECV_BUFFER_SIZE  32767
   #define SEND_BUFFER_SIZE  32767
 #else
-  #define RECV_BUFFER_SIZE  65535
-  #define SEND_BUFFER_SIZE  65535
+  #define RECV_BUFFER_SIZE  262144
+  #define SEND_BUFFER_SIZE  262144
 #endif
 
+#define MAX_BUFFER_SIZE  (8 * 1024 * 1024)
+
+// Pacing.
+// Rather than sending an entire window of segments back-to-back, segments are spread out across the round trip
+// at a rate of (pacingGain * cwnd / srtt). During slow start the rate is doubled, so pacing doesn't hold back
+// the growth of the window. A small burst is allowed, since the timer wheel only ticks every 10 milliseconds.
+#define DEFAULT_PACING_GAIN     1.25
+#define PACING_SLOW_START_GAIN  2.0
+#define PACING_BURST_INTERVAL   0.02    // Seconds worth of data that may be sent in a single burst
+#define PACING_BURST_SEGMENTS   2       // Minimum burst size, in segments
+
+// Forward error correction.
+// When enabled, a parity packet (the XOR of a group of consecutive segments) is sent after each group,
+// so the remote host can rebuild any one lost segment of the group without waiting for the retransmission.
+// Parity packets are only sent while the loss rate we measure on the path is high enough to be worth it,
+// and the groups get smaller as the loss rate goes up.
+#define FEC_LOSS_SAMPLE_SEGMENTS  64       // Data segments sent per loss rate sample
+#define FEC_LOSS_GAIN             0.25F    // Weight given to each new sample
+#define FEC_LOSS_ON               0.005F   // Start sending parity packets once the loss rate reaches this
+#define FEC_LOSS_OFF              0.0025F  // Stop once the loss rate drops back below this
+#define FEC_MIN_GROUP             2
+
 // Define retransmission timeouts (in seconds)
 #define SYN_TIMEOUT   180.0
 #define DATA_TIMEOUT  100.0
@@ -55,7 +92,126 @@ enum PseudoTcpFlags
 	kForbidWrites      = 1 << 2,   // If set, no new writes are allowed
 	kRecover           = 1 << 3,   // If set, the recover variable is valid
 	kFirstPartial      = 1 << 4,   // If set, a partial ack will indicate the first partial ack received
+	kWindowScale       = 1 << 5,   // If set, the remote host included the window scale option in its SYN
+	kMssProbeFailed    = 1 << 6,   // If set, a path mtu probe has failed during the current search
+	kPersist           = 1 << 7,   // If set, we're probing a zero window (the persist timer has been armed)
+};
+
+enum PseudoTcpSegmentFlags
+{
+	kSegmentSyn        = 1 << 0,   // Opening syn (or syn-ack) segment, which doesn't carry any data
+	kSegmentSynAck     = 1 << 1,   // Opening syn segment also acknowledges the remote syn
+	kSegmentRxmit      = 1 << 2,   // Was the segment retransmitted, or is this the first time sending it
+	kSegmentProbe      = 1 << 3,   // Is this an empty window probe
+	kSegmentRxQ        = 1 << 4,   // Is this segment part of the retransmissionQueueEffectiveSize
+	kSegmentSacked     = 1 << 5,   // Has this segment been selectively acknowledged
+	kSegmentMtuProbe   = 1 << 6,   // Is this a path mtu probe, larger than the current mss
+	kSegmentLost       = 1 << 7,   // Has this segment been counted towards the loss rate
+};
+
+/**
+ * A range of sequence numbers that has been received out-of-order.
+ * The data itself is stored directly in the recvBuffer, at the proper offset from the expected sequence.
+**/
+struct PseudoTcpRange
+{
+	UInt32 sequence;
+	UInt32 length;
+};
+typedef struct PseudoTcpRange PseudoTcpRange;
+
+/**
+ * A segment that has been sent, and is awaiting acknowledgement.
+ * The data itself is stored in the sendBuffer, and can be found by its sequence number.
+**/
+struct PseudoTcpSegment
+{
+	UInt32 sequence;
+	UInt32 length;
+	UInt8  control;
+	UInt64 firstSent;  // Monotonic nanoseconds
+};
+typedef struct PseudoTcpSegment PseudoTcpSegment;
+
+/**
+ * The group of consecutive segments that will be covered by the next parity packet.
+ * The parity is accumulated as each segment is sent, so the segments never have to be read again.
+**/
+struct PseudoTcpFecGroup
+{
+	UInt32 sequence;   // Sequence number of the first segment
+	UInt32 length;     // Total data bytes in the group
+	UInt8  count;
+	UInt16 lengths[PSEUDO_TCP_MAX_FEC_GROUP];
+	UInt8 *parity;     // XOR of the segments, each padded with zeros to the length of the longest
+	UInt32 parityLength;
+	UInt32 parityCapacity;
 };
+typedef struct PseudoTcpFecGroup PseudoTcpFecGroup;
+
+/**
+ * Returns the number of seconds that have elapsed since the given monotonic timestamp.
+**/
+static inline NSTimeInterval SecondsSince(UInt64 timestamp)
+{
+	return (double)(PseudoTcpMonotonicTime() - timestamp) / 1000000000.0;
+}
+
+/**
+ * Returns the current value of our timestamp clock (as per RFC 7323), which ticks in milliseconds.
+**/
+static inline UInt32 TimestampNow()
+{
+	return (UInt32)(PseudoTcpMonotonicTime() / 1000000);
+}
+
+/**
+ * Copies bytes into a ring buffer, starting at the given index, and wrapping around the end if needed.
+**/
+static inline void RingBufferWrite(UInt8 *ring, UInt32 capacity, UInt32 index, const void *bytes, UInt32 length)
+{
+	UInt32 firstLength = MIN(length, capacity - index);
+	
+	memcpy(ring + index, bytes, firstLength);
+	
+	if(firstLength < length)
+	{
+		memcpy(ring, (const UInt8 *)bytes + firstLength, length - firstLength);
+	}
+}
+
+/**
+ * Copies bytes out of a ring buffer, starting at the given index, and wrapping around the end if needed.
+**/
+static inline void RingBufferRead(const UInt8 *ring, UInt32 capacity, UInt32 index, void *bytes, UInt32 length)
+{
+	UInt32 firstLength = MIN(length, capacity - index);
+	
+	memcpy(bytes, ring + index, firstLength);
+	
+	if(firstLength < length)
+	{
+		memcpy((UInt8 *)bytes + firstLength, ring, length - firstLength);
+	}
+}
+
+/**
+ * XORs bytes out of a ring buffer into the given bytes, starting at the given index, and wrapping around the end if needed.
+**/
+static inline void RingBufferXor(const UInt8 *ring, UInt32 capacity, UInt32 index, UInt8 *bytes, UInt32 length)
+{
+	UInt32 firstLength = MIN(length, capacity - index);
+	UInt32 i;
+	
+	for(i = 0; i < firstLength; i++)
+	{
+		bytes[i] ^= ring[index + i];
+	}
+	for(i = firstLength; i < length; i++)
+	{
+		bytes[i] ^= ring[i - firstLength];
+	}
+}
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark -
@@ -63,16 +219,15 @@ enum PseudoTcpFlags
 
 @interface PseudoTcp (PrivateAPI)
 
-// Run Loop
-- (void)runLoopAddTimer:(NSTimer *)timer;
-- (void)runLoopRemoveTimer:(NSTimer *)timer;
-
 // State
+- (UInt8)windowScaleForBufferSize:(UInt32)size;
 - (UInt32)recvWindow;
+- (UInt16)advertisedRecvWindow;
 - (UInt32)expectedSequence;
 - (UInt32)spaceAvailableInSendBuffer;
 - (UInt32)sendUnacknowledged;
 - (UInt32)sendNext;
+- (UInt32)congestionWindow;
 
 // New Reno
 - (void)setRecover;
@@ -80,9 +235,29 @@ enum PseudoTcpFlags
 - (BOOL)isFullAck:(UInt32)ack;
 - (BOOL)isFirstPartialAck;
 
+// Path MTU Discovery
+- (UInt32)localMaxSegmentSize;
+- (void)processMaxSegmentSize:(PseudoTcpPacket *)synPacket;
+- (UInt32)nextMtuProbeSize;
+- (void)mtuProbeDidSucceed:(UInt32)probeSize;
+- (void)mtuProbeDidFail;
+- (void)maybeFallBackToDefaultMtu;
+
 // Utilities
-- (void)sendPacket:(PseudoTcpPacket *)packet;
-- (void)resendPacket:(PseudoTcpPacket *)packet;
+- (PseudoTcpSegment *)segmentAtIndex:(UInt32)index;
+- (UInt32)indexOfFirstSegmentAtOrAfterSequence:(UInt32)sequence;
+- (PseudoTcpSegment *)segmentWithSequence:(UInt32)sequence;
+- (UInt32)indexOfSegment:(PseudoTcpSegment *)segment;
+- (void)growRetransmissionQueue;
+- (PseudoTcpSegment *)enqueueSegmentWithSequence:(UInt32)sequence length:(UInt32)length control:(UInt8)control;
+- (UInt32)splitSegmentAtIndex:(UInt32)index maxLength:(UInt32)maxLength;
+- (void)dequeueSegment;
+- (void)getPacket:(PseudoTcpPacket *)packet forSegment:(PseudoTcpSegment *)segment;
+- (BOOL)writePacket:(PseudoTcpPacket *)packet segment:(PseudoTcpSegment *)segment;
+- (BOOL)sendPacket:(PseudoTcpPacket *)packet;
+- (void)sendSegment:(PseudoTcpSegment *)segment;
+- (UInt32)resendSegment:(PseudoTcpSegment *)segment;
+- (void)startRetransmissionTimer;
 - (void)cleanup;
 
 // Handshake
@@ -92,19 +267,41 @@ enum PseudoTcpFlags
 
 // ACK
 - (void)processDataAck:(PseudoTcpPacket *)ackPacket;
+- (void)processRttSample:(NSTimeInterval)rtt;
+- (void)processTimestamp:(PseudoTcpPacket *)packet;
+- (BOOL)detectSpuriousTimeout:(PseudoTcpPacket *)ackPacket;
+- (void)undoSpuriousTimeout;
 - (BOOL)isAckWithinRetransmissionQueue:(UInt32)ack;
-- (BOOL)doesAck:(UInt32)ack absolvePacket:(PseudoTcpPacket *)packet;
+- (BOOL)doesAck:(UInt32)ack absolveSegment:(PseudoTcpSegment *)segment;
+- (BOOL)markSegmentSacked:(PseudoTcpSegment *)segment;
+- (BOOL)processSackBlocks:(PseudoTcpPacket *)ackPacket;
+- (void)markLostSegments;
+- (void)countSackHoles;
+- (void)maybeAddSackBlocks:(PseudoTcpPacket *)packet mostRecent:(UInt32)sequence;
 - (void)scheduleDelayedAck;
-- (void)sendAckNow;
-- (void)sendSackNow;
+- (BOOL)sendAckNow;
+- (void)sendSackNow:(UInt32)sackSequence;
 - (void)maybeAddAck:(PseudoTcpPacket *)dataPacket;
 
 // Data
 - (void)processData:(PseudoTcpPacket *)packet;
 - (BOOL)doesPacketFitInRecvWindow:(PseudoTcpPacket *)packet;
+- (PseudoTcpRange *)outOfOrderRangeAtIndex:(UInt32)index;
+- (UInt32)indexOfFirstOutOfOrderRangeEndingAtOrAfterOffset:(UInt32)offset;
+- (BOOL)addOutOfOrderSequence:(UInt32)sequence length:(UInt32)length;
+- (UInt32)drainOutOfOrderBuffer;
 - (void)scheduleMaybeSendData;
+- (double)pacingRate;
+- (BOOL)mayPaceOut;
 - (void)maybeSendData;
-- (void)resendPacketWithSequence:(UInt32)sequence;
+- (void)updateLossRate;
+- (UInt32)fecGroupSize;
+- (void)addSegmentToFecGroup:(PseudoTcpSegment *)segment;
+- (void)sendFecParity;
+- (BOOL)hasReceivedSequence:(UInt32)sequence length:(UInt32)length;
+- (UInt32)recvBufferIndexForSequence:(UInt32)sequence;
+- (void)processParity:(PseudoTcpPacket *)parityPacket;
+- (void)resendSegmentWithSequence:(UInt32)sequence;
 - (void)maybeScheduleEmptyWindowProbe;
 
 // RST
@@ -115,27 +312,29 @@ enum PseudoTcpFlags
 
 // THE RECEIVE BUFFER:
 // 
-// The receive buffer is an array of received PseudoTcpPacket objects.
-// The array is kept sorted according to sequence number, taking wrap-around into account.
-// Any out-of-order data that arrives is similarly stored in a seperate array.
-// This seperate array only includes packets that would fit in the receive window (taking into
-// account the RECV_BUFFER_SIZE), had they not been out-of-order.
-// 
-// Using arrays instead of NSMutableData takes up less memory in most cases.
-// This is because allocating a NSMutableData object of size 64K always takes up 64K,
-// but creating an array and limiting its size to 64K of data will often take up much less than 64K.
-// This technique also avoids many underlying memcopy's and memmove's.
+// The receive buffer is a contiguous ring buffer of RECV_BUFFER_SIZE bytes, allocated once when the socket is created.
+// Data from received packets is copied directly into the ring, and the packets themselves are discarded.
+// Thus no objects are kept around per received segment, and reading from the buffer is a simple memcpy
+// (or two, if the data wraps around the end of the ring).
 // 
-// The recvBufferSize is the amount of data in the recvBuffer that hasn't been read by the upper-layer.
-// The recvBufferOffset is the amount of data, in the first PseudoTcpPacket in the recvBuffer,
-// that has been read by the upper-layer.
-// The recvSequence is the sequence number of the first byte of data in the first PseudoTcpPacket in the recvBuffer.
+// The recvBufferSize is the amount of in-order data in the recvBuffer that hasn't been read by the upper-layer.
+// The recvBufferOffset is the index, within the ring, of the first byte that hasn't been read by the upper-layer.
+// The recvSequence is the sequence number of that byte.
 // If the recvBuffer is empty, then the recvSequence is the sequence number we're expecting next.
 // 
 // Using the above three numbers, one can easily determine all needed information.
 // For example:
-// The next expected sequence number is recvSequnce + recvBufferOffset + recvBufferSize.
-// The sequence number of the first byte of unread data by upper-layer is recvSequence + recvBufferOffset.
+// The next expected sequence number is recvSequence + recvBufferSize.
+// The ring index of any sequence number within the receive window is
+// (recvBufferOffset + (sequence - recvSequence)) % recvBufferCapacity.
+// 
+// Any out-of-order data that arrives is also copied straight into the ring, at the index its sequence number maps to.
+// We only accept out-of-order data that fits in the receive window, so it never overwrites unread data.
+// The recvOutOfOrderBuffer is a sorted array of the sequence ranges that have been stored this way.
+// Overlapping and adjacent ranges are merged, so there's one range per island of data (and one hole in front of each).
+// Ranges are found by binary search on their offset from the expected sequence number.
+// When the hole in front of the first range is filled, it's simply folded into the recvBufferSize without any copying,
+// and dropped from the front of the array by advancing recvOutOfOrderHead.
 
 // SENDING ACK'S AND NOTIFYING THE DELEGATE OF NEW DATA:
 // 
@@ -144,34 +343,66 @@ enum PseudoTcpFlags
 // After a short period of time, the ack timer will expire, and the delayed ack will be sent.
 // If we receive more data before the ack timer expires, we will then send an immediate ack, and postpone
 // notifying the delegate until after we know the ack has been sent.
+// (Usually the ack is handed straight to the OS, in which case we know it's been sent as soon as sendAckNow returns.)
 // This way the ack is not delayed by any data processing the delegate may do, and
 // we minimize ack delays where they should properly be minimized.
 // The delayed ack may also be interrupted if we are sending data, as acks can and will be tacked onto data packets.
 
 // THE SEND BUFFER:
 // 
-// The send buffer is an array of NSData objects.
-// 
-// Similarly to the receive buffer, we use arrays instead of NSMutableData to take up less memory.
-// In the case of an http client, sending small requests, the benefits are easily seen.
-// In the case of an http server, sending large amounts of data, the benefits may be slim memory wise.
-// However, the technique will sometimes avoid many memcopy's,
-// and the memmove's required to shift the sliding window are not needed.
+// The send buffer is a contiguous ring buffer of SEND_BUFFER_SIZE bytes, allocated once when the socket is created.
+// It holds both the data that has been sent and is waiting to be acknowledged,
+// and the data that is waiting to be sent.
 // 
-// The sendBufferSize is the amound of data in the sendBuffer that hasn't been sent.
-// The sendBufferOffset is the amount of data, in the first NSData in the sendBuffer, that has already been sent.
-// The sendSequence is the sequence number of the first byte of data in the first NSData object in the sendBuffer.
+// The sendSequence is the sequence number of the oldest byte in the sendBuffer.
+// The sendBufferHead is the index, within the ring, of that byte.
+// The sendBufferOffset is the amount of data in the sendBuffer that has already been sent.
+// The sendBufferSize is the amount of data in the sendBuffer that hasn't been sent.
 // If the sendBuffer is empty, then the sendSequence is the sequence number of the next byte to go into the sendBuffer.
 // 
-// As data is sent, it is copied into PseudoTcpPackets, and these packets are placed into the retransmissionQueue.
-// The retransmission queue is kept sorted according to sequence number, taking wrap-around into account.
-// That is, the oldest packet sent and yet unacknowledged is the first packet in the queue.
-// As ack's are received, affected packets from the retransmission queue are removed.
+// As data is sent, a PseudoTcpSegment is appended to the retransmissionQueue.
+// The segment only records the sequence number and length of the data, along with a few flags and the time it
+// was sent. The data itself stays in the sendBuffer, and is copied out of the ring again if the segment
+// needs to be retransmitted. When the data is acknowledged, the sendBufferHead simply moves forward.
+// 
+// The retransmission queue is itself a ring of PseudoTcpSegment structs, kept sorted according to sequence number.
+// That is, the oldest segment sent and yet unacknowledged is the first segment in the queue.
+// As ack's are received, affected segments are removed from the front of the queue.
+// The queue only grows (by doubling) if more segments are in flight than it has ever held before,
+// so in the steady state no memory is allocated to hold sent or received segments.
+// 
+// THE SACK SCOREBOARD:
 // 
+// The retransmission queue doubles as the scoreboard described in RFC 6675.
+// When the remote host tells us (via SACK blocks) that it has received a segment, the segment is marked as sacked.
+// Sacked segments stay in the queue until they're cumulatively acknowledged, but no longer count as being in flight.
+// During recovery, any segment with at least DUP_THRESH sacked segments above it is considered lost.
+// Lost segments are simply taken out of the retransmissionQueueEffectiveSize (our estimate of the "pipe"),
+// which is exactly how segments that need to be resent after a timeout are handled.
+// So the normal send loop retransmits only the holes, as the congestion window allows,
+// and a burst of losses can be repaired in a single round trip.
+// 
+// Older implementations only support the single sack sequence in the header, which we still understand.
+
 // In most tcp explanations, the send buffer is presented as a sliding window of data.
 // The send buffer in these diagrams includes both the data that is waiting to be acknowledged, in addition to
-// the data that is waiting to be sent.  In the same way, the conecptual send buffer of PseudoTcp includes both
-// the retransmission queue and the send buffer.
+// the data that is waiting to be sent. This is exactly how the ring buffer of PseudoTcp is laid out.
+
+// PATH MTU DISCOVERY:
+// 
+// Every segment is sent in its own UDP datagram, so the segment size determines how efficiently we use the path.
+// The 536 byte DEFAULT_MTU is safe everywhere, but wastes a lot of packets on a typical 1500 byte ethernet path.
+// We can't rely on ICMP "fragmentation needed" messages to find the real path mtu, as they never make it
+// through most NATs. So we use packetization layer path mtu discovery (RFC 4821) instead.
+// 
+// The udp socket is set to not fragment, and each side advertises the largest segment it can receive in its SYN.
+// Once the connection is established, we occasionally send a segment of new data that is larger than the mss.
+// This is the probe. If it's acknowledged, the mss is raised to its size. If it's lost, the upper bound of the
+// search is lowered, and the probe is split into mss sized segments before it's retransmitted.
+// The sizes are chosen via binary search, starting with the largest possible size since that usually works.
+// 
+// If we see repeated timeouts with a raised mss, the path may have changed to one with a smaller mtu.
+// In this case we fall back to DEFAULT_MTU, and the search starts over.
 
 // KEEP ALIVE:
 // 
@@ -211,47 +442,115 @@ enum PseudoTcpFlags
 	{
 		udpSocket = [udpSock retain];
 		[udpSocket setDelegate:self];
-		[udpSocket setMaxReceiveBufferSize:(PSEUDO_TCP_HEADER_SIZE + DEFAULT_MTU)];
+		
+		// We'll advertise the largest segment our interface can handle, so we have to be able to receive it
+		mssMax = [self localMaxSegmentSize];
+		[udpSocket setMaxReceiveBufferSize:(PSEUDO_TCP_MAX_OVERHEAD + mssMax)];
+		
+		// Path mtu probes must not be fragmented along the way.
+		// If the OS doesn't support this, a probe can only succeed by being fragmented and reassembled.
+		// That's still a valid (if less efficient) path, so we continue to probe regardless.
+		NSError *dfError = nil;
+		if(![udpSocket enableDontFragment:YES error:&dfError])
+		{
+			DDLogInfo(@"PseudoTcp: Unable to disable fragmentation: %@", dfError);
+		}
 		
 		flags = 0;
 		state = STATE_INIT;
 		
-		recvBuffer = [[NSMutableArray alloc] initWithCapacity:30];
-		recvOutOfOrderBuffer = [[NSMutableArray alloc] initWithCapacity:10];
+		recvBufferCapacity = RECV_BUFFER_SIZE;
+		recvBuffer = malloc(recvBufferCapacity);
 		recvBufferOffset = 0;
 		recvBufferSize = 0;
 		
+		recvOutOfOrderCapacity = 8;
+		recvOutOfOrderBuffer = malloc(recvOutOfOrderCapacity * sizeof(PseudoTcpRange));
+		recvOutOfOrderHead = 0;
+		recvOutOfOrderCount = 0;
+		
 		unackedPackets = 0;
 		
-		sendBuffer = [[NSMutableArray alloc] initWithCapacity:30];
+		sendBufferCapacity = SEND_BUFFER_SIZE;
+		sendBuffer = malloc(sendBufferCapacity);
+		sendBufferHead = 0;
 		sendBufferOffset = 0;
 		sendBufferSize = 0;
 		
 		sendSequence = [[self class] randomNumber];
 		
-		retransmissionQueue = [[NSMutableArray alloc] initWithCapacity:15];
+		retransmissionQueueCapacity = 32;
+		retransmissionQueue = malloc(retransmissionQueueCapacity * sizeof(PseudoTcpSegment));
+		retransmissionQueueHead = 0;
+		retransmissionQueueCount = 0;
+		retransmissionQueueResendIndex = 0;
 		retransmissionQueueSize = 0;
 		retransmissionQueueEffectiveSize = 0;
+		retransmissionQueueSackedCount = 0;
 		lastAck = sendSequence;
 		lastAckCount = 0;
 		
-		cwnd = 2 * DEFAULT_MTU; // As per RFC 2581
-		ssthresh = 65535;
+		recvWindowScale = [self windowScaleForBufferSize:recvBufferCapacity];
+		sendWindowScale = 0;
+		
+		receiverSupportsTimestamps = NO;
+		tsRecent = 0;
+		tsLastAckSent = 0;
+		
+		mss = DEFAULT_MTU;
+		mssSearchHigh = DEFAULT_MTU; // No probing until we know the remote host's mss
+		mssProbeSize = 0;
+		mssSearchTime = 0;
+		consecutiveTimeouts = 0;
+		
+		congestionControl = [[PseudoTcpNewReno alloc] init];
+		[congestionControl setMaximumSegmentSize:mss];
+		cwndInflation = 0;
 		
 		srtt   = 0.0;
 		rttvar = 0.0;
 		rto    = 3.0;
 		
+		checkSpuriousTimeout = NO;
+		retransmitTimestamp = 0;
+		
 		recover = sendSequence;
 		
-		keepAliveTimer = [[NSTimer timerWithTimeInterval:KEEP_ALIVE_TIMEOUT
-												  target:self
-												selector:@selector(doKeepAliveTimeout:)
-												userInfo:nil
-												 repeats:NO] retain];
-		[self runLoopAddTimer:keepAliveTimer];
+		// All of our timers are driven by the timer wheel shared by every connection on this thread
+		timerWheel = [[PseudoTcpTimerWheel currentTimerWheel] retain];
+		[timerWheel addRunLoopModes:[udpSocket runLoopModes]];
+		
+		PseudoTcpTimerInit(&ackTimer, self, @selector(doAckTimeout));
+		PseudoTcpTimerInit(&retransmissionTimer, self, @selector(doTimeout));
+		PseudoTcpTimerInit(&persistTimer, self, @selector(doPersistTimeout));
+		PseudoTcpTimerInit(&keepAliveTimer, self, @selector(doKeepAliveTimeout));
+		
+		[timerWheel scheduleTimer:&keepAliveTimer withTimeInterval:KEEP_ALIVE_TIMEOUT];
+		
+		lastPacketTime = 0;
+		
+		pacingGain = DEFAULT_PACING_GAIN;
+		pacingTokens = 0.0;
+		pacingTime = 0;
+		PseudoTcpTimerInit(&pacingTimer, self, @selector(maybeSendData));
+		
+		forwardErrorCorrection = NO;
+		receiverSupportsFec = NO;
 		
-		lastPacketTime = [[NSDate distantPast] retain];
+		multiplexing = NO;
+		receiverSupportsMultiplexing = NO;
+		fecActive = NO;
+		lossRate = 0.0F;
+		lossSampleSent = 0;
+		lossSampleLost = 0;
+		fecGroup = calloc(1, sizeof(PseudoTcpFecGroup));
+		fecRecoveryBuffer = NULL;
+		fecRecoveryBufferCapacity = 0;
+		
+		memset(&statistics, 0, sizeof(PseudoTcpStatistics));
+		
+		datagramBufferCapacity = PSEUDO_TCP_MAX_OVERHEAD + mssMax;
+		datagramBuffer = malloc(datagramBufferCapacity);
 	}
 	return self;
 }
@@ -266,19 +565,21 @@ enum PseudoTcpFlags
 		[udpSocket close];
 	}
 	[udpSocket release];
-	[recvBuffer release];
-	[recvOutOfOrderBuffer release];
-	[ackTimer invalidate];
-	[ackTimer release];
-	[sendBuffer release];
-	[retransmissionQueue release];
-	[retransmissionTimer invalidate];
-	[retransmissionTimer release];
-	[persistTimer invalidate];
-	[persistTimer release];
-	[keepAliveTimer invalidate];
-	[keepAliveTimer release];
-	[lastPacketTime release];
+	free(recvBuffer);
+	free(recvOutOfOrderBuffer);
+	[timerWheel cancelTimer:&ackTimer];
+	free(sendBuffer);
+	free(retransmissionQueue);
+	[timerWheel cancelTimer:&retransmissionTimer];
+	[timerWheel cancelTimer:&persistTimer];
+	[timerWheel cancelTimer:&keepAliveTimer];
+	[timerWheel cancelTimer:&pacingTimer];
+	[timerWheel release];
+	free(datagramBuffer);
+	free(fecGroup->parity);
+	free(fecGroup);
+	free(fecRecoveryBuffer);
+	[congestionControl release];
 	[NSObject cancelPreviousPerformRequestsWithTarget:delegate selector:@selector(onPseudoTcpDidClose:) object:self];
 	[NSObject cancelPreviousPerformRequestsWithTarget:self];
 	[super dealloc];
@@ -303,58 +604,204 @@ enum PseudoTcpFlags
 	return udpSocket;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Run Loop
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+/**
+ * Returns the size of the receive buffer, which is the largest receive window we'll advertise.
+**/
+- (UInt32)maxReceiveBufferSize
+{
+	return recvBufferCapacity;
+}
 
-- (void)runLoopAddTimer:(NSTimer *)timer
+/**
+ * Sets the size of the receive buffer.
+ * This may only be called before the connection is opened, and is limited to MAX_BUFFER_SIZE.
+ * 
+ * Receive windows larger than 65535 bytes are only possible if the remote host supports window scaling.
+ * If it doesn't, we'll simply never advertise more than 65535 bytes.
+**/
+- (void)setMaxReceiveBufferSize:(UInt32)max
 {
-	CFRunLoopRef runLoop = [[NSRunLoop currentRunLoop] getCFRunLoop];
-	NSArray *runLoopModes = [udpSocket runLoopModes];
-	unsigned int i, count = [runLoopModes count];
-	for(i = 0; i < count; i++)
+	if(state != STATE_INIT)
 	{
-		NSString *mode = [runLoopModes objectAtIndex:i];
-		CFRunLoopAddTimer(runLoop, (CFRunLoopTimerRef)timer, (CFStringRef)mode);
+		DDLogWarn(@"PseudoTcp: setMaxReceiveBufferSize: cannot change buffer size after opening");
+		return;
 	}
+	
+	max = MIN(MAX(max, DEFAULT_MTU), MAX_BUFFER_SIZE);
+	
+	recvBuffer = reallocf(recvBuffer, max);
+	recvBufferCapacity = max;
+	
+	recvWindowScale = [self windowScaleForBufferSize:recvBufferCapacity];
 }
 
-- (void)runLoopRemoveTimer:(NSTimer *)timer
+/**
+ * Returns the size of the send buffer.
+ * This includes data waiting to be sent, as well as data waiting to be acknowledged.
+**/
+- (UInt32)maxSendBufferSize
 {
-	CFRunLoopRef runLoop = [[NSRunLoop currentRunLoop] getCFRunLoop];
-	NSArray *runLoopModes = [udpSocket runLoopModes];
-	unsigned int i, count = [runLoopModes count];
-	for(i = 0; i < count; i++)
-	{
-		NSString *mode = [runLoopModes objectAtIndex:i];
-		CFRunLoopRemoveTimer(runLoop, (CFRunLoopTimerRef)timer, (CFStringRef)mode);
-	}
+	return sendBufferCapacity;
 }
 
-- (void)setRunLoopModes:(NSArray *)modes
+/**
+ * Sets the size of the send buffer.
+ * This may only be called before the connection is opened, and is limited to MAX_BUFFER_SIZE.
+**/
+- (void)setMaxSendBufferSize:(UInt32)max
 {
-	[udpSocket setRunLoopModes:modes];
-	
-	if(ackTimer)
+	if(state != STATE_INIT)
 	{
-		[self runLoopRemoveTimer:ackTimer];
-		[self runLoopAddTimer:ackTimer];
+		DDLogWarn(@"PseudoTcp: setMaxSendBufferSize: cannot change buffer size after opening");
+		return;
 	}
-	if(retransmissionTimer)
+	
+	max = MIN(MAX(max, DEFAULT_MTU), MAX_BUFFER_SIZE);
+	
+	sendBuffer = reallocf(sendBuffer, max);
+	sendBufferCapacity = max;
+}
+
+/**
+ * Returns the current maximum segment size.
+ * This is the largest amount of data we'll put into a single packet, as determined by path mtu discovery.
+**/
+- (UInt32)maximumSegmentSize
+{
+	return mss;
+}
+
+/**
+ * Returns the congestion controller, which decides how much data may be in flight.
+ * The default is PseudoTcpNewReno.
+**/
+- (id <PseudoTcpCongestionControl>)congestionControl
+{
+	return congestionControl;
+}
+
+/**
+ * Sets the congestion controller.
+ * This may only be called before the connection is opened, and the controller may not be shared between connections.
+**/
+- (void)setCongestionControl:(id <PseudoTcpCongestionControl>)newCongestionControl
+{
+	if(state != STATE_INIT)
 	{
-		[self runLoopRemoveTimer:retransmissionTimer];
-		[self runLoopAddTimer:retransmissionTimer];
+		DDLogWarn(@"PseudoTcp: setCongestionControl: cannot change congestion control after opening");
+		return;
 	}
-	if(persistTimer)
+	if(newCongestionControl == nil)
 	{
-		[self runLoopRemoveTimer:persistTimer];
-		[self runLoopAddTimer:persistTimer];
+		DDLogWarn(@"PseudoTcp: setCongestionControl: congestion control may not be nil");
+		return;
 	}
-	if(keepAliveTimer)
+	
+	if(congestionControl != newCongestionControl)
 	{
-		[self runLoopRemoveTimer:keepAliveTimer];
-		[self runLoopAddTimer:keepAliveTimer];
+		[congestionControl release];
+		congestionControl = [newCongestionControl retain];
+		
+		[congestionControl setMaximumSegmentSize:mss];
 	}
+}
+
+/**
+ * Returns the pacing gain.
+ * Segments are paced out at this multiple of the congestion window per round trip.
+**/
+- (float)pacingGain
+{
+	return pacingGain;
+}
+
+/**
+ * Sets the pacing gain.
+ * A gain of zero disables pacing, so every segment allowed by the window is sent immediately in a burst.
+ * Values below 1.0 would prevent the window from ever being used in full, and are rounded up.
+**/
+- (void)setPacingGain:(float)gain
+{
+	if(gain <= 0.0F)
+		pacingGain = 0.0F;
+	else
+		pacingGain = MAX(gain, 1.0F);
+}
+
+/**
+ * Returns whether forward error correction is enabled.
+**/
+- (BOOL)forwardErrorCorrection
+{
+	return forwardErrorCorrection;
+}
+
+/**
+ * Enables or disables forward error correction.
+ * 
+ * When enabled, and the path is lossy enough, parity packets are sent alongside the data.
+ * This allows the remote host to rebuild a lost segment without waiting for it to be retransmitted,
+ * at the cost of some extra bandwidth. So it's disabled by default.
+ * 
+ * This only affects the data we send. We always rebuild lost segments from any parity packets we receive.
+**/
+- (void)setForwardErrorCorrection:(BOOL)flag
+{
+	forwardErrorCorrection = flag;
+}
+
+/**
+ * Returns whether we offer to multiplex streams over the connection.
+**/
+- (BOOL)multiplexing
+{
+	return multiplexing;
+}
+
+/**
+ * Sets whether we offer to multiplex streams over the connection, via a PseudoTcpMultiplexer.
+ * 
+ * The offer is made in our SYN (or SYN-ACK), so this must be set before the connection is opened.
+ * It's disabled by default, since older implementations don't understand the framing.
+**/
+- (void)setMultiplexing:(BOOL)flag
+{
+	multiplexing = flag;
+}
+
+/**
+ * Returns whether both hosts offered to multiplex streams over the connection.
+ * This is only known once the connection is open (in onPseudoTcpDidOpen: for example).
+ * If it's NO, the connection must be used as a single plain stream.
+**/
+- (BOOL)receiverSupportsMultiplexing
+{
+	return receiverSupportsMultiplexing;
+}
+
+/**
+ * Returns the running totals for the connection, along with a snapshot of the current round trip time and windows.
+**/
+- (PseudoTcpStatistics)statistics
+{
+	PseudoTcpStatistics result = statistics;
+	result.srtt = srtt;
+	result.maximumSegmentSize = mss;
+	result.congestionWindow = [congestionControl congestionWindow];
+	
+	return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Run Loop
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)setRunLoopModes:(NSArray *)modes
+{
+	[udpSocket setRunLoopModes:modes];
+	
+	// Note: The timer wheel is shared with other connections, so we can only ever add modes to it.
+	[timerWheel addRunLoopModes:modes];
 	
 	[NSObject cancelPreviousPerformRequestsWithTarget:self];
 	[self performSelector:@selector(maybeSendData) withObject:nil afterDelay:0.0 inModes:modes];
@@ -373,14 +820,10 @@ enum PseudoTcpFlags
 {
 	if(state == STATE_INIT)
 	{
-		// Create the opening SYN packet
-		PseudoTcpPacket *packet = [[[PseudoTcpPacket alloc] init] autorelease];
-		[packet setSequence:(sendSequence - 1)];
-		[packet setWindow:[self recvWindow]];
-		[packet setIsSyn:YES];
-		[packet setIsSack:YES];
+		// Create and send the opening SYN segment
+		PseudoTcpSegment *segment = [self enqueueSegmentWithSequence:(sendSequence - 1) length:0 control:kSegmentSyn];
 		
-		[self sendPacket:packet];
+		[self sendSegment:segment];
 		
 		// Start listening for SYN ACK
 		[udpSocket receiveWithTimeout:NO_TIMEOUT tag:0];
@@ -460,11 +903,8 @@ enum PseudoTcpFlags
 	if(state != STATE_ESTABLISHED) return NO;
 	if(flags & kForbidWrites) return NO;
 	
-	// Remember: Although the retransmissionQueue and sendBuffer are separate,
-	// they both combine to make up the conceptual send buffer.
-	
 	// Technically, this is the answer:
-	// return (retransmissionQueueSize + sendBufferSize) < SEND_BUFFER_SIZE;
+	// return [self spaceAvailableInSendBuffer] > 0;
 	
 	// However, if we consider how this class is used by the PseudoAsyncSocket class, this is not the best answer.
 	// Because the PseudoAsyncSocket, after writing a large chunk of data, will immediately fetch the
@@ -473,7 +913,7 @@ enum PseudoTcpFlags
 	// This will result in many small writes to our buffer.
 	// For better performance, we only answer YES when we can accept a larger chunk of data.
 	
-	return [self spaceAvailableInSendBuffer] > (SEND_BUFFER_SIZE / 4);
+	return [self spaceAvailableInSendBuffer] > (sendBufferCapacity / 4);
 }
 
 /**
@@ -501,25 +941,15 @@ enum PseudoTcpFlags
 	UInt32 dataAvailable = [data length] - offset;
 	UInt32 maxReadableLength = MIN([self spaceAvailableInSendBuffer], MIN(maxLength, dataAvailable));
 	
-	// If they pass NSMutableData, we're forced to make a copy.
-	// If they pass NSData, and we can only accept part of it, we're forced to make a copy.
-	// If they pass NSData, and we can accept the entire thing, we can simply retain it and avoid making a copy.
-	// 
-	// Wait - This trick doesn't work!
-	// 
-	// We had previously used it and it caused horrible crashes.
-	// The problem occurred when optimizations were made higher up, and data was passed that was
-	// created via dataWithBytesNoCopy. In this case, the data appears immutable, but a retain/copy of the
-	// object does not prevent the original data from being deallocated.
-	// The only solution to this problem outside of copying the bytes is a hack, requiring knowledge
-	// of the underlying _CFData struct, and it's _bytesDeallocator member.
+	// The data is copied straight into the ring buffer.
+	// We can't simply retain the given data and avoid the copy, as the data may have been
+	// created via dataWithBytesNoCopy, in which case a retain does not prevent the bytes from being deallocated.
 	
 	NSAssert2(offset < [data length], @"offset(%u) >= data(length=%u)", offset, (unsigned)[data length]);
 	
-	const void *subData = [data bytes] + offset;
-	NSData *fragment = [NSData dataWithBytes:subData length:maxReadableLength];
+	UInt32 index = (sendBufferHead + sendBufferOffset + sendBufferSize) % sendBufferCapacity;
 	
-	[sendBuffer addObject:fragment];
+	RingBufferWrite(sendBuffer, sendBufferCapacity, index, [data bytes] + offset, maxReadableLength);
 	sendBufferSize += maxReadableLength;
 	
 	[self scheduleMaybeSendData];
@@ -542,60 +972,53 @@ enum PseudoTcpFlags
 **/
 - (UInt32)read:(UInt8 *)buffer maxLength:(UInt32)maxLength
 {
-	// The recvBuffer is an array of PseudoTcpPacket's that we've received.
-	// The packets are added to the array in their proper sequential order.
+	// The recvBuffer is a ring buffer of the in-order data we've received.
 	
 	if(recvBufferSize == 0) return 0;
 	
-	UInt32 amountRead = 0;
+	UInt32 amountRead = MIN(recvBufferSize, maxLength);
 	
-	while(([recvBuffer count] > 0) && (amountRead < maxLength))
-	{
-		PseudoTcpPacket *packet = [recvBuffer objectAtIndex:0];
-		NSData *packetData = [packet data];
-		
-		UInt32 packetAvailableLength = [packetData length] - recvBufferOffset;
-		UInt32 resultRemainingLength = maxLength - amountRead;
-		
-		if(packetAvailableLength <= resultRemainingLength)
-		{
-			// All available data from this packet can be added to the result
-			void *subBuffer = buffer + amountRead;
-			const void *subData = [packetData bytes] + recvBufferOffset;
-			
-			memcpy(subBuffer, subData, packetAvailableLength);
-			
-			// Update the amount of data read
-			amountRead += packetAvailableLength;
-			
-			// Update the amount of data available in our recvBuffer
-			recvBufferSize -= packetAvailableLength;
-			
-			// Update the recvSequence variable, which always refers to the first packet in the recvBuffer
-			recvSequence += (UInt32)[packetData length];
-			
-			// We're finished with this packet, so we can remove it, and reset the offset
-			[recvBuffer removeObjectAtIndex:0];
-			recvBufferOffset = 0;
-		}
-		else
-		{
-			// Only a portion of data from this packet can be added to the result
-			void *subBuffer = buffer + amountRead;
-			const void *subData = [packetData bytes] + recvBufferOffset;
-			
-			memcpy(subBuffer, subData, resultRemainingLength);
-			
-			// Update the amount of data read
-			amountRead += resultRemainingLength;
-			
-			// Update the amount of data available in our recvBuffer
-			recvBufferSize -= resultRemainingLength;
-			
-			// We're not finished with this packet, but we do need to update the offset
-			recvBufferOffset += resultRemainingLength;
-		}
-	}
+	RingBufferRead(recvBuffer, recvBufferCapacity, recvBufferOffset, buffer, amountRead);
+	
+	[self consumeBytes:amountRead];
+	
+	return amountRead;
+}
+
+/**
+ * Provides direct access to the data at the front of the receive buffer, without copying or consuming it.
+ * 
+ * Returns the length of the region, and sets bytesPtr to point to it, or returns zero if there's no data.
+ * Since the receive buffer is a ring, the region stops at the end of the ring. Once it's been consumed,
+ * the rest of the data (if any) will be available from the start of the ring.
+ * 
+ * The bytes remain valid until they're consumed, or until the socket is deallocated.
+**/
+- (UInt32)peekBytes:(const UInt8 **)bytesPtr
+{
+	if(recvBufferSize == 0) return 0;
+	
+	if(bytesPtr) *bytesPtr = recvBuffer + recvBufferOffset;
+	
+	return MIN(recvBufferSize, recvBufferCapacity - recvBufferOffset);
+}
+
+/**
+ * Removes the given number of bytes from the front of the receive buffer, as if they had been read.
+ * This is used along with peekBytes: to process received data in place.
+**/
+- (void)consumeBytes:(UInt32)length
+{
+	if(length == 0) return;
+	
+	NSAssert2(length <= recvBufferSize, @"consumeBytes:%u with only %u bytes available", length, recvBufferSize);
+	
+	// Update the ring index and sequence number of the first unread byte
+	recvBufferOffset = (recvBufferOffset + length) % recvBufferCapacity;
+	recvSequence += length;
+	
+	// Update the amount of data available in our recvBuffer
+	recvBufferSize -= length;
 	
 	if(flags & kConnectionReset)
 	{
@@ -627,14 +1050,28 @@ enum PseudoTcpFlags
 		// Schedule window update to be sent
 		[self scheduleDelayedAck];
 	}
-	
-	return amountRead;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 #pragma mark State
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
+/**
+ * Returns the smallest window scale shift count that allows a buffer of the given size
+ * to be advertised in the 16 bit window field.
+**/
+- (UInt8)windowScaleForBufferSize:(UInt32)size
+{
+	UInt8 shift = 0;
+	
+	while((shift < PSEUDO_TCP_MAX_WSCALE) && ((size >> shift) > 65535))
+	{
+		shift++;
+	}
+	
+	return shift;
+}
+
 /**
  * Returns the current size of our receive window.
  * That is, how much data we have available in our recvBuffer.
@@ -645,7 +1082,19 @@ enum PseudoTcpFlags
 	// The reason being, if we implement Nagle's algorithm for sending from day one,
 	// there's no need to worry about advertising a small window.
 	
-	return RECV_BUFFER_SIZE - recvBufferSize;
+	return recvBufferCapacity - recvBufferSize;
+}
+
+/**
+ * Returns the receive window, as it should be put into the window field of a (non-SYN) packet.
+ * That is, scaled down by our window scale, and limited to 16 bits.
+**/
+- (UInt16)advertisedRecvWindow
+{
+	// Note: If window scaling wasn't negotiated, the recvWindowScale is zero,
+	// and we're limited to advertising a 65535 byte window.
+	
+	return (UInt16)MIN([self recvWindow] >> recvWindowScale, 65535);
 }
 
 /**
@@ -653,22 +1102,19 @@ enum PseudoTcpFlags
 **/
 - (UInt32)expectedSequence
 {
-	// Note: The recvSequence number refers to the sequence number of the first packet in the recvBuffer.
+	// Note: The recvSequence number refers to the sequence number of the first unread byte in the recvBuffer.
 	// If the recvBuffer is empty, it refers to the sequence number we expect next.
 	
-	return recvSequence + recvBufferOffset + recvBufferSize;
+	return recvSequence + recvBufferSize;
 }
 
 /**
  * Returns the number of bytes available in the send buffer.
- * This method properly takes into account the size of the retransmissionQueue and the size of the sendBuffer.
+ * This takes into account both the data waiting to be acknowledged, and the data waiting to be sent.
 **/
 - (UInt32)spaceAvailableInSendBuffer
 {
-	// Remember: Although the retransmissionQueue and sendBuffer are separate,
-	// they both combine to make up the conceptual send buffer.
-	
-	return SEND_BUFFER_SIZE - (retransmissionQueueSize + sendBufferSize);
+	return sendBufferCapacity - (sendBufferOffset + sendBufferSize);
 }
 
 /**
@@ -677,10 +1123,9 @@ enum PseudoTcpFlags
 **/
 - (UInt32)sendUnacknowledged
 {
-	if([retransmissionQueue count] > 0)
+	if(retransmissionQueueCount > 0)
 	{
-		PseudoTcpPacket *packet = [retransmissionQueue objectAtIndex:0];
-		return [packet sequence];
+		return [self segmentAtIndex:0]->sequence;
 	}
 	else
 	{
@@ -696,20 +1141,32 @@ enum PseudoTcpFlags
 	return sendSequence + sendBufferOffset;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark New Reno
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
+/**
+ * Returns the congestion window, including any temporary inflation during fast recovery.
+**/
+- (UInt32)congestionWindow
+{
+	UInt32 cwnd = [congestionControl congestionWindow];
+	
+	if(cwnd < UINT32_MAX - cwndInflation)
+		return cwnd + cwndInflation;
+	else
+		return UINT32_MAX;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark New Reno
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
 /**
  * Updates the recover variable, and sets flags indicating that the recover variable is valid,
  * and that the next partial ack will be the first partial ack.
 **/
 - (void)setRecover
 {
-	if([retransmissionQueue count] > 0)
+	if(retransmissionQueueCount > 0)
 	{
-		PseudoTcpPacket *firstPacket = [retransmissionQueue objectAtIndex:0];
-		recover = [firstPacket sequence] + retransmissionQueueEffectiveSize;
+		recover = [self sendNext];
 		
 		flags |= kRecover;
 		flags |= kFirstPartial;
@@ -733,16 +1190,14 @@ enum PseudoTcpFlags
 - (BOOL)isFullAck:(UInt32)ack
 {
 	if(!(flags & kRecover)) return YES;
-	if([retransmissionQueue count] == 0) return YES;
+	if(retransmissionQueueCount == 0) return YES;
 	
 	// The recover variable is within the retransmission window.
 	// 
 	// We also know the ack is within the retransmission window, because the processDataAck
 	// method calls isAckWithinRetransmissionQueue before doing any processing.
 	
-	PseudoTcpPacket *startPacket = [retransmissionQueue objectAtIndex:0];
-	
-	UInt32 startSequence = [startPacket sequence];
+	UInt32 startSequence = [self segmentAtIndex:0]->sequence;
 	UInt32 endSequence = startSequence + retransmissionQueueSize;
 	
 	// Always be weary of wrapping sequence numbers...
@@ -814,387 +1269,1008 @@ enum PseudoTcpFlags
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Utilities
+#pragma mark Path MTU Discovery
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * Utility method to handle the repetitive task of sending a packet,
- * adding it to the retransmission queue, and starting a timer for it.
+ * Returns the largest segment size the local interface can send or receive without fragmentation.
 **/
-- (void)sendPacket:(PseudoTcpPacket *)packet
+- (UInt32)localMaxSegmentSize
 {
-	DDLogInfo(@"PseudoTcp: SEND: flg(%d%d%d%d) seq(%010u) ack(%010u) wnd(%05u) dat(%03u)",
-			  [packet isRst]  ? 1 : 0, 
-			  [packet isSack] ? 1 : 0,
-			  [packet isAck]  ? 1 : 0,
-			  [packet isSyn]  ? 1 : 0,
-			  [packet sequence], [packet acknowledgement], [packet window], (unsigned)[[packet data] length]);
+	UInt32 mtu = [udpSocket maximumTransmissionUnit];
 	
-	// Send packet
-	[udpSocket sendData:[packet packetData] withTimeout:NO_TIMEOUT tag:0];
+	if(mtu == 0)
+	{
+		mtu = FALLBACK_LINK_MTU;
+	}
 	
-	// With the exception of acks not carrying any data, we'll expect an ack for this packet
-	if([packet isSyn] || [packet data])
+	if(mtu <= IP_UDP_OVERHEAD + PSEUDO_TCP_MAX_OVERHEAD + DEFAULT_MTU)
 	{
-		// Add packet to retransmission queue
-		[retransmissionQueue addObject:packet];
-		retransmissionQueueSize += (UInt32)[[packet data] length];
-		retransmissionQueueEffectiveSize += (UInt32)[[packet data] length];
-		
-		// Mark packet as counting towards the effective rxQ size
-		[packet setIsRxQ:YES];
-		
-		// Store time we sent this packet
-		[packet setFirstSent:[NSDate date]];
-		
-		// Start the retransmissionTimer, if it's not already started
-		if(retransmissionTimer == nil)
-		{
-			retransmissionTimer = [[NSTimer timerWithTimeInterval:rto
-														   target:self
-														 selector:@selector(doTimeout:)
-														 userInfo:nil
-														  repeats:NO] retain];
-			[self runLoopAddTimer:retransmissionTimer];
-		}
+		return DEFAULT_MTU;
 	}
+	
+	// The segment size is advertised in a 16 bit option
+	return MIN(mtu - IP_UDP_OVERHEAD - PSEUDO_TCP_MAX_OVERHEAD, 65535);
 }
 
 /**
- * Utility method to handle resending a packet from the retransmission queue.
+ * Extracts the maximum segment size from the remote host's SYN (or SYN-ACK) packet,
+ * and sets up the upper bound for path mtu discovery accordingly.
 **/
-- (void)resendPacket:(PseudoTcpPacket *)packet
+- (void)processMaxSegmentSize:(PseudoTcpPacket *)synPacket
 {
-	if(![packet isSyn])
+	if(synPacket->options & PSEUDO_TCP_HAS_MSS)
 	{
-		// Strip any old ack data from the packet
-		[packet setIsAck:NO];
-		[packet setIsSack:NO];
-		[packet setAcknowledgement:0];
-		
-		// Maybe add ack data
-		[self maybeAddAck:packet];
+		mssMax = MAX(DEFAULT_MTU, MIN(mssMax, synPacket->maxSegmentSize));
+	}
+	else
+	{
+		// Older implementations can't receive anything larger than DEFAULT_MTU
+		mssMax = DEFAULT_MTU;
 	}
 	
-	DDLogInfo(@"PseudoTcp: RSND: flg(%d%d%d%d) seq(%010u) ack(%010u) wnd(%05u) dat(%03u)",
-			  [packet isRst]  ? 1 : 0,
-			  [packet isSack] ? 1 : 0,
-			  [packet isAck]  ? 1 : 0,
-			  [packet isSyn]  ? 1 : 0,
-			  [packet sequence], [packet acknowledgement], [packet window], (unsigned)[[packet data] length]);
+	mssSearchHigh = mssMax;
+	
+	DDLogVerbose(@"PseudoTcp: mss(%u) mssMax(%u)", mss, mssMax);
+}
+
+/**
+ * Returns the size of the path mtu probe that should be sent next,
+ * or zero if we shouldn't send a probe right now.
+**/
+- (UInt32)nextMtuProbeSize
+{
+	// Only one probe may be outstanding at a time
+	if(mssProbeSize > 0) return 0;
 	
-	// Mark packet as being retransmitted
-	[packet setWasRetransmitted:YES];
+	// Don't probe while recovering from loss, as the probe would likely be lost too.
+	// And a lost probe would then be indistinguishable from congestion.
+	if((flags & kRecover) || (lastAckCount > 0)) return 0;
+	if(retransmissionQueueSize > retransmissionQueueEffectiveSize) return 0;
 	
-	// If packet wasn't part of effective rxQ size, it is now
-	if(![packet isRxQ])
+	if(mssSearchHigh < mss + MSS_SEARCH_GRANULARITY)
 	{
-		[packet setIsRxQ:YES];
-		retransmissionQueueEffectiveSize += (UInt32)[[packet data] length];
+		// The search is complete.
+		// If we're not already at the maximum, the path may change to allow a larger mtu at some point.
+		// So we periodically search again, as recommended by RFC 4821.
+		
+		if(mssMax < mss + MSS_SEARCH_GRANULARITY) return 0;
+		
+		if(SecondsSince(mssSearchTime) < MSS_SEARCH_INTERVAL) return 0;
+		
+		mssSearchHigh = mssMax;
+		flags &= ~kMssProbeFailed;
 	}
 	
-	// Send packet
-	[udpSocket sendData:[packet packetData] withTimeout:NO_TIMEOUT tag:0];
+	// Most paths these days support a full ethernet sized packet, so we try the upper bound first.
+	// If that fails, we binary search between the mss and the upper bound.
 	
-	// This method is not used to send plain acks, because they are never stored in the retransmission queue.
-	// 
-	// There's no need to add this packet to the retransmission queue, because it's already in the queue.
+	if(flags & kMssProbeFailed)
+		return mss + ((mssSearchHigh - mss + 1) / 2);
+	else
+		return mssSearchHigh;
+}
+
+/**
+ * Called when a path mtu probe has been acknowledged.
+**/
+- (void)mtuProbeDidSucceed:(UInt32)probeSize
+{
+	DDLogInfo(@"PseudoTcp: Path mtu probe succeeded: mss(%u -> %u)", mss, probeSize);
 	
-	// Start the retransmissionTimer, if it's not already started
-	if(retransmissionTimer == nil)
+	mss = MAX(mss, probeSize);
+	mssProbeSize = 0;
+	
+	[congestionControl setMaximumSegmentSize:mss];
+	
+	if(mssSearchHigh < mss + MSS_SEARCH_GRANULARITY)
 	{
-		retransmissionTimer = [[NSTimer timerWithTimeInterval:rto
-													   target:self
-													 selector:@selector(doTimeout:)
-													 userInfo:nil
-													  repeats:NO] retain];
-		[self runLoopAddTimer:retransmissionTimer];
+		mssSearchTime = PseudoTcpMonotonicTime();
 	}
 }
 
-- (void)cleanup
+/**
+ * Called when a path mtu probe was lost.
+ * The probe segment itself must be split into mss sized segments before it's retransmitted.
+**/
+- (void)mtuProbeDidFail
 {
-	NSAssert(state == STATE_CLOSED, @"Cleanup called in improper state");
+	if(mssProbeSize == 0) return;
 	
-	// Remove all objects from the receive buffer
-	[recvBuffer removeAllObjects];
-	recvBufferOffset = 0;
-	recvBufferSize = 0;
+	DDLogInfo(@"PseudoTcp: Path mtu probe failed: size(%u) mss(%u)", mssProbeSize, mss);
 	
-	// Clear the ack timer to prevent any pending acks from being sent
-	[ackTimer invalidate];
-	[ackTimer release];
-	ackTimer = nil;
+	mssSearchHigh = MAX(mss, mssProbeSize - 1);
+	mssProbeSize = 0;
 	
-	// Remove all objects from the send buffer
-	[sendBuffer removeAllObjects];
-	sendBufferOffset = 0;
-	sendBufferSize = 0;
+	flags |= kMssProbeFailed;
 	
-	// Remove all objects from the retransmissionQueue
-	[retransmissionQueue removeAllObjects];
-	retransmissionQueueSize = 0;
-	retransmissionQueueEffectiveSize = 0;
+	if(mssSearchHigh < mss + MSS_SEARCH_GRANULARITY)
+	{
+		mssSearchTime = PseudoTcpMonotonicTime();
+	}
+}
+
+/**
+ * Called after each retransmission timeout.
+ * If we've raised the mss, and keep timing out, the path mtu may have shrunk (a "black hole" in RFC 4821 terms).
+ * In this case we fall back to the DEFAULT_MTU, which is guaranteed to work, and search again from there.
+**/
+- (void)maybeFallBackToDefaultMtu
+{
+	if((mss <= DEFAULT_MTU) || (consecutiveTimeouts < MSS_BLACK_HOLE_TIMEOUTS)) return;
 	
-	// Clear the retransmission timer
-	[retransmissionTimer invalidate];
-	[retransmissionTimer release];
-	retransmissionTimer = nil;
+	DDLogWarn(@"PseudoTcp: Suspected path mtu black hole: mss(%u -> %u)", mss, DEFAULT_MTU);
 	
-	// Clear the persist timer
-	[persistTimer invalidate];
-	[persistTimer release];
-	persistTimer = nil;
+	mssSearchHigh = mss - 1;
+	mssProbeSize = 0;
+	mss = DEFAULT_MTU;
 	
-	// Clear the keep alive timer
-	[keepAliveTimer invalidate];
-	[keepAliveTimer release];
-	keepAliveTimer = nil;
+	[congestionControl setMaximumSegmentSize:mss];
+	
+	flags |= kMssProbeFailed;
+	
+	// Everything in the retransmission queue will have to be resent using the smaller segment size
+	
+	UInt32 i = 0;
+	while(i < retransmissionQueueCount)
+	{
+		i += [self splitSegmentAtIndex:i maxLength:mss];
+	}
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark Handshake
+#pragma mark Utilities
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /**
- * Processes an opening syn packet.
- * We're either in STATE_LISTEN or STATE_SYN_RECEIVED.
- * The latter may occur if our syn-ack gets lost, and they have to retransmit their opening syn.
+ * Returns the segment at the given index within the retransmission queue.
+ * Index zero is the oldest segment sent and yet unacknowledged.
 **/
-- (void)processOpeningSyn:(PseudoTcpPacket *)synPacket
+- (PseudoTcpSegment *)segmentAtIndex:(UInt32)index
 {
-	DDLogVerbose(@"PseudoTcp: processOpeningSyn: seq(%010u) ack(%010u) wnd(%05u)",
-				 [synPacket sequence], [synPacket acknowledgement], [synPacket window]);
+	return &retransmissionQueue[(retransmissionQueueHead + index) % retransmissionQueueCapacity];
+}
+
+/**
+ * Returns the index of the first segment in the retransmission queue whose sequence number is at or after
+ * the given sequence number. If there is no such segment, returns retransmissionQueueCount.
+**/
+- (UInt32)indexOfFirstSegmentAtOrAfterSequence:(UInt32)sequence
+{
+	if(retransmissionQueueCount == 0) return 0;
 	
-	recvSequence = [synPacket sequence] + 1;
-	sendWindow   = [synPacket window];
+	// The segments are sorted by sequence number, so we can simply binary search the queue.
+	// We compare offsets from the first segment, rather than the sequence numbers themselves,
+	// so we don't have to worry about wrapping sequence numbers.
 	
-	// Check for SACK support
-	receiverSupportsSack = [synPacket isSack];
-	DDLogVerbose(@"PseudoTcp: receiverSupportsSack: %d", receiverSupportsSack);
+	UInt32 firstSequence = [self segmentAtIndex:0]->sequence;
+	UInt32 offset = sequence - firstSequence;
 	
-	// Create and send our opening SYN-ACK packet
-	PseudoTcpPacket *synAckPacket = [[[PseudoTcpPacket alloc] init] autorelease];
-	[synAckPacket setSequence:(sendSequence - 1)];
-	[synAckPacket setAcknowledgement:recvSequence];
-	[synAckPacket setWindow:[self recvWindow]];
-	[synAckPacket setIsSyn:YES];
-	[synAckPacket setIsAck:YES];
-	[synAckPacket setIsSack:YES];
+	UInt32 low = 0;
+	UInt32 high = retransmissionQueueCount;
 	
-	[self sendPacket:synAckPacket];
+	while(low < high)
+	{
+		UInt32 mid = low + ((high - low) / 2);
+		
+		UInt32 midOffset = [self segmentAtIndex:mid]->sequence - firstSequence;
+		
+		if(midOffset < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
 	
-	// Update state
-	state = STATE_SYN_RECEIVED;
+	return low;
 }
 
 /**
- * Process an opening syn-ack packet.
- * We're either in the STATE_SYN_SENT or STATE_ESTABLISHED.
- * The latter may occur if our final ack gets lost, and they have to retransmit their opening syn-ack.
+ * Returns the segment in the retransmission queue with the given sequence number, or NULL if there isn't one.
 **/
-- (void)processOpeningSynAck:(PseudoTcpPacket *)synAckPacket
+- (PseudoTcpSegment *)segmentWithSequence:(UInt32)sequence
 {
-	DDLogVerbose(@"PseudoTcp: processOpeningSynAck: seq(%010u) ack(%010u) wnd(%05u)",
-				 [synAckPacket sequence], [synAckPacket acknowledgement], [synAckPacket window]);
+	UInt32 index = [self indexOfFirstSegmentAtOrAfterSequence:sequence];
 	
-	// If this is the first time we've received the syn-ack, we can remove the syn from the retransmission queue.
-	// Since the syn-ack may be sent several times (if our ack response is lost), we should double-check everything.
-	if([retransmissionQueue count] > 0)
+	if(index < retransmissionQueueCount)
 	{
-		PseudoTcpPacket *packet = [retransmissionQueue objectAtIndex:0];
-		if([packet isSyn])
+		PseudoTcpSegment *segment = [self segmentAtIndex:index];
+		
+		if(segment->sequence == sequence)
 		{
-			// The ack is for our opening syn, which we can now remove from the retransmission queue
-			[retransmissionQueue removeObjectAtIndex:0];
-			
-			// And don't forget to invalidate the timer we setup for the syn packet
-			[retransmissionTimer invalidate];
-			[retransmissionTimer release];
-			retransmissionTimer = nil;
+			return segment;
 		}
 	}
 	
-	// Extract syn data from the packet
-	recvSequence = [synAckPacket sequence] + 1;
-	sendWindow   = [synAckPacket window];
+	return NULL;
+}
+
+/**
+ * Returns the index within the retransmission queue of the given segment.
+**/
+- (UInt32)indexOfSegment:(PseudoTcpSegment *)segment
+{
+	UInt32 position = (UInt32)(segment - retransmissionQueue);
 	
-	// Check for SACK support
-	receiverSupportsSack = [synAckPacket isSack];
-	DDLogVerbose(@"PseudoTcp: receiverSupportsSack: %d", receiverSupportsSack);
+	return (position + retransmissionQueueCapacity - retransmissionQueueHead) % retransmissionQueueCapacity;
+}
+
+/**
+ * Doubles the capacity of the retransmission queue.
+ * We unwrap the segments while copying them so the new queue starts at index zero.
+ * Any segment pointers are invalid after calling this method.
+**/
+- (void)growRetransmissionQueue
+{
+	UInt32 newCapacity = retransmissionQueueCapacity * 2;
+	PseudoTcpSegment *newQueue = malloc(newCapacity * sizeof(PseudoTcpSegment));
 	
-	// Create and send our opening ack packet
-	PseudoTcpPacket *ackPacket = [[[PseudoTcpPacket alloc] init] autorelease];
-	[ackPacket setAcknowledgement:recvSequence];
-	[ackPacket setWindow:[self recvWindow]];
-	[ackPacket setIsAck:YES];
+	UInt32 firstCount = MIN(retransmissionQueueCount, retransmissionQueueCapacity - retransmissionQueueHead);
+	UInt32 secondCount = retransmissionQueueCount - firstCount;
 	
-	[self sendPacket:ackPacket];
+	memcpy(newQueue, retransmissionQueue + retransmissionQueueHead, firstCount * sizeof(PseudoTcpSegment));
+	memcpy(newQueue + firstCount, retransmissionQueue, secondCount * sizeof(PseudoTcpSegment));
 	
-	if(state != STATE_ESTABLISHED)
+	free(retransmissionQueue);
+	retransmissionQueue = newQueue;
+	retransmissionQueueCapacity = newCapacity;
+	retransmissionQueueHead = 0;
+}
+
+/**
+ * Appends a segment to the end of the retransmission queue, growing the queue if needed.
+ * The returned pointer is only valid until the next segment is enqueued.
+**/
+- (PseudoTcpSegment *)enqueueSegmentWithSequence:(UInt32)sequence length:(UInt32)length control:(UInt8)control
+{
+	if(retransmissionQueueCount == retransmissionQueueCapacity)
 	{
-		// Update state
-		state = STATE_ESTABLISHED;
-		
-		// Inform delegate that the connection is open
-		if([delegate respondsToSelector:@selector(onPseudoTcpDidOpen:)])
-		{
-			[delegate onPseudoTcpDidOpen:self];
-		}
-		
-		// If the delegate hasn't already filled the majority of the send buffer in the onPseudoTcpDidOpen method
-		if([self spaceAvailableInSendBuffer] > (SEND_BUFFER_SIZE / 4))
-		{
-			// Inform delegate that we can accept data to be sent
-			if([delegate respondsToSelector:@selector(onPseudoTcpCanAcceptBytes:)])
-			{
-				[delegate onPseudoTcpCanAcceptBytes:self];
-			}
-		}
+		// The queue is full, so we double its size
+		[self growRetransmissionQueue];
 	}
+	
+	PseudoTcpSegment *segment = [self segmentAtIndex:retransmissionQueueCount];
+	segment->sequence = sequence;
+	segment->length = length;
+	segment->control = control;
+	segment->firstSent = 0;
+	
+	retransmissionQueueCount++;
+	
+	return segment;
 }
 
 /**
- * Process an opening ack packet.
- * We should be in STATE_SYN_RECEIVED.
+ * Splits the segment at the given index into consecutive segments no larger than the given length.
+ * The new segments inherit the state of the original segment, except that none of them are path mtu probes.
+ * 
+ * Returns the number of segments the original segment now occupies in the queue.
+ * Any segment pointers are invalid after calling this method.
 **/
-- (void)processOpeningAck:(PseudoTcpPacket *)ackPacket
+- (UInt32)splitSegmentAtIndex:(UInt32)index maxLength:(UInt32)maxLength
 {
-	DDLogVerbose(@"PseudoTcp: processOpeningAck: seq(%010u) ack(%010u) wnd(%05u)",
-				 [ackPacket sequence], [ackPacket acknowledgement], [ackPacket window]);
+	PseudoTcpSegment original = *[self segmentAtIndex:index];
+	original.control &= ~kSegmentMtuProbe;
 	
-	// Note: This method is ONLY called once.
+	UInt32 count = MAX(1, (original.length + maxLength - 1) / maxLength);
+	UInt32 extra = count - 1;
 	
-	// The ack is for our opening syn-ack, which we can now remove from the retransmission queue
-	[retransmissionQueue removeObjectAtIndex:0];
+	while(retransmissionQueueCount + extra > retransmissionQueueCapacity)
+	{
+		[self growRetransmissionQueue];
+	}
 	
-	// And don't forget to invalidate the timer we setup for the syn-ack packet
-	[retransmissionTimer invalidate];
-	[retransmissionTimer release];
-	retransmissionTimer = nil;
+	// Shift the segments after the split one back to make room.
+	// Splitting only happens when a path mtu probe is lost, so it's rare enough that a simple loop will do.
 	
-	// Update state
-	state = STATE_ESTABLISHED;
+	UInt32 i;
+	for(i = retransmissionQueueCount; i > index + 1; i--)
+	{
+		*[self segmentAtIndex:(i - 1 + extra)] = *[self segmentAtIndex:(i - 1)];
+	}
+	retransmissionQueueCount += extra;
 	
-	// Inform delegate that the connection is open
-	if([delegate respondsToSelector:@selector(onPseudoTcpDidOpen:)])
+	if(original.control & kSegmentSacked)
 	{
-		[delegate onPseudoTcpDidOpen:self];
+		retransmissionQueueSackedCount += extra;
 	}
 	
-	// If the delegate hasn't already filled the majority of the send buffer in the onPseudoTcpDidOpen method
-	if([self spaceAvailableInSendBuffer] > (SEND_BUFFER_SIZE / 4))
+	for(i = 0; i < count; i++)
 	{
-		// Inform delegate that we can accept data to be sent
-		if([delegate respondsToSelector:@selector(onPseudoTcpCanAcceptBytes:)])
-		{
-			[delegate onPseudoTcpCanAcceptBytes:self];
-		}
+		PseudoTcpSegment *segment = [self segmentAtIndex:(index + i)];
+		*segment = original;
+		
+		segment->sequence = original.sequence + (i * maxLength);
+		segment->length = MIN(maxLength, original.length - (i * maxLength));
 	}
+	
+	// The sizes of the retransmission queue are unchanged, as the pieces carry the same flags as the original.
+	// But the resend index may now need to skip over the new pieces.
+	if(retransmissionQueueResendIndex > index + 1)
+	{
+		retransmissionQueueResendIndex += extra;
+	}
+	
+	return count;
 }
 
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-#pragma mark ACK
-////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
-
 /**
- * Process an ack packet for data we've sent.
- * We should be in STATE_ESTABLISHED.
- *
- * The paacket may or may not include data, but the data isn't processed by this method.
- * Only the ack part is processed in this method.
+ * Removes the oldest segment from the retransmission queue,
+ * and releases the data it occupied in the send buffer.
 **/
-- (void)processDataAck:(PseudoTcpPacket *)ackPacket
+- (void)dequeueSegment
 {
-	if(![self isAckWithinRetransmissionQueue:[ackPacket acknowledgement]])
+	PseudoTcpSegment *segment = [self segmentAtIndex:0];
+	
+	if(segment->control & kSegmentSacked)
 	{
-		// The ack doesn't apply to any packets in our retransmissionQueue.
-		// It must be an old ack.
-		// We can ignore it, as it doesn't affect anything.
-		return;
+		// Sacked segments have already been subtracted from the retransmission queue size
+		
+		retransmissionQueueSackedCount--;
+	}
+	else
+	{
+		if(segment->control & kSegmentRxQ)
+		{
+			retransmissionQueueEffectiveSize -= segment->length;
+		}
+		retransmissionQueueSize -= segment->length;
 	}
 	
-	// Check to see if packet contains a selective ack.
-	// If so, remove the indicated packet from the retransmission queue.
+	// The data for the segment is at the very front of the send buffer
+	sendSequence += segment->length;
+	sendBufferOffset -= segment->length;
+	sendBufferHead = (sendBufferHead + segment->length) % sendBufferCapacity;
 	
-	BOOL isEffectiveSelectiveAck = NO;
+	retransmissionQueueHead = (retransmissionQueueHead + 1) % retransmissionQueueCapacity;
+	retransmissionQueueCount--;
+	
+	if(retransmissionQueueResendIndex > 0)
+	{
+		retransmissionQueueResendIndex--;
+	}
+}
+
+/**
+ * Fills in the packet header for the given segment.
+ * The segment's data isn't copied here. It's copied straight from the send buffer into the datagram when sent.
+**/
+- (void)getPacket:(PseudoTcpPacket *)packet forSegment:(PseudoTcpSegment *)segment
+{
+	PseudoTcpPacketInit(packet);
+	packet->sequence = segment->sequence;
 	
-	if([ackPacket isSack])
+	if(segment->control & kSegmentSyn)
 	{
-		unsigned i;
-		for(i = 0; i < [retransmissionQueue count]; i++)
+		// The window field of a SYN packet is never scaled
+		packet->window = (UInt16)MIN([self recvWindow], 65535);
+		packet->flags |= PSEUDO_TCP_FLAG_SYN;
+		packet->flags |= PSEUDO_TCP_FLAG_SACK;
+		
+		if(segment->control & kSegmentSynAck)
 		{
-			PseudoTcpPacket *packet = [retransmissionQueue objectAtIndex:i];
+			packet->acknowledgement = recvSequence;
+			packet->flags |= PSEUDO_TCP_FLAG_ACK;
 			
-			if([packet sequence] == [ackPacket sackSequence])
+			// As per RFC 1323, we may only include the window scale option in our SYN-ACK
+			// if the remote host included it in their SYN.
+			if(flags & kWindowScale)
 			{
-				DDLogInfo(@"PseudoTcp: Received SACK %u", [ackPacket sackSequence]);
-				
-				if([packet isRxQ])
-				{
-					retransmissionQueueEffectiveSize -= (UInt32)[[packet data] length];
-					isEffectiveSelectiveAck = YES;
-				}
-				
-				retransmissionQueueSize -= (UInt32)[[packet data] length];
-				[retransmissionQueue removeObjectAtIndex:i];
-				
-				break;
+				PseudoTcpPacketSetWindowScale(packet, recvWindowScale);
 			}
 		}
+		else
+		{
+			PseudoTcpPacketSetWindowScale(packet, recvWindowScale);
+		}
+		
+		// Tell the remote host the largest segment we can receive, so it knows how far it may probe
+		PseudoTcpPacketSetMaxSegmentSize(packet, (UInt16)[self localMaxSegmentSize]);
+		
+		// Tell the remote host we can rebuild lost segments from parity packets
+		PseudoTcpPacketSetFecGroup(packet, 0, NULL);
+		
+		// We only offer multiplexing in our SYN-ACK if the remote host offered it in their SYN
+		if(multiplexing && (!(segment->control & kSegmentSynAck) || receiverSupportsMultiplexing))
+		{
+			PseudoTcpPacketSetMultiplexing(packet);
+		}
 	}
+	else
+	{
+		packet->dataLength = segment->length;
+	}
+}
+
+/**
+ * Encodes the given packet into our datagram buffer, and hands it to the udp socket.
+ * If a segment is given, its data is copied directly from the send buffer into the datagram.
+ * 
+ * Returns YES if the datagram was sent immediately.
+ * Otherwise it was queued in the udp socket, and we'll hear about it in onUdpSocket:didSendDataWithTag:.
+**/
+- (BOOL)writePacket:(PseudoTcpPacket *)packet segment:(PseudoTcpSegment *)segment
+{
+	// We always offer timestamps in our opening SYN.
+	// After that, they're only included if the remote host offered them as well.
 	
-	// Check to see if this is a duplicate ack.
-	// In the event of duplicate acks we may need to perform fast retransmit or fast recovery.
-	// 
-	// A duplicate ACK is a packet with the ACK bit set which acknowledges a previously acknowledged packet, AND
-	// and is not simply a window update (changes the receiver's advertised window).
-	// This method would not have been called if the ACK bit was not set.
-	
-	BOOL windowUpdateOnly = NO;
-	BOOL isPartialAck = NO;
+	BOOL isOpeningSyn = (packet->flags & PSEUDO_TCP_FLAG_SYN) && !(packet->flags & PSEUDO_TCP_FLAG_ACK);
 	
-	if([ackPacket acknowledgement] == lastAck)
+	if(receiverSupportsTimestamps || isOpeningSyn)
 	{
-		// This may not actually be a duplicate ack - it may simply be a window size update.
-		// It may also be a response to an empty window probe.
+		PseudoTcpPacketSetTimestamp(packet, TimestampNow(), tsRecent);
 		
-		if(([ackPacket window] > 0) && ([ackPacket window] == sendWindow))
+		if(packet->flags & PSEUDO_TCP_FLAG_ACK)
 		{
-			lastAckCount++;
-			
-			DDLogInfo(@"PseudoTcp: Duplicate Ack count: %u", (unsigned)lastAckCount);
-			
-			if(lastAckCount < 3)
-			{
-				// Todo: RFC 3042
-				
-				if(isEffectiveSelectiveAck)
-				{
-					// The ACK stayed the same, but SACK removed some data from the retransmissionQueue
-					[self maybeSendData];
-				}
-			}
-			else if(lastAckCount == 3)
+			tsLastAckSent = packet->acknowledgement;
+		}
+	}
+	
+	UInt32 headerLength = PseudoTcpPacketHeaderLength(packet);
+	UInt32 dataLength = segment ? segment->length : packet->dataLength;
+	
+	if(headerLength + dataLength > datagramBufferCapacity)
+	{
+		// This shouldn't happen, as segments are never larger than mssMax
+		datagramBufferCapacity = headerLength + dataLength;
+		datagramBuffer = reallocf(datagramBuffer, datagramBufferCapacity);
+	}
+	
+	PseudoTcpPacketEncodeHeader(packet, datagramBuffer);
+	
+	if(segment && (segment->length > 0))
+	{
+		UInt32 index = (sendBufferHead + (segment->sequence - sendSequence)) % sendBufferCapacity;
+		
+		RingBufferRead(sendBuffer, sendBufferCapacity, index, datagramBuffer + headerLength, segment->length);
+	}
+	else if(packet->data)
+	{
+		memcpy(datagramBuffer + headerLength, packet->data, dataLength);
+	}
+	
+	BOOL sentImmediately = NO;
+	[udpSocket sendBytes:datagramBuffer
+	              length:(headerLength + dataLength)
+	         withTimeout:NO_TIMEOUT
+	                 tag:0
+	     sentImmediately:&sentImmediately];
+	
+	if(sentImmediately)
+	{
+		// Update time of last packet sent/received
+		lastPacketTime = PseudoTcpMonotonicTime();
+	}
+	
+	return sentImmediately;
+}
+
+/**
+ * Utility method to handle the repetitive task of sending a packet.
+ * This method is used to send packets that don't occupy space in the retransmission queue,
+ * such as plain acks and RST packets.
+ * 
+ * Returns YES if the packet was sent immediately (see writePacket:segment:).
+**/
+- (BOOL)sendPacket:(PseudoTcpPacket *)packet
+{
+	DDLogInfo(@"PseudoTcp: SEND: flg(%d%d%d%d) seq(%010u) ack(%010u) wnd(%05u) dat(%03u)",
+			  (packet->flags & PSEUDO_TCP_FLAG_RST)  ? 1 : 0, 
+			  (packet->flags & PSEUDO_TCP_FLAG_SACK) ? 1 : 0,
+			  (packet->flags & PSEUDO_TCP_FLAG_ACK)  ? 1 : 0,
+			  (packet->flags & PSEUDO_TCP_FLAG_SYN)  ? 1 : 0,
+			  packet->sequence, packet->acknowledgement, packet->window, (unsigned)packet->dataLength);
+	
+	// Send packet
+	return [self writePacket:packet segment:NULL];
+}
+
+/**
+ * Utility method to handle the repetitive task of sending a segment from the retransmission queue
+ * for the first time, and starting a timer for it.
+**/
+- (void)sendSegment:(PseudoTcpSegment *)segment
+{
+	PseudoTcpPacket packet;
+	[self getPacket:&packet forSegment:segment];
+	
+	if(!(segment->control & kSegmentSyn))
+	{
+		[self maybeAddAck:&packet];
+	}
+	
+	DDLogInfo(@"PseudoTcp: SEND: flg(%d%d%d%d) seq(%010u) ack(%010u) wnd(%05u) dat(%03u)",
+			  (packet.flags & PSEUDO_TCP_FLAG_RST)  ? 1 : 0, 
+			  (packet.flags & PSEUDO_TCP_FLAG_SACK) ? 1 : 0,
+			  (packet.flags & PSEUDO_TCP_FLAG_ACK)  ? 1 : 0,
+			  (packet.flags & PSEUDO_TCP_FLAG_SYN)  ? 1 : 0,
+			  packet.sequence, packet.acknowledgement, packet.window, (unsigned)packet.dataLength);
+	
+	[self writePacket:&packet segment:segment];
+	
+	if(!(segment->control & (kSegmentSyn | kSegmentProbe)) && (segment->length > 0))
+	{
+		statistics.segmentsSent++;
+		statistics.bytesSent += segment->length;
+	}
+	
+	retransmissionQueueSize += segment->length;
+	retransmissionQueueEffectiveSize += segment->length;
+	
+	// Mark segment as counting towards the effective rxQ size
+	segment->control |= kSegmentRxQ;
+	
+	// Store time we sent this segment
+	segment->firstSent = PseudoTcpMonotonicTime();
+	
+	// Start the retransmissionTimer, if it's not already started
+	if(!PseudoTcpTimerIsScheduled(&retransmissionTimer))
+	{
+		[self startRetransmissionTimer];
+	}
+}
+
+/**
+ * Utility method to handle resending a segment from the retransmission queue.
+ * Returns the number of data bytes resent.
+**/
+- (UInt32)resendSegment:(PseudoTcpSegment *)segment
+{
+	// Retransmitted data segments count towards our measured loss rate, unless they've already been counted as a sack hole.
+	// Lost path mtu probes don't, since they're most likely lost due to their size rather than the path.
+	if(!(segment->control & (kSegmentSyn | kSegmentProbe | kSegmentMtuProbe | kSegmentLost)))
+	{
+		segment->control |= kSegmentLost;
+		lossSampleLost++;
+	}
+	
+	if(segment->control & kSegmentMtuProbe)
+	{
+		// Our path mtu probe was lost, and would likely be lost again if we resent it as-is.
+		// So we split it up into normal sized segments, and only resend the first one.
+		
+		UInt32 index = [self indexOfSegment:segment];
+		
+		[self mtuProbeDidFail];
+		[self splitSegmentAtIndex:index maxLength:mss];
+		
+		segment = [self segmentAtIndex:index];
+	}
+	
+	PseudoTcpPacket packet;
+	[self getPacket:&packet forSegment:segment];
+	
+	if(!(segment->control & kSegmentSyn))
+	{
+		// Maybe add ack data
+		[self maybeAddAck:&packet];
+	}
+	
+	DDLogInfo(@"PseudoTcp: RSND: flg(%d%d%d%d) seq(%010u) ack(%010u) wnd(%05u) dat(%03u)",
+			  (packet.flags & PSEUDO_TCP_FLAG_RST)  ? 1 : 0,
+			  (packet.flags & PSEUDO_TCP_FLAG_SACK) ? 1 : 0,
+			  (packet.flags & PSEUDO_TCP_FLAG_ACK)  ? 1 : 0,
+			  (packet.flags & PSEUDO_TCP_FLAG_SYN)  ? 1 : 0,
+			  packet.sequence, packet.acknowledgement, packet.window, (unsigned)packet.dataLength);
+	
+	// Mark segment as being retransmitted
+	segment->control |= kSegmentRxmit;
+	
+	// If segment wasn't part of effective rxQ size, it is now
+	if(!(segment->control & kSegmentRxQ))
+	{
+		segment->control |= kSegmentRxQ;
+		retransmissionQueueEffectiveSize += segment->length;
+	}
+	
+	// Send packet
+	[self writePacket:&packet segment:segment];
+	
+	if(!(segment->control & (kSegmentSyn | kSegmentProbe)) && (segment->length > 0))
+	{
+		statistics.segmentsRetransmitted++;
+		statistics.bytesSent += segment->length;
+		statistics.bytesRetransmitted += segment->length;
+	}
+	
+	// There's no need to add this segment to the retransmission queue, because it's already in the queue.
+	
+	// Start the retransmissionTimer, if it's not already started
+	if(!PseudoTcpTimerIsScheduled(&retransmissionTimer))
+	{
+		[self startRetransmissionTimer];
+	}
+	
+	return segment->length;
+}
+
+/**
+ * Starts (or restarts) the retransmission timer using the current RTO.
+**/
+- (void)startRetransmissionTimer
+{
+	[timerWheel scheduleTimer:&retransmissionTimer withTimeInterval:rto];
+}
+
+- (void)cleanup
+{
+	NSAssert(state == STATE_CLOSED, @"Cleanup called in improper state");
+	
+	// Empty the receive buffer
+	recvBufferOffset = 0;
+	recvBufferSize = 0;
+	recvOutOfOrderHead = 0;
+	recvOutOfOrderCount = 0;
+	
+	// Clear the ack timer to prevent any pending acks from being sent
+	[timerWheel cancelTimer:&ackTimer];
+	
+	// Empty the send buffer
+	sendBufferHead = 0;
+	sendBufferOffset = 0;
+	sendBufferSize = 0;
+	
+	// Remove all segments from the retransmissionQueue
+	retransmissionQueueHead = 0;
+	retransmissionQueueCount = 0;
+	retransmissionQueueResendIndex = 0;
+	retransmissionQueueSize = 0;
+	retransmissionQueueEffectiveSize = 0;
+	retransmissionQueueSackedCount = 0;
+	
+	// Clear the retransmission timer
+	[timerWheel cancelTimer:&retransmissionTimer];
+	
+	// Clear the persist timer
+	[timerWheel cancelTimer:&persistTimer];
+	flags &= ~kPersist;
+	
+	// Clear the keep alive timer
+	[timerWheel cancelTimer:&keepAliveTimer];
+	
+	// Clear the pacing timer
+	[timerWheel cancelTimer:&pacingTimer];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Handshake
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Processes an opening syn packet.
+ * We're either in STATE_LISTEN or STATE_SYN_RECEIVED.
+ * The latter may occur if our syn-ack gets lost, and they have to retransmit their opening syn.
+**/
+- (void)processOpeningSyn:(PseudoTcpPacket *)synPacket
+{
+	DDLogVerbose(@"PseudoTcp: processOpeningSyn: seq(%010u) ack(%010u) wnd(%05u)",
+				 synPacket->sequence, synPacket->acknowledgement, synPacket->window);
+	
+	recvSequence = synPacket->sequence + 1;
+	sendWindow   = synPacket->window;
+	
+	// Check for SACK support
+	receiverSupportsSack = (synPacket->flags & PSEUDO_TCP_FLAG_SACK);
+	DDLogVerbose(@"PseudoTcp: receiverSupportsSack: %d", receiverSupportsSack);
+	
+	// Implementations that understand options also understand sack blocks (or at least skip over them)
+	receiverSupportsSackBlocks = (synPacket->flags & PSEUDO_TCP_FLAG_OPT);
+	
+	// Check for window scale support.
+	// Window scaling is only used if both sides include the option in their SYN packets.
+	// Since we always include it, it all comes down to whether or not the remote host did.
+	if(synPacket->options & PSEUDO_TCP_HAS_WSCALE)
+	{
+		flags |= kWindowScale;
+		sendWindowScale = synPacket->windowScale;
+	}
+	else
+	{
+		sendWindowScale = 0;
+		recvWindowScale = 0;
+	}
+	DDLogVerbose(@"PseudoTcp: sendWindowScale(%u) recvWindowScale(%u)", sendWindowScale, recvWindowScale);
+	
+	// Check for the maximum segment size the remote host can receive
+	[self processMaxSegmentSize:synPacket];
+	
+	// Check for timestamp support.
+	// Timestamps are only used if both sides include the option in their SYN packets.
+	receiverSupportsTimestamps = (synPacket->options & PSEUDO_TCP_HAS_TS) ? YES : NO;
+	tsRecent = synPacket->timestampValue;
+	DDLogVerbose(@"PseudoTcp: receiverSupportsTimestamps: %d", receiverSupportsTimestamps);
+	
+	// Check whether the remote host can rebuild lost segments from our parity packets
+	receiverSupportsFec = (synPacket->options & PSEUDO_TCP_HAS_FEC) ? YES : NO;
+	DDLogVerbose(@"PseudoTcp: receiverSupportsFec: %d", receiverSupportsFec);
+	
+	// Check for multiplexing support.
+	// Streams are only multiplexed if both sides include the option in their SYN packets.
+	receiverSupportsMultiplexing = multiplexing && (synPacket->options & PSEUDO_TCP_HAS_MUX);
+	DDLogVerbose(@"PseudoTcp: receiverSupportsMultiplexing: %d", receiverSupportsMultiplexing);
+	
+	// Create and send our opening SYN-ACK segment
+	PseudoTcpSegment *segment = [self enqueueSegmentWithSequence:(sendSequence - 1)
+	                                                      length:0
+	                                                     control:(kSegmentSyn | kSegmentSynAck)];
+	
+	[self sendSegment:segment];
+	
+	// Update state
+	state = STATE_SYN_RECEIVED;
+}
+
+/**
+ * Process an opening syn-ack packet.
+ * We're either in the STATE_SYN_SENT or STATE_ESTABLISHED.
+ * The latter may occur if our final ack gets lost, and they have to retransmit their opening syn-ack.
+**/
+- (void)processOpeningSynAck:(PseudoTcpPacket *)synAckPacket
+{
+	DDLogVerbose(@"PseudoTcp: processOpeningSynAck: seq(%010u) ack(%010u) wnd(%05u)",
+				 synAckPacket->sequence, synAckPacket->acknowledgement, synAckPacket->window);
+	
+	// If this is the first time we've received the syn-ack, we can remove the syn from the retransmission queue.
+	// Since the syn-ack may be sent several times (if our ack response is lost), we should double-check everything.
+	if(retransmissionQueueCount > 0)
+	{
+		if([self segmentAtIndex:0]->control & kSegmentSyn)
+		{
+			// The ack is for our opening syn, which we can now remove from the retransmission queue
+			[self dequeueSegment];
+			
+			// And don't forget to invalidate the timer we setup for the syn packet
+			[timerWheel cancelTimer:&retransmissionTimer];
+		}
+	}
+	
+	// Extract syn data from the packet
+	recvSequence = synAckPacket->sequence + 1;
+	sendWindow   = synAckPacket->window;
+	
+	// Check for SACK support
+	receiverSupportsSack = (synAckPacket->flags & PSEUDO_TCP_FLAG_SACK);
+	DDLogVerbose(@"PseudoTcp: receiverSupportsSack: %d", receiverSupportsSack);
+	
+	// Implementations that understand options also understand sack blocks (or at least skip over them)
+	receiverSupportsSackBlocks = (synAckPacket->flags & PSEUDO_TCP_FLAG_OPT);
+	
+	// Check for window scale support.
+	// The remote host only includes the option in its SYN-ACK if it understood the option in our SYN.
+	if(synAckPacket->options & PSEUDO_TCP_HAS_WSCALE)
+	{
+		flags |= kWindowScale;
+		sendWindowScale = synAckPacket->windowScale;
+	}
+	else
+	{
+		sendWindowScale = 0;
+		recvWindowScale = 0;
+	}
+	DDLogVerbose(@"PseudoTcp: sendWindowScale(%u) recvWindowScale(%u)", sendWindowScale, recvWindowScale);
+	
+	// Check for the maximum segment size the remote host can receive
+	[self processMaxSegmentSize:synAckPacket];
+	
+	// Check for timestamp support.
+	// The remote host only includes the option in its SYN-ACK if it understood the option in our SYN.
+	receiverSupportsTimestamps = (synAckPacket->options & PSEUDO_TCP_HAS_TS) ? YES : NO;
+	tsRecent = synAckPacket->timestampValue;
+	DDLogVerbose(@"PseudoTcp: receiverSupportsTimestamps: %d", receiverSupportsTimestamps);
+	
+	// Check whether the remote host can rebuild lost segments from our parity packets
+	receiverSupportsFec = (synAckPacket->options & PSEUDO_TCP_HAS_FEC) ? YES : NO;
+	DDLogVerbose(@"PseudoTcp: receiverSupportsFec: %d", receiverSupportsFec);
+	
+	// Check for multiplexing support.
+	// The remote host only includes the option in its SYN-ACK if it understood the option in our SYN.
+	receiverSupportsMultiplexing = multiplexing && (synAckPacket->options & PSEUDO_TCP_HAS_MUX);
+	DDLogVerbose(@"PseudoTcp: receiverSupportsMultiplexing: %d", receiverSupportsMultiplexing);
+	
+	// Create and send our opening ack packet
+	PseudoTcpPacket ackPacket;
+	PseudoTcpPacketInit(&ackPacket);
+	ackPacket.acknowledgement = recvSequence;
+	ackPacket.window = [self advertisedRecvWindow];
+	ackPacket.flags |= PSEUDO_TCP_FLAG_ACK;
+	
+	[self sendPacket:&ackPacket];
+	
+	if(state != STATE_ESTABLISHED)
+	{
+		// Update state
+		state = STATE_ESTABLISHED;
+		
+		// Inform delegate that the connection is open
+		if([delegate respondsToSelector:@selector(onPseudoTcpDidOpen:)])
+		{
+			[delegate onPseudoTcpDidOpen:self];
+		}
+		
+		// If the delegate hasn't already filled the majority of the send buffer in the onPseudoTcpDidOpen method
+		if([self spaceAvailableInSendBuffer] > (sendBufferCapacity / 4))
+		{
+			// Inform delegate that we can accept data to be sent
+			if([delegate respondsToSelector:@selector(onPseudoTcpCanAcceptBytes:)])
+			{
+				[delegate onPseudoTcpCanAcceptBytes:self];
+			}
+		}
+	}
+}
+
+/**
+ * Process an opening ack packet.
+ * We should be in STATE_SYN_RECEIVED.
+**/
+- (void)processOpeningAck:(PseudoTcpPacket *)ackPacket
+{
+	DDLogVerbose(@"PseudoTcp: processOpeningAck: seq(%010u) ack(%010u) wnd(%05u)",
+				 ackPacket->sequence, ackPacket->acknowledgement, ackPacket->window);
+	
+	// Note: This method is ONLY called once.
+	
+	// The ack is for our opening syn-ack, which we can now remove from the retransmission queue
+	[self dequeueSegment];
+	
+	// And don't forget to invalidate the timer we setup for the syn-ack packet
+	[timerWheel cancelTimer:&retransmissionTimer];
+	
+	// Update state
+	state = STATE_ESTABLISHED;
+	
+	// Inform delegate that the connection is open
+	if([delegate respondsToSelector:@selector(onPseudoTcpDidOpen:)])
+	{
+		[delegate onPseudoTcpDidOpen:self];
+	}
+	
+	// If the delegate hasn't already filled the majority of the send buffer in the onPseudoTcpDidOpen method
+	if([self spaceAvailableInSendBuffer] > (sendBufferCapacity / 4))
+	{
+		// Inform delegate that we can accept data to be sent
+		if([delegate respondsToSelector:@selector(onPseudoTcpCanAcceptBytes:)])
+		{
+			[delegate onPseudoTcpCanAcceptBytes:self];
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark ACK
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Process an ack packet for data we've sent.
+ * We should be in STATE_ESTABLISHED.
+ *
+ * The paacket may or may not include data, but the data isn't processed by this method.
+ * Only the ack part is processed in this method.
+**/
+- (void)processDataAck:(PseudoTcpPacket *)ackPacket
+{
+	if(![self isAckWithinRetransmissionQueue:ackPacket->acknowledgement])
+	{
+		// The ack doesn't apply to any packets in our retransmissionQueue.
+		// It must be an old ack.
+		// We can ignore it, as it doesn't affect anything.
+		return;
+	}
+	
+	// The window advertised by the remote host is scaled by its window scale
+	UInt32 ackWindow = (UInt32)ackPacket->window << sendWindowScale;
+	
+	// Check to see if packet contains selective acks.
+	// If so, mark the indicated segments in the retransmission queue as sacked.
+	// The segments remain in the queue (and their data in the send buffer) until they're cumulatively acknowledged,
+	// but no longer count towards the size of the retransmission queue, and will not be retransmitted.
+	
+	BOOL isEffectiveSelectiveAck = NO;
+	
+	if(ackPacket->sackBlockCount > 0)
+	{
+		isEffectiveSelectiveAck = [self processSackBlocks:ackPacket];
+	}
+	else if(ackPacket->flags & PSEUDO_TCP_FLAG_SACK)
+	{
+		PseudoTcpSegment *segment = [self segmentWithSequence:ackPacket->sackSequence];
+		
+		if(segment && !(segment->control & kSegmentSacked))
+		{
+			DDLogInfo(@"PseudoTcp: Received SACK %u", ackPacket->sackSequence);
+			
+			isEffectiveSelectiveAck = [self markSegmentSacked:segment];
+		}
+	}
+	
+	if(retransmissionQueueSackedCount > 0)
+	{
+		[self countSackHoles];
+	}
+	
+	// Check to see if this is a duplicate ack.
+	// In the event of duplicate acks we may need to perform fast retransmit or fast recovery.
+	// 
+	// A duplicate ACK is a packet with the ACK bit set which acknowledges a previously acknowledged packet, AND
+	// and is not simply a window update (changes the receiver's advertised window).
+	// This method would not have been called if the ACK bit was not set.
+	
+	BOOL windowUpdateOnly = NO;
+	BOOL isPartialAck = NO;
+	
+	if(ackPacket->acknowledgement == lastAck)
+	{
+		// This may not actually be a duplicate ack - it may simply be a window size update.
+		// It may also be a response to an empty window probe.
+		
+		if((ackWindow > 0) && (ackWindow == sendWindow))
+		{
+			lastAckCount++;
+			
+			// RFC 6675:
+			// With sack blocks, we don't have to wait for the third duplicate ack if the scoreboard already shows
+			// that enough segments have arrived after the first unacknowledged segment for it to be considered lost.
+			if((lastAckCount < 3) && receiverSupportsSackBlocks && (retransmissionQueueSackedCount >= DUP_THRESH))
+			{
+				lastAckCount = 3;
+			}
+			
+			DDLogInfo(@"PseudoTcp: Duplicate Ack count: %u", (unsigned)lastAckCount);
+			
+			if(lastAckCount < 3)
+			{
+				// Todo: RFC 3042
+				
+				if(isEffectiveSelectiveAck)
+				{
+					// The ACK stayed the same, but SACK removed some data from the retransmissionQueue
+					[self maybeSendData];
+				}
+			}
+			else if(lastAckCount == 3)
 			{
 				DDLogInfo(@"PseudoTcp: Fast Retransmit");
 				
-				// When the third duplicate ACK in a row is received, decrease ssthresh according to RFC 2581.
+				// When the third duplicate ACK in a row is received, inform the congestion controller,
+				// which decreases the congestion window (ssthresh in RFC 2581 terms).
 				// Retransmit the missing segment.
-				// Set cwnd to ssthresh plus 3 times the segment size. This inflates the congestion window
-				// by the number of segments that have left the network and which the other end has cached.
+				// Inflate the congestion window by 3 times the segment size. This accounts for the number
+				// of segments that have left the network and which the other end has cached.
+				// 
+				// If the lost segment is our path mtu probe, it was most likely dropped for being too big,
+				// rather than due to congestion. So we leave the congestion window where it is (RFC 4821).
 				
-				ssthresh = MAX((retransmissionQueueEffectiveSize / 2), (2 * DEFAULT_MTU));
+				PseudoTcpSegment *lostSegment = [self segmentWithSequence:lastAck];
 				
-				[self resendPacketWithSequence:lastAck];
+				if(!lostSegment || !(lostSegment->control & kSegmentMtuProbe))
+				{
+					[congestionControl onLossWithBytesInFlight:retransmissionQueueEffectiveSize];
+				}
 				
-				cwnd = ssthresh + (3 * DEFAULT_MTU);
+				[self resendSegmentWithSequence:lastAck];
+				
+				if(receiverSupportsSackBlocks)
+				{
+					// RFC 6675:
+					// The sacked segments have already been taken out of the effective size of the
+					// retransmission queue, so there's no need to inflate the congestion window.
+					cwndInflation = 0;
+				}
+				else
+				{
+					cwndInflation = 3 * mss;
+				}
 				
 				// New Reno (RFC 3782):
 				// In addition, record the highest sequence number transmitted in the recover variable.
 				[self setRecover];
 				
-				if(isEffectiveSelectiveAck)
+				if(receiverSupportsSackBlocks)
+				{
+					// Retransmit any other holes in the scoreboard, as the congestion window allows
+					[self markLostSegments];
+					[self maybeSendData];
+				}
+				else if(isEffectiveSelectiveAck)
 				{
 					// The ACK stayed the same, but SACK removed some data from the retransmissionQueue
 					[self maybeSendData];
@@ -1204,12 +2280,25 @@ enum PseudoTcpFlags
 			{
 				DDLogInfo(@"PseudoTcp: Fast Recovery");
 				
-				// Each time another duplicate ACK arrives, increment cwnd by the segment size.
-				// This inflates the congestion window for the additional segment that has left the network.
-				// Transmit a packet, if allowed by the new value of cwnd.
-				
-				cwnd += DEFAULT_MTU;
+				if(receiverSupportsSackBlocks)
+				{
+					// The newly sacked segments have already left the effective size of the retransmission queue.
+					// Check to see if they reveal any more lost segments.
+					
+					if(isEffectiveSelectiveAck)
+					{
+						[self markLostSegments];
+					}
+				}
+				else
+				{
+					// Each time another duplicate ACK arrives, increment cwnd by the segment size.
+					// This inflates the congestion window for the additional segment that has left the network.
+					
+					cwndInflation += mss;
+				}
 				
+				// Transmit a packet, if allowed by the new value of cwnd.
 				[self maybeSendData];
 			}
 			
@@ -1227,7 +2316,7 @@ enum PseudoTcpFlags
 		{
 			// As per new reno, check for full or partial acknowledegment
 			
-			if([self isFullAck:[ackPacket acknowledgement]])
+			if([self isFullAck:ackPacket->acknowledgement])
 			{
 				DDLogInfo(@"PseudoTcp: Full ACK - Exiting Fast Recovery");
 				
@@ -1236,11 +2325,12 @@ enum PseudoTcpFlags
 				// Set cwnd to ssthresh (the value set in step 1).
 				// This is termed "deflating" the window.
 				
-				cwnd = ssthresh;
+				cwndInflation = 0;
+				[congestionControl onRecoveryComplete];
 				
 				// Exit fast recovery
 				[self unsetRecover];
-				lastAck = [ackPacket acknowledgement];
+				lastAck = ackPacket->acknowledgement;
 				lastAckCount = 0;
 			}
 			else
@@ -1251,9 +2341,15 @@ enum PseudoTcpFlags
 				// Deflate the congestion window by the amount of new data ackowledged by the ACK.
 				// Do not exit fast recovery.
 				// If any duplicate ACKs subsequently arrive, continue fast recovery procedure.
+				// 
+				// With sack blocks, the scoreboard tells us which segments to retransmit instead.
 				
-				lastAck = [ackPacket acknowledgement];
-				[self resendPacketWithSequence:lastAck];
+				lastAck = ackPacket->acknowledgement;
+				
+				if(!receiverSupportsSackBlocks)
+				{
+					[self resendSegmentWithSequence:lastAck];
+				}
 				
 				// Notice that we do not reset lastAckCount.
 				// This means that further duplicate ACKs will follow fast recovery above.
@@ -1264,7 +2360,7 @@ enum PseudoTcpFlags
 		}
 		else
 		{
-			lastAck = [ackPacket acknowledgement];
+			lastAck = ackPacket->acknowledgement;
 			lastAckCount = 0;
 		}
 	}
@@ -1274,56 +2370,59 @@ enum PseudoTcpFlags
 		// If the window update was a response to an empty window probe,
 		// and the window size is still zero, then update the packet to prevent a timeout.
 		
-		if([ackPacket window] == 0)
+		if(ackWindow == 0)
 		{
-			PseudoTcpPacket *packet = [retransmissionQueue count] > 0 ? [retransmissionQueue objectAtIndex:0] : nil;
+			PseudoTcpSegment *segment = retransmissionQueueCount > 0 ? [self segmentAtIndex:0] : NULL;
 			
-			if([packet isEmptyWindowProbe])
+			if(segment && (segment->control & kSegmentProbe))
 			{
 				DDLogVerbose(@"PseudoTcp: Receiving empty window probe ack - window is still empty");
-				[packet setFirstSent:[NSDate date]];
+				segment->firstSent = PseudoTcpMonotonicTime();
 			}
 		}
 	}
 	else
 	{
-		// Remove all packets from the retransmission queue which are acknowledged by this packet.
+		// Remove all segments from the retransmission queue which are acknowledged by this packet.
 		// 
-		// Also, we need to make a note if any of the acknowledged packets were retransmitted,
-		// because ack's for retransmitted packets are not to be used in updating the RTO.
+		// Also, we need to make a note if any of the acknowledged segments were retransmitted,
+		// because ack's for retransmitted segments are not to be used in updating the RTO.
 		// 
-		// And we also need to know the sent time of the oldest packet being acknowledged.
-		// Since packets are stored in the retransmission queue accorinding to sequence number,
-		// this will be the sent time of the first ack'd packet.
+		// And we also need to know the sent time of the oldest segment being acknowledged.
+		// Since segments are stored in the retransmission queue accorinding to sequence number,
+		// this will be the sent time of the first ack'd segment.
 		
 		uint numAckedPackets = 0;
 		uint numAckedData = 0;
 		BOOL wasRetransmitted = NO;
-		NSDate *sentTime = nil;
+		UInt64 sentTime = 0;
 		
-		while([retransmissionQueue count] > 0)
+		while(retransmissionQueueCount > 0)
 		{
-			PseudoTcpPacket *packet = [retransmissionQueue objectAtIndex:0];
+			PseudoTcpSegment *segment = [self segmentAtIndex:0];
 			
-			if([self doesAck:[ackPacket acknowledgement] absolvePacket:packet])
+			if([self doesAck:ackPacket->acknowledgement absolveSegment:segment])
 			{
+				if(numAckedPackets == 0)
+				{
+					sentTime = segment->firstSent;
+				}
+				
 				numAckedPackets++;
-				numAckedData += [[packet data] length];
-				wasRetransmitted = wasRetransmitted || [packet wasRetransmitted];
+				wasRetransmitted = wasRetransmitted || (segment->control & kSegmentRxmit);
 				
-				if(sentTime == nil)
+				if(segment->control & kSegmentMtuProbe)
 				{
-					// We need to retain the sentTime or else it will get released when we release the packet
-					sentTime = [[[packet firstSent] retain] autorelease];
+					[self mtuProbeDidSucceed:segment->length];
 				}
 				
-				if([packet isRxQ])
+				if(!(segment->control & kSegmentSacked))
 				{
-					retransmissionQueueEffectiveSize -= (UInt32)[[packet data] length];
+					// Sacked data was already accounted for when the sack arrived
+					numAckedData += segment->length;
 				}
 				
-				retransmissionQueueSize -= (UInt32)[[packet data] length];
-				[retransmissionQueue removeObjectAtIndex:0];
+				[self dequeueSegment];
 			}
 			else
 			{
@@ -1340,9 +2439,33 @@ enum PseudoTcpFlags
 			return;
 		}
 		
+		// New data was acknowledged, so the path is clearly still working
+		consecutiveTimeouts = 0;
+		
 		// Update RTO and related variables
 		
-		if(wasRetransmitted)
+		if(receiverSupportsTimestamps && (ackPacket->options & PSEUDO_TCP_HAS_TS))
+		{
+			// From RFC 7323:
+			// The echoed timestamp identifies the exact transmission that triggered the ack.
+			// So every ack for new data yields a valid sample, even if segments were retransmitted.
+			// There's no need for Karn's algorithm.
+			
+			NSTimeInterval rtt = (double)(TimestampNow() - ackPacket->timestampEcho) / 1000.0;
+			
+			// The timestamp clock only ticks once per millisecond
+			[self processRttSample:MAX(rtt, 0.001)];
+			
+			if(checkSpuriousTimeout)
+			{
+				if([self detectSpuriousTimeout:ackPacket])
+				{
+					[self undoSpuriousTimeout];
+				}
+				checkSpuriousTimeout = NO;
+			}
+		}
+		else if(wasRetransmitted)
 		{
 			// A TCP implementation may clear SRTT and RTTVAR after backing off the timer multiple times as
 			// it is unlikely that the current SRTT and RTTVAR are bogus in this situation.
@@ -1351,60 +2474,7 @@ enum PseudoTcpFlags
 		}
 		else
 		{
-			NSTimeInterval rtt = [sentTime timeIntervalSinceNow] * -1.0;
-			
-			// Check for a valid rtt time
-			if((rtt > 0.0) && (rtt <= 60.0))
-			{
-				// Update RTT related variables according to RFC 2988
-				
-				if(srtt == 0.0)
-				{
-					// This is the first RTT measurement that has been made,
-					// or the first that has been made since a retransmission reset the values of srtt and rttvar.
-					srtt = rtt;
-					rttvar = srtt / 2.0;
-				}
-				else
-				{
-					// These are the suggested values of alpha and beta, as per RFC 2988
-					double alpha = 1.0 / 8.0;
-					double beta  = 1.0 / 4.0;
-					
-					rttvar = (1.0 - beta) * rttvar + beta * fabs(srtt - rtt);
-					srtt = (1.0 - alpha) * srtt + alpha * rtt;
-				}
-				
-				// G = clock granularity -> how precise our timer is.
-				// According to the NSTimer documentation: the effective resolution of
-				// the time interval for an NSTimer is limited to on the order of 50-100 milliseconds.
-				// In practice, I would say it's actually more like 1-8 milliseconds.
-				double G = 0.05;
-				
-				// I don't know WTF K is supposed to be, but I'm told its value is simply 4
-				double K = 4.0;
-				
-				rto = srtt + MAX(G, K*rttvar);
-				
-				// From RFC 2988:
-				// Whenever RTO is computed, if it is less than 1 second then the RTO SHOULD be rounded up to 1 second
-				if(rto < 1.0 )
-				{
-					rto = 1.0;
-				}
-				
-				DDLogVerbose(@"rtt(%1.3f) srtt(%1.3f) rttvar(%1.3f) rto(%1.3f)", rtt, srtt, rttvar, rto);
-			}
-			else
-			{
-				// The RTT doesn't appear to be valid...
-				// Maybe the user changed the clock, changed time zones, or daylight savings time kicked in.
-				// Whatever the case, we obviously can't use this tainted RTT to update the RTO.
-				
-				// How did we come up with the 60 seconds limit?
-				// We use a maximum RTO of 60 seconds, so anything over 60 seconds would have been retransmitted.
-				// But we've already checked to make sure none of the ack'd packets were retransmitted.
-			}
+			[self processRttSample:SecondsSince(sentTime)];
 		}
 		
 		// Stop or restart the retransmission timer.
@@ -1417,15 +2487,7 @@ enum PseudoTcpFlags
 			
 			if([self isFirstPartialAck])
 			{
-				[retransmissionTimer invalidate];
-				[retransmissionTimer release];
-				
-				retransmissionTimer = [[NSTimer timerWithTimeInterval:rto
-															   target:self
-															 selector:@selector(doTimeout:)
-															 userInfo:nil
-															  repeats:NO] retain];
-				[self runLoopAddTimer:retransmissionTimer];
+				[self startRetransmissionTimer];
 			}
 		}
 		else
@@ -1433,89 +2495,59 @@ enum PseudoTcpFlags
 			if(retransmissionQueueSize > 0)
 			{
 				// When an ACK is received that acknowledges new data, restart the retransmission timer.
-				[retransmissionTimer invalidate];
-				[retransmissionTimer release];
-				
-				retransmissionTimer = [[NSTimer timerWithTimeInterval:rto
-															   target:self
-															 selector:@selector(doTimeout:)
-															 userInfo:nil
-															  repeats:NO] retain];
-				[self runLoopAddTimer:retransmissionTimer];
+				[self startRetransmissionTimer];
 			}
 			else
 			{
 				// When all outstanding data has been acknowledged, turn off the retransmission timer.
-				[retransmissionTimer invalidate];
-				[retransmissionTimer release];
-				retransmissionTimer = nil;
+				[timerWheel cancelTimer:&retransmissionTimer];
 			}
 		}
 		
 		// Update congestion window
 		
-		if(isPartialAck)
+		if(isPartialAck && receiverSupportsSackBlocks)
+		{
+			// From RFC 6675:
+			// The congestion window isn't inflated during sack based recovery, so there's nothing to deflate.
+			// Instead we check the updated scoreboard for lost segments, which will be resent below.
+			
+			[self markLostSegments];
+		}
+		else if(isPartialAck)
 		{
 			// From RFC 3782:
 			// Deflate the congestion window by the amount of new data acknowledged.
 			// If the partial ack acknowledges at least one SMSS of new data, then add back SMSS bytes to cwnd.
 			
-			// Note: cwnd should theoretically always be greater than numAckedData
+			// The congestion controller isn't involved here, as only the inflation is deflated.
 			
-			if(cwnd > numAckedData)
-			{
-				cwnd -= numAckedData;
-			}
-			if(numAckedData >= DEFAULT_MTU)
+			if(cwndInflation > numAckedData)
+				cwndInflation -= numAckedData;
+			else
+				cwndInflation = 0;
+			
+			if(numAckedData >= mss)
 			{
-				cwnd += DEFAULT_MTU;
+				cwndInflation += mss;
 			}
 		}
 		else
 		{
-			// From RFC 2581:
-			// The slow start algorithm is used when cwnd < ssthresh, while
-			// the congestion avoidance algorithm is used when cwnd > ssthresh.
-			// When cwnd and ssthresh are equal the sender may use either slow start or congestion avoidance.
+			// Let the congestion controller grow the window (slow start, congestion avoidance, etc)
 			
-			if(cwnd <= ssthresh)
-			{
-				// We're in slow start
-				
-				if(cwnd < UINT32_MAX - DEFAULT_MTU)
-				{
-					cwnd += DEFAULT_MTU;
-				}
-				
-				DDLogVerbose(@"slow start: cwnd(%05u)", cwnd);
-			}
-			else
-			{
-				// We're in congestion avoidance
-				// 
-				// Note: Since integer arithmetic is used, the congestion avoidance formula for incrementing cwnd can
-				// fail when the congestion window is very large (larger than SMSS * SMSS). If the formula yields an
-				// increase of 0, the result SHOULD be rounded up to an increase of 1 byte.
-				
-				if(cwnd < UINT32_MAX - 1)
-				{
-					cwnd += MAX(1, DEFAULT_MTU * DEFAULT_MTU / cwnd);
-				}
-				
-				DDLogVerbose(@"congestion avoidance: cwnd(%05u)", cwnd);
-			}
+			[congestionControl onAck:numAckedData bytesInFlight:retransmissionQueueEffectiveSize];
 		}
 	}
 	
 	// Update sliding window variables
-	sendWindow = [ackPacket window];
+	sendWindow = ackWindow;
 	
-	if((persistTimer != nil) && (sendWindow > 0))
+	if((flags & kPersist) && (sendWindow > 0))
 	{
 		// We're done sending empty window probes
-		[persistTimer invalidate];
-		[persistTimer release];
-		persistTimer = nil;
+		[timerWheel cancelTimer:&persistTimer];
+		flags &= ~kPersist;
 	}
 	
 	if(flags & kForbidWrites)
@@ -1530,7 +2562,7 @@ enum PseudoTcpFlags
 	{
 		// We may want to inform the delegate that we can accept more data to be sent.
 		// However, we don't want to inform them after every ack, so we wait until we can accept larger data chunks.
-		if([self spaceAvailableInSendBuffer] > (SEND_BUFFER_SIZE / 4))
+		if([self spaceAvailableInSendBuffer] > (sendBufferCapacity / 4))
 		{
 			if([delegate respondsToSelector:@selector(onPseudoTcpCanAcceptBytes:)])
 			{
@@ -1544,6 +2576,136 @@ enum PseudoTcpFlags
 	}
 }
 
+/**
+ * Updates the RTO and related variables with a new round trip time measurement.
+**/
+- (void)processRttSample:(NSTimeInterval)rtt
+{
+	// Check for a valid rtt time
+	if((rtt > 0.0) && (rtt <= 60.0))
+	{
+		// Update RTT related variables according to RFC 2988
+		
+		if(srtt == 0.0)
+		{
+			// This is the first RTT measurement that has been made,
+			// or the first that has been made since a retransmission reset the values of srtt and rttvar.
+			srtt = rtt;
+			rttvar = srtt / 2.0;
+		}
+		else
+		{
+			// These are the suggested values of alpha and beta, as per RFC 2988
+			double alpha = 1.0 / 8.0;
+			double beta  = 1.0 / 4.0;
+			
+			rttvar = (1.0 - beta) * rttvar + beta * fabs(srtt - rtt);
+			srtt = (1.0 - alpha) * srtt + alpha * rtt;
+		}
+		
+		[congestionControl onRttSample:rtt];
+		
+		// G = clock granularity -> how precise our timer is.
+		// Our timers are driven by the PseudoTcpTimerWheel, which has a resolution of 10 milliseconds,
+		// and is in turn driven by an NSTimer, whose resolution is on the order of 1-8 milliseconds.
+		// We leave some extra slack for delayed acks and processing on the remote end.
+		double G = 0.05;
+		
+		// I don't know WTF K is supposed to be, but I'm told its value is simply 4
+		double K = 4.0;
+		
+		rto = srtt + MAX(G, K*rttvar);
+		
+		// From RFC 2988:
+		// Whenever RTO is computed, if it is less than 1 second then the RTO SHOULD be rounded up to 1 second
+		if(rto < 1.0 )
+		{
+			rto = 1.0;
+		}
+		
+		DDLogVerbose(@"rtt(%1.3f) srtt(%1.3f) rttvar(%1.3f) rto(%1.3f)", rtt, srtt, rttvar, rto);
+	}
+	else
+	{
+		// The RTT doesn't appear to be valid...
+		// Maybe the user changed the clock, changed time zones, or daylight savings time kicked in.
+		// Whatever the case, we obviously can't use this tainted RTT to update the RTO.
+		
+		// How did we come up with the 60 seconds limit?
+		// We use a maximum RTO of 60 seconds, so anything over 60 seconds would have been retransmitted.
+		// Without timestamps, we only take samples from segments that weren't retransmitted.
+		// With timestamps, the echoed timestamp is from the transmission that was acknowledged.
+	}
+}
+
+/**
+ * Updates the timestamp we echo back to the remote host.
+**/
+- (void)processTimestamp:(PseudoTcpPacket *)packet
+{
+	if(!receiverSupportsTimestamps) return;
+	
+	// From RFC 7323:
+	// We echo the timestamp of the earliest segment we haven't acknowledged yet.
+	// So we only pick up the timestamp of a segment starting at or before the last acknowledgement we sent.
+	// This way a delayed ack echoes the timestamp of the first segment it acknowledges,
+	// and the remote host's rtt measurement includes the delay.
+	// 
+	// Pure acks don't carry a meaningful sequence number, so only segments with data are considered.
+	// Note: The comparisons use signed differences in order to handle wrapping.
+	
+	if(packet->dataLength == 0) return;
+	
+	if(((SInt32)(packet->timestampValue - tsRecent) >= 0) && ((SInt32)(packet->sequence - tsLastAckSent) <= 0))
+	{
+		tsRecent = packet->timestampValue;
+	}
+}
+
+/**
+ * Called with the first ack for new data following a retransmission timeout.
+ * Returns YES if the timeout was spurious.
+**/
+- (BOOL)detectSpuriousTimeout:(PseudoTcpPacket *)ackPacket
+{
+	// From RFC 3522 (Eifel detection):
+	// If the ack echoes a timestamp from before our retransmission,
+	// then it was triggered by the original transmission, which therefore wasn't lost after all.
+	// The retransmission timer simply expired because of a sudden delay on the path.
+	
+	return ((SInt32)(ackPacket->timestampEcho - retransmitTimestamp) < 0);
+}
+
+/**
+ * Reverses the effects of a spurious retransmission timeout.
+**/
+- (void)undoSpuriousTimeout
+{
+	DDLogInfo(@"PseudoTcp: Spurious timeout - restoring congestion window");
+	
+	// Restore the congestion window, so we don't needlessly crawl through slow start again
+	[congestionControl onSpuriousTimeout];
+	cwndInflation = 0;
+	
+	// When the timer expired, everything in the retransmission queue was marked as needing to be resent.
+	// Since the original transmissions are still in flight, we don't resend them (no go-back-N).
+	
+	UInt32 i;
+	for(i = 0; i < retransmissionQueueCount; i++)
+	{
+		PseudoTcpSegment *segment = [self segmentAtIndex:i];
+		
+		if(!(segment->control & (kSegmentRxQ | kSegmentSacked)))
+		{
+			segment->control |= kSegmentRxQ;
+			retransmissionQueueEffectiveSize += segment->length;
+		}
+	}
+	
+	retransmissionQueueResendIndex = retransmissionQueueCount;
+	consecutiveTimeouts = 0;
+}
+
 /**
  * Checks to see if the given ack fits within our retransmission queue.
  * That is, that the ack is between sendUnacknowledged and sendNext.
@@ -1555,81 +2717,278 @@ enum PseudoTcpFlags
 	
 	// Always be weary of wrapping sequence numbers...
 	
-	if(sendUnacknowledged <= sendNext)
+	if(sendUnacknowledged <= sendNext)
+	{
+		return ((ack >= sendUnacknowledged) && (ack <= sendNext));
+	}
+	else
+	{
+		return ((ack >= sendUnacknowledged) || (ack <= sendNext));
+	}
+}
+
+/**
+ * Utility method to compare acks and sequence numbers.
+ * Use this method instead of a simple integer comparison because this method properly handles wrapping.
+ * 
+ * This method is not designed to work with syn segments.
+**/
+- (BOOL)doesAck:(UInt32)ack absolveSegment:(PseudoTcpSegment *)segment
+{
+	UInt32 sendUnacknowledged = [self sendUnacknowledged];
+	UInt32 sendNext = [self sendNext];
+	
+	UInt32 endSeq = segment->sequence + segment->length;
+	
+	// Note: sendUnacknowledged points to the sequence number of the oldest byte sent but yet un-ack'd.
+	// Note: sendNext points to the sequence number of the next byte of data to send.
+	
+	// Always be weary of wrapping sequence numbers...
+	
+	if(sendUnacknowledged <= sendNext)
+	{
+		if((ack >= sendUnacknowledged) && (ack <= sendNext))
+		{
+			// The send window hasn't wrapped, so the packet is absolved only if it also hasn't wrapped
+			// and is still less than or equal to the ack.
+			
+			if(endSeq >= sendUnacknowledged)
+				return endSeq <= ack;
+			
+			return NO;
+		}
+		else
+		{
+			// This is a delayed ack that doesn't apply to any unacknowledged data
+			return NO;
+		}
+	}
+	else
+	{
+		// The send window has wrapped, so we'll need to take this into consideration
+		
+		if(ack >= sendUnacknowledged)
+		{
+			// The ack itself hasn't wrapped, so the packet is absolved only if it also hasn't wrapped
+			// and is still less than or equal to the ack.
+			
+			if(endSeq >= sendUnacknowledged)
+				return endSeq <= ack;
+			
+			return NO;
+		}
+		else if(ack <= sendNext)
+		{
+			// The ack has wrapped, so the packet is absolved only if it hasn't wrapped,
+			// or if it has wrapped and is still less than or equal to the ack.
+			
+			if(endSeq >= sendUnacknowledged)
+				return YES;
+			else
+				return endSeq <= ack;
+		}
+		else
+		{
+			// This is a delayed ack that doesn't apply to any unacknowledged data
+			return NO;
+		}
+	}
+}
+
+/**
+ * Marks the given segment as having been selectively acknowledged.
+ * Returns YES if the segment was counted as being in flight (part of the effective retransmission queue size).
+**/
+- (BOOL)markSegmentSacked:(PseudoTcpSegment *)segment
+{
+	BOOL wasInFlight = (segment->control & kSegmentRxQ) ? YES : NO;
+	
+	if(wasInFlight)
+	{
+		retransmissionQueueEffectiveSize -= segment->length;
+	}
+	retransmissionQueueSize -= segment->length;
+	
+	segment->control |= kSegmentSacked;
+	segment->control &= ~kSegmentRxQ;
+	
+	retransmissionQueueSackedCount++;
+	
+	if(segment->control & kSegmentMtuProbe)
+	{
+		segment->control &= ~kSegmentMtuProbe;
+		[self mtuProbeDidSucceed:segment->length];
+	}
+	
+	return wasInFlight;
+}
+
+/**
+ * Marks every segment covered by the sack blocks of the given packet as sacked.
+ * Returns YES if any segment was newly sacked.
+**/
+- (BOOL)processSackBlocks:(PseudoTcpPacket *)ackPacket
+{
+	if(retransmissionQueueCount == 0) return NO;
+	
+	// We compare offsets from the first segment, so we don't have to worry about wrapping sequence numbers
+	
+	UInt32 firstSequence = [self segmentAtIndex:0]->sequence;
+	UInt32 queueLength = [self sendNext] - firstSequence;
+	
+	BOOL result = NO;
+	
+	UInt32 i;
+	for(i = 0; i < ackPacket->sackBlockCount; i++)
+	{
+		UInt32 leftEdge = ackPacket->sackBlocks[(i * 2)];
+		UInt32 rightEdge = ackPacket->sackBlocks[(i * 2) + 1];
+		
+		UInt32 leftOffset = leftEdge - firstSequence;
+		UInt32 rightOffset = rightEdge - firstSequence;
+		
+		if((leftOffset >= rightOffset) || (rightOffset > queueLength))
+		{
+			// The block is either invalid, or refers to data that has already been cumulatively acknowledged
+			continue;
+		}
+		
+		DDLogInfo(@"PseudoTcp: Received SACK block %u-%u", leftEdge, rightEdge);
+		
+		UInt32 index = [self indexOfFirstSegmentAtOrAfterSequence:leftEdge];
+		
+		while(index < retransmissionQueueCount)
+		{
+			PseudoTcpSegment *segment = [self segmentAtIndex:index];
+			
+			if((segment->sequence - firstSequence) + segment->length > rightOffset)
+			{
+				break;
+			}
+			
+			if(!(segment->control & kSegmentSacked))
+			{
+				[self markSegmentSacked:segment];
+				result = YES;
+			}
+			
+			index++;
+		}
+	}
+	
+	return result;
+}
+
+/**
+ * Implements the IsLost() check of RFC 6675 against the scoreboard.
+ * 
+ * Any segment still in flight with at least DUP_THRESH sacked segments above it is considered lost,
+ * and is taken out of the effective size of the retransmission queue so that maybeSendData will resend it.
+ * Segments that have already been retransmitted are left alone, and are recovered by the retransmission timer.
+**/
+- (void)markLostSegments
+{
+	if(retransmissionQueueSackedCount < DUP_THRESH) return;
+	
+	UInt32 sackedAbove = 0;
+	UInt32 firstLostIndex = retransmissionQueueCount;
+	
+	UInt32 i = retransmissionQueueCount;
+	while(i > 0)
+	{
+		i--;
+		PseudoTcpSegment *segment = [self segmentAtIndex:i];
+		
+		if(segment->control & kSegmentSacked)
+		{
+			sackedAbove++;
+		}
+		else if((sackedAbove >= DUP_THRESH) &&
+		        (segment->control & kSegmentRxQ) && !(segment->control & kSegmentRxmit))
+		{
+			segment->control &= ~kSegmentRxQ;
+			retransmissionQueueEffectiveSize -= segment->length;
+			
+			firstLostIndex = i;
+		}
+	}
+	
+	if(firstLostIndex < retransmissionQueueResendIndex)
+	{
+		retransmissionQueueResendIndex = firstLostIndex;
+	}
+}
+
+/**
+ * Counts the holes in the scoreboard towards our measured loss rate.
+ * 
+ * Every segment below a sacked one that hasn't itself been sacked was (most likely) lost on the path.
+ * We count these whether or not they end up being retransmitted. The remote host may rebuild them from
+ * our parity packets, and if we only counted retransmissions, the loss rate would drop as soon as
+ * forward error correction started working, and it would be turned straight back off again.
+**/
+- (void)countSackHoles
+{
+	// Find the highest sacked segment. Everything below it that hasn't been sacked is a hole.
+	
+	UInt32 i = retransmissionQueueCount;
+	while((i > 0) && !([self segmentAtIndex:(i - 1)]->control & kSegmentSacked))
 	{
-		return ((ack >= sendUnacknowledged) && (ack <= sendNext));
+		i--;
 	}
-	else
+	
+	while(i > 0)
 	{
-		return ((ack >= sendUnacknowledged) || (ack <= sendNext));
+		i--;
+		PseudoTcpSegment *segment = [self segmentAtIndex:i];
+		
+		if(!(segment->control & (kSegmentSacked | kSegmentLost | kSegmentSyn | kSegmentProbe | kSegmentMtuProbe)))
+		{
+			segment->control |= kSegmentLost;
+			lossSampleLost++;
+		}
 	}
 }
 
 /**
- * Utility method to compare acks and sequence numbers.
- * Use this method instead of a simple integer comparison because this method properly handles wrapping.
+ * Adds sack blocks describing our out-of-order data to the given packet,
+ * if we have any, and the remote host supports them.
  * 
- * This method is not designed to work with syn packets.
+ * As per RFC 2018, the first block contains the most recently received segment, given by the sequence number.
+ * The remaining blocks are filled with the ranges closest to the expected sequence number,
+ * as these are the ones the remote host is most likely to need to hear about.
 **/
-- (BOOL)doesAck:(UInt32)ack absolvePacket:(PseudoTcpPacket *)packet
+- (void)maybeAddSackBlocks:(PseudoTcpPacket *)packet mostRecent:(UInt32)sequence
 {
-	UInt32 sendUnacknowledged = [self sendUnacknowledged];
-	UInt32 sendNext = [self sendNext];
-	
-	UInt32 endSeq = [packet sequence] + (UInt32)[[packet data] length];
-	
-	// Note: sendUnacknowledged points to the sequence number of the oldest byte sent but yet un-ack'd.
-	// Note: sendNext points to the sequence number of the next byte of data to send.
+	if(!receiverSupportsSackBlocks || (recvOutOfOrderCount == 0)) return;
 	
-	// Always be weary of wrapping sequence numbers...
+	UInt32 expectedSequence = [self expectedSequence];
+	UInt32 recentOffset = sequence - expectedSequence;
+	UInt32 recentIndex = [self indexOfFirstOutOfOrderRangeEndingAtOrAfterOffset:(recentOffset + 1)];
 	
-	if(sendUnacknowledged <= sendNext)
+	if(recentIndex < recvOutOfOrderCount)
 	{
-		if((ack >= sendUnacknowledged) && (ack <= sendNext))
+		PseudoTcpRange *range = [self outOfOrderRangeAtIndex:recentIndex];
+		
+		if((range->sequence - expectedSequence) <= recentOffset)
 		{
-			// The send window hasn't wrapped, so the packet is absolved only if it also hasn't wrapped
-			// and is still less than or equal to the ack.
-			
-			if(endSeq >= sendUnacknowledged)
-				return endSeq <= ack;
-			
-			return NO;
+			PseudoTcpPacketAddSackBlock(packet, range->sequence, (range->sequence + range->length));
 		}
 		else
 		{
-			// This is a delayed ack that doesn't apply to any unacknowledged data
-			return NO;
+			recentIndex = recvOutOfOrderCount;
 		}
 	}
-	else
+	
+	UInt32 i;
+	for(i = 0; i < recvOutOfOrderCount; i++)
 	{
-		// The send window has wrapped, so we'll need to take this into consideration
+		if(i == recentIndex) continue;
 		
-		if(ack >= sendUnacknowledged)
-		{
-			// The ack itself hasn't wrapped, so the packet is absolved only if it also hasn't wrapped
-			// and is still less than or equal to the ack.
-			
-			if(endSeq >= sendUnacknowledged)
-				return endSeq <= ack;
-			
-			return NO;
-		}
-		else if(ack <= sendNext)
-		{
-			// The ack has wrapped, so the packet is absolved only if it hasn't wrapped,
-			// or if it has wrapped and is still less than or equal to the ack.
-			
-			if(endSeq >= sendUnacknowledged)
-				return YES;
-			else
-				return endSeq <= ack;
-		}
-		else
-		{
-			// This is a delayed ack that doesn't apply to any unacknowledged data
-			return NO;
-		}
+		PseudoTcpRange *range = [self outOfOrderRangeAtIndex:i];
+		
+		BOOL added = PseudoTcpPacketAddSackBlock(packet, range->sequence, (range->sequence + range->length));
+		if(!added) break;
 	}
 }
 
@@ -1639,37 +2998,34 @@ enum PseudoTcpFlags
 **/
 - (void)scheduleDelayedAck
 {
-	if(ackTimer == nil)
+	if(!PseudoTcpTimerIsScheduled(&ackTimer))
 	{
-		ackTimer = [[NSTimer timerWithTimeInterval:ACK_TIMEOUT
-											target:self
-										  selector:@selector(doAckTimeout:)
-										  userInfo:nil
-										   repeats:NO] retain];
-		[self runLoopAddTimer:ackTimer];
+		[timerWheel scheduleTimer:&ackTimer withTimeInterval:ACK_TIMEOUT];
 	}
 }
 
 /**
  * Immediately sends an ack.
+ * Returns YES if the ack was handed to the OS immediately, rather than queued in the udp socket.
 **/
-- (void)sendAckNow
+- (BOOL)sendAckNow
 {
 	// Remove any scheduled ack
-	[ackTimer invalidate];
-	[ackTimer release];
-	ackTimer = nil;
+	[timerWheel cancelTimer:&ackTimer];
 	
 	// Clear the tally of un-acked packets
 	unackedPackets = 0;
 	
 	// Send the ack
-	PseudoTcpPacket *packet = [[[PseudoTcpPacket alloc] init] autorelease];
-	[packet setAcknowledgement:[self expectedSequence]];
-	[packet setWindow:[self recvWindow]];
-	[packet setIsAck:YES];
+	PseudoTcpPacket packet;
+	PseudoTcpPacketInit(&packet);
+	packet.acknowledgement = [self expectedSequence];
+	packet.window = [self advertisedRecvWindow];
+	packet.flags |= PSEUDO_TCP_FLAG_ACK;
 	
-	[self sendPacket:packet];
+	[self maybeAddSackBlocks:&packet mostRecent:[self expectedSequence]];
+	
+	return [self sendPacket:&packet];
 }
 
 /**
@@ -1678,26 +3034,29 @@ enum PseudoTcpFlags
 - (void)sendSackNow:(UInt32)sackSequence
 {
 	// Remove any scheduled ack
-	[ackTimer invalidate];
-	[ackTimer release];
-	ackTimer = nil;
+	[timerWheel cancelTimer:&ackTimer];
 	
 	// Clear the tally of un-acked packets
 	unackedPackets = 0;
 	
 	// Send the ack
-	PseudoTcpPacket *packet = [[[PseudoTcpPacket alloc] init] autorelease];
-	[packet setAcknowledgement:[self expectedSequence]];
-	[packet setWindow:[self recvWindow]];
-	[packet setIsAck:YES];
+	PseudoTcpPacket packet;
+	PseudoTcpPacketInit(&packet);
+	packet.acknowledgement = [self expectedSequence];
+	packet.window = [self advertisedRecvWindow];
+	packet.flags |= PSEUDO_TCP_FLAG_ACK;
 	
-	if(receiverSupportsSack)
+	if(receiverSupportsSackBlocks)
+	{
+		[self maybeAddSackBlocks:&packet mostRecent:sackSequence];
+	}
+	else if(receiverSupportsSack)
 	{
-		[packet setIsSack:YES];
-		[packet setSackSequence:sackSequence];
+		packet.flags |= PSEUDO_TCP_FLAG_SACK;
+		packet.sackSequence = sackSequence;
 	}
 	
-	[self sendPacket:packet];
+	[self sendPacket:&packet];
 }
 
 /**
@@ -1706,20 +3065,20 @@ enum PseudoTcpFlags
 **/
 - (void)maybeAddAck:(PseudoTcpPacket *)dataPacket
 {
-	if(ackTimer && ![dataPacket isAck])
+	if(PseudoTcpTimerIsScheduled(&ackTimer) && !(dataPacket->flags & PSEUDO_TCP_FLAG_ACK))
 	{
 		// Remove scheduled ack
-		[ackTimer invalidate];
-		[ackTimer release];
-		ackTimer = nil;
+		[timerWheel cancelTimer:&ackTimer];
 		
 		// Clear the tally of un-acked packets
 		unackedPackets = 0;
 		
 		// Add ack info to existing data packet
-		[dataPacket setAcknowledgement:[self expectedSequence]];
-		[dataPacket setWindow:[self recvWindow]];
-		[dataPacket setIsAck:YES];
+		dataPacket->acknowledgement = [self expectedSequence];
+		dataPacket->window = [self advertisedRecvWindow];
+		dataPacket->flags |= PSEUDO_TCP_FLAG_ACK;
+		
+		[self maybeAddSackBlocks:dataPacket mostRecent:[self expectedSequence]];
 	}
 }
 
@@ -1727,76 +3086,6 @@ enum PseudoTcpFlags
 #pragma mark Data
 ////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
 
-/**
- * Compares two numbers within the context of the receive window.
- * Both numbers are expected to be within the current receive window.
- * Use this method instead of a simple integer comparison because this method properly handles wrapping.
- * 
- * NSOrderedAscending  -> numA < numB
- * NSOrderedDescending -> numA > numB
- * NSOrderedSame       -> numA = numB
-**/
-- (NSComparisonResult)compareWithinRecvWindow:(UInt32)numA to:(UInt32)numB
-{
-	UInt32 startSequence = recvSequence + recvBufferOffset + recvBufferSize;
-	UInt32 endSequence = recvSequence + recvBufferOffset + RECV_BUFFER_SIZE;
-	
-	// Always be weary of wrapping sequence numbers...
-	
-	if(startSequence <= endSequence)
-	{
-		if(numA < numB)
-			return NSOrderedAscending;
-		if(numA > numB)
-			return NSOrderedDescending;
-		else
-			return NSOrderedSame; 
-	}
-	else
-	{
-		// The window has wrapped
-		
-		if(numA >= startSequence)
-		{
-			if(numB >= startSequence)
-			{
-				// Neither numA or numB has wrapped
-				if(numA < numB)
-					return NSOrderedAscending;
-				if(numA > numB)
-					return NSOrderedDescending;
-				else
-					return NSOrderedSame; 
-			}
-			else
-			{
-				// numA didn't wrap, but numB did.
-				// numA < numB
-				return NSOrderedAscending;
-			}
-		}
-		else
-		{
-			if(numB >= startSequence)
-			{
-				// numA wrapped, but numB didn't.
-				// numA > numB
-				return NSOrderedDescending;
-			}
-			else
-			{
-				// Both numA and numB wrapped
-				if(numA < numB)
-					return NSOrderedAscending;
-				if(numA > numB)
-					return NSOrderedDescending;
-				else
-					return NSOrderedSame; 
-			}
-		}
-	}
-}
-
 /**
  * Processes the data from the given packet.
 **/
@@ -1805,66 +3094,48 @@ enum PseudoTcpFlags
 	// Check to make sure there's room in the recvBuffer for this packet
 	if([self doesPacketFitInRecvWindow:dataPacket])
 	{
+		UInt32 dataLength = dataPacket->dataLength;
+		
+		// Copy the data straight into the ring buffer, at the index its sequence number maps to.
+		// This is the case whether the packet is in-order or out-of-order.
+		
+		UInt32 sequenceOffset = dataPacket->sequence - recvSequence;
+		UInt32 index = (recvBufferOffset + sequenceOffset) % recvBufferCapacity;
+		
+		RingBufferWrite(recvBuffer, recvBufferCapacity, index, dataPacket->data, dataLength);
+		
 		// Check to see if this is the sequence number we're expecting next
-		if([dataPacket sequence] == [self expectedSequence])
+		if(dataPacket->sequence == [self expectedSequence])
 		{
-			// Append the packet to our recvBuffer
-			[recvBuffer addObject:dataPacket];
-			recvBufferSize += [[dataPacket data] length];
+			// The data is now part of our in-order recvBuffer
+			recvBufferSize += dataLength;
 			unackedPackets++;
 			
 			// Add any out-of-order data that can be added.
-			// Remember: the recvOutOfOrderBuffer is kept sorted also.
+			// Since the data is already in place, this is simply a matter of updating the recvBufferSize.
+			unackedPackets += [self drainOutOfOrderBuffer];
 			
-			while([recvOutOfOrderBuffer count] > 0)
+			if(unackedPackets >= 2)
 			{
-				PseudoTcpPacket *packet = [recvOutOfOrderBuffer objectAtIndex:0];
-				
-				// We knew, at the point when we added the packet to the out-of-order buffer, that
-				// the packet was within the receive window at that time.
-				// However, if the remote host screwed up and sent data fragments that overlapped,
-				// then the packet may no longer be within the receive window.
-				
-				if([self doesPacketFitInRecvWindow:packet])
+				// According to the TCP guidelines:
+				// In a stream of full-sized segments there SHOULD be an ack for at least every second segment.
+				// 
+				// Furthermore, according to RFC 2581, section 4.2:
+				// It is desireable [to immediately acknowledge] at least every second segment, regardless of size.
+				if([self sendAckNow])
 				{
-					if([packet sequence] == [self expectedSequence])
-					{
-						// Append the packet to the recvBuffer
-						[recvBuffer addObject:packet];
-						recvBufferSize += [[packet data] length];
-						unackedPackets++;
-						
-						// Remove the packet from the recvOutOfOrderBuffer
-						[recvOutOfOrderBuffer removeObjectAtIndex:0];
-					}
-					else
+					// The ack is already on its way, so we can inform the delegate right away
+					if([delegate respondsToSelector:@selector(onPseudoTcpHasBytesAvailable:)])
 					{
-						// The packet is still out-of-order.
-						// Since we know the out-of-order buffer is sorted, this means
-						// we don't have any more data we can append to the receive buffer.
-						break;
+						[delegate onPseudoTcpHasBytesAvailable:self];
 					}
 				}
 				else
 				{
-					// Found a packet that overlapped existing data within receive buffer.
-					// Remove it from the out-of-order buffer, and continue looking.
-					[recvOutOfOrderBuffer removeObjectAtIndex:0];
+					// We'll inform the delegate after the ack has been sent (in onUdpSocket:didSendDataWithTag:)
+					flags |= kNewDataAvailable;
 				}
 			}
-			
-			if(unackedPackets >= 2)
-			{
-				// According to the TCP guidelines:
-				// In a stream of full-sized segments there SHOULD be an ack for at least every second segment.
-				// 
-				// Furthermore, according to RFC 2581, section 4.2:
-				// It is desireable [to immediately acknowledge] at least every second segment, regardless of size.
-				[self sendAckNow];
-				
-				// We'll inform the delegate after the ack has been sent (in onUdpSocket:didSendDataWithTag:)
-				flags |= kNewDataAvailable;
-			}
 			else
 			{
 				// We've only received a small amount of data, so we'll delay our ack.
@@ -1882,56 +3153,17 @@ enum PseudoTcpFlags
 		else
 		{
 			// We received an out-of-order packet.
-			// Add the packet to the out-of-order buffer.
-			// 
-			// Remember to keep the out-of-order buffer sorted by sequence number,
-			// and not to add the same packet twice.
-			
-			BOOL isDuplicatePacket = NO;
-			NSUInteger index = 0;
-			
-			while(index < [recvOutOfOrderBuffer count])
-			{
-				PseudoTcpPacket *packet = [recvOutOfOrderBuffer objectAtIndex:index];
-				
-				// Always be weary of wrapping sequence numbers...
-				NSComparisonResult cmp = [self compareWithinRecvWindow:[dataPacket sequence] to:[packet sequence]];
-				
-				if(cmp == NSOrderedAscending)
-				{
-					// [dataPacket sequence] < [packet sequence]
-					// 
-					// We found the spot in which to insert the packet
-					break;
-				}
-				else if(cmp == NSOrderedDescending)
-				{
-					// [dataPacket sequence > [packet sequence]
-					// 
-					// We still haven't found the spot in which to insert the newly received data packet
-					index++;
-				}
-				else
-				{
-					// [dataPacket sequence] == [packet sequence]
-					// 
-					// We've already received this data packet, and it already exists in the out-of-order buffer.
-					// There's no need to add it again.
-					isDuplicatePacket = YES;
-					break;
-				}
-			}
+			// Record the range of data we've stored in the out-of-order buffer.
 			
-			if(!isDuplicatePacket)
+			if([self addOutOfOrderSequence:dataPacket->sequence length:dataLength])
 			{
-				[recvOutOfOrderBuffer insertObject:dataPacket atIndex:index];
-				
 				// In order to facilitate fast-retrasmit, we must send an ack immediately
 				// We also selectively ack the packet we've received and added to our outOfOrder buffer
-				[self sendSackNow:[dataPacket sequence]];
+				[self sendSackNow:dataPacket->sequence];
 			}
 			else
 			{
+				// We've already received this data, and it already exists in the out-of-order buffer.
 				// In order to facilitate fast-retrasmit, we must send an ack immediately
 				[self sendAckNow];
 			}
@@ -1948,49 +3180,351 @@ enum PseudoTcpFlags
 }
 
 /**
- * Checks to see if the given packet fits within our receive window somewhere.
- * That is, that the packet hasn't already been received, and that it doesn't overflow our receive buffer.
- * The packet may or may not be the next exepected sequence number.
+ * Checks to see if the given packet fits within our receive window somewhere.
+ * That is, that the packet hasn't already been received, and that it doesn't overflow our receive buffer.
+ * The packet may or may not be the next exepected sequence number.
+**/
+- (BOOL)doesPacketFitInRecvWindow:(PseudoTcpPacket *)packet
+{
+	// We measure the packet's offset from the expected sequence number.
+	// If the packet starts before the expected sequence number, the unsigned subtraction wraps around
+	// to a very large number, which won't fit in the receive window.
+	// This way we don't have to worry about wrapping sequence numbers.
+	
+	UInt32 packetOffset = packet->sequence - [self expectedSequence];
+	UInt32 packetLength = packet->dataLength;
+	
+	UInt32 windowSize = [self recvWindow];
+	
+	return (packetOffset < windowSize) && (packetLength <= (windowSize - packetOffset));
+}
+
+/**
+ * Returns the out-of-order range at the given index, counting from the front of the out-of-order buffer.
+**/
+- (PseudoTcpRange *)outOfOrderRangeAtIndex:(UInt32)index
+{
+	return &recvOutOfOrderBuffer[recvOutOfOrderHead + index];
+}
+
+/**
+ * Returns the index of the first out-of-order range that ends at or after the given offset from the expected sequence.
+ * If there is no such range, returns recvOutOfOrderCount.
+ * 
+ * Since the ranges are sorted, and never overlap, this is a simple binary search.
+**/
+- (UInt32)indexOfFirstOutOfOrderRangeEndingAtOrAfterOffset:(UInt32)offset
+{
+	UInt32 expectedSequence = [self expectedSequence];
+	
+	UInt32 low = 0;
+	UInt32 high = recvOutOfOrderCount;
+	
+	while(low < high)
+	{
+		UInt32 mid = low + ((high - low) / 2);
+		PseudoTcpRange *range = [self outOfOrderRangeAtIndex:mid];
+		
+		if((range->sequence - expectedSequence) + range->length < offset)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+	
+	return low;
+}
+
+/**
+ * Records the given range of sequence numbers in the out-of-order buffer.
+ * The buffer is kept sorted, and overlapping or adjacent ranges are merged together.
+ * 
+ * Returns NO if the entire range was already present in the buffer.
+**/
+- (BOOL)addOutOfOrderSequence:(UInt32)sequence length:(UInt32)length
+{
+	// Offsets are measured from the expected sequence number, which is always before any out-of-order data.
+	// This way we don't have to worry about wrapping sequence numbers.
+	
+	UInt32 expectedSequence = [self expectedSequence];
+	
+	UInt32 startOffset = sequence - expectedSequence;
+	UInt32 endOffset = startOffset + length;
+	
+	// Find the first range that ends at or after the start of the new range.
+	// Any range before it can't touch the new range.
+	
+	UInt32 i = [self indexOfFirstOutOfOrderRangeEndingAtOrAfterOffset:startOffset];
+	
+	if(i < recvOutOfOrderCount)
+	{
+		PseudoTcpRange *range = [self outOfOrderRangeAtIndex:i];
+		
+		UInt32 rangeStartOffset = range->sequence - expectedSequence;
+		UInt32 rangeEndOffset = rangeStartOffset + range->length;
+		
+		if((rangeStartOffset <= startOffset) && (endOffset <= rangeEndOffset))
+		{
+			// We've already received all of this data
+			return NO;
+		}
+	}
+	
+	// Merge all the ranges that overlap or are adjacent to the new range
+	
+	UInt32 j = i;
+	while(j < recvOutOfOrderCount)
+	{
+		PseudoTcpRange *range = [self outOfOrderRangeAtIndex:j];
+		
+		UInt32 rangeStartOffset = range->sequence - expectedSequence;
+		UInt32 rangeEndOffset = rangeStartOffset + range->length;
+		
+		if(rangeStartOffset > endOffset) break;
+		
+		startOffset = MIN(startOffset, rangeStartOffset);
+		endOffset = MAX(endOffset, rangeEndOffset);
+		
+		j++;
+	}
+	
+	if(i == j)
+	{
+		// The new range doesn't touch any existing range, so we need to insert it
+		
+		if(recvOutOfOrderHead + recvOutOfOrderCount == recvOutOfOrderCapacity)
+		{
+			if(recvOutOfOrderHead > 0)
+			{
+				// There's room at the front, left behind by drained ranges
+				memmove(recvOutOfOrderBuffer, recvOutOfOrderBuffer + recvOutOfOrderHead,
+				        recvOutOfOrderCount * sizeof(PseudoTcpRange));
+				recvOutOfOrderHead = 0;
+			}
+			else
+			{
+				recvOutOfOrderCapacity *= 2;
+				recvOutOfOrderBuffer = reallocf(recvOutOfOrderBuffer, recvOutOfOrderCapacity * sizeof(PseudoTcpRange));
+			}
+		}
+		
+		PseudoTcpRange *ranges = [self outOfOrderRangeAtIndex:0];
+		
+		memmove(ranges + i + 1, ranges + i, (recvOutOfOrderCount - i) * sizeof(PseudoTcpRange));
+		recvOutOfOrderCount++;
+	}
+	else if(j > i + 1)
+	{
+		// The new range swallowed several existing ranges, which collapse into the one at index i
+		
+		PseudoTcpRange *ranges = [self outOfOrderRangeAtIndex:0];
+		
+		memmove(ranges + i + 1, ranges + j, (recvOutOfOrderCount - j) * sizeof(PseudoTcpRange));
+		recvOutOfOrderCount -= (j - i - 1);
+	}
+	
+	PseudoTcpRange *range = [self outOfOrderRangeAtIndex:i];
+	range->sequence = expectedSequence + startOffset;
+	range->length = endOffset - startOffset;
+	
+	return YES;
+}
+
+/**
+ * Moves any out-of-order data that is now in-order into the recvBuffer.
+ * The data is already stored at the proper place in the ring buffer, so no data is actually copied.
+ * 
+ * Returns the number of out-of-order ranges that were moved.
+**/
+- (UInt32)drainOutOfOrderBuffer
+{
+	UInt32 count = 0;
+	
+	while(count < recvOutOfOrderCount)
+	{
+		PseudoTcpRange *range = [self outOfOrderRangeAtIndex:count];
+		
+		// Since the buffer is sorted, and adjacent ranges are merged, the first range is the only one
+		// that can start at the expected sequence number. The ranges after it can only start at or before
+		// the expected sequence number if the remote host sent data fragments that overlapped them.
+		
+		UInt32 expectedSequence = [self expectedSequence];
+		UInt32 rangeOffset = expectedSequence - range->sequence;
+		
+		if(rangeOffset > recvBufferCapacity)
+		{
+			// The range still starts after the expected sequence number
+			break;
+		}
+		
+		if(rangeOffset < range->length)
+		{
+			recvBufferSize += range->length - rangeOffset;
+		}
+		
+		count++;
+	}
+	
+	// The drained ranges are dropped from the front without moving the rest
+	
+	recvOutOfOrderCount -= count;
+	recvOutOfOrderHead = (recvOutOfOrderCount > 0) ? (recvOutOfOrderHead + count) : 0;
+	
+	return count;
+}
+
+/**
+ * Returns whether we've received the entire given range of sequence numbers, either in-order or out-of-order.
+**/
+- (BOOL)hasReceivedSequence:(UInt32)sequence length:(UInt32)length
+{
+	// Note: The comparison uses a signed difference in order to handle wrapping.
+	
+	if((SInt32)(sequence + length - [self expectedSequence]) <= 0)
+	{
+		return YES;
+	}
+	
+	UInt32 startOffset = sequence - [self expectedSequence];
+	UInt32 i = [self indexOfFirstOutOfOrderRangeEndingAtOrAfterOffset:(startOffset + length)];
+	
+	if(i < recvOutOfOrderCount)
+	{
+		PseudoTcpRange *range = [self outOfOrderRangeAtIndex:i];
+		UInt32 rangeOffset = sequence - range->sequence;
+		
+		return (rangeOffset < range->length) && (length <= range->length - rangeOffset);
+	}
+	
+	return NO;
+}
+
+/**
+ * Returns the index in the recvBuffer of the given sequence number.
+ * 
+ * The sequence number may be up to a full buffer length before recvSequence.
+ * This refers to data that's already been read, but is still sitting in the ring buffer until it's overwritten.
+**/
+- (UInt32)recvBufferIndexForSequence:(UInt32)sequence
+{
+	UInt32 sequenceOffset = sequence - recvSequence;
+	
+	if(sequenceOffset < recvBufferCapacity)
+		return (recvBufferOffset + sequenceOffset) % recvBufferCapacity;
+	else
+		return (recvBufferOffset + recvBufferCapacity - (recvSequence - sequence)) % recvBufferCapacity;
+}
+
+/**
+ * Processes a parity packet, which covers a group of consecutive segments starting at its sequence number.
+ * 
+ * If exactly one segment of the group is missing, it's rebuilt by XOR'ing the parity with the rest of the group,
+ * all of which is still sitting in the recvBuffer, and is then processed as though it had just arrived.
+ * Otherwise there's either nothing to do, or nothing we can do, and the parity packet is simply dropped.
 **/
-- (BOOL)doesPacketFitInRecvWindow:(PseudoTcpPacket *)packet
+- (void)processParity:(PseudoTcpPacket *)parityPacket
 {
-	UInt32 startSequence = recvSequence + recvBufferOffset + recvBufferSize;
-	UInt32 endSequence = recvSequence + recvBufferOffset + RECV_BUFFER_SIZE;
+	UInt32 count = parityPacket->fecCount;
+	UInt32 groupSequence = parityPacket->sequence;
+	UInt32 groupLength = 0;
+	UInt32 parityLength = 0;
 	
-	UInt32 packetStartSequence = [packet sequence];
-	UInt32 packetEndSequence = packetStartSequence + (UInt32)[[packet data] length];
+	UInt32 i;
+	for(i = 0; i < count; i++)
+	{
+		groupLength += parityPacket->fecLengths[i];
+		parityLength = MAX(parityLength, parityPacket->fecLengths[i]);
+	}
 	
-	// Always be weary of wrapping sequence numbers...
+	if((parityLength == 0) || (parityLength != parityPacket->dataLength))
+	{
+		DDLogWarn(@"PseudoTcp: Received malformed parity packet");
+		return;
+	}
 	
-	if(startSequence <= endSequence)
+	// Note: The comparisons use signed differences in order to handle wrapping.
+	
+	if((SInt32)(groupSequence + groupLength - [self expectedSequence]) <= 0)
 	{
-		if(packetStartSequence <= packetEndSequence)
-		{
-			// Normal situation
-			return ((packetStartSequence >= startSequence) && (packetEndSequence <= endSequence));
-		}
-		else
-		{
-			// Window sequence numbers didn't wrap, but packet sequence numbers did.
-			// The packetEndSequence must be past the endSequence.
-			return NO;
-		}
+		// We've already received the entire group
+		return;
 	}
-	else
+	
+	// Every part of the group we've received has to still be in the ring buffer.
+	// Data that's been read stays in place until it's overwritten by data a full buffer length later,
+	// so this is the case as long as we haven't received anything that far beyond the start of the group.
+	
+	UInt32 highSequence = [self expectedSequence];
+	if(recvOutOfOrderCount > 0)
+	{
+		PseudoTcpRange *lastRange = [self outOfOrderRangeAtIndex:(recvOutOfOrderCount - 1)];
+		highSequence = lastRange->sequence + lastRange->length;
+	}
+	
+	if((SInt32)(highSequence - groupSequence) > (SInt32)recvBufferCapacity)
+	{
+		return;
+	}
+	
+	// Find the missing segment
+	
+	UInt32 missingIndex = count;
+	UInt32 missingSequence = 0;
+	UInt32 sequence = groupSequence;
+	
+	for(i = 0; i < count; i++)
 	{
-		if(packetStartSequence <= packetEndSequence)
+		if(![self hasReceivedSequence:sequence length:parityPacket->fecLengths[i]])
 		{
-			// The window sequence numbers wrapped, but the packet sequence numbers didn't.
-			// The endSequence must be past the packetEndSequence, so we need only check the start sequence numbers.
-			return packetStartSequence >= startSequence;
+			if(missingIndex < count)
+			{
+				// A single parity packet can't rebuild more than one segment
+				return;
+			}
+			
+			missingIndex = i;
+			missingSequence = sequence;
 		}
-		else
+		
+		sequence += parityPacket->fecLengths[i];
+	}
+	
+	if(missingIndex == count) return;
+	
+	// Rebuild the missing segment
+	
+	if(fecRecoveryBufferCapacity < parityLength)
+	{
+		fecRecoveryBufferCapacity = parityLength;
+		fecRecoveryBuffer = reallocf(fecRecoveryBuffer, fecRecoveryBufferCapacity);
+	}
+	
+	memcpy(fecRecoveryBuffer, parityPacket->data, parityLength);
+	
+	sequence = groupSequence;
+	
+	for(i = 0; i < count; i++)
+	{
+		if(i != missingIndex)
 		{
-			// Both the window sequence numbers and the packet sequence numbers wrapped.
-			// Mathematically, we can treat this the same as the normal situation.
-			return ((packetStartSequence >= startSequence) && (packetEndSequence <= endSequence));
+			UInt32 index = [self recvBufferIndexForSequence:sequence];
+			
+			RingBufferXor(recvBuffer, recvBufferCapacity, index, fecRecoveryBuffer, parityPacket->fecLengths[i]);
 		}
+		
+		sequence += parityPacket->fecLengths[i];
 	}
+	
+	DDLogVerbose(@"PseudoTcp: Rebuilt segment from parity: seq(%010u) dat(%03u)",
+				 missingSequence, (unsigned)parityPacket->fecLengths[missingIndex]);
+	
+	PseudoTcpPacket dataPacket;
+	PseudoTcpPacketInit(&dataPacket);
+	dataPacket.sequence = missingSequence;
+	dataPacket.data = fecRecoveryBuffer;
+	dataPacket.dataLength = parityPacket->fecLengths[missingIndex];
+	
+	statistics.segmentsRebuilt++;
+	[self processData:&dataPacket];
 }
 
 /**
@@ -2001,11 +3535,72 @@ enum PseudoTcpFlags
 	[self performSelector:@selector(maybeSendData) withObject:nil afterDelay:0.0 inModes:[udpSocket runLoopModes]];
 }
 
+/**
+ * Returns the rate (in bytes per second) at which we pace out segments,
+ * or zero if pacing is disabled or we don't have an rtt measurement yet.
+**/
+- (double)pacingRate
+{
+	if((pacingGain == 0.0F) || (srtt == 0.0)) return 0.0;
+	
+	double rate = pacingGain * [self congestionWindow] / srtt;
+	
+	if([congestionControl congestionWindow] < [congestionControl slowStartThreshold])
+	{
+		rate *= PACING_SLOW_START_GAIN;
+	}
+	
+	return rate;
+}
+
+/**
+ * Refills the token bucket, and returns whether we may send another segment right now.
+ * If not, the pacing timer is scheduled for when we may.
+**/
+- (BOOL)mayPaceOut
+{
+	double rate = [self pacingRate];
+	
+	if(rate <= 0.0)
+	{
+		// Not pacing. The bucket will start out full once we are.
+		pacingTime = 0;
+		return YES;
+	}
+	
+	UInt64 now = PseudoTcpMonotonicTime();
+	double burst = MAX(PACING_BURST_SEGMENTS * mss, rate * PACING_BURST_INTERVAL);
+	
+	if(pacingTime == 0)
+	{
+		pacingTokens = burst;
+	}
+	else
+	{
+		pacingTokens = MIN(pacingTokens + (rate * (now - pacingTime) / 1000000000.0), burst);
+	}
+	pacingTime = now;
+	
+	if(pacingTokens > 0.0)
+	{
+		return YES;
+	}
+	
+	if(!PseudoTcpTimerIsScheduled(&pacingTimer))
+	{
+		[timerWheel scheduleTimer:&pacingTimer withTimeInterval:(-pacingTokens / rate)];
+	}
+	
+	return NO;
+}
+
 /**
  * Sends data if data can and should be sent.
 **/
 - (void)maybeSendData
 {
+	UInt32 cwnd = [self congestionWindow];
+	
 	DDLogVerbose(@"PseudoTcp: maybeSendData: sendWindow(%u) cwnd(%u) rxEffectiveSize(%u) rxSize(%u)",
 				 sendWindow, cwnd, retransmissionQueueEffectiveSize, retransmissionQueueSize);
 	
@@ -2038,10 +3633,10 @@ enum PseudoTcpFlags
 	// Loop sending data until we run out of data to send, or until we've filled our effective send window
 	while(maxSendSize > 0)
 	{
-		UInt32 maxPacketDataLength = MIN(maxSendSize, DEFAULT_MTU);
+		UInt32 maxPacketDataLength = MIN(maxSendSize, mss);
 		
 		// Nagle's algorithm
-		if(maxPacketDataLength < DEFAULT_MTU)
+		if(maxPacketDataLength < mss)
 		{
 			if(retransmissionQueueEffectiveSize > 0)
 			{
@@ -2051,7 +3646,14 @@ enum PseudoTcpFlags
 			}
 		}
 		
-		PseudoTcpPacket *packet = nil;
+		// Pacing
+		if(![self mayPaceOut])
+		{
+			// Don't send the segment until the pacing timer fires
+			return;
+		}
+		
+		UInt32 sentLength;
 		
 		if(retransmissionQueueSize > retransmissionQueueEffectiveSize)
 		{
@@ -2059,104 +3661,222 @@ enum PseudoTcpFlags
 			
 			// The effective size is smaller than the actual size because a retransmission timer expired.
 			// Thus, we have to resend parts of the retransmission queue.
+			// The resend index points to the first segment we haven't gotten around to resending yet.
 			
-			UInt32 totalSize = 0;
+			PseudoTcpSegment *segment = NULL;
 			
-			unsigned i;
-			for(i = 0; i < [retransmissionQueue count] && packet == nil; i++)
+			while((segment == NULL) && (retransmissionQueueResendIndex < retransmissionQueueCount))
 			{
-				if(totalSize == retransmissionQueueEffectiveSize)
-				{
-					packet = [retransmissionQueue objectAtIndex:i];
-				}
-				else
+				PseudoTcpSegment *candidate = [self segmentAtIndex:retransmissionQueueResendIndex];
+				retransmissionQueueResendIndex++;
+				
+				if(!(candidate->control & (kSegmentRxQ | kSegmentSacked)))
 				{
-					totalSize += (UInt32)[[[retransmissionQueue objectAtIndex:i] data] length];
+					segment = candidate;
 				}
 			}
 			
-			if(packet == nil)
+			if(segment == NULL)
 			{
 				DDLogError(@"PseudoTcp: maybeSendData: invalid rxQSize or rxQEffectiveSize");
 				return;
 			}
 			
-			if([packet isRxQ])
-			{
-				DDLogError(@"PseudoTcp: maybeSendData: resend packet with isRxQ == YES");
-				return;
-			}
-			
-			[self resendPacket:packet];
+			sentLength = [self resendSegment:segment];
 		}
 		else
 		{
 			// Send NEW data
 			
-			// Create empty packet
-			packet = [[[PseudoTcpPacket alloc] init] autorelease];
-			[packet setSequence:[self sendNext]];
+			// The data is already sitting in the send buffer, right after the data that's been sent.
+			// So all we need to do is create a segment that refers to it.
+			// 
+			// If we have enough data (and window) for it, this segment may be a larger path mtu probe.
 			
-			NSMutableData *packetData = [NSMutableData dataWithCapacity:maxPacketDataLength];
+			UInt32 segmentLength = maxPacketDataLength;
+			UInt8 control = 0;
 			
-			// The sendBuffer is an array of NSData objects.
-			// We'll need to loop through this array, and fill the packetData to capacity.
-			// This may require using more than one object in the sendBuffer,
-			// and it may require using fragments of objects in the sendBuffer.
+			UInt32 probeSize = [self nextMtuProbeSize];
 			
-			while([packetData length] < maxPacketDataLength)
+			if((probeSize > 0) && (maxSendSize >= probeSize))
 			{
-				NSData *data = [sendBuffer objectAtIndex:0];
+				DDLogVerbose(@"PseudoTcp: Sending path mtu probe: size(%u) mss(%u)", probeSize, mss);
 				
-				// Determine how much data we can append to packetData.
-				// This is the minimum of:
-				// - The amount of unread data from the current data object.
-				// - The amount of space left in packetData.
-				UInt32 maxDataLength = MIN(([data length] - sendBufferOffset), (maxPacketDataLength - [packetData length]));
+				segmentLength = probeSize;
+				control = kSegmentMtuProbe;
 				
-				const void *subData = [data bytes] + sendBufferOffset;
-				[packetData appendBytes:subData length:maxDataLength];
-				
-				// Update the offset and size of the send buffer
-				sendBufferOffset += maxDataLength;
-				sendBufferSize -= maxDataLength;
-				
-				// If we've used up all the bytes in data, remove it from the send buffer
-				if(sendBufferOffset == [data length])
-				{
-					sendSequence += sendBufferOffset;
-					[sendBuffer removeObjectAtIndex:0];
-					sendBufferOffset = 0;
-				}
+				mssProbeSize = probeSize;
 			}
-			[packet setData:packetData];
 			
-			// Fear not - PseudoTcpPacket will not copy the packetData. It only retains it.
+			PseudoTcpSegment *segment = [self enqueueSegmentWithSequence:[self sendNext]
+			                                                      length:segmentLength
+			                                                     control:control];
 			
-			[self maybeAddAck:packet];
-			[self sendPacket:packet];
+			// Update the offset and size of the send buffer
+			sendBufferOffset += segmentLength;
+			sendBufferSize -= segmentLength;
+			
+			[self sendSegment:segment];
+			
+			if(++lossSampleSent >= FEC_LOSS_SAMPLE_SEGMENTS)
+			{
+				[self updateLossRate];
+			}
+			
+			if(control == 0)
+			{
+				[self addSegmentToFecGroup:segment];
+			}
+			else
+			{
+				// The probe isn't covered by a parity packet, and breaks up the run of consecutive segments
+				[self sendFecParity];
+			}
+			
+			sentLength = segmentLength;
 		}
 		
-		maxSendSize -= (UInt32)[[packet data] length];
+		maxSendSize -= MIN(sentLength, maxSendSize);
+		pacingTokens -= sentLength;
 	
 	} // while(maxSendSize > 0)
 }
 
 /**
- * Immediately resends the packet in the retransmissionQueue with the given sequence number.
+ * Folds the latest loss rate sample into the smoothed loss rate,
+ * and decides whether or not it's high enough to send parity packets.
 **/
-- (void)resendPacketWithSequence:(UInt32)sequence
+- (void)updateLossRate
 {
-	NSUInteger i;
-	for(i = 0; i < [retransmissionQueue count]; i++)
+	float sample = MIN((float)lossSampleLost / (float)lossSampleSent, 1.0F);
+	
+	lossRate = ((1.0F - FEC_LOSS_GAIN) * lossRate) + (FEC_LOSS_GAIN * sample);
+	
+	lossSampleSent = 0;
+	lossSampleLost = 0;
+	
+	if(!fecActive && (lossRate >= FEC_LOSS_ON))
 	{
-		PseudoTcpPacket *packet = [retransmissionQueue objectAtIndex:i];
-		
-		if([packet sequence] == sequence)
+		DDLogVerbose(@"PseudoTcp: Starting forward error correction: lossRate(%.4f)", lossRate);
+		fecActive = YES;
+	}
+	else if(fecActive && (lossRate < FEC_LOSS_OFF))
+	{
+		DDLogVerbose(@"PseudoTcp: Stopping forward error correction: lossRate(%.4f)", lossRate);
+		fecActive = NO;
+	}
+}
+
+/**
+ * Returns the number of segments each parity packet should cover, or zero if we shouldn't send parity packets.
+**/
+- (UInt32)fecGroupSize
+{
+	if(!forwardErrorCorrection || !receiverSupportsFec || !fecActive) return 0;
+	
+	// A parity packet can only rebuild a single segment of its group.
+	// So we size the groups such that, on average, only one group in four loses a segment.
+	
+	UInt32 size = (UInt32)(1.0F / (4.0F * lossRate));
+	
+	return MIN(MAX(size, FEC_MIN_GROUP), PSEUDO_TCP_MAX_FEC_GROUP);
+}
+
+/**
+ * Adds a newly sent segment to the current parity group,
+ * and sends the parity packet if the group is full, or if there's no more data to send.
+**/
+- (void)addSegmentToFecGroup:(PseudoTcpSegment *)segment
+{
+	UInt32 groupSize = [self fecGroupSize];
+	
+	if(groupSize == 0)
+	{
+		// Forward error correction is off, although we may have just turned it off in the middle of a group
+		[self sendFecParity];
+		return;
+	}
+	
+	if((fecGroup->count > 0) && (segment->sequence != fecGroup->sequence + fecGroup->length))
+	{
+		// The parity packet can only cover consecutive segments
+		[self sendFecParity];
+	}
+	
+	if(fecGroup->count == 0)
+	{
+		fecGroup->sequence = segment->sequence;
+	}
+	
+	if(segment->length > fecGroup->parityLength)
+	{
+		if(segment->length > fecGroup->parityCapacity)
 		{
-			[self resendPacket:packet];
-			return;
+			fecGroup->parityCapacity = segment->length;
+			fecGroup->parity = reallocf(fecGroup->parity, fecGroup->parityCapacity);
 		}
+		
+		// Shorter segments are padded with zeros
+		bzero(fecGroup->parity + fecGroup->parityLength, segment->length - fecGroup->parityLength);
+		fecGroup->parityLength = segment->length;
+	}
+	
+	UInt32 index = (sendBufferHead + (segment->sequence - sendSequence)) % sendBufferCapacity;
+	
+	RingBufferXor(sendBuffer, sendBufferCapacity, index, fecGroup->parity, segment->length);
+	
+	fecGroup->lengths[fecGroup->count] = (UInt16)segment->length;
+	fecGroup->length += segment->length;
+	fecGroup->count++;
+	
+	// If we've run out of data, we send the parity packet for what we've got.
+	// A lost segment at the end of a burst is the most expensive kind to lose,
+	// since there aren't any segments after it to trigger a fast retransmit.
+	
+	if((fecGroup->count >= groupSize) || (sendBufferSize == 0))
+	{
+		[self sendFecParity];
+	}
+}
+
+/**
+ * Sends the parity packet for the current group (if there is one), and starts a new group.
+ * 
+ * Parity packets aren't part of the sequence space. They're never acknowledged or retransmitted,
+ * and don't count against the congestion window. They're paced like any other packet though.
+**/
+- (void)sendFecParity
+{
+	if(fecGroup->count == 0) return;
+	
+	PseudoTcpPacket packet;
+	PseudoTcpPacketInit(&packet);
+	packet.sequence = fecGroup->sequence;
+	packet.data = fecGroup->parity;
+	packet.dataLength = fecGroup->parityLength;
+	
+	PseudoTcpPacketSetFecGroup(&packet, fecGroup->count, fecGroup->lengths);
+	
+	[self sendPacket:&packet];
+	
+	statistics.parityPacketsSent++;
+	pacingTokens -= fecGroup->parityLength;
+	
+	fecGroup->count = 0;
+	fecGroup->length = 0;
+	fecGroup->parityLength = 0;
+}
+
+/**
+ * Immediately resends the segment in the retransmissionQueue with the given sequence number.
+**/
+- (void)resendSegmentWithSequence:(UInt32)sequence
+{
+	PseudoTcpSegment *segment = [self segmentWithSequence:sequence];
+	
+	if(segment)
+	{
+		[self resendSegment:segment];
 	}
 }
 
@@ -2165,19 +3885,15 @@ enum PseudoTcpFlags
 **/
 - (void)maybeScheduleEmptyWindowProbe
 {
-	// If the persistTimer is non-nil, then the empty window probe is already scheduled to be sent,
+	// If the kPersist flag is set, then the empty window probe is already scheduled to be sent,
 	// or has already been sent, and is still sitting in the retransmission queue.
 	
-	if(persistTimer == nil)
+	if(!(flags & kPersist))
 	{
-		persistTimer = [[NSTimer timerWithTimeInterval:rto
-												target:self
-											  selector:@selector(doPersistTimeout:)
-											  userInfo:nil
-											   repeats:NO] retain];
-		[self runLoopAddTimer:persistTimer];
+		[timerWheel scheduleTimer:&persistTimer withTimeInterval:rto];
+		flags |= kPersist;
 		
-		// Note: The persistTimer is invalidated and released in the processDataAck method.
+		// Note: The kPersist flag is cleared in the processDataAck method.
 	}
 }
 
@@ -2242,13 +3958,14 @@ enum PseudoTcpFlags
 **/
 - (void)maybeSendRst
 {
-	if((sendBufferSize == 0) && (retransmissionQueueSize == 0))
+	if((sendBufferSize == 0) && (sendBufferOffset == 0))
 	{
 		// Create the RST packet
-		PseudoTcpPacket *packet = [[[PseudoTcpPacket alloc] init] autorelease];
-		[packet setIsRst:YES];
+		PseudoTcpPacket packet;
+		PseudoTcpPacketInit(&packet);
+		packet.flags |= PSEUDO_TCP_FLAG_RST;
 		
-		[self sendPacket:packet];
+		[self sendPacket:&packet];
 		
 		if(state != STATE_CLOSED)
 		{
@@ -2279,8 +3996,7 @@ enum PseudoTcpFlags
 	DDLogVerbose(@"PseudoTcp: onUdpSocket:didSendDataWithTag:");
 	
 	// Update time of last packet sent/received
-	[lastPacketTime release];
-	lastPacketTime = [[NSDate date] retain];
+	lastPacketTime = PseudoTcpMonotonicTime();
 	
 	// Check to see if there's new data available for the delegate and, if so, inform them.
 	// Note: We also check the recvBuffer as it's possible the delegate may have read
@@ -2307,8 +4023,15 @@ enum PseudoTcpFlags
 	
 	// If something bad happens, such as the connection is refused, we'll receive a posix error.
 	// We'll need to treat such a situation as an unrecoverable error.
+	// 
+	// The exception is EMSGSIZE, which means the packet was too big for the local interface (with DF set).
+	// This is how a path mtu probe may fail, and is handled just like any other lost packet.
 	
-	if([[error domain] isEqualToString:NSPOSIXErrorDomain])
+	if([[error domain] isEqualToString:NSPOSIXErrorDomain] && ([error code] == EMSGSIZE))
+	{
+		DDLogInfo(@"PseudoTcp: Packet too large for the local interface");
+	}
+	else if([[error domain] isEqualToString:NSPOSIXErrorDomain])
 	{
 		// Error code is most likely ECONNREFUSED.
 		// But really any posix error is likely unrecoverable.
@@ -2338,8 +4061,7 @@ enum PseudoTcpFlags
 	 didReceiveData:(NSData *)data withTag:(long)tag fromHost:(NSString *)host port:(UInt16)port
 {
 	// Update time of last packet sent/received
-	[lastPacketTime release];
-	lastPacketTime = [[NSDate date] retain];
+	lastPacketTime = PseudoTcpMonotonicTime();
 	
 	if(state == STATE_CLOSED)
 	{
@@ -2353,26 +4075,27 @@ enum PseudoTcpFlags
 		return NO;
 	}
 	
-	PseudoTcpPacket *packet = [[[PseudoTcpPacket alloc] initWithData:data] autorelease];
+	PseudoTcpPacket packet;
+	PseudoTcpPacketDecode(&packet, [data bytes], (UInt32)[data length]);
 	
 	DDLogInfo(@"PseudoTcp: RECV: flg(%d%d%d%d) seq(%010u) ack(%010u) wnd(%05u) dat(%03u)",
-			  [packet isRst]  ? 1 : 0,
-			  [packet isSack] ? 1 : 0,
-			  [packet isAck]  ? 1 : 0,
-			  [packet isSyn]  ? 1 : 0,
-			  [packet sequence], [packet acknowledgement], [packet window], (unsigned)[[packet data] length]);
+			  (packet.flags & PSEUDO_TCP_FLAG_RST)  ? 1 : 0,
+			  (packet.flags & PSEUDO_TCP_FLAG_SACK) ? 1 : 0,
+			  (packet.flags & PSEUDO_TCP_FLAG_ACK)  ? 1 : 0,
+			  (packet.flags & PSEUDO_TCP_FLAG_SYN)  ? 1 : 0,
+			  packet.sequence, packet.acknowledgement, packet.window, (unsigned)packet.dataLength);
 	
 	if(state == STATE_LISTEN)
 	{
 		// We're waiting for a syn from the remote host
-		if([packet isSyn])
+		if(packet.flags & PSEUDO_TCP_FLAG_SYN)
 		{
 			// This could be a STUN validation packet that *looks* like a SYN packet at first glance.
 			// But a true SYN packet would have an acknowledgement of zero.
 			
-			if([packet acknowledgement] == 0)
+			if(packet.acknowledgement == 0)
 			{
-				[self processOpeningSyn:packet];
+				[self processOpeningSyn:&packet];
 			}
 			else
 			{
@@ -2391,14 +4114,14 @@ enum PseudoTcpFlags
 		if(state == STATE_SYN_SENT)
 		{
 			// We're waiting for a syn-ack from the remote host
-			if([packet isSyn] && [packet isAck])
+			if((packet.flags & PSEUDO_TCP_FLAG_SYN) && (packet.flags & PSEUDO_TCP_FLAG_ACK))
 			{
 				// This could be a STUN validation packet that *looks* like a SYN-ACK packet at first glance.
 				// But a true SYN-ACK packet would have the proper acknowledgement number.
 				
-				if([packet acknowledgement] == sendSequence)
+				if(packet.acknowledgement == sendSequence)
 				{
-					[self processOpeningSynAck:packet];
+					[self processOpeningSynAck:&packet];
 				}
 				else
 				{
@@ -2415,14 +4138,14 @@ enum PseudoTcpFlags
 		else if(state == STATE_SYN_RECEIVED)
 		{
 			// We're waiting for an ack to our syn-ack
-			if([packet isAck])
+			if(packet.flags & PSEUDO_TCP_FLAG_ACK)
 			{
 				// This could be a STUN validation packet that *looks* like an ACK packet at first glance.
 				// But a true ACK packet would have the proper acknowledgement number.
 				
-				if([packet acknowledgement] == sendSequence)
+				if(packet.acknowledgement == sendSequence)
 				{
-					[self processOpeningAck:packet];
+					[self processOpeningAck:&packet];
 				}
 				else
 				{
@@ -2439,14 +4162,14 @@ enum PseudoTcpFlags
 		else if(state == STATE_ESTABLISHED)
 		{
 			// We may still receive a syn-ack if our ack was lost
-			if([packet isSyn] && [packet isAck])
+			if((packet.flags & PSEUDO_TCP_FLAG_SYN) && (packet.flags & PSEUDO_TCP_FLAG_ACK))
 			{
 				// This could be a STUN validation packet that *looks* like a SYN-ACK packet at first glance.
 				// But a duplicate SYN-ACK packet would have the same sequence number as before.
 				
-				if(([packet sequence] + 1) == recvSequence)
+				if((packet.sequence + 1) == recvSequence)
 				{
-					[self processOpeningSynAck:packet];
+					[self processOpeningSynAck:&packet];
 				}
 				else
 				{
@@ -2454,19 +4177,28 @@ enum PseudoTcpFlags
 					return NO;
 				}
 			}
+			else if((packet.options & PSEUDO_TCP_HAS_FEC) && (packet.fecCount > 0))
+			{
+				// Parity packets don't carry an ack, and their data isn't part of the stream
+				[self processParity:&packet];
+			}
 			else
 			{
-				if([packet isAck])
+				if(packet.options & PSEUDO_TCP_HAS_TS)
+				{
+					[self processTimestamp:&packet];
+				}
+				if(packet.flags & PSEUDO_TCP_FLAG_ACK)
 				{
-					[self processDataAck:packet];
+					[self processDataAck:&packet];
 				}
-				if([packet data])
+				if(packet.dataLength > 0)
 				{
-					[self processData:packet];
+					[self processData:&packet];
 				}
-				if([packet isRst])
+				if(packet.flags & PSEUDO_TCP_FLAG_RST)
 				{
-					[self processRst:packet];
+					[self processRst:&packet];
 				}
 			}
 		}
@@ -2540,31 +4272,30 @@ enum PseudoTcpFlags
 /**
  * Called when the timer for a packet in the retransmissionQueue expires.
 **/
-- (void)doTimeout:(NSTimer *)aTimer
+- (void)doTimeout
 {
 	DDLogInfo(@"PseudoTcp: doTimeout: ---------------------------------------------------------");
 	
-	[retransmissionTimer release];
-	retransmissionTimer = nil;
-	
 	// When the retransmission timer expires, do the following:
 	// - Retransmit the earliest segment that has not been acknowledged
 	// - Update RTO according to back-off rules
 	// - Start the retransmission timer according to the updated RTO
 	
-	if([retransmissionQueue count] == 0)
+	if(retransmissionQueueCount == 0)
 	{
 		DDLogError(@"PseudoTcp: retransmissionTimer fired with empty retransmissionQueue");
 		return;
 	}
 	
-	// Remember: The retransmission queue stores packets in sequence number order
+	statistics.timeouts++;
 	
-	PseudoTcpPacket *packet = [retransmissionQueue objectAtIndex:0];
+	// Remember: The retransmission queue stores segments in sequence number order
 	
-	// Update ssthresh and cwnd according to RFC 2581
-	ssthresh = MAX((retransmissionQueueEffectiveSize / 2), (2 * DEFAULT_MTU));
-	cwnd = DEFAULT_MTU;
+	PseudoTcpSegment *segment = [self segmentAtIndex:0];
+	
+	// Update ssthresh and cwnd according to RFC 2581 (or whichever algorithm the congestion controller uses)
+	[congestionControl onTimeoutWithBytesInFlight:retransmissionQueueEffectiveSize];
+	cwndInflation = 0;
 	
 	// Back-off RTO according to RFC 2988
 	rto = rto * 2.0;
@@ -2581,94 +4312,99 @@ enum PseudoTcpFlags
 	// We either need to resend the packet, or we need to call it quits and terminate the TCP connection.
 	// We can determine this based on how long we've been trying to send the packet.
 	
-	NSTimeInterval timeEllapsed = [[packet firstSent] timeIntervalSinceNow] * -1.0;
+	NSTimeInterval timeEllapsed = SecondsSince(segment->firstSent);
 	
 	// Note: Empty window probes should not cause timeouts, as long as we continue to receive responses to the probes.
-	// Everytime we receive a response to a window probe, we update the firstSent timestamp of the packet.
+	// Everytime we receive a response to a window probe, we update the firstSent timestamp of the segment.
 	// Thus we shouldn't have to do anything special here concerning window probe packets.
 	// And the back-off RTO above is appropriate for probes as well.
 	
-	if((timeEllapsed >= 0.0) && (timeEllapsed < 300.0))
+	BOOL isTimeout = NO;
+	
+	if(segment->control & kSegmentSyn)
 	{
-		BOOL isTimeout = NO;
-		
-		if([packet isSyn])
-		{
-			if(timeEllapsed >= SYN_TIMEOUT)
-			{
-				isTimeout = YES;
-			}
-		}
-		else if(timeEllapsed >= DATA_TIMEOUT)
+		if(timeEllapsed >= SYN_TIMEOUT)
 		{
 			isTimeout = YES;
 		}
+	}
+	else if(timeEllapsed >= DATA_TIMEOUT)
+	{
+		isTimeout = YES;
+	}
+	
+	if(isTimeout)
+	{
+		// Update state
+		state = STATE_CLOSED;
 		
-		if(isTimeout)
+		if([delegate respondsToSelector:@selector(onPseudoTcp:willCloseWithError:)])
 		{
-			// Update state
-			state = STATE_CLOSED;
-			
-			if([delegate respondsToSelector:@selector(onPseudoTcp:willCloseWithError:)])
-			{
-				NSString *errMsg = @"Connection timed out";
-				NSDictionary *errInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
-				
-				NSError *err = [NSError errorWithDomain:NSPOSIXErrorDomain code:ETIMEDOUT userInfo:errInfo];
-				
-				[delegate onPseudoTcp:self willCloseWithError:err];
-			}
-			
-			// Release TCP resources
-			[self cleanup];
+			NSString *errMsg = @"Connection timed out";
+			NSDictionary *errInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
 			
-			if([delegate respondsToSelector:@selector(onPseudoTcpDidClose:)])
-			{
-				[delegate performSelector:@selector(onPseudoTcpDidClose:) 
-							   withObject:self
-							   afterDelay:0.0
-								  inModes:[udpSocket runLoopModes]];
-			}
+			NSError *err = [NSError errorWithDomain:NSPOSIXErrorDomain code:ETIMEDOUT userInfo:errInfo];
 			
-			return;
+			[delegate onPseudoTcp:self willCloseWithError:err];
+		}
+		
+		// Release TCP resources
+		[self cleanup];
+		
+		if([delegate respondsToSelector:@selector(onPseudoTcpDidClose:)])
+		{
+			[delegate performSelector:@selector(onPseudoTcpDidClose:) 
+						   withObject:self
+						   afterDelay:0.0
+							  inModes:[udpSocket runLoopModes]];
 		}
+		
+		return;
 	}
-	else
+	
+	// Repeated timeouts may indicate that the path can no longer handle our raised segment size
+	
+	if(state == STATE_ESTABLISHED)
 	{
-		// The time interval doesn't appear to be accurate.
-		// Maybe the user changed the clock, changed time zones, or daylight savings time kicked in.
-		// We'll reset the pacekt's firstSent time so we can timeout eventually if needed.
-		[packet setFirstSent:[NSDate date]];
-		
-		// Resetting the sent time of a packet in this situation won't interfere with the RTO calculation.
-		// This is because retransmitted packets are not used to update the RTO.
+		consecutiveTimeouts++;
+		[self maybeFallBackToDefaultMtu];
 		
-		// How did we come up with the 300 seconds limit?
-		// We use a maximum RTO of 60 seconds, and a maximum timeout of 3 minutes.
-		// So it shouldn't be possible to ever encouter a valid elapsed time interval over 4 minutes.
+		// The segment may have been split
+		segment = [self segmentAtIndex:0];
+	}
+	
+	// From RFC 3522 (Eifel detection):
+	// Remember the timestamp of our first retransmission.
+	// If the ack for it echoes an earlier timestamp, the timeout was spurious and can be undone.
+	
+	if((state == STATE_ESTABLISHED) && receiverSupportsTimestamps && !checkSpuriousTimeout)
+	{
+		checkSpuriousTimeout = YES;
+		retransmitTimestamp = TimestampNow();
 	}
 	
-	// Mark all packets in the retransmission queue as needing to be resent
+	// Mark all segments in the retransmission queue as needing to be resent
 	
 	retransmissionQueueEffectiveSize = 0;
+	retransmissionQueueResendIndex = 0;
 	
-	unsigned i;
-	for(i = 0; i < [retransmissionQueue count]; i++)
+	UInt32 i;
+	for(i = 0; i < retransmissionQueueCount; i++)
 	{
-		[[retransmissionQueue objectAtIndex:i] setIsRxQ:NO];
+		[self segmentAtIndex:i]->control &= ~kSegmentRxQ;
 	}
 	
-	// And immediately resend the oldest unacknowledged packet
+	// And immediately resend the oldest unacknowledged segment
 	
-	[self resendPacket:packet];
+	[self resendSegment:segment];
 }
 
-- (void)doAckTimeout:(NSTimer *)aTimer
+- (void)doAckTimeout
 {
 	[self sendAckNow];
 }
 
-- (void)doPersistTimeout:(NSTimer *)aTimer
+- (void)doPersistTimeout
 {
 	DDLogInfo(@"PseudoTcp: doPersistTimeout");
 	
@@ -2686,48 +4422,27 @@ enum PseudoTcpFlags
 	// the maximum value of 60 seconds. So the empty window probe will get resent after 1, 2, 4, 8, ... etc
 	// up to every 60 seconds.
 	
-	PseudoTcpPacket *packet = [[[PseudoTcpPacket alloc] init] autorelease];
-	[packet setSequence:[self sendNext]];
-	[packet setIsEmptyWindowProbe:YES];
-	
 	// An empty window probe MUST (according to our specifications) contain a single byte of data
 	
-	NSMutableData *packetData = [NSMutableData dataWithCapacity:1];
-	
-	NSData *data = [sendBuffer objectAtIndex:0];
-	
-	const void *subData = [data bytes] + sendBufferOffset;
-	[packetData appendBytes:subData length:1];
+	PseudoTcpSegment *segment = [self enqueueSegmentWithSequence:[self sendNext] length:1 control:kSegmentProbe];
 	
 	// Update the offset and size of the send buffer
 	sendBufferOffset += 1;
 	sendBufferSize -= 1;
 	
-	// If we've used up all the bytes in data, remove it from the send buffer
-	if(sendBufferOffset == [data length])
-	{
-		sendSequence += sendBufferOffset;
-		[sendBuffer removeObjectAtIndex:0];
-		sendBufferOffset = 0;
-	}
-	
-	[packet setData:packetData];
-	
-	[self sendPacket:packet];
+	[self sendSegment:segment];
 }
 
-- (void)doKeepAliveTimeout:(NSTimer *)aTimer
+- (void)doKeepAliveTimeout
 {
 	if(state == STATE_CLOSED)
 	{
-		[keepAliveTimer release];
-		keepAliveTimer = nil;
 		return;
 	}
 	
-	NSTimeInterval ti = [lastPacketTime timeIntervalSinceNow] * -1.0;
+	NSTimeInterval ti = SecondsSince(lastPacketTime);
 	
-	if((ti < 0) || (ti >= KEEP_ALIVE_TIMEOUT))
+	if(ti >= KEEP_ALIVE_TIMEOUT)
 	{
 		// Send some data to keep the UDP connection open.
 		// This is required because the router will only maintain mappings for active UDP sockets.
@@ -2739,28 +4454,15 @@ enum PseudoTcpFlags
 		[udpSocket sendData:keepAliveData withTimeout:NO_TIMEOUT tag:-1];
 		
 		// Update time of last packet sent/received
-		[lastPacketTime release];
-		lastPacketTime = [[NSDate date] retain];
+		lastPacketTime = PseudoTcpMonotonicTime();
 		
 		// Reschedule keep alive timer
-		[keepAliveTimer release];
-		keepAliveTimer = [[NSTimer timerWithTimeInterval:KEEP_ALIVE_TIMEOUT
-												  target:self
-												selector:@selector(doKeepAliveTimeout:)
-												userInfo:nil
-												 repeats:NO] retain];
-		[self runLoopAddTimer:keepAliveTimer];
+		[timerWheel scheduleTimer:&keepAliveTimer withTimeInterval:KEEP_ALIVE_TIMEOUT];
 	}
 	else
 	{
 		// Reschedule keep alive timer
-		[keepAliveTimer release];
-		keepAliveTimer = [[NSTimer timerWithTimeInterval:(KEEP_ALIVE_TIMEOUT - ti)
-												  target:self
-												selector:@selector(doKeepAliveTimeout:)
-												userInfo:nil
-												 repeats:NO] retain];
-		[self runLoopAddTimer:keepAliveTimer];
+		[timerWheel scheduleTimer:&keepAliveTimer withTimeInterval:(KEEP_ALIVE_TIMEOUT - ti)];
 	}
 }
 
@@ -0,0 +1,1373 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import <Foundation/Foundation.h>
+#import "PseudoTcp.h"
+#import "PseudoTcpCongestionControl.h"
+#import "PseudoTcpImpairedLink.h"
+#import "PseudoTcpNetworkThread.h"
+#import "PseudoTcpTimerWheel.h"
+#import "AsyncUdpSocket.h"
+#import <sys/resource.h>
+
+// Debug levels: 0-off, 1-error, 2-warn, 3-info, 4-verbose
+#ifdef CONFIGURATION_DEBUG
+  #define DEBUG_LEVEL 2
+#else
+  #define DEBUG_LEVEL 2
+#endif
+#include "DDLog.h"
+
+// A command line tool that measures PseudoTcp over a range of simulated network paths.
+//
+// Each scenario connects two PseudoTcp sockets on the loopback interface through a PseudoTcpImpairedLink,
+// and runs two tests over separate connections:
+//
+// - Throughput: The sender writes as fast as it can for the given duration, and the receiver reads everything,
+//   checking it against what was sent. Corrupt data fails the scenario.
+//   Reports the goodput (data delivered to the receiving application), the fraction of data segments that had to be
+//   retransmitted, how many segments were rebuilt from parity packets, and the CPU time used per megabyte.
+//   The CPU time is for the whole process, so it includes both endpoints and the link.
+//   Also reports how many receive buffers the two endpoints' UDP sockets had to allocate per second
+//   (that is, how often their receive buffer pools were empty), and the sender's smoothed round trip time,
+//   which includes the time the receiver takes to ack each segment.
+//
+// - Latency: The client sends a small message, the server echoes it back, and the client waits for the echo
+//   before sending the next one. Reports percentiles of the application level round trip time,
+//   which includes any time spent recovering lost packets.
+//
+// Options (all optional, in NSUserDefaults argument form, eg "-duration 5"):
+//
+// -scenario      Only run the scenario with this name
+// -congestionControl  Run every scenario with this congestion controller: "newreno", "cubic" or "delay".
+//                     By default each scenario uses its own (the socket's default, unless the scenario says otherwise).
+// -duration      Seconds to run each throughput test (default 10)
+// -pings         Number of round trips in each latency test (default 200)
+// -seed          Seed for the link's random numbers (default 1)
+// -saveBaseline  Write the results to this plist file
+// -baseline      Compare the results against this plist file, and fail if any of them have regressed
+// -tolerance     Fraction by which a result may be worse than the baseline (default 0.1)
+// -receiveBufferPool  Whether the endpoints' UDP sockets use a receive buffer pool (default YES).
+//                     Run once with NO and once with YES to compare the allocation rates.
+// -networkThread      Run the sockets and the link on a PseudoTcpNetworkThread, rather than the main thread
+// -mainThreadLoad     Milliseconds of busy work the main thread does every 100 milliseconds (default 0),
+//                     standing in for the user interface. Compare the round trip times with and without
+//                     -networkThread to see how much the main thread's load holds up acks.
+// -fecCheck      Whether to check that lost segments are rebuilt correctly from parity packets (default YES).
+//                This doesn't use the link, but chooses exactly which packets are lost (see PseudoTcpFecCheck).
+//
+// The exit status is zero unless a test failed to run, or a result regressed.
+// So the tool can be used as a regression gate for changes to congestion control, buffering or pacing:
+// save a baseline before the change, and compare against it afterwards (on the same machine).
+
+#define PAYLOAD_SIZE        (64 * 1024)  // Chunk of data the sender writes over and over
+#define PING_SIZE           64
+#define PING_INTERVAL       0.01         // Pause between receiving an echo and sending the next ping
+#define CONNECT_TIMEOUT     10.0
+#define LATENCY_TIMEOUT     120.0
+
+#define LOOPBACK_MTU        0            // No limit beyond the loopback interface itself
+#define ETHERNET_MTU        1472         // 1500 bytes, less the IPv4 and UDP headers
+
+#define DEFAULT_PACING      -1.0F        // Leave the socket's default pacing gain alone
+
+#define NSEC_PER_SECOND     1000000000.0
+
+#define MAIN_THREAD_LOAD_INTERVAL  0.1
+
+/**
+ * A simulated network path, and the socket options to test over it.
+**/
+struct PseudoTcpBenchmarkScenario
+{
+	const char *name;
+	const char *description;
+	PseudoTcpImpairment impairment;  // delay, jitter, loss, reorder, rate, queueLimit, mtu
+	float pacingGain;
+	BOOL forwardErrorCorrection;
+	const char *congestionControl;   // "newreno", "cubic" or "delay", or NULL for the socket's default
+};
+typedef struct PseudoTcpBenchmarkScenario PseudoTcpBenchmarkScenario;
+
+static const PseudoTcpBenchmarkScenario scenarios[] = {
+	{ "loopback",       "No impairment",
+	  { 0.000, 0.000, 0.00F,  0.00F,       0,      0, LOOPBACK_MTU }, DEFAULT_PACING, NO,  NULL      },
+	{ "wan",            "40ms delay, 2ms jitter",
+	  { 0.040, 0.002, 0.00F,  0.00F,       0,      0, ETHERNET_MTU }, DEFAULT_PACING, NO,  NULL      },
+	{ "lossy",          "40ms delay, 1% loss",
+	  { 0.040, 0.002, 0.01F,  0.00F,       0,      0, ETHERNET_MTU }, DEFAULT_PACING, NO,  NULL      },
+	{ "lossy-fec",      "40ms delay, 1% loss, forward error correction",
+	  { 0.040, 0.002, 0.01F,  0.00F,       0,      0, ETHERNET_MTU }, DEFAULT_PACING, YES, NULL      },
+	{ "reorder",        "20ms delay, 5% reordered",
+	  { 0.020, 0.000, 0.00F,  0.05F,       0,      0, ETHERNET_MTU }, DEFAULT_PACING, NO,  NULL      },
+	{ "dsl",            "1 Mbit/s, 20ms delay, 32KB queue",
+	  { 0.020, 0.000, 0.00F,  0.00F,  125000,  32768, ETHERNET_MTU }, DEFAULT_PACING, NO,  NULL      },
+	{ "dsl-unpaced",    "1 Mbit/s, 20ms delay, 32KB queue, pacing disabled",
+	  { 0.020, 0.000, 0.00F,  0.00F,  125000,  32768, ETHERNET_MTU }, 0.0F,           NO,  NULL      },
+	{ "cable",          "20 Mbit/s, 15ms delay, 64KB queue, 0.1% loss",
+	  { 0.015, 0.001, 0.001F, 0.00F, 2500000,  65536, ETHERNET_MTU }, DEFAULT_PACING, NO,  NULL      },
+	
+	// A long, fat path, with and without random loss, run with each of the congestion controllers.
+	// The bandwidth-delay product (200KB) fits in the socket buffers, so how much of it gets used is up to the controller.
+	{ "longfat-reno",   "16 Mbit/s, 50ms delay, 128KB queue, NewReno",
+	  { 0.050, 0.000, 0.00F,  0.00F, 2000000, 131072, ETHERNET_MTU }, DEFAULT_PACING, NO,  "newreno" },
+	{ "longfat-cubic",  "16 Mbit/s, 50ms delay, 128KB queue, CUBIC",
+	  { 0.050, 0.000, 0.00F,  0.00F, 2000000, 131072, ETHERNET_MTU }, DEFAULT_PACING, NO,  "cubic"   },
+	{ "longfat-delay",  "16 Mbit/s, 50ms delay, 128KB queue, delay based",
+	  { 0.050, 0.000, 0.00F,  0.00F, 2000000, 131072, ETHERNET_MTU }, DEFAULT_PACING, NO,  "delay"   },
+	{ "lossyfat-reno",  "16 Mbit/s, 50ms delay, 128KB queue, 0.5% loss, NewReno",
+	  { 0.050, 0.000, 0.005F, 0.00F, 2000000, 131072, ETHERNET_MTU }, DEFAULT_PACING, NO,  "newreno" },
+	{ "lossyfat-cubic", "16 Mbit/s, 50ms delay, 128KB queue, 0.5% loss, CUBIC",
+	  { 0.050, 0.000, 0.005F, 0.00F, 2000000, 131072, ETHERNET_MTU }, DEFAULT_PACING, NO,  "cubic"   },
+	{ "lossyfat-delay", "16 Mbit/s, 50ms delay, 128KB queue, 0.5% loss, delay based",
+	  { 0.050, 0.000, 0.005F, 0.00F, 2000000, 131072, ETHERNET_MTU }, DEFAULT_PACING, NO,  "delay"   },
+};
+
+#define SCENARIO_COUNT  (sizeof(scenarios) / sizeof(PseudoTcpBenchmarkScenario))
+
+// Result keys, as stored in the baseline plist
+#define GOODPUT_KEY           @"goodput"            // KB/s
+#define RETRANSMIT_RATIO_KEY  @"retransmitRatio"
+#define REBUILT_KEY           @"segmentsRebuilt"
+#define CPU_KEY               @"cpuPerMB"           // Milliseconds
+#define BUFFER_ALLOCS_KEY     @"bufferAllocs"       // Receive buffer allocations per second
+#define SRTT_KEY              @"srtt"               // Milliseconds
+#define RTT_P50_KEY           @"rttP50"             // Milliseconds
+#define RTT_P90_KEY           @"rttP90"
+#define RTT_P99_KEY           @"rttP99"
+
+/**
+ * Returns the CPU time (user plus system) used by the process so far, in seconds.
+**/
+static NSTimeInterval ProcessCpuTime()
+{
+	struct rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	
+	return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) + ((usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1000000.0);
+}
+
+/**
+ * Returns the congestion controller class with the given name (as used in the scenarios),
+ * or Nil if the name is NULL or unknown.
+**/
+static Class CongestionControlClass(const char *name)
+{
+	if(name == NULL) return Nil;
+	
+	if(strcmp(name, "newreno") == 0) return [PseudoTcpNewReno class];
+	if(strcmp(name, "cubic") == 0)   return [PseudoTcpCubic class];
+	if(strcmp(name, "delay") == 0)   return [PseudoTcpDelayBased class];
+	
+	return Nil;
+}
+
+static int CompareDoubles(const void *a, const void *b)
+{
+	double x = *(const double *)a;
+	double y = *(const double *)b;
+	
+	return (x < y) ? -1 : ((x > y) ? 1 : 0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@interface PseudoTcpBenchmark : NSObject
+{
+	PseudoTcpBenchmarkScenario scenario;
+	BOOL usesReceiveBufferPool;
+	PseudoTcpNetworkThread *networkThread;
+	
+	// Owned by the network thread, if there is one
+	PseudoTcpImpairedLink *link;
+	PseudoTcp *client;
+	PseudoTcp *server;
+	
+	BOOL isLatencyTest;
+	volatile BOOL isOpen;
+	volatile BOOL finished;
+	volatile BOOL failed;
+	
+	// Throughput
+	NSData *payload;
+	UInt32 payloadOffset;
+	UInt64 bytesReceived;
+	UInt64 startTime;
+	NSTimeInterval startCpuTime;
+	UInt64 startBufferAllocs;
+	UInt64 elapsedTime;
+	NSTimeInterval cpuTime;
+	UInt64 bufferAllocs;
+	PseudoTcpStatistics clientStatistics;
+	PseudoTcpStatistics serverStatistics;
+	
+	// Latency
+	UInt8 pingBuffer[PING_SIZE];
+	UInt32 pingBytesReceived;
+	UInt64 pingTime;
+	UInt32 pingCount;
+	double *rttSamples;
+	UInt32 rttSampleCount;
+	UInt32 rttSampleCapacity;
+}
+
+- (id)initWithScenario:(const PseudoTcpBenchmarkScenario *)aScenario;
+
+- (void)setUsesReceiveBufferPool:(BOOL)flag;
+- (void)setNetworkThread:(PseudoTcpNetworkThread *)thread;
+
++ (void)simulateMainThreadLoad:(NSTimer *)timer;
+
+- (NSDictionary *)runThroughputTestForDuration:(NSTimeInterval)duration;
+- (NSDictionary *)runLatencyTestWithPings:(UInt32)pings;
+
+@end
+
+@interface PseudoTcpBenchmark (PrivateAPI)
+- (void)performOnNetworkThread:(SEL)selector;
+- (void)openConnection;
+- (void)closeConnection;
+- (void)finishThroughputTest;
+- (BOOL)runUntilDate:(UInt64)deadline orCondition:(volatile BOOL *)condition;
+- (void)writePayload;
+- (BOOL)isPayload:(const UInt8 *)bytes length:(UInt32)length;
+- (void)sendPing;
+- (UInt64)receiveBufferAllocs;
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpBenchmark
+
+- (id)initWithScenario:(const PseudoTcpBenchmarkScenario *)aScenario
+{
+	if((self = [super init]))
+	{
+		scenario = *aScenario;
+		usesReceiveBufferPool = YES;
+		
+		// Random data, so nothing along the way gets to cheat by compressing it
+		UInt8 *bytes = malloc(PAYLOAD_SIZE);
+		UInt32 i;
+		for(i = 0; i < PAYLOAD_SIZE; i++)
+		{
+			bytes[i] = (UInt8)random();
+		}
+		payload = [[NSData alloc] initWithBytesNoCopy:bytes length:PAYLOAD_SIZE freeWhenDone:YES];
+		
+		rttSampleCapacity = 0;
+		rttSampleCount = 0;
+		rttSamples = NULL;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[self performOnNetworkThread:@selector(closeConnection)];
+	[networkThread release];
+	[payload release];
+	free(rttSamples);
+	[super dealloc];
+}
+
+- (void)setUsesReceiveBufferPool:(BOOL)flag
+{
+	usesReceiveBufferPool = flag;
+}
+
+- (void)setNetworkThread:(PseudoTcpNetworkThread *)thread
+{
+	[networkThread autorelease];
+	networkThread = [thread retain];
+}
+
+/**
+ * Keeps the main thread busy for the number of milliseconds in the timer's userInfo.
+**/
++ (void)simulateMainThreadLoad:(NSTimer *)timer
+{
+	UInt64 busyUntil = PseudoTcpMonotonicTime() + (UInt64)([[timer userInfo] doubleValue] * 1000000.0);
+	
+	while(PseudoTcpMonotonicTime() < busyUntil)
+	{
+		// Spin
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Tests
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Sends data as fast as possible for the given duration.
+ * Returns the results, or nil if the connection failed.
+**/
+- (NSDictionary *)runThroughputTestForDuration:(NSTimeInterval)duration
+{
+	isLatencyTest = NO;
+	payloadOffset = 0;
+	bytesReceived = 0;
+	
+	[self performOnNetworkThread:@selector(openConnection)];
+	if(failed) return nil;
+	
+	UInt64 deadline = PseudoTcpMonotonicTime() + (UInt64)(CONNECT_TIMEOUT * NSEC_PER_SECOND);
+	
+	if(![self runUntilDate:deadline orCondition:&isOpen])
+	{
+		DDLogError(@"PseudoTcpBenchmark: %s: Connection timed out", scenario.name);
+		
+		[self performOnNetworkThread:@selector(closeConnection)];
+		return nil;
+	}
+	
+	// The clock starts when the handshake completes (see onPseudoTcpDidOpen:)
+	
+	deadline = startTime + (UInt64)(duration * NSEC_PER_SECOND);
+	[self runUntilDate:deadline orCondition:&finished];
+	
+	[self performOnNetworkThread:@selector(finishThroughputTest)];
+	
+	if(failed || (bytesReceived == 0)) return nil;
+	
+	NSTimeInterval elapsed = elapsedTime / NSEC_PER_SECOND;
+	double megabytes = bytesReceived / (1024.0 * 1024.0);
+	double retransmitRatio = 0.0;
+	
+	if(clientStatistics.segmentsSent > 0)
+	{
+		retransmitRatio = (double)clientStatistics.segmentsRetransmitted / (double)clientStatistics.segmentsSent;
+	}
+	
+	NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:6];
+	
+	[result setObject:[NSNumber numberWithDouble:(bytesReceived / 1024.0 / elapsed)] forKey:GOODPUT_KEY];
+	[result setObject:[NSNumber numberWithDouble:retransmitRatio] forKey:RETRANSMIT_RATIO_KEY];
+	[result setObject:[NSNumber numberWithUnsignedInt:serverStatistics.segmentsRebuilt] forKey:REBUILT_KEY];
+	[result setObject:[NSNumber numberWithDouble:(cpuTime * 1000.0 / megabytes)] forKey:CPU_KEY];
+	[result setObject:[NSNumber numberWithDouble:(bufferAllocs / elapsed)] forKey:BUFFER_ALLOCS_KEY];
+	[result setObject:[NSNumber numberWithDouble:(clientStatistics.srtt * 1000.0)] forKey:SRTT_KEY];
+	
+	return result;
+}
+
+/**
+ * Bounces small messages back and forth, one at a time.
+ * Returns the results, or nil if the connection failed.
+**/
+- (NSDictionary *)runLatencyTestWithPings:(UInt32)pings
+{
+	isLatencyTest = YES;
+	pingBytesReceived = 0;
+	pingCount = pings;
+	rttSampleCount = 0;
+	
+	if(rttSampleCapacity < pings)
+	{
+		rttSampleCapacity = pings;
+		rttSamples = reallocf(rttSamples, rttSampleCapacity * sizeof(double));
+	}
+	
+	[self performOnNetworkThread:@selector(openConnection)];
+	if(failed) return nil;
+	
+	UInt64 deadline = PseudoTcpMonotonicTime() + (UInt64)(CONNECT_TIMEOUT * NSEC_PER_SECOND);
+	
+	if(![self runUntilDate:deadline orCondition:&isOpen])
+	{
+		DDLogError(@"PseudoTcpBenchmark: %s: Connection timed out", scenario.name);
+		
+		[self performOnNetworkThread:@selector(closeConnection)];
+		return nil;
+	}
+	
+	deadline = PseudoTcpMonotonicTime() + (UInt64)(LATENCY_TIMEOUT * NSEC_PER_SECOND);
+	[self runUntilDate:deadline orCondition:&finished];
+	
+	[self performOnNetworkThread:@selector(closeConnection)];
+	
+	if(failed || (rttSampleCount == 0)) return nil;
+	
+	qsort(rttSamples, rttSampleCount, sizeof(double), CompareDoubles);
+	
+	UInt32 p50 = (UInt32)((rttSampleCount - 1) * 0.50);
+	UInt32 p90 = (UInt32)((rttSampleCount - 1) * 0.90);
+	UInt32 p99 = (UInt32)((rttSampleCount - 1) * 0.99);
+	
+	NSMutableDictionary *result = [NSMutableDictionary dictionaryWithCapacity:3];
+	
+	[result setObject:[NSNumber numberWithDouble:(rttSamples[p50] * 1000.0)] forKey:RTT_P50_KEY];
+	[result setObject:[NSNumber numberWithDouble:(rttSamples[p90] * 1000.0)] forKey:RTT_P90_KEY];
+	[result setObject:[NSNumber numberWithDouble:(rttSamples[p99] * 1000.0)] forKey:RTT_P99_KEY];
+	
+	return result;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Private API
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Invokes the selector on the network thread (waiting for it to finish), or directly if there isn't one.
+**/
+- (void)performOnNetworkThread:(SEL)selector
+{
+	if(networkThread)
+		[networkThread performSelector:selector target:self withObject:nil waitUntilDone:YES];
+	else
+		[self performSelector:selector];
+}
+
+/**
+ * Creates a link and a pair of connected PseudoTcp sockets, and starts the handshake.
+ * Sets failed if the sockets couldn't be set up.
+**/
+- (void)openConnection
+{
+	isOpen = NO;
+	finished = NO;
+	failed = NO;
+	
+	link = [[PseudoTcpImpairedLink alloc] initWithImpairment:scenario.impairment];
+	if(link == nil)
+	{
+		failed = YES;
+		return;
+	}
+	
+	AsyncUdpSocket *clientSocket = [[[AsyncUdpSocket alloc] initIPv4] autorelease];
+	AsyncUdpSocket *serverSocket = [[[AsyncUdpSocket alloc] initIPv4] autorelease];
+	
+	NSError *err = nil;
+	
+	if(![clientSocket bindToAddress:@"127.0.0.1" port:0 error:&err] ||
+	   ![serverSocket bindToAddress:@"127.0.0.1" port:0 error:&err] ||
+	   ![link connectEndpoint:clientSocket withEndpoint:serverSocket error:&err])
+	{
+		DDLogError(@"PseudoTcpBenchmark: Unable to set up sockets: %@", err);
+		
+		[self closeConnection];
+		failed = YES;
+		return;
+	}
+	
+	client = [[PseudoTcp alloc] initWithUdpSocket:clientSocket];
+	server = [[PseudoTcp alloc] initWithUdpSocket:serverSocket];
+	
+	[client setDelegate:self];
+	[server setDelegate:self];
+	
+	[clientSocket setUsesReceiveBufferPool:usesReceiveBufferPool];
+	[serverSocket setUsesReceiveBufferPool:usesReceiveBufferPool];
+	
+	if(scenario.pacingGain >= 0.0F)
+	{
+		[client setPacingGain:scenario.pacingGain];
+		[server setPacingGain:scenario.pacingGain];
+	}
+	
+	[client setForwardErrorCorrection:scenario.forwardErrorCorrection];
+	[server setForwardErrorCorrection:scenario.forwardErrorCorrection];
+	
+	// Each socket needs its own controller, as they keep per-connection state
+	Class congestionControlClass = CongestionControlClass(scenario.congestionControl);
+	if(congestionControlClass)
+	{
+		[client setCongestionControl:[[[congestionControlClass alloc] init] autorelease]];
+		[server setCongestionControl:[[[congestionControlClass alloc] init] autorelease]];
+	}
+	
+	[server passiveOpen];
+	[client activeOpen];
+}
+
+/**
+ * Tears down the sockets and the link, without waiting for anything in flight.
+**/
+- (void)closeConnection
+{
+	[client setDelegate:nil];
+	[client release];
+	client = nil;
+	
+	[server setDelegate:nil];
+	[server release];
+	server = nil;
+	
+	[link close];
+	[link release];
+	link = nil;
+	
+	[NSObject cancelPreviousPerformRequestsWithTarget:self];
+}
+
+/**
+ * Takes down the results of the throughput test, and closes the connection.
+**/
+- (void)finishThroughputTest
+{
+	elapsedTime = PseudoTcpMonotonicTime() - startTime;
+	cpuTime = ProcessCpuTime() - startCpuTime;
+	bufferAllocs = [self receiveBufferAllocs] - startBufferAllocs;
+	
+	clientStatistics = [client statistics];
+	serverStatistics = [server statistics];
+	
+	[self closeConnection];
+}
+
+/**
+ * Runs the current run loop until the deadline passes, or the condition becomes true.
+ * The condition may be set on the network thread.
+ * Returns the condition.
+**/
+- (BOOL)runUntilDate:(UInt64)deadline orCondition:(volatile BOOL *)condition
+{
+	NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+	
+	while(!(*condition) && (PseudoTcpMonotonicTime() < deadline))
+	{
+		NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+		
+		if(![runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]])
+		{
+			// Nothing is on this run loop (everything is on the network thread), so it returned immediately
+			[NSThread sleepUntilDate:[NSDate dateWithTimeIntervalSinceNow:0.01]];
+		}
+		
+		[pool release];
+	}
+	
+	return *condition;
+}
+
+/**
+ * Fills the client's send buffer.
+**/
+- (void)writePayload
+{
+	while([client canAcceptBytes])
+	{
+		UInt32 written = [client writeData:payload atOffset:payloadOffset withMaxLength:PAYLOAD_SIZE];
+		if(written == 0) break;
+		
+		payloadOffset = (payloadOffset + written) % PAYLOAD_SIZE;
+	}
+}
+
+/**
+ * Returns whether the received bytes match the payload, starting where the data received so far leaves off.
+ * The sender writes the payload over and over, so the received data may wrap around to its start.
+**/
+- (BOOL)isPayload:(const UInt8 *)bytes length:(UInt32)length
+{
+	const UInt8 *payloadBytes = [payload bytes];
+	UInt32 offset = (UInt32)(bytesReceived % PAYLOAD_SIZE);
+	
+	while(length > 0)
+	{
+		UInt32 chunkLength = MIN(length, PAYLOAD_SIZE - offset);
+		
+		if(memcmp(bytes, payloadBytes + offset, chunkLength) != 0) return NO;
+		
+		bytes += chunkLength;
+		length -= chunkLength;
+		offset = 0;
+	}
+	
+	return YES;
+}
+
+- (void)sendPing
+{
+	UInt32 i;
+	for(i = 0; i < PING_SIZE; i++)
+	{
+		pingBuffer[i] = (UInt8)random();
+	}
+	
+	NSData *ping = [NSData dataWithBytesNoCopy:pingBuffer length:PING_SIZE freeWhenDone:NO];
+	
+	pingBytesReceived = 0;
+	pingTime = PseudoTcpMonotonicTime();
+	
+	if([client writeData:ping atOffset:0 withMaxLength:PING_SIZE] < PING_SIZE)
+	{
+		DDLogError(@"PseudoTcpBenchmark: %s: Unable to write ping", scenario.name);
+		
+		failed = YES;
+		finished = YES;
+	}
+}
+
+/**
+ * Returns the number of receive buffers the endpoints' UDP sockets have allocated so far.
+**/
+- (UInt64)receiveBufferAllocs
+{
+	return [[client udpSocket] receiveBufferPoolMisses] + [[server udpSocket] receiveBufferPoolMisses];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark PseudoTcp Delegate Methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)onPseudoTcpDidOpen:(id <PseudoTcpSocket>)sock
+{
+	if(sock != client) return;
+	
+	isOpen = YES;
+	
+	if(isLatencyTest)
+	{
+		[self sendPing];
+	}
+	else
+	{
+		startTime = PseudoTcpMonotonicTime();
+		startCpuTime = ProcessCpuTime();
+		startBufferAllocs = [self receiveBufferAllocs];
+		
+		[self writePayload];
+	}
+}
+
+- (void)onPseudoTcpHasBytesAvailable:(id <PseudoTcpSocket>)sock
+{
+	const UInt8 *bytes;
+	UInt32 length;
+	
+	if(sock == server)
+	{
+		while((length = [server peekBytes:&bytes]) > 0)
+		{
+			if(isLatencyTest)
+			{
+				// Echo it straight back
+				NSData *echo = [NSData dataWithBytesNoCopy:(void *)bytes length:length freeWhenDone:NO];
+				
+				length = [server writeData:echo atOffset:0 withMaxLength:length];
+				if(length == 0) break;
+			}
+			else if(![self isPayload:bytes length:length])
+			{
+				DDLogError(@"PseudoTcpBenchmark: %s: Received data doesn't match what was sent, at offset %llu",
+				           scenario.name, bytesReceived);
+				
+				failed = YES;
+				finished = YES;
+				return;
+			}
+			
+			bytesReceived += length;
+			[server consumeBytes:length];
+		}
+	}
+	else if(sock == client)
+	{
+		while((length = [client peekBytes:&bytes]) > 0)
+		{
+			pingBytesReceived += length;
+			[client consumeBytes:length];
+		}
+		
+		if(isLatencyTest && (pingBytesReceived >= PING_SIZE))
+		{
+			pingBytesReceived -= PING_SIZE;
+			
+			rttSamples[rttSampleCount++] = (PseudoTcpMonotonicTime() - pingTime) / NSEC_PER_SECOND;
+			
+			if(rttSampleCount < pingCount)
+				[self performSelector:@selector(sendPing) withObject:nil afterDelay:PING_INTERVAL];
+			else
+				finished = YES;
+		}
+	}
+}
+
+- (void)onPseudoTcpCanAcceptBytes:(id <PseudoTcpSocket>)sock
+{
+	if((sock == client) && !isLatencyTest)
+	{
+		[self writePayload];
+	}
+	else if(sock == server)
+	{
+		// An echo didn't fit earlier
+		[self onPseudoTcpHasBytesAvailable:server];
+	}
+}
+
+- (void)onPseudoTcp:(id <PseudoTcpSocket>)sock willCloseWithError:(NSError *)err
+{
+	DDLogError(@"PseudoTcpBenchmark: %s: Connection closed unexpectedly: %@", scenario.name, err);
+	
+	failed = YES;
+	finished = YES;
+}
+
+- (void)onPseudoTcpDidClose:(id <PseudoTcpSocket>)sock
+{
+	failed = YES;
+	finished = YES;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+#define FEC_CHECK_GROUP_SIZE   4
+#define FEC_CHECK_GROUP_COUNT  3
+#define FEC_CHECK_LOST_GROUP   1                            // Losses are in the middle group
+#define FEC_CHECK_PARITY       (1 << FEC_CHECK_GROUP_SIZE)  // Lost bit for the group's parity packet
+#define FEC_CHECK_ISN          1000
+#define FEC_CHECK_WINDOW       65535
+#define FEC_CHECK_TIMEOUT      2.0
+
+#define NO_TIMEOUT  -1
+
+// The last segment is short, so the parity has to be padded
+static const UInt16 fecCheckLengths[FEC_CHECK_GROUP_SIZE] = { 1000, 1000, 1000, 600 };
+
+/**
+ * A pattern of losses in the middle parity group.
+ * Each bit is a segment of the group (or the parity packet), that is left out the first time around.
+**/
+struct PseudoTcpFecCheckCase
+{
+	const char *description;
+	UInt32 lost;
+};
+typedef struct PseudoTcpFecCheckCase PseudoTcpFecCheckCase;
+
+static const PseudoTcpFecCheckCase fecCheckCases[] = {
+	{ "no loss",                0 },
+	{ "first segment",          (1 << 0) },
+	{ "middle segment",         (1 << 1) },
+	{ "short last segment",     (1 << 3) },
+	{ "two segments",           (1 << 0) | (1 << 2) },
+	{ "segment and parity",     (1 << 1) | FEC_CHECK_PARITY },
+};
+
+#define FEC_CHECK_CASE_COUNT  (sizeof(fecCheckCases) / sizeof(PseudoTcpFecCheckCase))
+
+/**
+ * Checks that the receiver rebuilds lost segments from parity packets correctly.
+ * 
+ * Random loss can't tell us much about this, since which segments get lost (and which groups they fall in)
+ * changes from run to run. So here we play the part of the sender ourselves, over a plain UDP socket.
+ * We do the handshake by hand, and then send a few parity groups, leaving out exactly the packets we choose.
+ * 
+ * A single lost segment is never resent, so the stream can only be complete if it was rebuilt.
+ * Anything more than that can't be rebuilt from one parity packet, so the lost segments are resent after the parity,
+ * which checks that a useless parity packet doesn't corrupt anything on its way through.
+ * Either way, every byte the receiving application reads is compared against what was sent.
+**/
+@interface PseudoTcpFecCheck : NSObject
+{
+	AsyncUdpSocket *peer;
+	PseudoTcp *server;
+	
+	NSData *sentData;
+	UInt32 serverSequence;
+	UInt64 bytesReceived;
+	
+	volatile BOOL synAckReceived;
+	volatile BOOL finished;
+	volatile BOOL failed;
+}
+
+- (BOOL)runCase:(const PseudoTcpFecCheckCase *)fecCase;
+
+@end
+
+@interface PseudoTcpFecCheck (PrivateAPI)
+- (BOOL)openConnection;
+- (void)closeConnection;
+- (void)sendPacket:(PseudoTcpPacket *)packet;
+- (void)sendSegment:(UInt32)index ofGroup:(UInt32)group;
+- (void)sendParityForGroup:(UInt32)group;
+- (BOOL)runUntilDate:(UInt64)deadline orCondition:(volatile BOOL *)condition;
+@end
+
+@implementation PseudoTcpFecCheck
+
+- (id)init
+{
+	if((self = [super init]))
+	{
+		UInt32 length = 0;
+		
+		UInt32 i;
+		for(i = 0; i < FEC_CHECK_GROUP_SIZE; i++)
+		{
+			length += fecCheckLengths[i];
+		}
+		length *= FEC_CHECK_GROUP_COUNT;
+		
+		UInt8 *bytes = malloc(length);
+		for(i = 0; i < length; i++)
+		{
+			bytes[i] = (UInt8)random();
+		}
+		sentData = [[NSData alloc] initWithBytesNoCopy:bytes length:length freeWhenDone:YES];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[self closeConnection];
+	[sentData release];
+	[super dealloc];
+}
+
+/**
+ * Runs a single loss pattern over a new connection.
+ * Returns YES if the receiver delivered exactly what was sent, and rebuilt the expected number of segments.
+**/
+- (BOOL)runCase:(const PseudoTcpFecCheckCase *)fecCase
+{
+	bytesReceived = 0;
+	finished = NO;
+	failed = NO;
+	
+	if(![self openConnection])
+	{
+		[self closeConnection];
+		return NO;
+	}
+	
+	UInt32 lostSegments = 0;
+	
+	UInt32 i;
+	for(i = 0; i < FEC_CHECK_GROUP_SIZE; i++)
+	{
+		if(fecCase->lost & (1 << i)) lostSegments++;
+	}
+	
+	BOOL rebuildable = (lostSegments == 1) && !(fecCase->lost & FEC_CHECK_PARITY);
+	
+	UInt32 group;
+	for(group = 0; group < FEC_CHECK_GROUP_COUNT; group++)
+	{
+		UInt32 lost = (group == FEC_CHECK_LOST_GROUP) ? fecCase->lost : 0;
+		
+		for(i = 0; i < FEC_CHECK_GROUP_SIZE; i++)
+		{
+			if(!(lost & (1 << i))) [self sendSegment:i ofGroup:group];
+		}
+		
+		if(!(lost & FEC_CHECK_PARITY)) [self sendParityForGroup:group];
+	}
+	
+	if(!rebuildable)
+	{
+		for(i = 0; i < FEC_CHECK_GROUP_SIZE; i++)
+		{
+			if(fecCase->lost & (1 << i)) [self sendSegment:i ofGroup:FEC_CHECK_LOST_GROUP];
+		}
+	}
+	
+	UInt64 deadline = PseudoTcpMonotonicTime() + (UInt64)(FEC_CHECK_TIMEOUT * NSEC_PER_SECOND);
+	[self runUntilDate:deadline orCondition:&finished];
+	
+	UInt32 rebuilt = [server statistics].segmentsRebuilt;
+	UInt32 expectedRebuilt = rebuildable ? 1 : 0;
+	
+	[self closeConnection];
+	
+	if(failed) return NO;
+	
+	if(bytesReceived != [sentData length])
+	{
+		printf("fec check: %s: received %llu of %lu bytes\n",
+		       fecCase->description, bytesReceived, (unsigned long)[sentData length]);
+		return NO;
+	}
+	
+	if(rebuilt != expectedRebuilt)
+	{
+		printf("fec check: %s: rebuilt %u segments, expected %u\n", fecCase->description, rebuilt, expectedRebuilt);
+		return NO;
+	}
+	
+	return YES;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Private API
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Connects our plain UDP socket to a listening PseudoTcp socket, and does the handshake.
+ * Returns NO if the connection couldn't be opened.
+**/
+- (BOOL)openConnection
+{
+	peer = [[AsyncUdpSocket alloc] initIPv4];
+	AsyncUdpSocket *serverSocket = [[[AsyncUdpSocket alloc] initIPv4] autorelease];
+	
+	NSError *err = nil;
+	
+	if(![peer bindToAddress:@"127.0.0.1" port:0 error:&err] ||
+	   ![serverSocket bindToAddress:@"127.0.0.1" port:0 error:&err] ||
+	   ![peer connectToHost:@"127.0.0.1" onPort:[serverSocket localPort] error:&err] ||
+	   ![serverSocket connectToHost:@"127.0.0.1" onPort:[peer localPort] error:&err])
+	{
+		DDLogError(@"PseudoTcpFecCheck: Unable to set up sockets: %@", err);
+		return NO;
+	}
+	
+	[peer setDelegate:self];
+	
+	server = [[PseudoTcp alloc] initWithUdpSocket:serverSocket];
+	[server setDelegate:self];
+	[server passiveOpen];
+	
+	synAckReceived = NO;
+	[peer receiveWithTimeout:NO_TIMEOUT tag:0];
+	
+	// Offer to receive parity packets, just like a real PseudoTcp would
+	PseudoTcpPacket syn;
+	PseudoTcpPacketInit(&syn);
+	syn.flags = PSEUDO_TCP_FLAG_SYN;
+	syn.sequence = FEC_CHECK_ISN;
+	syn.window = FEC_CHECK_WINDOW;
+	PseudoTcpPacketSetFecGroup(&syn, 0, NULL);
+	
+	[self sendPacket:&syn];
+	
+	UInt64 deadline = PseudoTcpMonotonicTime() + (UInt64)(CONNECT_TIMEOUT * NSEC_PER_SECOND);
+	
+	if(![self runUntilDate:deadline orCondition:&synAckReceived])
+	{
+		DDLogError(@"PseudoTcpFecCheck: Connection timed out");
+		return NO;
+	}
+	
+	PseudoTcpPacket ack;
+	PseudoTcpPacketInit(&ack);
+	ack.flags = PSEUDO_TCP_FLAG_ACK;
+	ack.sequence = FEC_CHECK_ISN + 1;
+	ack.acknowledgement = serverSequence;
+	ack.window = FEC_CHECK_WINDOW;
+	
+	[self sendPacket:&ack];
+	
+	return YES;
+}
+
+- (void)closeConnection
+{
+	[server setDelegate:nil];
+	[server release];
+	server = nil;
+	
+	[peer setDelegate:nil];
+	[peer close];
+	[peer release];
+	peer = nil;
+}
+
+- (void)sendPacket:(PseudoTcpPacket *)packet
+{
+	UInt32 headerLength = PseudoTcpPacketHeaderLength(packet);
+	
+	NSMutableData *datagram = [NSMutableData dataWithLength:headerLength];
+	PseudoTcpPacketEncodeHeader(packet, [datagram mutableBytes]);
+	
+	[datagram appendBytes:packet->data length:packet->dataLength];
+	
+	[peer sendData:datagram withTimeout:NO_TIMEOUT tag:0];
+}
+
+/**
+ * Sends a data segment.
+ * The segments don't carry an ack, since the server never has anything for us to acknowledge.
+**/
+- (void)sendSegment:(UInt32)index ofGroup:(UInt32)group
+{
+	UInt32 offset = group * ([sentData length] / FEC_CHECK_GROUP_COUNT);
+	
+	UInt32 i;
+	for(i = 0; i < index; i++)
+	{
+		offset += fecCheckLengths[i];
+	}
+	
+	PseudoTcpPacket packet;
+	PseudoTcpPacketInit(&packet);
+	packet.sequence = FEC_CHECK_ISN + 1 + offset;
+	packet.window = FEC_CHECK_WINDOW;
+	packet.data = (const UInt8 *)[sentData bytes] + offset;
+	packet.dataLength = fecCheckLengths[index];
+	
+	[self sendPacket:&packet];
+}
+
+/**
+ * Sends the parity packet for a group, computed independently of PseudoTcp's own sender.
+**/
+- (void)sendParityForGroup:(UInt32)group
+{
+	UInt32 groupOffset = group * ([sentData length] / FEC_CHECK_GROUP_COUNT);
+	UInt32 parityLength = 0;
+	
+	UInt32 i, j;
+	for(i = 0; i < FEC_CHECK_GROUP_SIZE; i++)
+	{
+		parityLength = MAX(parityLength, fecCheckLengths[i]);
+	}
+	
+	UInt8 *parity = calloc(1, parityLength);
+	const UInt8 *bytes = (const UInt8 *)[sentData bytes] + groupOffset;
+	
+	for(i = 0; i < FEC_CHECK_GROUP_SIZE; i++)
+	{
+		for(j = 0; j < fecCheckLengths[i]; j++)
+		{
+			parity[j] ^= bytes[j];
+		}
+		bytes += fecCheckLengths[i];
+	}
+	
+	PseudoTcpPacket packet;
+	PseudoTcpPacketInit(&packet);
+	packet.sequence = FEC_CHECK_ISN + 1 + groupOffset;
+	packet.data = parity;
+	packet.dataLength = parityLength;
+	PseudoTcpPacketSetFecGroup(&packet, FEC_CHECK_GROUP_SIZE, fecCheckLengths);
+	
+	[self sendPacket:&packet];
+	
+	free(parity);
+}
+
+- (BOOL)runUntilDate:(UInt64)deadline orCondition:(volatile BOOL *)condition
+{
+	NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+	
+	while(!(*condition) && (PseudoTcpMonotonicTime() < deadline))
+	{
+		NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+		
+		[runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate dateWithTimeIntervalSinceNow:0.05]];
+		
+		[pool release];
+	}
+	
+	return *condition;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark AsyncUdpSocket Delegate Methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)onUdpSocket:(AsyncUdpSocket *)sock
+     didReceiveData:(NSData *)data
+            withTag:(long)tag
+           fromHost:(NSString *)host
+               port:(UInt16)port
+{
+	PseudoTcpPacket packet;
+	
+	if(!PseudoTcpPacketDecode(&packet, [data bytes], (UInt32)[data length])) return NO;
+	
+	if((packet.flags & PSEUDO_TCP_FLAG_SYN) && (packet.flags & PSEUDO_TCP_FLAG_ACK))
+	{
+		// Everything the server sends after this is an ack, which we can ignore
+		serverSequence = packet.sequence + 1;
+		synAckReceived = YES;
+	}
+	else
+	{
+		[sock receiveWithTimeout:NO_TIMEOUT tag:0];
+	}
+	
+	return YES;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark PseudoTcp Delegate Methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)onPseudoTcpHasBytesAvailable:(id <PseudoTcpSocket>)sock
+{
+	const UInt8 *bytes;
+	UInt32 length;
+	
+	while((length = [server peekBytes:&bytes]) > 0)
+	{
+		if((bytesReceived + length > [sentData length]) ||
+		   (memcmp(bytes, (const UInt8 *)[sentData bytes] + bytesReceived, length) != 0))
+		{
+			printf("fec check: Received data doesn't match what was sent, at offset %llu\n", bytesReceived);
+			
+			failed = YES;
+			finished = YES;
+			return;
+		}
+		
+		bytesReceived += length;
+		[server consumeBytes:length];
+	}
+	
+	if(bytesReceived == [sentData length])
+	{
+		finished = YES;
+	}
+}
+
+- (void)onPseudoTcp:(id <PseudoTcpSocket>)sock willCloseWithError:(NSError *)err
+{
+	DDLogError(@"PseudoTcpFecCheck: Connection closed unexpectedly: %@", err);
+	
+	failed = YES;
+	finished = YES;
+}
+
+- (void)onPseudoTcpDidClose:(id <PseudoTcpSocket>)sock
+{
+	failed = YES;
+	finished = YES;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Compares the results for a scenario against its baseline, and prints any regressions.
+ * Returns YES if nothing regressed.
+**/
+static BOOL CompareWithBaseline(const char *name, NSDictionary *result, NSDictionary *baseline, double tolerance)
+{
+	BOOL passed = YES;
+	
+	if(baseline == nil) return YES;
+	
+	double base, value;
+	
+	base = [[baseline objectForKey:GOODPUT_KEY] doubleValue];
+	value = [[result objectForKey:GOODPUT_KEY] doubleValue];
+	if(value < base * (1.0 - tolerance))
+	{
+		printf("REGRESSION: %s: goodput %.1f KB/s, baseline %.1f KB/s\n", name, value, base);
+		passed = NO;
+	}
+	
+	// Small absolute allowances, so a baseline of (nearly) zero doesn't fail on noise
+	
+	base = [[baseline objectForKey:RETRANSMIT_RATIO_KEY] doubleValue];
+	value = [[result objectForKey:RETRANSMIT_RATIO_KEY] doubleValue];
+	if(value > (base * (1.0 + tolerance)) + 0.005)
+	{
+		printf("REGRESSION: %s: retransmitted %.2f%%, baseline %.2f%%\n", name, value * 100.0, base * 100.0);
+		passed = NO;
+	}
+	
+	base = [[baseline objectForKey:RTT_P99_KEY] doubleValue];
+	value = [[result objectForKey:RTT_P99_KEY] doubleValue];
+	if(value > (base * (1.0 + tolerance)) + 2.0)
+	{
+		printf("REGRESSION: %s: rtt p99 %.1f ms, baseline %.1f ms\n", name, value, base);
+		passed = NO;
+	}
+	
+	// CPU time isn't gated, as it's too noisy from run to run.
+	// Nor are buffer allocations, as they depend on whether the baseline was run with the pool.
+	
+	return passed;
+}
+
+int main(int argc, const char *argv[])
+{
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	
+	NSUserDefaults *defaults = [NSUserDefaults standardUserDefaults];
+	
+	NSMutableDictionary *defaultValues = [NSMutableDictionary dictionaryWithCapacity:4];
+	[defaultValues setObject:[NSNumber numberWithDouble:10.0] forKey:@"duration"];
+	[defaultValues setObject:[NSNumber numberWithInt:200] forKey:@"pings"];
+	[defaultValues setObject:[NSNumber numberWithInt:1] forKey:@"seed"];
+	[defaultValues setObject:[NSNumber numberWithDouble:0.1] forKey:@"tolerance"];
+	[defaultValues setObject:[NSNumber numberWithBool:YES] forKey:@"receiveBufferPool"];
+	[defaultValues setObject:[NSNumber numberWithBool:NO] forKey:@"networkThread"];
+	[defaultValues setObject:[NSNumber numberWithDouble:0.0] forKey:@"mainThreadLoad"];
+	[defaultValues setObject:[NSNumber numberWithBool:YES] forKey:@"fecCheck"];
+	[defaults registerDefaults:defaultValues];
+	
+	NSString *onlyScenario = [defaults stringForKey:@"scenario"];
+	NSString *congestionControl = [defaults stringForKey:@"congestionControl"];
+	NSTimeInterval duration = [defaults doubleForKey:@"duration"];
+	UInt32 pings = (UInt32)MAX([defaults integerForKey:@"pings"], 1);
+	unsigned seed = (unsigned)[defaults integerForKey:@"seed"];
+	double tolerance = [defaults doubleForKey:@"tolerance"];
+	BOOL receiveBufferPool = [defaults boolForKey:@"receiveBufferPool"];
+	BOOL useNetworkThread = [defaults boolForKey:@"networkThread"];
+	double mainThreadLoad = [defaults doubleForKey:@"mainThreadLoad"];
+	BOOL fecCheck = [defaults boolForKey:@"fecCheck"];
+	
+	NSDictionary *baselines = nil;
+	NSString *baselinePath = [defaults stringForKey:@"baseline"];
+	
+	if(baselinePath)
+	{
+		baselines = [NSDictionary dictionaryWithContentsOfFile:[baselinePath stringByStandardizingPath]];
+		
+		if(baselines == nil)
+		{
+			printf("Unable to read baseline: %s\n", [baselinePath UTF8String]);
+			
+			[pool release];
+			return 1;
+		}
+	}
+	
+	if(congestionControl && (CongestionControlClass([congestionControl UTF8String]) == Nil))
+	{
+		printf("Unknown congestion controller: %s\n", [congestionControl UTF8String]);
+		
+		[pool release];
+		return 1;
+	}
+	
+	PseudoTcpNetworkThread *networkThread = nil;
+	
+	if(useNetworkThread)
+	{
+		networkThread = [PseudoTcpNetworkThread sharedNetworkThread];
+	}
+	
+	if(mainThreadLoad > 0.0)
+	{
+		[NSTimer scheduledTimerWithTimeInterval:MAIN_THREAD_LOAD_INTERVAL
+		                                 target:[PseudoTcpBenchmark class]
+		                               selector:@selector(simulateMainThreadLoad:)
+		                               userInfo:[NSNumber numberWithDouble:mainThreadLoad]
+		                                repeats:YES];
+	}
+	
+	NSMutableDictionary *results = [NSMutableDictionary dictionaryWithCapacity:SCENARIO_COUNT];
+	BOOL passed = YES;
+	
+	UInt32 i;
+	
+	if(fecCheck)
+	{
+		srandom(seed);
+		
+		PseudoTcpFecCheck *check = [[PseudoTcpFecCheck alloc] init];
+		
+		for(i = 0; i < FEC_CHECK_CASE_COUNT; i++)
+		{
+			NSAutoreleasePool *casePool = [[NSAutoreleasePool alloc] init];
+			
+			if(![check runCase:&fecCheckCases[i]])
+			{
+				printf("fec check: %s: FAILED\n", fecCheckCases[i].description);
+				passed = NO;
+			}
+			
+			[casePool release];
+		}
+		
+		[check release];
+		
+		if(passed)
+		{
+			printf("fec check: passed (%u loss patterns)\n\n", (unsigned)FEC_CHECK_CASE_COUNT);
+		}
+	}
+	
+	printf("%-14s %12s %9s %8s %9s %9s %9s %9s %10s %10s\n",
+	       "scenario", "goodput", "rexmit", "rebuilt", "srtt", "rtt p50", "rtt p90", "rtt p99", "cpu", "allocs");
+	printf("%-14s %12s %9s %8s %9s %9s %9s %9s %10s %10s\n",
+	       "", "(KB/s)", "(%)", "", "(ms)", "(ms)", "(ms)", "(ms)", "(ms/MB)", "(/s)");
+	
+	for(i = 0; i < SCENARIO_COUNT; i++)
+	{
+		PseudoTcpBenchmarkScenario scenario = scenarios[i];
+		NSString *name = [NSString stringWithUTF8String:scenario.name];
+		
+		if(onlyScenario && ![onlyScenario isEqualToString:name]) continue;
+		
+		NSAutoreleasePool *scenarioPool = [[NSAutoreleasePool alloc] init];
+		
+		// Each scenario gets the same random numbers, regardless of which other scenarios are run
+		srandom(seed);
+		
+		if(congestionControl)
+		{
+			scenario.congestionControl = [congestionControl UTF8String];
+		}
+		
+		PseudoTcpBenchmark *benchmark = [[PseudoTcpBenchmark alloc] initWithScenario:&scenario];
+		[benchmark setUsesReceiveBufferPool:receiveBufferPool];
+		[benchmark setNetworkThread:networkThread];
+		
+		NSDictionary *throughput = [benchmark runThroughputTestForDuration:duration];
+		NSDictionary *latency = [benchmark runLatencyTestWithPings:pings];
+		
+		[benchmark release];
+		
+		if(throughput == nil || latency == nil)
+		{
+			printf("%-14s FAILED (%s)\n", scenario.name, scenario.description);
+			passed = NO;
+		}
+		else
+		{
+			NSMutableDictionary *result = [NSMutableDictionary dictionaryWithDictionary:throughput];
+			[result addEntriesFromDictionary:latency];
+			
+			printf("%-14s %12.1f %9.2f %8u %9.1f %9.1f %9.1f %9.1f %10.1f %10.0f\n",
+			       scenario.name,
+			       [[result objectForKey:GOODPUT_KEY] doubleValue],
+			       [[result objectForKey:RETRANSMIT_RATIO_KEY] doubleValue] * 100.0,
+			       [[result objectForKey:REBUILT_KEY] unsignedIntValue],
+			       [[result objectForKey:SRTT_KEY] doubleValue],
+			       [[result objectForKey:RTT_P50_KEY] doubleValue],
+			       [[result objectForKey:RTT_P90_KEY] doubleValue],
+			       [[result objectForKey:RTT_P99_KEY] doubleValue],
+			       [[result objectForKey:CPU_KEY] doubleValue],
+			       [[result objectForKey:BUFFER_ALLOCS_KEY] doubleValue]);
+			
+			if(!CompareWithBaseline(scenario.name, result, [baselines objectForKey:name], tolerance))
+			{
+				passed = NO;
+			}
+			
+			[results setObject:result forKey:name];
+		}
+		
+		[scenarioPool release];
+	}
+	
+	NSString *savePath = [defaults stringForKey:@"saveBaseline"];
+	
+	if(savePath)
+	{
+		if(![results writeToFile:[savePath stringByStandardizingPath] atomically:YES])
+		{
+			printf("Unable to write baseline: %s\n", [savePath UTF8String]);
+			passed = NO;
+		}
+	}
+	
+	[pool release];
+	return passed ? 0 : 1;
+}
@@ -0,0 +1,152 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import <Foundation/Foundation.h>
+
+// A congestion controller decides how much data PseudoTcp may have in flight at any one time.
+//
+// PseudoTcp itself detects loss (via duplicate acks, the sack scoreboard, or the retransmission timer),
+// decides what to retransmit, and measures the round trip time.
+// It reports these events to the congestion controller, which only maintains the congestion window.
+//
+// All sizes are in bytes.
+// A controller instance belongs to a single connection, and is only ever called from that connection's thread.
+
+@protocol PseudoTcpCongestionControl <NSObject>
+
+// Returns the current congestion window.
+- (UInt32)congestionWindow;
+
+// Returns the current slow start threshold.
+- (UInt32)slowStartThreshold;
+
+// Called when the connection is created, and again whenever path mtu discovery changes the segment size.
+- (void)setMaximumSegmentSize:(UInt32)mss;
+
+// Called when an ack acknowledges new data, except for partial acks during loss recovery.
+// The bytesInFlight is the amount of data still outstanding after processing the ack.
+- (void)onAck:(UInt32)ackedBytes bytesInFlight:(UInt32)bytesInFlight;
+
+// Called with each valid round trip time measurement.
+- (void)onRttSample:(NSTimeInterval)rtt;
+
+// Called when a lost segment is detected via duplicate acks or the sack scoreboard, and loss recovery begins.
+// This is called at most once per window of data.
+- (void)onLossWithBytesInFlight:(UInt32)bytesInFlight;
+
+// Called when loss recovery is complete.
+// That is, when an ack arrives covering all the data that was outstanding when the loss was detected.
+- (void)onRecoveryComplete;
+
+// Called when the retransmission timer expires.
+- (void)onTimeoutWithBytesInFlight:(UInt32)bytesInFlight;
+
+// Called when the retransmission timer is found to have expired needlessly.
+// That is, the original transmission was acknowledged after all (see RFC 3522).
+// This is only called before any onAck: following the timeout(s).
+// The controller should restore the window it had before the first of the timeouts.
+- (void)onSpuriousTimeout;
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// The standard TCP congestion control algorithms of RFC 2581 / RFC 3782.
+// This is the default.
+
+@interface PseudoTcpNewReno : NSObject <PseudoTcpCongestionControl>
+{
+	UInt32 mss;
+	UInt32 cwnd;      // Congestion window
+	UInt32 ssthresh;  // Slow start threshold size
+	BOOL inRecovery;
+	
+	BOOL timedOut;
+	UInt32 undoCwnd;      // Values from before the timeout, in case it turns out to be spurious
+	UInt32 undoSsthresh;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// CUBIC, as per RFC 8312.
+//
+// After a loss, the window grows along a cubic curve that is independent of the round trip time.
+// It quickly returns to the window size at which the loss occurred, levels off around it,
+// and then probes for more bandwidth. This makes much better use of long, fat paths than NewReno,
+// whose window only grows by one segment per round trip.
+
+@interface PseudoTcpCubic : NSObject <PseudoTcpCongestionControl>
+{
+	UInt32 mss;
+	UInt32 cwnd;
+	UInt32 ssthresh;
+	BOOL inRecovery;
+	
+	BOOL timedOut;
+	UInt32 undoCwnd;
+	UInt32 undoSsthresh;
+	double undoWMax;
+	double undoWLastMax;
+	
+	double wMax;              // Window size (in segments) just before the last reduction
+	double wLastMax;          // Previous value of wMax, for fast convergence
+	double wEst;              // Estimate of the window standard TCP would have (in segments)
+	double k;                 // Time (in seconds) the cubic function takes to return to wMax
+	UInt64 epochStart;        // Monotonic time (in nanoseconds) of the first ack since the last reduction, or zero
+	NSTimeInterval minRtt;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A delay based controller, modeled after BBR.
+//
+// Rather than treating loss as the signal of congestion, it measures the bottleneck bandwidth (the max delivery
+// rate seen over recent rounds) and the propagation delay (the min rtt seen recently), and sizes the window to
+// a small multiple of their product. The window grows quickly at startup until the bandwidth stops increasing.
+// Random loss, as is common on wi-fi, doesn't cause the window to collapse.
+
+#define PSEUDO_TCP_BW_FILTER_LENGTH  10
+
+@interface PseudoTcpDelayBased : NSObject <PseudoTcpCongestionControl>
+{
+	UInt32 mss;
+	UInt32 cwnd;
+	BOOL inRecovery;
+	BOOL inStartup;
+	
+	double bwSamples[PSEUDO_TCP_BW_FILTER_LENGTH];  // Delivery rate (bytes/sec) of recent rounds
+	UInt32 bwSampleIndex;
+	double fullBw;                 // Bandwidth at which startup last saw significant growth
+	UInt32 fullBwCount;            // Number of rounds without significant growth
+	
+	NSTimeInterval minRtt;
+	UInt64 minRttTimestamp;        // Monotonic time (in nanoseconds) the minRtt was measured
+	
+	UInt64 roundStart;             // Monotonic time (in nanoseconds) the current round started, or zero
+	UInt32 roundDelivered;
+	UInt32 priorCwnd;
+	
+	BOOL timedOut;
+	UInt32 undoCwnd;
+}
+
+// Returns the estimated bottleneck bandwidth, in bytes per second.
+- (double)bottleneckBandwidth;
+
+// Returns the estimated propagation delay (the minimum recent round trip time).
+- (NSTimeInterval)minRtt;
+
+@end
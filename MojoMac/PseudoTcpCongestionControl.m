@@ -0,0 +1,579 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import "PseudoTcpCongestionControl.h"
+#import "PseudoTcpTimerWheel.h"
+#import <math.h>
+
+// Debug levels: 0-off, 1-error, 2-warn, 3-info, 4-verbose
+#ifdef CONFIGURATION_DEBUG
+  #define DEBUG_LEVEL 2
+#else
+  #define DEBUG_LEVEL 2
+#endif
+#include "DDLog.h"
+
+// Every connection starts out with the same segment size (see DEFAULT_MTU in PseudoTcp.m)
+#define INITIAL_MSS  536
+
+// CUBIC constants, as suggested by RFC 8312
+#define CUBIC_C     0.4
+#define CUBIC_BETA  0.7
+
+// Delay based constants, as used by BBR
+#define STARTUP_GAIN         2.885   // 2/ln(2), which doubles the sending rate every round
+#define CWND_GAIN            2.0     // Allow for delayed and aggregated acks
+#define STARTUP_GROWTH       1.25    // Bandwidth must grow by this factor per round to stay in startup
+#define STARTUP_FULL_ROUNDS  3       // Rounds without growth before leaving startup
+#define MIN_RTT_WINDOW       10.0    // Seconds a min rtt measurement remains valid
+#define MIN_CWND_SEGMENTS    4
+
+@interface PseudoTcpCubic (PrivateAPI)
+- (void)reduceWindow;
+@end
+
+@interface PseudoTcpDelayBased (PrivateAPI)
+- (void)addBandwidthSample:(double)bw;
+@end
+
+
+@implementation PseudoTcpNewReno
+
+- (id)init
+{
+	if((self = [super init]))
+	{
+		mss = INITIAL_MSS;
+		cwnd = 2 * INITIAL_MSS; // As per RFC 2581
+		ssthresh = UINT32_MAX;  // RFC 2581 says it may be arbitrarily high
+		inRecovery = NO;
+		timedOut = NO;
+	}
+	return self;
+}
+
+- (UInt32)congestionWindow
+{
+	return cwnd;
+}
+
+- (UInt32)slowStartThreshold
+{
+	return ssthresh;
+}
+
+- (void)setMaximumSegmentSize:(UInt32)newMss
+{
+	mss = newMss;
+}
+
+- (void)onAck:(UInt32)ackedBytes bytesInFlight:(UInt32)bytesInFlight
+{
+	// From RFC 2581:
+	// The slow start algorithm is used when cwnd < ssthresh, while
+	// the congestion avoidance algorithm is used when cwnd > ssthresh.
+	// When cwnd and ssthresh are equal the sender may use either slow start or congestion avoidance.
+	
+	timedOut = NO;
+	
+	if(cwnd <= ssthresh)
+	{
+		// We're in slow start
+		
+		if(cwnd < UINT32_MAX - mss)
+		{
+			cwnd += mss;
+		}
+		
+		DDLogVerbose(@"slow start: cwnd(%05u)", cwnd);
+	}
+	else
+	{
+		// We're in congestion avoidance
+		//
+		// Note: Since integer arithmetic is used, the congestion avoidance formula for incrementing cwnd can
+		// fail when the congestion window is very large (larger than SMSS * SMSS). If the formula yields an
+		// increase of 0, the result SHOULD be rounded up to an increase of 1 byte.
+		
+		if(cwnd < UINT32_MAX - 1)
+		{
+			cwnd += MAX(1, mss * mss / cwnd);
+		}
+		
+		DDLogVerbose(@"congestion avoidance: cwnd(%05u)", cwnd);
+	}
+}
+
+- (void)onRttSample:(NSTimeInterval)rtt
+{
+	// NewReno doesn't use the rtt
+}
+
+- (void)onLossWithBytesInFlight:(UInt32)bytesInFlight
+{
+	// When the third duplicate ACK in a row is received, decrease ssthresh according to RFC 2581.
+	// PseudoTcp takes care of inflating the window during fast recovery, as that depends on whether sack is used.
+	
+	ssthresh = MAX((bytesInFlight / 2), (2 * mss));
+	cwnd = ssthresh;
+	
+	inRecovery = YES;
+}
+
+- (void)onRecoveryComplete
+{
+	// Set cwnd to ssthresh (the value set when the loss was detected).
+	// This is termed "deflating" the window.
+	
+	if(inRecovery)
+	{
+		cwnd = ssthresh;
+		inRecovery = NO;
+	}
+}
+
+- (void)onTimeoutWithBytesInFlight:(UInt32)bytesInFlight
+{
+	// Update ssthresh and cwnd according to RFC 2581
+	
+	if(!timedOut)
+	{
+		undoCwnd = cwnd;
+		undoSsthresh = ssthresh;
+		timedOut = YES;
+	}
+	
+	ssthresh = MAX((bytesInFlight / 2), (2 * mss));
+	cwnd = mss;
+	
+	inRecovery = NO;
+}
+
+- (void)onSpuriousTimeout
+{
+	if(timedOut)
+	{
+		cwnd = MAX(cwnd, undoCwnd);
+		ssthresh = MAX(ssthresh, undoSsthresh);
+		timedOut = NO;
+	}
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpCubic
+
+- (id)init
+{
+	if((self = [super init]))
+	{
+		mss = INITIAL_MSS;
+		cwnd = 2 * INITIAL_MSS;
+		ssthresh = UINT32_MAX;
+		inRecovery = NO;
+		timedOut = NO;
+		
+		wMax = 0.0;
+		wLastMax = 0.0;
+		wEst = 0.0;
+		k = 0.0;
+		epochStart = 0;
+		minRtt = 0.0;
+	}
+	return self;
+}
+
+- (UInt32)congestionWindow
+{
+	return cwnd;
+}
+
+- (UInt32)slowStartThreshold
+{
+	return ssthresh;
+}
+
+- (void)setMaximumSegmentSize:(UInt32)newMss
+{
+	// The cubic function works in segments, so it has to start a new epoch with the new segment size
+	
+	if(newMss != mss)
+	{
+		wMax = wMax * mss / newMss;
+		wLastMax = wLastMax * mss / newMss;
+		epochStart = 0;
+	}
+	
+	mss = newMss;
+}
+
+- (void)onAck:(UInt32)ackedBytes bytesInFlight:(UInt32)bytesInFlight
+{
+	timedOut = NO;
+	
+	if(cwnd < ssthresh)
+	{
+		// Slow start is the same as standard TCP
+		
+		if(cwnd < UINT32_MAX - mss)
+		{
+			cwnd += MIN(ackedBytes, mss);
+		}
+		return;
+	}
+	
+	UInt64 now = PseudoTcpMonotonicTime();
+	double cwndSegments = (double)cwnd / mss;
+	
+	if(epochStart == 0)
+	{
+		// First ack since the last reduction (or since leaving slow start)
+		
+		epochStart = now;
+		
+		if(cwndSegments < wMax)
+		{
+			k = cbrt((wMax - cwndSegments) / CUBIC_C);
+		}
+		else
+		{
+			k = 0.0;
+			wMax = cwndSegments;
+		}
+		
+		wEst = cwndSegments;
+	}
+	
+	// The target is where the cubic function will be one rtt from now
+	
+	double t = ((now - epochStart) / 1000000000.0) + minRtt;
+	double target = (CUBIC_C * (t - k) * (t - k) * (t - k)) + wMax;
+	
+	// TCP friendly region:
+	// Never grow slower than standard TCP would in the same situation
+	
+	wEst += (3.0 * (1.0 - CUBIC_BETA) / (1.0 + CUBIC_BETA)) * ((double)ackedBytes / cwnd);
+	
+	if(wEst > target)
+	{
+		target = wEst;
+	}
+	
+	// RFC 8312 limits the target to 1.5 times the current window
+	target = MIN(target, 1.5 * cwndSegments);
+	
+	if(target > cwndSegments)
+	{
+		double increment = ackedBytes * (target - cwndSegments) / cwndSegments;
+		
+		if(cwnd < UINT32_MAX - (UInt32)increment - 1)
+		{
+			cwnd += MAX(1, (UInt32)increment);
+		}
+	}
+	
+	DDLogVerbose(@"cubic: cwnd(%05u) target(%.1f) k(%.3f)", cwnd, target, k);
+}
+
+- (void)onRttSample:(NSTimeInterval)rtt
+{
+	if((minRtt == 0.0) || (rtt < minRtt))
+	{
+		minRtt = rtt;
+	}
+}
+
+/**
+ * Records the window size at which the loss occurred, and the reduced window.
+**/
+- (void)reduceWindow
+{
+	double cwndSegments = (double)cwnd / mss;
+	
+	// Fast convergence:
+	// If the window is smaller than it was at the previous loss, another flow is likely claiming bandwidth.
+	// So we give up some more, by plateauing below the point of loss.
+	
+	if(cwndSegments < wLastMax)
+	{
+		wLastMax = cwndSegments;
+		wMax = cwndSegments * (1.0 + CUBIC_BETA) / 2.0;
+	}
+	else
+	{
+		wLastMax = cwndSegments;
+		wMax = cwndSegments;
+	}
+	
+	ssthresh = MAX((UInt32)(cwnd * CUBIC_BETA), (2 * mss));
+	epochStart = 0;
+}
+
+- (void)onLossWithBytesInFlight:(UInt32)bytesInFlight
+{
+	[self reduceWindow];
+	
+	cwnd = ssthresh;
+	inRecovery = YES;
+}
+
+- (void)onRecoveryComplete
+{
+	if(inRecovery)
+	{
+		cwnd = ssthresh;
+		inRecovery = NO;
+	}
+}
+
+- (void)onTimeoutWithBytesInFlight:(UInt32)bytesInFlight
+{
+	if(!timedOut)
+	{
+		undoCwnd = cwnd;
+		undoSsthresh = ssthresh;
+		undoWMax = wMax;
+		undoWLastMax = wLastMax;
+		timedOut = YES;
+	}
+	
+	[self reduceWindow];
+	
+	cwnd = mss;
+	inRecovery = NO;
+}
+
+- (void)onSpuriousTimeout
+{
+	if(timedOut)
+	{
+		// Restoring wMax puts us back on the cubic curve we were following before the timeout
+		
+		cwnd = MAX(cwnd, undoCwnd);
+		ssthresh = MAX(ssthresh, undoSsthresh);
+		wMax = undoWMax;
+		wLastMax = undoWLastMax;
+		epochStart = 0;
+		timedOut = NO;
+	}
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpDelayBased
+
+- (id)init
+{
+	if((self = [super init]))
+	{
+		mss = INITIAL_MSS;
+		cwnd = 2 * INITIAL_MSS;
+		inRecovery = NO;
+		inStartup = YES;
+		
+		bzero(bwSamples, sizeof(bwSamples));
+		bwSampleIndex = 0;
+		fullBw = 0.0;
+		fullBwCount = 0;
+		
+		minRtt = 0.0;
+		minRttTimestamp = 0;
+		
+		roundStart = 0;
+		roundDelivered = 0;
+		priorCwnd = 0;
+		
+		timedOut = NO;
+		undoCwnd = 0;
+	}
+	return self;
+}
+
+- (UInt32)congestionWindow
+{
+	return cwnd;
+}
+
+- (UInt32)slowStartThreshold
+{
+	return inStartup ? UINT32_MAX : cwnd;
+}
+
+- (void)setMaximumSegmentSize:(UInt32)newMss
+{
+	mss = newMss;
+}
+
+- (double)bottleneckBandwidth
+{
+	double bw = 0.0;
+	
+	UInt32 i;
+	for(i = 0; i < PSEUDO_TCP_BW_FILTER_LENGTH; i++)
+	{
+		bw = MAX(bw, bwSamples[i]);
+	}
+	
+	return bw;
+}
+
+- (NSTimeInterval)minRtt
+{
+	return minRtt;
+}
+
+/**
+ * Called at the end of every round (roughly one min rtt) with the delivery rate measured during the round.
+**/
+- (void)addBandwidthSample:(double)bw
+{
+	bwSamples[bwSampleIndex] = bw;
+	bwSampleIndex = (bwSampleIndex + 1) % PSEUDO_TCP_BW_FILTER_LENGTH;
+	
+	if(inStartup)
+	{
+		// Once the bandwidth stops growing, we've found the bottleneck, and the queue is starting to build
+		
+		double maxBw = [self bottleneckBandwidth];
+		
+		if(maxBw >= fullBw * STARTUP_GROWTH)
+		{
+			fullBw = maxBw;
+			fullBwCount = 0;
+		}
+		else if(++fullBwCount >= STARTUP_FULL_ROUNDS)
+		{
+			DDLogVerbose(@"delay based: leaving startup: bw(%.0f) minRtt(%.3f)", maxBw, minRtt);
+			
+			inStartup = NO;
+		}
+	}
+}
+
+- (void)onAck:(UInt32)ackedBytes bytesInFlight:(UInt32)bytesInFlight
+{
+	UInt64 now = PseudoTcpMonotonicTime();
+	
+	timedOut = NO;
+	
+	// Measure the delivery rate over rounds of (approximately) one round trip
+	
+	if(roundStart == 0)
+	{
+		roundStart = now;
+	}
+	
+	roundDelivered += ackedBytes;
+	
+	NSTimeInterval elapsed = (now - roundStart) / 1000000000.0;
+	
+	if((minRtt > 0.0) && (elapsed >= minRtt))
+	{
+		[self addBandwidthSample:(roundDelivered / elapsed)];
+		
+		roundStart = now;
+		roundDelivered = 0;
+	}
+	
+	// Size the window according to the bandwidth delay product
+	
+	UInt32 minCwnd = MIN_CWND_SEGMENTS * mss;
+	double bdp = [self bottleneckBandwidth] * minRtt;
+	
+	if(bdp <= 0.0)
+	{
+		// No model yet, so grow like slow start
+		
+		if(cwnd < UINT32_MAX - ackedBytes)
+		{
+			cwnd += ackedBytes;
+		}
+	}
+	else
+	{
+		double gain = inStartup ? STARTUP_GAIN : CWND_GAIN;
+		UInt32 target = (UInt32)MIN(gain * bdp, (double)(UINT32_MAX / 2));
+		
+		if(cwnd < target)
+			cwnd = MIN(cwnd + ackedBytes, target);
+		else
+			cwnd = target;
+	}
+	
+	cwnd = MAX(cwnd, minCwnd);
+	
+	DDLogVerbose(@"delay based: cwnd(%05u) bw(%.0f) minRtt(%.3f)", cwnd, [self bottleneckBandwidth], minRtt);
+}
+
+- (void)onRttSample:(NSTimeInterval)rtt
+{
+	UInt64 now = PseudoTcpMonotonicTime();
+	
+	// The min rtt expires after a while, so we notice if the path changes to a longer one
+	
+	if((minRtt == 0.0) || (rtt <= minRtt) || (((now - minRttTimestamp) / 1000000000.0) > MIN_RTT_WINDOW))
+	{
+		minRtt = rtt;
+		minRttTimestamp = now;
+	}
+}
+
+- (void)onLossWithBytesInFlight:(UInt32)bytesInFlight
+{
+	// Loss isn't treated as a congestion signal.
+	// But during recovery we only send as much as has left the network (packet conservation).
+	
+	if(!inRecovery)
+	{
+		priorCwnd = cwnd;
+	}
+	
+	cwnd = MAX(bytesInFlight, MIN_CWND_SEGMENTS * mss);
+	inRecovery = YES;
+}
+
+- (void)onRecoveryComplete
+{
+	if(inRecovery)
+	{
+		cwnd = MAX(cwnd, priorCwnd);
+		inRecovery = NO;
+	}
+}
+
+- (void)onTimeoutWithBytesInFlight:(UInt32)bytesInFlight
+{
+	// Everything in flight is presumed lost.
+	// The window will quickly grow back to the bandwidth delay product as acks arrive.
+	
+	if(!timedOut)
+	{
+		undoCwnd = inRecovery ? priorCwnd : cwnd;
+		timedOut = YES;
+	}
+	
+	cwnd = mss;
+	inRecovery = NO;
+}
+
+- (void)onSpuriousTimeout
+{
+	if(timedOut)
+	{
+		cwnd = MAX(cwnd, undoCwnd);
+		timedOut = NO;
+	}
+}
+
+@end
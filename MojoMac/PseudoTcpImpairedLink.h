@@ -0,0 +1,99 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import <Foundation/Foundation.h>
+
+@class AsyncUdpSocket;
+
+// A simulated network path between two UDP sockets on the loopback interface.
+//
+// Loopback is far too good a network to tell us anything about PseudoTcp. There's no delay, no loss,
+// and more bandwidth than we could ever use. So the two endpoints are instead connected to a pair of relay sockets,
+// and every datagram passes through the link, which delays, drops, reorders and rate limits it on the way.
+//
+// Each direction is impaired independently, using the same settings.
+// The rate limit is modelled as a bottleneck with a drop-tail queue in front of it, like a typical home router.
+// A datagram waits in the queue for its turn on the wire, and is dropped if the queue is already full.
+// Once it's been put on the wire it's delayed by the propagation delay (plus jitter) before being delivered.
+//
+// The link uses random(), so seeding it with srandom() makes runs repeatable.
+
+struct PseudoTcpImpairment
+{
+	NSTimeInterval delay;   // One-way propagation delay
+	NSTimeInterval jitter;  // Each datagram is delayed by an extra random amount of up to this much
+	float lossRate;         // Fraction of datagrams that are dropped at random
+	float reorderRate;      // Fraction of datagrams that skip the propagation delay, and overtake the others
+	UInt32 rate;            // Bottleneck bandwidth in bytes per second, or zero for no limit
+	UInt32 queueLimit;      // Bytes that may be queued at the bottleneck, or zero for no limit
+	UInt32 mtu;             // Datagrams larger than this are dropped, or zero for no limit (UDP payload size)
+};
+typedef struct PseudoTcpImpairment PseudoTcpImpairment;
+
+/**
+ * Per-direction counters.
+**/
+struct PseudoTcpImpairedLinkStatistics
+{
+	UInt32 datagrams;        // Datagrams handed to the link
+	UInt32 delivered;
+	UInt32 dropped;          // Random loss
+	UInt32 queueDropped;     // Arrived to a full bottleneck queue
+	UInt32 oversizeDropped;  // Exceeded the mtu
+	UInt32 reordered;
+	UInt64 bytesDelivered;
+};
+typedef struct PseudoTcpImpairedLinkStatistics PseudoTcpImpairedLinkStatistics;
+
+struct PseudoTcpImpairedLinkQueue;
+
+
+@interface PseudoTcpImpairedLink : NSObject
+{
+	PseudoTcpImpairment impairment;
+	
+	AsyncUdpSocket *socketA;  // Relays datagrams to and from endpoint A
+	AsyncUdpSocket *socketB;  // Relays datagrams to and from endpoint B
+	
+	struct PseudoTcpImpairedLinkQueue *queueAB;  // Datagrams from A waiting to be delivered to B
+	struct PseudoTcpImpairedLinkQueue *queueBA;  // Datagrams from B waiting to be delivered to A
+	
+	NSTimer *deliveryTimer;
+	UInt64 deliveryTime;  // When the deliveryTimer is set to fire (monotonic nanoseconds), or zero if it isn't
+}
+
+/**
+ * Creates a link with the given impairments.
+ * The relay sockets are bound to random ports on the IPv4 loopback interface.
+**/
+- (id)initWithImpairment:(PseudoTcpImpairment)impairment;
+
+- (PseudoTcpImpairment)impairment;
+
+/**
+ * Connects the two endpoints through the link.
+ *
+ * Both sockets must already be bound to the IPv4 loopback interface (127.0.0.1), and must not be connected.
+ * Each endpoint is connected to its relay socket, and so may be passed to PseudoTcp's initWithUdpSocket:.
+ *
+ * Returns NO, and sets errPtr, if any of the sockets couldn't be connected.
+**/
+- (BOOL)connectEndpoint:(AsyncUdpSocket *)endpointA
+           withEndpoint:(AsyncUdpSocket *)endpointB
+                  error:(NSError **)errPtr;
+
+/**
+ * Returns the counters for datagrams sent by endpoint A (to endpoint B), or by endpoint B (to endpoint A).
+**/
+- (PseudoTcpImpairedLinkStatistics)statisticsFromEndpointA;
+- (PseudoTcpImpairedLinkStatistics)statisticsFromEndpointB;
+
+/**
+ * Closes the relay sockets, and discards any datagrams still in flight.
+**/
+- (void)close;
+
+@end
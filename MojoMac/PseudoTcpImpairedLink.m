@@ -0,0 +1,408 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import "PseudoTcpImpairedLink.h"
+#import "PseudoTcpTimerWheel.h"
+#import "AsyncUdpSocket.h"
+
+// Debug levels: 0-off, 1-error, 2-warn, 3-info, 4-verbose
+#ifdef CONFIGURATION_DEBUG
+  #define DEBUG_LEVEL 2
+#else
+  #define DEBUG_LEVEL 2
+#endif
+#include "DDLog.h"
+
+#define NO_TIMEOUT  -1
+
+// Datagrams due within this many nanoseconds are delivered early, rather than waiting for another timer
+#define DELIVERY_SLACK  500000
+
+#define NSEC_PER_SECOND  1000000000.0
+
+/**
+ * A datagram in flight.
+**/
+struct PseudoTcpImpairedDatagram
+{
+	NSData *data;         // Retained
+	UInt64 deliveryTime;  // Monotonic nanoseconds
+};
+typedef struct PseudoTcpImpairedDatagram PseudoTcpImpairedDatagram;
+
+/**
+ * The datagrams in flight in one direction, sorted by delivery time.
+**/
+struct PseudoTcpImpairedLinkQueue
+{
+	PseudoTcpImpairedDatagram *datagrams;
+	UInt32 count;
+	UInt32 capacity;
+	
+	UInt64 wireFreeTime;  // When the bottleneck finishes sending everything queued for it (monotonic nanoseconds)
+	
+	PseudoTcpImpairedLinkStatistics statistics;
+};
+typedef struct PseudoTcpImpairedLinkQueue PseudoTcpImpairedLinkQueue;
+
+/**
+ * Returns a random number in the range [0, 1).
+**/
+static inline double RandomFraction()
+{
+	return (double)random() / ((double)0x7FFFFFFF + 1.0);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@interface PseudoTcpImpairedLink (PrivateAPI)
+- (void)sendData:(NSData *)data throughQueue:(PseudoTcpImpairedLinkQueue *)queue;
+- (void)deliverDatagrams;
+- (UInt32)deliverDatagramsInQueue:(PseudoTcpImpairedLinkQueue *)queue toSocket:(AsyncUdpSocket *)sock before:(UInt64)time;
+- (void)scheduleDeliveryTimer;
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpImpairedLink
+
+- (id)initWithImpairment:(PseudoTcpImpairment)newImpairment
+{
+	if((self = [super init]))
+	{
+		impairment = newImpairment;
+		
+		queueAB = calloc(1, sizeof(PseudoTcpImpairedLinkQueue));
+		queueBA = calloc(1, sizeof(PseudoTcpImpairedLinkQueue));
+		
+		deliveryTimer = nil;
+		deliveryTime = 0;
+		
+		socketA = [[AsyncUdpSocket alloc] initIPv4];
+		socketB = [[AsyncUdpSocket alloc] initIPv4];
+		
+		[socketA setDelegate:self];
+		[socketB setDelegate:self];
+		
+		NSError *err = nil;
+		
+		if(![socketA bindToAddress:@"127.0.0.1" port:0 error:&err] ||
+		   ![socketB bindToAddress:@"127.0.0.1" port:0 error:&err])
+		{
+			DDLogError(@"PseudoTcpImpairedLink: Unable to bind relay socket: %@", err);
+			
+			[self release];
+			return nil;
+		}
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[self close];
+	
+	[socketA setDelegate:nil];
+	[socketA release];
+	[socketB setDelegate:nil];
+	[socketB release];
+	
+	free(queueAB);
+	free(queueBA);
+	
+	[super dealloc];
+}
+
+- (PseudoTcpImpairment)impairment
+{
+	return impairment;
+}
+
+- (BOOL)connectEndpoint:(AsyncUdpSocket *)endpointA
+           withEndpoint:(AsyncUdpSocket *)endpointB
+                  error:(NSError **)errPtr
+{
+	if(![socketA connectToHost:@"127.0.0.1" onPort:[endpointA localPort] error:errPtr]) return NO;
+	if(![socketB connectToHost:@"127.0.0.1" onPort:[endpointB localPort] error:errPtr]) return NO;
+	
+	if(![endpointA connectToHost:@"127.0.0.1" onPort:[socketA localPort] error:errPtr]) return NO;
+	if(![endpointB connectToHost:@"127.0.0.1" onPort:[socketB localPort] error:errPtr]) return NO;
+	
+	[socketA receiveWithTimeout:NO_TIMEOUT tag:0];
+	[socketB receiveWithTimeout:NO_TIMEOUT tag:0];
+	
+	return YES;
+}
+
+- (PseudoTcpImpairedLinkStatistics)statisticsFromEndpointA
+{
+	return queueAB->statistics;
+}
+
+- (PseudoTcpImpairedLinkStatistics)statisticsFromEndpointB
+{
+	return queueBA->statistics;
+}
+
+- (void)close
+{
+	[deliveryTimer invalidate];
+	[deliveryTimer release];
+	deliveryTimer = nil;
+	deliveryTime = 0;
+	
+	[socketA close];
+	[socketB close];
+	
+	UInt32 i;
+	for(i = 0; i < queueAB->count; i++)
+	{
+		[queueAB->datagrams[i].data release];
+	}
+	for(i = 0; i < queueBA->count; i++)
+	{
+		[queueBA->datagrams[i].data release];
+	}
+	
+	free(queueAB->datagrams);
+	free(queueBA->datagrams);
+	
+	queueAB->datagrams = NULL;
+	queueAB->count = 0;
+	queueAB->capacity = 0;
+	
+	queueBA->datagrams = NULL;
+	queueBA->count = 0;
+	queueBA->capacity = 0;
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Impairment
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Applies the impairments to a datagram, and if it survives, queues it for delivery at the appropriate time.
+**/
+- (void)sendData:(NSData *)data throughQueue:(PseudoTcpImpairedLinkQueue *)queue
+{
+	UInt32 length = [data length];
+	UInt64 now = PseudoTcpMonotonicTime();
+	
+	queue->statistics.datagrams++;
+	
+	if((impairment.mtu > 0) && (length > impairment.mtu))
+	{
+		queue->statistics.oversizeDropped++;
+		return;
+	}
+	
+	if((impairment.lossRate > 0.0F) && (RandomFraction() < impairment.lossRate))
+	{
+		queue->statistics.dropped++;
+		return;
+	}
+	
+	// Wait for our turn at the bottleneck
+	
+	UInt64 sentTime = now;
+	
+	if(impairment.rate > 0)
+	{
+		if(queue->wireFreeTime > now)
+		{
+			double backlog = (double)(queue->wireFreeTime - now) * impairment.rate / NSEC_PER_SECOND;
+			
+			if((impairment.queueLimit > 0) && ((backlog + length) > impairment.queueLimit))
+			{
+				queue->statistics.queueDropped++;
+				return;
+			}
+			
+			sentTime = queue->wireFreeTime;
+		}
+		
+		sentTime += (UInt64)((double)length * NSEC_PER_SECOND / impairment.rate);
+		queue->wireFreeTime = sentTime;
+	}
+	
+	// Then cross the wire
+	
+	UInt64 deliveryTime = sentTime;
+	
+	if((impairment.reorderRate > 0.0F) && (RandomFraction() < impairment.reorderRate))
+	{
+		queue->statistics.reordered++;
+	}
+	else
+	{
+		NSTimeInterval delay = impairment.delay + (impairment.jitter * RandomFraction());
+		
+		deliveryTime += (UInt64)(delay * NSEC_PER_SECOND);
+	}
+	
+	// Insert the datagram in delivery order.
+	// It almost always belongs at the end, so we search backwards.
+	
+	if(queue->count == queue->capacity)
+	{
+		queue->capacity = MAX(queue->capacity * 2, 64);
+		queue->datagrams = reallocf(queue->datagrams, queue->capacity * sizeof(PseudoTcpImpairedDatagram));
+	}
+	
+	UInt32 index = queue->count;
+	while((index > 0) && (queue->datagrams[index - 1].deliveryTime > deliveryTime))
+	{
+		index--;
+	}
+	
+	memmove(queue->datagrams + index + 1, queue->datagrams + index,
+	        (queue->count - index) * sizeof(PseudoTcpImpairedDatagram));
+	
+	queue->datagrams[index].data = [data retain];
+	queue->datagrams[index].deliveryTime = deliveryTime;
+	queue->count++;
+	
+	if(deliveryTime <= now + DELIVERY_SLACK)
+		[self deliverDatagrams];
+	else
+		[self scheduleDeliveryTimer];
+}
+
+/**
+ * Delivers every datagram that's due, in both directions, and reschedules the delivery timer for the next one.
+**/
+- (void)deliverDatagrams
+{
+	UInt64 time = PseudoTcpMonotonicTime() + DELIVERY_SLACK;
+	
+	[self deliverDatagramsInQueue:queueAB toSocket:socketB before:time];
+	[self deliverDatagramsInQueue:queueBA toSocket:socketA before:time];
+	
+	[self scheduleDeliveryTimer];
+}
+
+/**
+ * Sends the datagrams in the queue that are due before the given time, and returns how many were sent.
+**/
+- (UInt32)deliverDatagramsInQueue:(PseudoTcpImpairedLinkQueue *)queue toSocket:(AsyncUdpSocket *)sock before:(UInt64)time
+{
+	UInt32 count = 0;
+	
+	while((count < queue->count) && (queue->datagrams[count].deliveryTime <= time))
+	{
+		NSData *data = queue->datagrams[count].data;
+		
+		[sock sendData:data withTimeout:NO_TIMEOUT tag:0];
+		
+		queue->statistics.delivered++;
+		queue->statistics.bytesDelivered += [data length];
+		
+		[data release];
+		count++;
+	}
+	
+	if(count > 0)
+	{
+		queue->count -= count;
+		memmove(queue->datagrams, queue->datagrams + count, queue->count * sizeof(PseudoTcpImpairedDatagram));
+	}
+	
+	return count;
+}
+
+/**
+ * Makes sure the delivery timer will fire when the next datagram (in either direction) is due.
+**/
+- (void)scheduleDeliveryTimer
+{
+	UInt64 nextTime = UINT64_MAX;
+	
+	if(queueAB->count > 0)
+		nextTime = MIN(nextTime, queueAB->datagrams[0].deliveryTime);
+	if(queueBA->count > 0)
+		nextTime = MIN(nextTime, queueBA->datagrams[0].deliveryTime);
+	
+	if(nextTime == UINT64_MAX)
+	{
+		// Nothing in flight. If the timer is still scheduled it'll simply find nothing to do.
+		return;
+	}
+	
+	if((deliveryTimer != nil) && (deliveryTime <= nextTime))
+	{
+		// The timer will already fire in time
+		return;
+	}
+	
+	[deliveryTimer invalidate];
+	[deliveryTimer release];
+	
+	UInt64 now = PseudoTcpMonotonicTime();
+	NSTimeInterval interval = (nextTime > now) ? ((nextTime - now) / NSEC_PER_SECOND) : 0.0;
+	
+	deliveryTimer = [[NSTimer timerWithTimeInterval:interval
+	                                         target:self
+	                                       selector:@selector(doDeliveryTimeout:)
+	                                       userInfo:nil
+	                                        repeats:NO] retain];
+	deliveryTime = nextTime;
+	
+	NSRunLoop *runLoop = [NSRunLoop currentRunLoop];
+	
+	NSEnumerator *modesEnumerator = [[socketA runLoopModes] objectEnumerator];
+	NSString *mode;
+	
+	while((mode = [modesEnumerator nextObject]))
+	{
+		[runLoop addTimer:deliveryTimer forMode:mode];
+	}
+}
+
+- (void)doDeliveryTimeout:(NSTimer *)aTimer
+{
+	[deliveryTimer release];
+	deliveryTimer = nil;
+	deliveryTime = 0;
+	
+	[self deliverDatagrams];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark AsyncUdpSocket Delegate Methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)onUdpSocket:(AsyncUdpSocket *)sock
+     didReceiveData:(NSData *)data
+            withTag:(long)tag
+           fromHost:(NSString *)host
+               port:(UInt16)port
+{
+	if(sock == socketA)
+		[self sendData:data throughQueue:queueAB];
+	else
+		[self sendData:data throughQueue:queueBA];
+	
+	[sock receiveWithTimeout:NO_TIMEOUT tag:0];
+	
+	return YES;
+}
+
+- (void)onUdpSocket:(AsyncUdpSocket *)sock didNotReceiveDataWithTag:(long)tag dueToError:(NSError *)error
+{
+	DDLogWarn(@"PseudoTcpImpairedLink: Receive failed: %@", error);
+	
+	// An ICMP port unreachable from a closed endpoint shows up here. Keep relaying for the other endpoint.
+	if(![sock isClosed])
+	{
+		[sock receiveWithTimeout:NO_TIMEOUT tag:0];
+	}
+}
+
+@end
@@ -0,0 +1,175 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import <Foundation/Foundation.h>
+#import "PseudoTcp.h"
+
+@class PseudoTcpStream;
+
+// Multiplexes many logical streams over a single PseudoTcp connection.
+//
+// Setting up a PseudoTcp connection requires a full NAT traversal (a STUN exchange over XMPP),
+// which takes several round trips and may not succeed at all. Instead of paying that cost for every
+// HTTP connection, we traverse once, and then open as many streams as we like over the resulting flow.
+// All the streams share the one UDP flow, and thus the one congestion controller.
+//
+// Each stream is a PseudoTcpStream, which has the same interface as PseudoTcp, and sends the same delegate
+// methods. So a stream can be wrapped in a PseudoAsyncSocket just like a PseudoTcp socket.
+//
+// Every piece of data is sent in a frame, which consists of an 8 byte header followed by the payload:
+//
+// 0                   1                   2                   3
+// 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1 2 3 4 5 6 7 8 9 0 1
+// +-------------------------------+-------------------------------+
+// |                           Stream ID                           |
+// +---------------+---------------+-------------------------------+
+// |     Type      |     Flags     |            Length             |
+// +---------------+---------------+-------------------------------+
+//
+// The type is one of DATA, WINDOW_UPDATE or RESET.
+// The SYN flag is set on the first frame of a new stream, and the FIN flag on the last data frame.
+//
+// Each stream has its own flow control window, so a stream whose data isn't being read can't stall the others.
+// A host may only send as much data on a stream as the remote host has allowed via WINDOW_UPDATE frames.
+//
+// The framing is negotiated in the PseudoTcp handshake (see PseudoTcp's setMultiplexing:), so a connection
+// is only wrapped in a multiplexer once it's open, and only if receiverSupportsMultiplexing returns YES.
+// Otherwise the remote host is an older implementation, and the connection must be used as a single plain stream.
+// 
+// Note that the streams are still carried over a single reliable byte stream,
+// so a lost packet holds up every stream until it's been retransmitted (head of line blocking).
+// This is the price we pay for sharing the congestion controller and the NAT traversal.
+
+@interface PseudoTcpMultiplexer : NSObject
+{
+	PseudoTcp *pseudoSocket;
+	id delegate;
+	
+	Byte flags;
+	
+	UInt32 nextStreamId;
+	NSMutableDictionary *streams;    // Open streams, keyed by stream ID
+	NSMutableArray *pendingStreams;  // Streams with frames waiting to be sent, in round robin order
+	
+	NSMutableData *readBuffer;       // Received data that hasn't been parsed into frames yet
+	NSMutableData *writeBuffer;      // Encoded frames that haven't been handed to the pseudoSocket yet
+	UInt32 writeBufferOffset;
+	
+	NSError *closeError;
+}
+
+/**
+ * Creates a multiplexer over the given socket, which must already be open,
+ * with multiplexing negotiated by both hosts. The multiplexer becomes the delegate of the socket.
+ * 
+ * The activeOpen flag says which side of the connection we're on (whether we called activeOpen or passiveOpen),
+ * so the two hosts never pick the same stream ID.
+**/
+- (id)initWithPseudoTcp:(PseudoTcp *)pseudoTcp activeOpen:(BOOL)flag;
+
+- (PseudoTcp *)pseudoTcp;
+
+- (id)delegate;
+- (void)setDelegate:(id)delegate;
+
+- (BOOL)isOpen;
+
+/**
+ * Opens a new stream, which may be used immediately.
+ * Returns nil if the multiplexer has been closed.
+**/
+- (PseudoTcpStream *)openStream;
+
+- (NSUInteger)streamCount;
+
+/**
+ * Closes the underlying PseudoTcp socket, after all the data that's been written to it has been sent.
+ * All open streams will be closed.
+**/
+- (void)close;
+
+- (void)setRunLoopModes:(NSArray *)modes;
+- (NSArray *)runLoopModes;
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * A single logical stream within a PseudoTcpMultiplexer.
+ *
+ * The stream has the same interface as PseudoTcp, and invokes the same PseudoTcp delegate methods,
+ * passing itself as the socket.
+ * Closing a stream, via closeAfterWriting, sends the FIN flag after the last of the data,
+ * and closes the stream entirely. It's the same semantics as a PseudoTcp socket's RST.
+**/
+@interface PseudoTcpStream : NSObject <PseudoTcpSocket>
+{
+	PseudoTcpMultiplexer *multiplexer;  // Not retained - the multiplexer retains us until we're closed
+	id delegate;
+	
+	UInt32 streamId;
+	UInt16 flags;
+	
+	NSMutableData *recvBuffer;
+	UInt32 recvBufferOffset;
+	UInt32 recvWindow;        // Bytes the remote host may still send us
+	UInt32 recvWindowUpdate;  // Bytes read since we last sent a window update
+	
+	NSMutableData *sendBuffer;
+	UInt32 sendBufferOffset;
+	UInt32 sendWindow;        // Bytes we may still send to the remote host
+}
+
+- (UInt32)streamId;
+
+/**
+ * Returns the multiplexer the stream belongs to, or nil if the stream has been closed.
+**/
+- (PseudoTcpMultiplexer *)multiplexer;
+
+- (AsyncUdpSocket *)udpSocket;
+
+- (id)delegate;
+- (void)setDelegate:(id)delegate;
+
+- (BOOL)canAcceptBytes;
+- (UInt32)writeData:(NSData *)data atOffset:(UInt32)offset withMaxLength:(UInt32)length;
+
+- (BOOL)hasBytesAvailable;
+- (UInt32)read:(UInt8 *)buffer maxLength:(UInt32)length;
+
+- (UInt32)peekBytes:(const UInt8 **)bytesPtr;
+- (void)consumeBytes:(UInt32)length;
+
+- (void)closeAfterWriting;
+
+- (void)setRunLoopModes:(NSArray *)modes;
+- (NSArray *)runLoopModes;
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@interface NSObject (PseudoTcpMultiplexerDelegate)
+
+/**
+ * Called when the remote host opens a new stream.
+ * The delegate should set the stream's delegate, and keep a reference to it if needed.
+ * If the delegate doesn't implement this method, incoming streams are reset.
+**/
+- (void)multiplexer:(PseudoTcpMultiplexer *)sender didAcceptStream:(PseudoTcpStream *)stream;
+
+/**
+ * Called after the underlying PseudoTcp socket has closed, and every stream has been closed.
+**/
+- (void)multiplexerDidClose:(PseudoTcpMultiplexer *)sender;
+
+@end
@@ -0,0 +1,1059 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import "PseudoTcpMultiplexer.h"
+#import "PseudoTcp.h"
+#import <arpa/inet.h>
+
+// Debug levels: 0-off, 1-error, 2-warn, 3-info, 4-verbose
+#ifdef CONFIGURATION_DEBUG
+  #define DEBUG_LEVEL 2
+#else
+  #define DEBUG_LEVEL 2
+#endif
+#include "DDLog.h"
+
+#define FRAME_HEADER_SIZE        8
+
+#define FRAME_DATA               0
+#define FRAME_WINDOW_UPDATE      1
+#define FRAME_RESET              2
+
+#define FRAME_FLAG_SYN           0x01
+#define FRAME_FLAG_FIN           0x02
+
+#define MAX_FRAME_DATA          (1024 * 16)   // Largest data payload we put in a single frame
+#define STREAM_WINDOW           (1024 * 256)  // Initial flow control window of each stream, in each direction
+#define STREAM_SEND_BUFFER_SIZE (1024 * 64)   // Data each stream buffers before it stops accepting writes
+#define WRITE_BUFFER_LOW_WATER  (1024 * 16)   // We only encode more frames when less than this is waiting
+#define READ_BUFFER_SIZE        (FRAME_HEADER_SIZE + MAX_FRAME_DATA)  // Initial capacity of the readBuffer
+
+enum PseudoTcpMultiplexerFlags
+{
+	kOpen          = 1 << 0,  // If set, the pseudoSocket is open
+	kClosed        = 1 << 1,  // If set, the pseudoSocket has closed
+	kSendingFrames = 1 << 2,  // If set, we're within the maybeSendFrames loop
+};
+
+enum PseudoTcpStreamFlags
+{
+	kStreamSendSyn           = 1 << 0,  // If set, the next frame we send will carry the SYN flag
+	kStreamSendWindowUpdate  = 1 << 1,  // If set, we need to send a window update
+	kStreamCloseAfterWriting = 1 << 2,  // If set, we'll send the FIN flag after all queued data
+	kStreamRemoteClosed      = 1 << 3,  // If set, we've received the FIN flag
+	kStreamClosed            = 1 << 4,  // If set, the stream is closed
+	kStreamCanAcceptNotified = 1 << 5,  // If set, a notifyCanAcceptBytes operation is already scheduled
+};
+
+
+static inline UInt32 ReadUInt32(const UInt8 *bytes)
+{
+	UInt32 num;
+	memcpy(&num, bytes, sizeof(num));
+	return ntohl(num);
+}
+
+static inline UInt16 ReadUInt16(const UInt8 *bytes)
+{
+	UInt16 num;
+	memcpy(&num, bytes, sizeof(num));
+	return ntohs(num);
+}
+
+/**
+ * Appends a complete frame (header and payload) to the given buffer.
+**/
+static void AppendFrame(NSMutableData *buffer, UInt32 streamId, UInt8 type, UInt8 frameFlags,
+						const void *payload, UInt16 length)
+{
+	UInt8 header[FRAME_HEADER_SIZE];
+	
+	UInt32 streamIdN = htonl(streamId);
+	UInt16 lengthN = htons(length);
+	
+	memcpy(header, &streamIdN, 4);
+	header[4] = type;
+	header[5] = frameFlags;
+	memcpy(header + 6, &lengthN, 2);
+	
+	[buffer appendBytes:header length:FRAME_HEADER_SIZE];
+	
+	if(length > 0)
+	{
+		[buffer appendBytes:payload length:length];
+	}
+}
+
+/**
+ * Removes the bytes before the given offset from the front of the buffer, and resets the offset.
+**/
+static void TrimBuffer(NSMutableData *buffer, UInt32 *offset)
+{
+	if(*offset == [buffer length])
+	{
+		[buffer setLength:0];
+		*offset = 0;
+	}
+	else if(*offset > 0)
+	{
+		[buffer replaceBytesInRange:NSMakeRange(0, *offset) withBytes:NULL length:0];
+		*offset = 0;
+	}
+}
+
+@interface PseudoTcpMultiplexer (PrivateAPI)
+- (void)streamHasFramesToSend:(PseudoTcpStream *)stream;
+- (void)removeStream:(PseudoTcpStream *)stream;
+- (void)sendResetForStreamId:(UInt32)streamId;
+- (void)maybeSendFrames;
+- (void)flushWriteBuffer;
+- (void)processFrames;
+- (UInt32)processFramesInBytes:(const UInt8 *)bytes length:(UInt32)length;
+- (void)processFrameWithStreamId:(UInt32)streamId
+							type:(UInt8)type
+						   flags:(UInt8)frameFlags
+						 payload:(const UInt8 *)payload
+						  length:(UInt16)length;
+@end
+
+@interface PseudoTcpStream (PrivateAPI)
+- (id)initWithMultiplexer:(PseudoTcpMultiplexer *)mux streamId:(UInt32)sid;
+- (void)sendSyn;
+- (void)scheduleDidOpen;
+- (void)notifyDidOpen;
+- (BOOL)hasFramesToSend;
+- (void)encodeFramesInto:(NSMutableData *)buffer;
+- (void)scheduleCanAcceptBytes;
+- (void)notifyCanAcceptBytes;
+- (BOOL)processData:(const UInt8 *)bytes length:(UInt32)length fin:(BOOL)fin;
+- (void)processWindowUpdate:(UInt32)increment;
+- (void)processReset;
+- (void)maybeCloseAfterRemoteClose;
+- (void)closeWithError:(NSError *)err;
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpMultiplexer
+
+- (id)initWithPseudoTcp:(PseudoTcp *)pseudoTcp activeOpen:(BOOL)flag
+{
+	if((self = [super init]))
+	{
+		pseudoSocket = [pseudoTcp retain];
+		[pseudoSocket setDelegate:self];
+		
+		flags = kOpen;
+		
+		// The active host uses the odd stream IDs, and the passive host the even ones,
+		// so the two hosts never pick the same ID.
+		nextStreamId = flag ? 1 : 2;
+		
+		streams = [[NSMutableDictionary alloc] initWithCapacity:4];
+		pendingStreams = [[NSMutableArray alloc] initWithCapacity:4];
+		
+		readBuffer = [[NSMutableData alloc] initWithCapacity:READ_BUFFER_SIZE];
+		writeBuffer = [[NSMutableData alloc] initWithCapacity:WRITE_BUFFER_LOW_WATER];
+		writeBufferOffset = 0;
+		
+		closeError = nil;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	DDLogInfo(@"Destroying %@", self);
+	
+	[NSObject cancelPreviousPerformRequestsWithTarget:self];
+	
+	// Any stream still open may be retained elsewhere (by a PseudoAsyncSocket for example),
+	// so we need to close them, or they'd be left with a dangling reference to us.
+	NSArray *openStreams = [streams allValues];
+	
+	NSUInteger i;
+	for(i = 0; i < [openStreams count]; i++)
+	{
+		[[openStreams objectAtIndex:i] closeWithError:nil];
+	}
+	
+	if([pseudoSocket delegate] == self)
+	{
+		[pseudoSocket setDelegate:nil];
+	}
+	[pseudoSocket release];
+	
+	[streams release];
+	[pendingStreams release];
+	[readBuffer release];
+	[writeBuffer release];
+	[closeError release];
+	
+	[super dealloc];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Accessors
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (PseudoTcp *)pseudoTcp
+{
+	return pseudoSocket;
+}
+
+- (id)delegate
+{
+	return delegate;
+}
+
+- (void)setDelegate:(id)newDelegate
+{
+	delegate = newDelegate;
+}
+
+- (BOOL)isOpen
+{
+	return (flags & kOpen) ? YES : NO;
+}
+
+- (NSUInteger)streamCount
+{
+	return [streams count];
+}
+
+- (void)setRunLoopModes:(NSArray *)modes
+{
+	[pseudoSocket setRunLoopModes:modes];
+}
+
+- (NSArray *)runLoopModes
+{
+	return [pseudoSocket runLoopModes];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Opening and Closing
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (PseudoTcpStream *)openStream
+{
+	if(flags & kClosed) return nil;
+	
+	UInt32 streamId = nextStreamId;
+	nextStreamId += 2;
+	
+	DDLogInfo(@"PseudoTcpMultiplexer: openStream (%u)", streamId);
+	
+	PseudoTcpStream *stream = [[PseudoTcpStream alloc] initWithMultiplexer:self streamId:streamId];
+	[streams setObject:stream forKey:[NSNumber numberWithUnsignedInt:streamId]];
+	[stream release];
+	
+	// The first frame we send on the stream announces it to the remote host
+	[stream sendSyn];
+	
+	if(flags & kOpen)
+	{
+		[stream scheduleDidOpen];
+	}
+	
+	return stream;
+}
+
+- (void)close
+{
+	DDLogInfo(@"PseudoTcpMultiplexer: close");
+	
+	// The PseudoTcp socket will send all the frames it's already accepted before closing.
+	// When it's done, it will invoke onPseudoTcpDidClose:, and we'll close all the streams.
+	[pseudoSocket closeAfterWriting];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Streams
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Called by a stream when it has data or control frames that need to be sent.
+**/
+- (void)streamHasFramesToSend:(PseudoTcpStream *)stream
+{
+	if([pendingStreams indexOfObjectIdenticalTo:stream] == NSNotFound)
+	{
+		[pendingStreams addObject:stream];
+	}
+	
+	[self maybeSendFrames];
+}
+
+/**
+ * Called by a stream when it closes.
+**/
+- (void)removeStream:(PseudoTcpStream *)stream
+{
+	[pendingStreams removeObjectIdenticalTo:stream];
+	[streams removeObjectForKey:[NSNumber numberWithUnsignedInt:[stream streamId]]];
+}
+
+- (void)sendResetForStreamId:(UInt32)streamId
+{
+	AppendFrame(writeBuffer, streamId, FRAME_RESET, 0, NULL, 0);
+	
+	[self maybeSendFrames];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Sending
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Encodes frames from the pending streams, and hands them to the pseudoSocket.
+ *
+ * The streams take turns, with each getting to send at most MAX_FRAME_DATA bytes per turn.
+ * We only encode frames while there's little waiting in the writeBuffer, so that a stream that starts
+ * sending doesn't have to wait behind a large amount of data we've already encoded for the other streams.
+**/
+- (void)maybeSendFrames
+{
+	if(flags & kClosed) return;
+	
+	// Streams may be written to from within the loop below (a stream's delegate is told when it closes,
+	// and may then write to another). That's fine, as the stream is simply added to the pendingStreams array,
+	// which the loop picks up.
+	if(flags & kSendingFrames) return;
+	flags |= kSendingFrames;
+	
+	BOOL done = NO;
+	while(!done)
+	{
+		[self flushWriteBuffer];
+		
+		UInt32 waiting = [writeBuffer length] - writeBufferOffset;
+		
+		if((waiting < WRITE_BUFFER_LOW_WATER) && ([pendingStreams count] > 0))
+		{
+			PseudoTcpStream *stream = [[pendingStreams objectAtIndex:0] retain];
+			[pendingStreams removeObjectAtIndex:0];
+			
+			[stream encodeFramesInto:writeBuffer];
+			
+			// If the stream still has more to send, it goes to the back of the line
+			if([stream hasFramesToSend] && ([pendingStreams indexOfObjectIdenticalTo:stream] == NSNotFound))
+			{
+				[pendingStreams addObject:stream];
+			}
+			
+			[stream release];
+		}
+		else
+		{
+			done = YES;
+		}
+	}
+	
+	flags &= ~kSendingFrames;
+}
+
+/**
+ * Hands as much of the writeBuffer to the pseudoSocket as it will take.
+**/
+- (void)flushWriteBuffer
+{
+	while((writeBufferOffset < [writeBuffer length]) && [pseudoSocket canAcceptBytes])
+	{
+		UInt32 bytesWritten = [pseudoSocket writeData:writeBuffer
+											 atOffset:writeBufferOffset
+										withMaxLength:([writeBuffer length] - writeBufferOffset)];
+		if(bytesWritten == 0) break;
+		
+		writeBufferOffset += bytesWritten;
+	}
+	
+	TrimBuffer(writeBuffer, &writeBufferOffset);
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Receiving
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Parses and processes all the complete frames in the readBuffer.
+**/
+- (void)processFrames
+{
+	UInt32 offset = [self processFramesInBytes:[readBuffer bytes] length:[readBuffer length]];
+	
+	TrimBuffer(readBuffer, &offset);
+}
+
+/**
+ * Parses and processes all the complete frames in the given bytes.
+ * Returns the number of bytes processed. Anything after that is the start of an incomplete frame.
+**/
+- (UInt32)processFramesInBytes:(const UInt8 *)bytes length:(UInt32)length
+{
+	UInt32 offset = 0;
+	
+	while(!(flags & kClosed) && ((length - offset) >= FRAME_HEADER_SIZE))
+	{
+		UInt32 streamId   = ReadUInt32(bytes + offset);
+		UInt8 type        = bytes[offset + 4];
+		UInt8 frameFlags  = bytes[offset + 5];
+		UInt16 dataLength = ReadUInt16(bytes + offset + 6);
+		
+		if((length - offset) < (FRAME_HEADER_SIZE + dataLength))
+		{
+			// We don't have the entire frame yet
+			break;
+		}
+		
+		[self processFrameWithStreamId:streamId
+								  type:type
+								 flags:frameFlags
+							   payload:(bytes + offset + FRAME_HEADER_SIZE)
+								length:dataLength];
+		
+		offset += FRAME_HEADER_SIZE + dataLength;
+	}
+	
+	return offset;
+}
+
+- (void)processFrameWithStreamId:(UInt32)streamId
+							type:(UInt8)type
+						   flags:(UInt8)frameFlags
+						 payload:(const UInt8 *)payload
+						  length:(UInt16)length
+{
+	NSNumber *key = [NSNumber numberWithUnsignedInt:streamId];
+	PseudoTcpStream *stream = [streams objectForKey:key];
+	
+	if(stream == nil)
+	{
+		// Frames for streams we've already closed are simply ignored.
+		// Remember: A stream is closed as soon as we send or receive the FIN flag,
+		// so the remote host may still be sending window updates or data it wrote before it saw our FIN.
+		if(!(frameFlags & FRAME_FLAG_SYN) || (type == FRAME_RESET)) return;
+		
+		// The remote host may only open streams with its own IDs
+		if((streamId == 0) || ((streamId & 1) == (nextStreamId & 1)))
+		{
+			DDLogWarn(@"PseudoTcpMultiplexer: Ignoring SYN with invalid stream ID (%u)", streamId);
+			return;
+		}
+		
+		DDLogInfo(@"PseudoTcpMultiplexer: Accepted stream (%u)", streamId);
+		
+		stream = [[PseudoTcpStream alloc] initWithMultiplexer:self streamId:streamId];
+		[streams setObject:stream forKey:key];
+		[stream release];
+		
+		if([delegate respondsToSelector:@selector(multiplexer:didAcceptStream:)])
+		{
+			[delegate multiplexer:self didAcceptStream:stream];
+			[stream scheduleDidOpen];
+		}
+		else
+		{
+			[self sendResetForStreamId:streamId];
+			[stream closeWithError:nil];
+			return;
+		}
+	}
+	
+	if(type == FRAME_DATA)
+	{
+		if(![stream processData:payload length:length fin:((frameFlags & FRAME_FLAG_FIN) ? YES : NO)])
+		{
+			// The remote host sent more than we allowed
+			DDLogWarn(@"PseudoTcpMultiplexer: Flow control violation on stream (%u)", streamId);
+			
+			[self sendResetForStreamId:streamId];
+			
+			NSString *errMsg = @"Flow control violation";
+			NSDictionary *errInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+			
+			[stream closeWithError:[NSError errorWithDomain:NSPOSIXErrorDomain code:EPROTO userInfo:errInfo]];
+		}
+	}
+	else if(type == FRAME_WINDOW_UPDATE)
+	{
+		if(length >= 4)
+		{
+			[stream processWindowUpdate:ReadUInt32(payload)];
+		}
+	}
+	else if(type == FRAME_RESET)
+	{
+		[stream processReset];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark PseudoTcp Delegate Methods
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)onPseudoTcpHasBytesAvailable:(PseudoTcp *)sock
+{
+	// We always read everything that's available.
+	// Each stream buffers its own data (up to its flow control window) until it's read,
+	// so a stream whose data isn't being read never holds up the others.
+	// 
+	// Frames are parsed straight out of the pseudoSocket's receive buffer, so each payload is only copied once,
+	// into the stream it belongs to. The only frames we copy into our own readBuffer are those that are split,
+	// either because the rest hasn't arrived yet, or because it wraps around the end of the receive buffer.
+	
+	const UInt8 *bytes;
+	UInt32 length;
+	
+	while(!(flags & kClosed) && ((length = [pseudoSocket peekBytes:&bytes]) > 0))
+	{
+		if([readBuffer length] > 0)
+		{
+			// Copy just enough to complete the split frame
+			UInt32 frameLength = FRAME_HEADER_SIZE;
+			if([readBuffer length] >= FRAME_HEADER_SIZE)
+			{
+				frameLength += ReadUInt16([readBuffer bytes] + 6);
+			}
+			
+			UInt32 amount = MIN(frameLength - [readBuffer length], length);
+			
+			[readBuffer appendBytes:bytes length:amount];
+			[pseudoSocket consumeBytes:amount];
+			
+			[self processFrames];
+		}
+		else
+		{
+			UInt32 processed = [self processFramesInBytes:bytes length:length];
+			
+			if(processed < length)
+			{
+				[readBuffer appendBytes:(bytes + processed) length:(length - processed)];
+			}
+			
+			[pseudoSocket consumeBytes:length];
+		}
+	}
+}
+
+- (void)onPseudoTcpCanAcceptBytes:(PseudoTcp *)sock
+{
+	[self maybeSendFrames];
+}
+
+- (void)onPseudoTcp:(PseudoTcp *)sock willCloseWithError:(NSError *)err
+{
+	DDLogInfo(@"PseudoTcpMultiplexer: onPseudoTcp:willCloseWithError: %@", err);
+	
+	// We pass the error on to the streams once the socket has actually closed
+	[closeError release];
+	closeError = [err retain];
+}
+
+- (void)onPseudoTcpDidClose:(PseudoTcp *)sock
+{
+	DDLogInfo(@"PseudoTcpMultiplexer: onPseudoTcpDidClose:");
+	
+	flags |= kClosed;
+	flags &= ~kOpen;
+	
+	// Make sure we're not deallocated while we're notifying everyone
+	[[self retain] autorelease];
+	
+	NSArray *openStreams = [streams allValues];
+	
+	NSUInteger i;
+	for(i = 0; i < [openStreams count]; i++)
+	{
+		[[openStreams objectAtIndex:i] closeWithError:closeError];
+	}
+	
+	[streams removeAllObjects];
+	[pendingStreams removeAllObjects];
+	
+	[readBuffer setLength:0];
+	[writeBuffer setLength:0];
+	writeBufferOffset = 0;
+	
+	if([delegate respondsToSelector:@selector(multiplexerDidClose:)])
+	{
+		[delegate multiplexerDidClose:self];
+	}
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpStream
+
+- (id)initWithMultiplexer:(PseudoTcpMultiplexer *)mux streamId:(UInt32)sid
+{
+	if((self = [super init]))
+	{
+		multiplexer = mux;
+		delegate = nil;
+		
+		streamId = sid;
+		flags = 0;
+		
+		recvBuffer = [[NSMutableData alloc] initWithCapacity:MAX_FRAME_DATA];
+		recvBufferOffset = 0;
+		recvWindow = STREAM_WINDOW;
+		recvWindowUpdate = 0;
+		
+		sendBuffer = [[NSMutableData alloc] initWithCapacity:MAX_FRAME_DATA];
+		sendBufferOffset = 0;
+		sendWindow = STREAM_WINDOW;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	DDLogInfo(@"Destroying %@", self);
+	
+	[NSObject cancelPreviousPerformRequestsWithTarget:self];
+	
+	[recvBuffer release];
+	[sendBuffer release];
+	
+	[super dealloc];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Accessors
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (UInt32)streamId
+{
+	return streamId;
+}
+
+- (PseudoTcpMultiplexer *)multiplexer
+{
+	return multiplexer;
+}
+
+- (AsyncUdpSocket *)udpSocket
+{
+	return [[multiplexer pseudoTcp] udpSocket];
+}
+
+- (id)delegate
+{
+	return delegate;
+}
+
+- (void)setDelegate:(id)newDelegate
+{
+	delegate = newDelegate;
+}
+
+- (void)setRunLoopModes:(NSArray *)modes
+{
+	[multiplexer setRunLoopModes:modes];
+}
+
+- (NSArray *)runLoopModes
+{
+	NSArray *modes = [multiplexer runLoopModes];
+	
+	if(modes)
+		return modes;
+	else
+		return [NSArray arrayWithObject:NSDefaultRunLoopMode];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Opening and Closing
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)sendSyn
+{
+	flags |= kStreamSendSyn;
+	[multiplexer streamHasFramesToSend:self];
+}
+
+/**
+ * Schedules the onPseudoTcpDidOpen: delegate method.
+ * It's always invoked asynchronously, so the stream can be handed to its delegate (a PseudoAsyncSocket) first.
+**/
+- (void)scheduleDidOpen
+{
+	[self performSelector:@selector(notifyDidOpen) withObject:nil afterDelay:0.0 inModes:[self runLoopModes]];
+}
+
+- (void)notifyDidOpen
+{
+	if(flags & kStreamClosed) return;
+	
+	if([delegate respondsToSelector:@selector(onPseudoTcpDidOpen:)])
+	{
+		[delegate onPseudoTcpDidOpen:self];
+	}
+	
+	// If the delegate hasn't already filled the send buffer in the onPseudoTcpDidOpen method
+	// we inform them that we're ready to accept bytes
+	if([self canAcceptBytes])
+	{
+		if([delegate respondsToSelector:@selector(onPseudoTcpCanAcceptBytes:)])
+		{
+			[delegate onPseudoTcpCanAcceptBytes:self];
+		}
+	}
+}
+
+- (void)closeAfterWriting
+{
+	DDLogInfo(@"PseudoTcpStream: closeAfterWriting (%u)", streamId);
+	
+	if(flags & (kStreamClosed | kStreamCloseAfterWriting)) return;
+	
+	if(flags & kStreamRemoteClosed)
+	{
+		// The remote host has already closed the stream, and isn't expecting anything more from us
+		[self closeWithError:nil];
+	}
+	else
+	{
+		// Wait till all queued data has been encoded, then send the FIN flag
+		flags |= kStreamCloseAfterWriting;
+		[multiplexer streamHasFramesToSend:self];
+	}
+}
+
+/**
+ * Closes the stream once the remote host has closed it, and we've read all the data it sent.
+**/
+- (void)maybeCloseAfterRemoteClose
+{
+	if(!(flags & kStreamRemoteClosed) || (flags & kStreamClosed)) return;
+	if([self hasBytesAvailable]) return;
+	
+	// If we were still trying to send data, treat this as an error
+	if([sendBuffer length] > sendBufferOffset)
+	{
+		NSString *errMsg = @"Connection reset";
+		NSDictionary *errInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+		
+		[self closeWithError:[NSError errorWithDomain:NSPOSIXErrorDomain code:ECONNRESET userInfo:errInfo]];
+	}
+	else
+	{
+		[self closeWithError:nil];
+	}
+}
+
+- (void)closeWithError:(NSError *)err
+{
+	if(flags & kStreamClosed) return;
+	flags |= kStreamClosed;
+	
+	DDLogInfo(@"PseudoTcpStream: closeWithError: (%u) %@", streamId, err);
+	
+	// The multiplexer may be holding the last reference to us
+	[[self retain] autorelease];
+	
+	if(err && [delegate respondsToSelector:@selector(onPseudoTcp:willCloseWithError:)])
+	{
+		[delegate onPseudoTcp:self willCloseWithError:err];
+	}
+	
+	NSArray *modes = [self runLoopModes];
+	
+	[multiplexer removeStream:self];
+	multiplexer = nil;
+	
+	[recvBuffer setLength:0];
+	recvBufferOffset = 0;
+	[sendBuffer setLength:0];
+	sendBufferOffset = 0;
+	
+	if([delegate respondsToSelector:@selector(onPseudoTcpDidClose:)])
+	{
+		[delegate performSelector:@selector(onPseudoTcpDidClose:)
+					   withObject:self
+					   afterDelay:0.0
+						  inModes:modes];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Writing
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)canAcceptBytes
+{
+	if(flags & (kStreamClosed | kStreamCloseAfterWriting | kStreamRemoteClosed)) return NO;
+	
+	// As with PseudoTcp, we only answer YES when we can accept a larger chunk of data,
+	// so the PseudoAsyncSocket doesn't trickle data into the buffer in small pieces.
+	UInt32 pending = [sendBuffer length] - sendBufferOffset;
+	
+	return (STREAM_SEND_BUFFER_SIZE - MIN(pending, STREAM_SEND_BUFFER_SIZE)) > (STREAM_SEND_BUFFER_SIZE / 4);
+}
+
+- (UInt32)writeData:(NSData *)data atOffset:(UInt32)offset withMaxLength:(UInt32)maxLength
+{
+	if(![self canAcceptBytes]) return 0;
+	if(data == nil || [data length] == 0) return 0;
+	
+	NSAssert2(offset < [data length], @"offset(%u) >= data(length=%u)", offset, (unsigned)[data length]);
+	
+	UInt32 pending = [sendBuffer length] - sendBufferOffset;
+	UInt32 dataAvailable = [data length] - offset;
+	
+	UInt32 amount = MIN(STREAM_SEND_BUFFER_SIZE - pending, MIN(maxLength, dataAvailable));
+	
+	[sendBuffer appendBytes:([data bytes] + offset) length:amount];
+	
+	if(sendWindow > 0)
+	{
+		[multiplexer streamHasFramesToSend:self];
+	}
+	
+	return amount;
+}
+
+- (BOOL)hasFramesToSend
+{
+	if(flags & kStreamClosed) return NO;
+	if(flags & (kStreamSendSyn | kStreamSendWindowUpdate)) return YES;
+	
+	UInt32 pending = [sendBuffer length] - sendBufferOffset;
+	
+	if(pending > 0)
+		return (sendWindow > 0);
+	else
+		return (flags & kStreamCloseAfterWriting) ? YES : NO;
+}
+
+/**
+ * Appends the stream's next frames to the given buffer.
+ * This is any pending window update, followed by at most one data frame.
+**/
+- (void)encodeFramesInto:(NSMutableData *)buffer
+{
+	if(flags & kStreamClosed) return;
+	
+	BOOL couldAcceptBytes = [self canAcceptBytes];
+	
+	UInt8 frameFlags = 0;
+	
+	if(flags & kStreamSendSyn)
+	{
+		frameFlags |= FRAME_FLAG_SYN;
+		flags &= ~kStreamSendSyn;
+	}
+	
+	if(flags & kStreamSendWindowUpdate)
+	{
+		UInt32 incrementN = htonl(recvWindowUpdate);
+		AppendFrame(buffer, streamId, FRAME_WINDOW_UPDATE, frameFlags, &incrementN, 4);
+		
+		recvWindow += recvWindowUpdate;
+		recvWindowUpdate = 0;
+		
+		flags &= ~kStreamSendWindowUpdate;
+		frameFlags = 0;
+	}
+	
+	UInt32 pending = [sendBuffer length] - sendBufferOffset;
+	UInt32 dataLength = MIN(MIN(pending, sendWindow), MAX_FRAME_DATA);
+	
+	BOOL fin = (flags & kStreamCloseAfterWriting) && (dataLength == pending);
+	
+	if(fin)
+	{
+		frameFlags |= FRAME_FLAG_FIN;
+	}
+	
+	if((dataLength > 0) || (frameFlags != 0))
+	{
+		AppendFrame(buffer, streamId, FRAME_DATA, frameFlags, ([sendBuffer bytes] + sendBufferOffset), dataLength);
+		
+		sendBufferOffset += dataLength;
+		sendWindow -= dataLength;
+		
+		if((sendBufferOffset == [sendBuffer length]) || (sendBufferOffset >= (STREAM_SEND_BUFFER_SIZE / 2)))
+		{
+			TrimBuffer(sendBuffer, &sendBufferOffset);
+		}
+	}
+	
+	if(fin)
+	{
+		// We've sent everything we're ever going to send.
+		// The remote host forgets about the stream when it gets the FIN, so we're done with it as well.
+		[self closeWithError:nil];
+	}
+	else if(!couldAcceptBytes && [self canAcceptBytes])
+	{
+		[self scheduleCanAcceptBytes];
+	}
+}
+
+/**
+ * Schedules the onPseudoTcpCanAcceptBytes: delegate method.
+ * 
+ * Frames are encoded from within writeData:atOffset:withMaxLength: (via the multiplexer's maybeSendFrames loop),
+ * so invoking the delegate directly would call back into the writer before it has accounted for the bytes
+ * it just wrote. As with PseudoTcp, the notification is always delivered asynchronously instead.
+**/
+- (void)scheduleCanAcceptBytes
+{
+	if(flags & kStreamCanAcceptNotified) return;
+	flags |= kStreamCanAcceptNotified;
+	
+	[self performSelector:@selector(notifyCanAcceptBytes) withObject:nil afterDelay:0.0 inModes:[self runLoopModes]];
+}
+
+- (void)notifyCanAcceptBytes
+{
+	flags &= ~kStreamCanAcceptNotified;
+	
+	if(![self canAcceptBytes]) return;
+	
+	if([delegate respondsToSelector:@selector(onPseudoTcpCanAcceptBytes:)])
+	{
+		[delegate onPseudoTcpCanAcceptBytes:self];
+	}
+}
+
+- (void)processWindowUpdate:(UInt32)increment
+{
+	// Guard against a misbehaving remote host wrapping the window around
+	sendWindow = (UInt32)MIN((UInt64)sendWindow + increment, (UInt64)UINT32_MAX);
+	
+	if([self hasFramesToSend])
+	{
+		[multiplexer streamHasFramesToSend:self];
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Reading
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (BOOL)hasBytesAvailable
+{
+	return [recvBuffer length] > recvBufferOffset;
+}
+
+- (UInt32)read:(UInt8 *)buffer maxLength:(UInt32)maxLength
+{
+	const UInt8 *bytes;
+	UInt32 amountRead = MIN([self peekBytes:&bytes], maxLength);
+	
+	if(amountRead == 0) return 0;
+	
+	memcpy(buffer, bytes, amountRead);
+	
+	[self consumeBytes:amountRead];
+	
+	return amountRead;
+}
+
+/**
+ * The recvBuffer isn't a ring, so the region always includes all the data available.
+**/
+- (UInt32)peekBytes:(const UInt8 **)bytesPtr
+{
+	UInt32 available = [recvBuffer length] - recvBufferOffset;
+	
+	if(available == 0) return 0;
+	
+	if(bytesPtr) *bytesPtr = (const UInt8 *)[recvBuffer bytes] + recvBufferOffset;
+	
+	return available;
+}
+
+- (void)consumeBytes:(UInt32)length
+{
+	if(length == 0) return;
+	
+	NSAssert2(length <= ([recvBuffer length] - recvBufferOffset),
+			  @"consumeBytes:%u with only %u bytes available", length, ([recvBuffer length] - recvBufferOffset));
+	
+	recvBufferOffset += length;
+	
+	if((recvBufferOffset == [recvBuffer length]) || (recvBufferOffset >= (STREAM_WINDOW / 4)))
+	{
+		TrimBuffer(recvBuffer, &recvBufferOffset);
+	}
+	
+	if(flags & kStreamRemoteClosed)
+	{
+		// The remote host won't send anything more, so there's no need for window updates
+		[self maybeCloseAfterRemoteClose];
+	}
+	else
+	{
+		recvWindowUpdate += length;
+		
+		// Open the window back up once the application has read half of it.
+		// Updating it any more often would only waste bandwidth on tiny frames.
+		if((recvWindowUpdate >= (STREAM_WINDOW / 2)) && !(flags & kStreamSendWindowUpdate))
+		{
+			flags |= kStreamSendWindowUpdate;
+			[multiplexer streamHasFramesToSend:self];
+		}
+	}
+}
+
+/**
+ * Processes the payload of a received data frame.
+ * Returns NO if the remote host has violated the flow control window.
+**/
+- (BOOL)processData:(const UInt8 *)bytes length:(UInt32)length fin:(BOOL)fin
+{
+	if(flags & kStreamClosed) return YES;
+	
+	if(length > recvWindow) return NO;
+	
+	recvWindow -= length;
+	
+	if(length > 0)
+	{
+		[recvBuffer appendBytes:bytes length:length];
+	}
+	
+	if(fin)
+	{
+		flags |= kStreamRemoteClosed;
+	}
+	
+	if(length > 0)
+	{
+		if([delegate respondsToSelector:@selector(onPseudoTcpHasBytesAvailable:)])
+		{
+			[delegate onPseudoTcpHasBytesAvailable:self];
+		}
+	}
+	
+	// If the remote host closed the stream, and there's no data left to read, we can close now.
+	// Otherwise the upper-layer continues to read until it reaches the end of the stream,
+	// just as it would with a PseudoTcp socket that received a RST.
+	[self maybeCloseAfterRemoteClose];
+	
+	return YES;
+}
+
+- (void)processReset
+{
+	NSString *errMsg = @"Connection reset";
+	NSDictionary *errInfo = [NSDictionary dictionaryWithObject:errMsg forKey:NSLocalizedDescriptionKey];
+	
+	[self closeWithError:[NSError errorWithDomain:NSPOSIXErrorDomain code:ECONNRESET userInfo:errInfo]];
+}
+
+@end
@@ -0,0 +1,243 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import <Foundation/Foundation.h>
+#import "PseudoTcp.h"
+
+@class AsyncUdpSocket;
+@class PseudoTcpThreadedSocketCore;
+@class PseudoTcpThreadedConnectionCore;
+
+// A background thread with a run loop of its own, for running network code away from the main thread.
+//
+// AsyncUdpSocket and PseudoTcp (along with everything built on them) do all their work on the run loop of the
+// thread they were created on. On the main thread, that means packets wait while the application is busy drawing,
+// laying out tables or handling menus, which shows up directly as extra round trip time (delayed acks are delayed
+// even further, and retransmission timers fire late).
+//
+// To avoid this, create the sockets on a network thread instead:
+//
+// [networkThread performSelector:@selector(setupSockets) target:self withObject:nil waitUntilDone:YES];
+//
+// From then on the sockets, and their delegate methods, run on the network thread.
+// Every call into the sockets must also be made on the network thread, as they're not thread-safe.
+// So the delegates of sockets on a network thread must live on the network thread as well.
+//
+// Code that belongs on the main thread (such as an HTTP server, or anything touching the user interface)
+// can instead use a PseudoTcpThreadedConnection (below), which runs the PseudoTcp socket on the network thread,
+// and hands out PseudoTcpThreadedSockets that may be used from the main thread.
+
+@interface PseudoTcpNetworkThread : NSObject
+{
+	NSThread *thread;
+	NSRunLoop *runLoop;
+	NSConditionLock *startupLock;
+	volatile BOOL shouldStop;
+}
+
+/**
+ * Returns a network thread shared by the whole application, starting it if needed.
+**/
++ (PseudoTcpNetworkThread *)sharedNetworkThread;
+
+/**
+ * Starts a new network thread with the given name (which shows up in the debugger and crash reports).
+ * Applications with many connections may spread them over several network threads.
+**/
+- (id)initWithName:(NSString *)name;
+
+- (NSThread *)thread;
+
+/**
+ * Returns the run loop of the network thread.
+ * This may be passed to the moveToRunLoop: method of sockets that were created elsewhere.
+**/
+- (NSRunLoop *)runLoop;
+
+/**
+ * Returns whether the current thread is the network thread.
+**/
+- (BOOL)isCurrentThread;
+
+/**
+ * Invokes the selector on the target, on the network thread, in the common run loop modes.
+ * If called from the network thread with waitUntilDone set, the selector is invoked immediately.
+**/
+- (void)performSelector:(SEL)selector target:(id)target withObject:(id)object waitUntilDone:(BOOL)wait;
+
+/**
+ * Stops the thread once its run loop next wakes up.
+ * Any sockets still on the thread should be closed first.
+**/
+- (void)stop;
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A socket on a network thread, as seen from another thread (usually the main thread).
+//
+// It has the same interface as PseudoTcp, and sends the same delegate methods, on the thread it's used from.
+// So it can be wrapped in a PseudoAsyncSocket just like a PseudoTcp socket.
+//
+// The underlying socket (a PseudoTcp or PseudoTcpStream) never leaves the network thread.
+// Incoming data is read from it on the network thread, into a buffer that's then handed over whole,
+// and outgoing data is copied into a buffer that the network thread writes out. The two threads only ever share
+// these buffers (under a lock), never the socket's own. Delegate methods are gathered up, and delivered in a batch
+// the next time the thread's run loop comes around, so a burst of packets costs that thread a single wake up.
+// The network thread never waits for the other thread.
+//
+// Each buffer holds up to PSEUDO_TCP_THREADED_BUFFER_SIZE bytes. Once the incoming buffer is full,
+// the network thread stops reading, and the socket's receive window closes, until the data has been read.
+
+#define PSEUDO_TCP_THREADED_BUFFER_SIZE  (256 * 1024)
+
+@interface PseudoTcpThreadedSocket : NSObject <PseudoTcpSocket>
+{
+	PseudoTcpThreadedSocketCore *core;
+	id delegate;
+	
+	NSMutableData *readBuffer;  // Data handed over by the network thread, that's being read on this thread
+	UInt32 readBufferOffset;
+	BOOL closed;
+}
+
+/**
+ * Takes over as the delegate of the given socket, which must already be open.
+ * 
+ * This must be called on the socket's network thread. The returned object may then only be used on the given thread,
+ * to which all of its delegate methods are delivered. (PseudoTcpThreadedConnection takes care of this.)
+**/
+- (id)initWithSocket:(id <PseudoTcpSocket>)socket delegateThread:(NSThread *)thread;
+
+/**
+ * Returns the UDP socket underneath, which lives on the network thread.
+ * Only its address accessors (such as connectedHost) may be used from other threads.
+**/
+- (AsyncUdpSocket *)udpSocket;
+
+- (id)delegate;
+- (void)setDelegate:(id)delegate;
+
+- (BOOL)canAcceptBytes;
+- (UInt32)writeData:(NSData *)data atOffset:(UInt32)offset withMaxLength:(UInt32)length;
+
+- (BOOL)hasBytesAvailable;
+- (UInt32)read:(UInt8 *)buffer maxLength:(UInt32)length;
+
+- (UInt32)peekBytes:(const UInt8 **)bytesPtr;
+- (void)consumeBytes:(UInt32)length;
+
+/**
+ * Closes the underlying socket once all the data written so far has been handed to it.
+**/
+- (void)closeAfterWriting;
+
+/**
+ * The run loop modes in which delegate methods are delivered. The default is NSDefaultRunLoopMode.
+ * These don't affect the underlying socket, which runs in the network thread's modes.
+**/
+- (void)setRunLoopModes:(NSArray *)modes;
+- (NSArray *)runLoopModes;
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+// A PseudoTcp connection that runs on a network thread, on behalf of an object on another thread.
+//
+// The connection is created from a connected UDP socket (such as the result of a STUN procedure),
+// which is moved over to the network thread, along with the PseudoTcp socket created on top of it.
+// If both hosts offer multiplexing in the handshake, a PseudoTcpMultiplexer is put over the connection
+// (on the network thread), and each stream is handed out as its own PseudoTcpThreadedSocket.
+// Otherwise the connection itself is handed out, once, as a single PseudoTcpThreadedSocket.
+//
+// All methods, and all delegate methods, are on the thread the connection was created on.
+
+@interface PseudoTcpThreadedConnection : NSObject
+{
+	PseudoTcpThreadedConnectionCore *core;
+	PseudoTcpNetworkThread *networkThread;
+	id delegate;
+	
+	BOOL isOpen;
+	BOOL isMultiplexed;
+}
+
+/**
+ * Creates a PseudoTcp socket over the given UDP socket, on the given network thread.
+ * The UDP socket must be connected, and running on the current thread's run loop.
+ * It's moved over to the network thread, so it must not be used directly from here on.
+ * 
+ * Returns nil if the PseudoTcp socket couldn't be created.
+**/
+- (id)initWithUdpSocket:(AsyncUdpSocket *)udpSocket networkThread:(PseudoTcpNetworkThread *)thread;
+
+- (id)delegate;
+- (void)setDelegate:(id)delegate;
+
+/**
+ * Configures the PseudoTcp socket, which may only be touched on the network thread.
+ * The selector is invoked on the target, with the socket as its argument, on the network thread,
+ * and this method waits for it to finish.
+ * 
+ * This should be done before the connection is opened, and the target should do nothing but configure the socket
+ * (buffer sizes, congestion control, forward error correction, multiplexing and so on).
+**/
+- (void)configurePseudoTcpWithSelector:(SEL)selector target:(id)target;
+
+- (void)activeOpen;
+- (void)passiveOpen;
+
+- (BOOL)isOpen;
+
+/**
+ * Returns whether streams are multiplexed over the connection (only known once it's open).
+**/
+- (BOOL)isMultiplexed;
+
+/**
+ * Returns a socket for a new stream over a multiplexed connection.
+ * For a connection that isn't multiplexed, the first call returns the connection itself, and any later calls nil.
+ * Also returns nil if the connection isn't open, or has closed.
+**/
+- (PseudoTcpThreadedSocket *)openSocket;
+
+/**
+ * Closes the connection, along with every stream over it.
+ * Does not close a connection that isn't multiplexed, once its socket has been handed out by openSocket.
+**/
+- (void)close;
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@interface NSObject (PseudoTcpThreadedConnectionDelegate)
+
+/**
+ * Called when the connection opens. Check isMultiplexed, and call openSocket to start using it.
+**/
+- (void)threadedConnectionDidOpen:(PseudoTcpThreadedConnection *)sender;
+
+/**
+ * Called when the remote host opens a new stream over a multiplexed connection.
+ * The delegate should set the socket's delegate, and keep a reference to it.
+**/
+- (void)threadedConnection:(PseudoTcpThreadedConnection *)sender didAcceptSocket:(PseudoTcpThreadedSocket *)socket;
+
+/**
+ * Called if the connection fails to open, or when a multiplexed connection closes.
+**/
+- (void)threadedConnectionDidClose:(PseudoTcpThreadedConnection *)sender;
+
+@end
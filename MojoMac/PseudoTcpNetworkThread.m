@@ -0,0 +1,1195 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import "PseudoTcpNetworkThread.h"
+#import "PseudoTcpMultiplexer.h"
+#import "AsyncUdpSocket.h"
+#import <pthread.h>
+
+#define THREAD_STARTING  0
+#define THREAD_RUNNING   1
+
+// Events waiting to be delivered to the delegate of a PseudoTcpThreadedSocket
+#define kHasBytesAvailable  1 << 0  // onPseudoTcpHasBytesAvailable:
+#define kCanAcceptBytes     1 << 1  // onPseudoTcpCanAcceptBytes:
+#define kWillClose          1 << 2  // onPseudoTcp:willCloseWithError:
+#define kDidClose           1 << 3  // onPseudoTcpDidClose:
+
+@interface PseudoTcpNetworkThread (PrivateAPI)
+- (void)threadMain;
+- (void)wakeUp;
+@end
+
+@interface PseudoTcpThreadedSocket (PrivateAPI)
+- (void)markClosed;
+@end
+
+@interface PseudoTcpThreadedConnection (PrivateAPI)
+- (void)setOpen:(BOOL)openFlag multiplexed:(BOOL)multiplexedFlag;
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpNetworkThread
+
+static PseudoTcpNetworkThread *sharedNetworkThread;
+
++ (PseudoTcpNetworkThread *)sharedNetworkThread
+{
+	@synchronized(self)
+	{
+		if(sharedNetworkThread == nil)
+		{
+			sharedNetworkThread = [[PseudoTcpNetworkThread alloc] initWithName:@"PseudoTcpNetworkThread"];
+		}
+	}
+	return sharedNetworkThread;
+}
+
+- (id)initWithName:(NSString *)name
+{
+	if((self = [super init]))
+	{
+		shouldStop = NO;
+		startupLock = [[NSConditionLock alloc] initWithCondition:THREAD_STARTING];
+		
+		thread = [[NSThread alloc] initWithTarget:self selector:@selector(threadMain) object:nil];
+		[thread setName:name];
+		[thread start];
+		
+		// Wait for the run loop to be set up, so it can be used as soon as we return
+		[startupLock lockWhenCondition:THREAD_RUNNING];
+		[startupLock unlock];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	[thread release];
+	[startupLock release];
+	[super dealloc];
+}
+
+- (NSThread *)thread
+{
+	return thread;
+}
+
+- (NSRunLoop *)runLoop
+{
+	return runLoop;
+}
+
+- (BOOL)isCurrentThread
+{
+	return [NSThread currentThread] == thread;
+}
+
+- (void)performSelector:(SEL)selector target:(id)target withObject:(id)object waitUntilDone:(BOOL)wait
+{
+	[target performSelector:selector
+	               onThread:thread
+	             withObject:object
+	          waitUntilDone:wait
+	                  modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+}
+
+- (void)stop
+{
+	shouldStop = YES;
+	
+	// The run loop only checks the flag after handling something
+	[self performSelector:@selector(wakeUp) target:self withObject:nil waitUntilDone:NO];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Private API
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)threadMain
+{
+	NSAutoreleasePool *pool = [[NSAutoreleasePool alloc] init];
+	
+	[startupLock lock];
+	
+	runLoop = [NSRunLoop currentRunLoop];
+	
+	// A run loop without any sources returns immediately, instead of waiting.
+	// So we give it a port that nothing is ever sent to, to keep it alive until we're stopped.
+	[runLoop addPort:[NSMachPort port] forMode:NSDefaultRunLoopMode];
+	
+	[startupLock unlockWithCondition:THREAD_RUNNING];
+	
+	[pool release];
+	
+	while(!shouldStop)
+	{
+		pool = [[NSAutoreleasePool alloc] init];
+		
+		[runLoop runMode:NSDefaultRunLoopMode beforeDate:[NSDate distantFuture]];
+		
+		[pool release];
+	}
+}
+
+- (void)wakeUp
+{
+	// Nothing to do, the run loop simply needed to come around
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The PseudoTcpThreadedSocketCore is the half of a PseudoTcpThreadedSocket that lives on the network thread,
+ * as the delegate of the underlying socket.
+ * 
+ * It's a separate object so that it can outlive the PseudoTcpThreadedSocket,
+ * until the network thread gets around to detaching it from the underlying socket.
+**/
+@interface PseudoTcpThreadedSocketCore : NSObject
+{
+@public
+	// Only touched on the network thread (after init)
+	id <PseudoTcpSocket> socket;
+	BOOL closeSent;
+	BOOL writing;     // If set, we're within the writeOutgoing loop
+	BOOL writeAgain;  // If set, writeOutgoing was called again from within its loop
+	
+	// Only touched on the delegate thread (after init)
+	PseudoTcpThreadedSocket *owner;  // Not retained, cleared when the owner is deallocated
+	
+	// Never changed after init (until detach, which comes after the owner is gone)
+	AsyncUdpSocket *udpSocket;
+	NSThread *networkThread;
+	NSThread *delegateThread;
+	
+	// Shared by both threads, under the lock.
+	// The lock is recursive, as the underlying socket may call back into us while we're writing to it.
+	pthread_mutex_t lock;
+	NSArray *runLoopModes;
+	NSMutableData *incoming;
+	NSMutableData *outgoing;
+	UInt32 outgoingOffset;
+	BOOL readStalled;
+	BOOL writeBlocked;
+	BOOL writeScheduled;
+	BOOL closeRequested;
+	UInt8 events;
+	NSError *closeError;
+	BOOL deliveryScheduled;
+}
+- (id)initWithSocket:(id <PseudoTcpSocket>)socket delegateThread:(NSThread *)thread;
+- (void)attach;
+- (void)setRunLoopModes:(NSArray *)modes;
+- (NSArray *)runLoopModes;
+- (NSMutableData *)takeIncoming:(NSMutableData *)emptyBuffer;
+- (UInt32)appendOutgoing:(const UInt8 *)bytes length:(UInt32)length;
+- (void)requestClose;
+- (void)delegateChanged;
+- (void)readAvailable;
+- (void)writeOutgoing;
+- (void)postEvents:(UInt8)newEvents error:(NSError *)err;
+- (void)deliverEvents;
+- (void)detach;
+@end
+
+@implementation PseudoTcpThreadedSocketCore
+
+- (id)initWithSocket:(id <PseudoTcpSocket>)aSocket delegateThread:(NSThread *)aThread
+{
+	if((self = [super init]))
+	{
+		socket = [aSocket retain];
+		udpSocket = [[aSocket udpSocket] retain];
+		closeSent = NO;
+		writing = NO;
+		writeAgain = NO;
+		
+		owner = nil;
+		
+		networkThread = [[NSThread currentThread] retain];
+		delegateThread = [aThread retain];
+		
+		pthread_mutexattr_t attr;
+		pthread_mutexattr_init(&attr);
+		pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+		pthread_mutex_init(&lock, &attr);
+		pthread_mutexattr_destroy(&attr);
+		
+		runLoopModes = [[NSArray alloc] initWithObjects:NSDefaultRunLoopMode, nil];
+		incoming = [[NSMutableData alloc] initWithCapacity:PSEUDO_TCP_THREADED_BUFFER_SIZE];
+		outgoing = [[NSMutableData alloc] initWithCapacity:PSEUDO_TCP_THREADED_BUFFER_SIZE];
+		outgoingOffset = 0;
+		
+		readStalled = NO;
+		writeBlocked = NO;
+		writeScheduled = NO;
+		closeRequested = NO;
+		
+		events = 0;
+		closeError = nil;
+		deliveryScheduled = NO;
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	// By now detach has run on the network thread, and released the socket
+	[networkThread release];
+	[delegateThread release];
+	[runLoopModes release];
+	[incoming release];
+	[outgoing release];
+	[closeError release];
+	pthread_mutex_destroy(&lock);
+	[super dealloc];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Delegate Thread
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)setRunLoopModes:(NSArray *)modes
+{
+	pthread_mutex_lock(&lock);
+	
+	[runLoopModes autorelease];
+	runLoopModes = [modes copy];
+	
+	pthread_mutex_unlock(&lock);
+}
+
+- (NSArray *)runLoopModes
+{
+	pthread_mutex_lock(&lock);
+	
+	NSArray *result = [[runLoopModes retain] autorelease];
+	
+	pthread_mutex_unlock(&lock);
+	
+	return result;
+}
+
+/**
+ * Swaps the given (empty) buffer for the one the network thread has been reading into, and returns it.
+**/
+- (NSMutableData *)takeIncoming:(NSMutableData *)emptyBuffer
+{
+	[emptyBuffer setLength:0];
+	
+	pthread_mutex_lock(&lock);
+	
+	NSMutableData *result = incoming;
+	incoming = emptyBuffer;
+	
+	BOOL shouldResume = readStalled;
+	readStalled = NO;
+	
+	pthread_mutex_unlock(&lock);
+	
+	if(shouldResume)
+	{
+		// There's room again, for whatever the network thread left in the socket
+		[self performSelector:@selector(readAvailable)
+		             onThread:networkThread
+		           withObject:nil
+		        waitUntilDone:NO
+		                modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+	}
+	
+	return result;
+}
+
+/**
+ * Copies as much of the given data as there's room for into the outgoing buffer, and returns how much that was.
+**/
+- (UInt32)appendOutgoing:(const UInt8 *)bytes length:(UInt32)length
+{
+	pthread_mutex_lock(&lock);
+	
+	UInt32 buffered = [outgoing length] - outgoingOffset;
+	UInt32 available = (buffered < PSEUDO_TCP_THREADED_BUFFER_SIZE) ? PSEUDO_TCP_THREADED_BUFFER_SIZE - buffered : 0;
+	
+	UInt32 accepted = MIN(length, available);
+	if(accepted < length)
+	{
+		writeBlocked = YES;
+	}
+	
+	[outgoing appendBytes:bytes length:accepted];
+	
+	BOOL shouldSchedule = (accepted > 0) && !writeScheduled;
+	if(shouldSchedule)
+	{
+		writeScheduled = YES;
+	}
+	
+	pthread_mutex_unlock(&lock);
+	
+	if(shouldSchedule)
+	{
+		[self performSelector:@selector(writeOutgoing)
+		             onThread:networkThread
+		           withObject:nil
+		        waitUntilDone:NO
+		                modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+	}
+	
+	return accepted;
+}
+
+- (void)requestClose
+{
+	pthread_mutex_lock(&lock);
+	
+	closeRequested = YES;
+	
+	BOOL shouldSchedule = !writeScheduled;
+	writeScheduled = YES;
+	
+	pthread_mutex_unlock(&lock);
+	
+	if(shouldSchedule)
+	{
+		[self performSelector:@selector(writeOutgoing)
+		             onThread:networkThread
+		           withObject:nil
+		        waitUntilDone:NO
+		                modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+	}
+}
+
+/**
+ * Called when the owner is given a delegate, in case there were events waiting for one.
+**/
+- (void)delegateChanged
+{
+	pthread_mutex_lock(&lock);
+	
+	BOOL shouldSchedule = (events != 0) && !deliveryScheduled;
+	if(shouldSchedule)
+	{
+		deliveryScheduled = YES;
+	}
+	
+	NSArray *modes = [[runLoopModes retain] autorelease];
+	
+	pthread_mutex_unlock(&lock);
+	
+	if(shouldSchedule)
+	{
+		// Not right away, so whoever set the delegate can finish setting up first
+		[self performSelector:@selector(deliverEvents)
+		             onThread:delegateThread
+		           withObject:nil
+		        waitUntilDone:NO
+		                modes:modes];
+	}
+}
+
+/**
+ * Delivers everything that's happened since the last batch, in the order the socket itself would have.
+**/
+- (void)deliverEvents
+{
+	pthread_mutex_lock(&lock);
+	
+	deliveryScheduled = NO;
+	
+	if(owner == nil || [owner delegate] == nil)
+	{
+		// Sockets are handed over before they're given a delegate (see delegateChanged),
+		// and anything that happened in between mustn't be lost.
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	
+	UInt8 batch = events;
+	NSError *err = [closeError autorelease];
+	
+	events = 0;
+	closeError = nil;
+	
+	pthread_mutex_unlock(&lock);
+	
+	if((batch & kWillClose) || (batch & kDidClose))
+	{
+		[owner markClosed];
+	}
+	
+	// The owner may be released by its own delegate, part way through the batch,
+	// so we check it before each method.
+	
+	if((batch & kHasBytesAvailable) && owner)
+	{
+		id theDelegate = [owner delegate];
+		if([theDelegate respondsToSelector:@selector(onPseudoTcpHasBytesAvailable:)])
+		{
+			[theDelegate onPseudoTcpHasBytesAvailable:owner];
+		}
+	}
+	
+	if((batch & kCanAcceptBytes) && owner)
+	{
+		id theDelegate = [owner delegate];
+		if([theDelegate respondsToSelector:@selector(onPseudoTcpCanAcceptBytes:)])
+		{
+			[theDelegate onPseudoTcpCanAcceptBytes:owner];
+		}
+	}
+	
+	if((batch & kWillClose) && owner)
+	{
+		id theDelegate = [owner delegate];
+		if([theDelegate respondsToSelector:@selector(onPseudoTcp:willCloseWithError:)])
+		{
+			[theDelegate onPseudoTcp:owner willCloseWithError:err];
+		}
+	}
+	
+	if((batch & kDidClose) && owner)
+	{
+		id theDelegate = [owner delegate];
+		if([theDelegate respondsToSelector:@selector(onPseudoTcpDidClose:)])
+		{
+			[theDelegate onPseudoTcpDidClose:owner];
+		}
+	}
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Network Thread
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)attach
+{
+	[socket setDelegate:self];
+	
+	// Data may have arrived before we took over as the delegate
+	if([socket hasBytesAvailable])
+	{
+		[self readAvailable];
+	}
+}
+
+/**
+ * Moves data out of the socket's receive buffer, and into the incoming buffer, until one is empty or the other full.
+**/
+- (void)readAvailable
+{
+	if(socket == nil) return;
+	
+	BOOL didRead = NO;
+	
+	pthread_mutex_lock(&lock);
+	
+	UInt32 buffered = [incoming length];
+	
+	while(buffered < PSEUDO_TCP_THREADED_BUFFER_SIZE)
+	{
+		const UInt8 *bytes;
+		UInt32 length = [socket peekBytes:&bytes];
+		
+		if(length == 0) break;
+		
+		length = MIN(length, PSEUDO_TCP_THREADED_BUFFER_SIZE - buffered);
+		
+		[incoming appendBytes:bytes length:length];
+		[socket consumeBytes:length];
+		
+		buffered += length;
+		didRead = YES;
+	}
+	
+	if(buffered >= PSEUDO_TCP_THREADED_BUFFER_SIZE && [socket hasBytesAvailable])
+	{
+		// We'll carry on once the delegate thread takes the buffer
+		readStalled = YES;
+	}
+	
+	pthread_mutex_unlock(&lock);
+	
+	if(didRead)
+	{
+		[self postEvents:kHasBytesAvailable error:nil];
+	}
+}
+
+/**
+ * Hands as much of the outgoing buffer to the socket as it will take.
+**/
+- (void)writeOutgoing
+{
+	// The socket may tell us it can accept more bytes from within its own writeData method.
+	// The lock is recursive, so that would bring us straight back here, in the middle of the loop below.
+	// Rather than writing from a stale offset, the nested call just asks the loop to go around again.
+	if(writing)
+	{
+		writeAgain = YES;
+		return;
+	}
+	
+	pthread_mutex_lock(&lock);
+	
+	writeScheduled = NO;
+	
+	if(socket == nil)
+	{
+		pthread_mutex_unlock(&lock);
+		return;
+	}
+	
+	writing = YES;
+	
+	do
+	{
+		writeAgain = NO;
+		
+		while(outgoingOffset < [outgoing length])
+		{
+			UInt32 length = [outgoing length] - outgoingOffset;
+			UInt32 written = [socket writeData:outgoing atOffset:outgoingOffset withMaxLength:length];
+			
+			if(written == 0) break;
+			
+			outgoingOffset += written;
+		}
+	} while(writeAgain && (outgoingOffset < [outgoing length]));
+	
+	writing = NO;
+	
+	UInt32 length = [outgoing length];
+	
+	if(outgoingOffset == length)
+	{
+		[outgoing setLength:0];
+		outgoingOffset = 0;
+	}
+	else if(outgoingOffset >= (PSEUDO_TCP_THREADED_BUFFER_SIZE / 2))
+	{
+		// Compact the buffer, so it doesn't keep growing while the socket is slowly drained
+		[outgoing replaceBytesInRange:NSMakeRange(0, outgoingOffset) withBytes:NULL length:0];
+		outgoingOffset = 0;
+	}
+	
+	BOOL canAccept = writeBlocked && (([outgoing length] - outgoingOffset) < PSEUDO_TCP_THREADED_BUFFER_SIZE);
+	if(canAccept)
+	{
+		writeBlocked = NO;
+	}
+	
+	BOOL shouldClose = closeRequested && !closeSent && ([outgoing length] == 0);
+	
+	pthread_mutex_unlock(&lock);
+	
+	if(canAccept)
+	{
+		[self postEvents:kCanAcceptBytes error:nil];
+	}
+	
+	if(shouldClose)
+	{
+		closeSent = YES;
+		[socket closeAfterWriting];
+	}
+}
+
+/**
+ * Adds to the events waiting for the delegate thread, and schedules a delivery if one isn't already on its way.
+**/
+- (void)postEvents:(UInt8)newEvents error:(NSError *)err
+{
+	pthread_mutex_lock(&lock);
+	
+	events |= newEvents;
+	
+	if(err)
+	{
+		[closeError release];
+		closeError = [err retain];
+	}
+	
+	BOOL shouldSchedule = !deliveryScheduled;
+	deliveryScheduled = YES;
+	
+	NSArray *modes = [[runLoopModes retain] autorelease];
+	
+	pthread_mutex_unlock(&lock);
+	
+	if(shouldSchedule)
+	{
+		[self performSelector:@selector(deliverEvents)
+		             onThread:delegateThread
+		           withObject:nil
+		        waitUntilDone:NO
+		                modes:modes];
+	}
+}
+
+/**
+ * Called once the owner has been deallocated. Closes the socket if it wasn't already closed.
+**/
+- (void)detach
+{
+	if(socket == nil) return;
+	
+	[socket setDelegate:nil];
+	
+	if(!closeSent)
+	{
+		closeSent = YES;
+		[socket closeAfterWriting];
+	}
+	
+	[socket release];
+	socket = nil;
+	
+	[udpSocket release];
+	udpSocket = nil;
+}
+
+- (void)onPseudoTcpHasBytesAvailable:(id <PseudoTcpSocket>)sock
+{
+	[self readAvailable];
+}
+
+- (void)onPseudoTcpCanAcceptBytes:(id <PseudoTcpSocket>)sock
+{
+	[self writeOutgoing];
+}
+
+- (void)onPseudoTcp:(id <PseudoTcpSocket>)sock willCloseWithError:(NSError *)err
+{
+	// Anything still in the socket's receive buffer can still be read
+	[self readAvailable];
+	
+	[self postEvents:kWillClose error:err];
+}
+
+- (void)onPseudoTcpDidClose:(id <PseudoTcpSocket>)sock
+{
+	[self postEvents:kDidClose error:nil];
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpThreadedSocket
+
+- (id)initWithSocket:(id <PseudoTcpSocket>)socket delegateThread:(NSThread *)thread
+{
+	if((self = [super init]))
+	{
+		delegate = nil;
+		
+		readBuffer = [[NSMutableData alloc] initWithCapacity:PSEUDO_TCP_THREADED_BUFFER_SIZE];
+		readBufferOffset = 0;
+		closed = NO;
+		
+		core = [[PseudoTcpThreadedSocketCore alloc] initWithSocket:socket delegateThread:thread];
+		core->owner = self;
+		
+		// Only once the owner is set, as events may be posted straight away
+		[core attach];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	core->owner = nil;
+	
+	// The socket may only be touched on the network thread.
+	// The perform retains the core until it's done.
+	[core performSelector:@selector(detach)
+	             onThread:core->networkThread
+	           withObject:nil
+	        waitUntilDone:NO
+	                modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+	[core release];
+	
+	[readBuffer release];
+	[super dealloc];
+}
+
+- (AsyncUdpSocket *)udpSocket
+{
+	// The core releases the udp socket only after we're gone
+	return core->udpSocket;
+}
+
+- (id)delegate
+{
+	return delegate;
+}
+
+- (void)setDelegate:(id)newDelegate
+{
+	delegate = newDelegate;
+	
+	if(delegate)
+	{
+		[core delegateChanged];
+	}
+}
+
+- (BOOL)canAcceptBytes
+{
+	if(closed) return NO;
+	
+	pthread_mutex_lock(&core->lock);
+	
+	BOOL result = ([core->outgoing length] - core->outgoingOffset) < PSEUDO_TCP_THREADED_BUFFER_SIZE;
+	
+	pthread_mutex_unlock(&core->lock);
+	
+	return result;
+}
+
+- (UInt32)writeData:(NSData *)data atOffset:(UInt32)offset withMaxLength:(UInt32)length
+{
+	if(closed) return 0;
+	
+	if(offset >= [data length]) return 0;
+	
+	length = MIN(length, [data length] - offset);
+	
+	return [core appendOutgoing:((const UInt8 *)[data bytes] + offset) length:length];
+}
+
+- (BOOL)hasBytesAvailable
+{
+	const UInt8 *bytes;
+	return [self peekBytes:&bytes] > 0;
+}
+
+- (UInt32)read:(UInt8 *)buffer maxLength:(UInt32)length
+{
+	UInt32 total = 0;
+	
+	while(total < length)
+	{
+		const UInt8 *bytes;
+		UInt32 available = [self peekBytes:&bytes];
+		
+		if(available == 0) break;
+		
+		UInt32 count = MIN(available, length - total);
+		memcpy(buffer + total, bytes, count);
+		
+		[self consumeBytes:count];
+		total += count;
+	}
+	
+	return total;
+}
+
+- (UInt32)peekBytes:(const UInt8 **)bytesPtr
+{
+	if(readBufferOffset == [readBuffer length])
+	{
+		// Everything handed over so far has been read, so take whatever the network thread has read since
+		NSMutableData *newBuffer = [core takeIncoming:readBuffer];
+		
+		readBuffer = newBuffer;
+		readBufferOffset = 0;
+	}
+	
+	*bytesPtr = (const UInt8 *)[readBuffer bytes] + readBufferOffset;
+	
+	return [readBuffer length] - readBufferOffset;
+}
+
+- (void)consumeBytes:(UInt32)length
+{
+	readBufferOffset += MIN(length, [readBuffer length] - readBufferOffset);
+}
+
+- (void)closeAfterWriting
+{
+	if(closed) return;
+	
+	[core requestClose];
+}
+
+- (void)setRunLoopModes:(NSArray *)modes
+{
+	[core setRunLoopModes:modes];
+}
+
+- (NSArray *)runLoopModes
+{
+	return [core runLoopModes];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Private API
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)markClosed
+{
+	closed = YES;
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * The PseudoTcpThreadedConnectionCore is the half of a PseudoTcpThreadedConnection that lives on the network thread,
+ * as the delegate of the PseudoTcp socket and its multiplexer.
+**/
+@interface PseudoTcpThreadedConnectionCore : NSObject
+{
+@public
+	// Only touched on the network thread (or on the delegate thread while it waits for the network thread)
+	PseudoTcp *pseudoTcp;
+	PseudoTcpMultiplexer *multiplexer;
+	PseudoTcpThreadedSocket *singleSocket;  // The connection itself, when it isn't multiplexed, until it's handed out
+	PseudoTcpThreadedSocket *openedSocket;  // The result of openSocket, passed back to the waiting delegate thread
+	BOOL isActiveOpen;
+	
+	// Only touched on the delegate thread
+	PseudoTcpThreadedConnection *owner;  // Not retained, cleared when the owner is deallocated
+	
+	// Never changed after init
+	NSThread *delegateThread;
+}
+- (id)initWithDelegateThread:(NSThread *)thread;
+- (void)createPseudoTcpWithUdpSocket:(AsyncUdpSocket *)udpSocket;
+- (void)openActively;
+- (void)openPassively;
+- (void)openSocket;
+- (void)close;
+- (void)detach;
+- (void)deliverOpen:(NSNumber *)multiplexed;
+- (void)deliverAcceptedSocket:(PseudoTcpThreadedSocket *)socket;
+- (void)deliverClose;
+- (void)performOnDelegateThread:(SEL)selector withObject:(id)object;
+@end
+
+@implementation PseudoTcpThreadedConnectionCore
+
+- (id)initWithDelegateThread:(NSThread *)thread
+{
+	if((self = [super init]))
+	{
+		delegateThread = [thread retain];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	// By now detach has run on the network thread, and released the sockets
+	[delegateThread release];
+	[super dealloc];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Network Thread
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)createPseudoTcpWithUdpSocket:(AsyncUdpSocket *)udpSocket
+{
+	pseudoTcp = [[PseudoTcp alloc] initWithUdpSocket:udpSocket];
+	[pseudoTcp setDelegate:self];
+}
+
+- (void)openActively
+{
+	isActiveOpen = YES;
+	[pseudoTcp activeOpen];
+}
+
+- (void)openPassively
+{
+	isActiveOpen = NO;
+	[pseudoTcp passiveOpen];
+}
+
+- (void)openSocket
+{
+	if(multiplexer)
+	{
+		PseudoTcpStream *stream = [multiplexer openStream];
+		if(stream)
+		{
+			openedSocket = [[PseudoTcpThreadedSocket alloc] initWithSocket:stream delegateThread:delegateThread];
+		}
+	}
+	else
+	{
+		// Ownership passes to the delegate thread
+		openedSocket = singleSocket;
+		singleSocket = nil;
+	}
+}
+
+- (void)close
+{
+	if(multiplexer)
+	{
+		[multiplexer close];
+	}
+	else if(singleSocket)
+	{
+		// Open, but never handed out, so releasing it closes it
+		[singleSocket release];
+		singleSocket = nil;
+		
+		[self performOnDelegateThread:@selector(deliverClose) withObject:nil];
+	}
+	else if([pseudoTcp delegate] == self)
+	{
+		// Not open yet, so we'll hear about it in onPseudoTcpDidClose:
+		[pseudoTcp closeAfterWriting];
+	}
+}
+
+/**
+ * Called once the owner has been deallocated. Closes the connection, unless its socket was handed out.
+**/
+- (void)detach
+{
+	if(multiplexer)
+	{
+		[multiplexer setDelegate:nil];
+		[multiplexer close];
+		[multiplexer release];
+		multiplexer = nil;
+	}
+	else if([pseudoTcp delegate] == self)
+	{
+		[pseudoTcp setDelegate:nil];
+		[pseudoTcp closeAfterWriting];
+	}
+	
+	// If the connection was never handed out, this closes it
+	[singleSocket release];
+	singleSocket = nil;
+	
+	[pseudoTcp release];
+	pseudoTcp = nil;
+}
+
+- (void)performOnDelegateThread:(SEL)selector withObject:(id)object
+{
+	[self performSelector:selector
+	             onThread:delegateThread
+	           withObject:object
+	        waitUntilDone:NO
+	                modes:[NSArray arrayWithObject:NSRunLoopCommonModes]];
+}
+
+- (void)onPseudoTcpDidOpen:(PseudoTcp *)sock
+{
+	BOOL multiplexed = [sock receiverSupportsMultiplexing];
+	
+	if(multiplexed)
+	{
+		multiplexer = [[PseudoTcpMultiplexer alloc] initWithPseudoTcp:sock activeOpen:isActiveOpen];
+		[multiplexer setDelegate:self];
+	}
+	else
+	{
+		// Take over as the delegate now, so nothing that arrives before it's handed out is missed
+		singleSocket = [[PseudoTcpThreadedSocket alloc] initWithSocket:sock delegateThread:delegateThread];
+	}
+	
+	[self performOnDelegateThread:@selector(deliverOpen:) withObject:[NSNumber numberWithBool:multiplexed]];
+}
+
+- (void)onPseudoTcpDidClose:(PseudoTcp *)sock
+{
+	// The connection failed to open
+	[self performOnDelegateThread:@selector(deliverClose) withObject:nil];
+}
+
+- (void)multiplexer:(PseudoTcpMultiplexer *)sender didAcceptStream:(PseudoTcpStream *)stream
+{
+	PseudoTcpThreadedSocket *socket;
+	socket = [[[PseudoTcpThreadedSocket alloc] initWithSocket:stream delegateThread:delegateThread] autorelease];
+	
+	[self performOnDelegateThread:@selector(deliverAcceptedSocket:) withObject:socket];
+}
+
+- (void)multiplexerDidClose:(PseudoTcpMultiplexer *)sender
+{
+	[self performOnDelegateThread:@selector(deliverClose) withObject:nil];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Delegate Thread
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)deliverOpen:(NSNumber *)multiplexed
+{
+	if(owner == nil) return;
+	
+	[owner setOpen:YES multiplexed:[multiplexed boolValue]];
+	
+	id theDelegate = [owner delegate];
+	if([theDelegate respondsToSelector:@selector(threadedConnectionDidOpen:)])
+	{
+		[theDelegate threadedConnectionDidOpen:owner];
+	}
+}
+
+- (void)deliverAcceptedSocket:(PseudoTcpThreadedSocket *)socket
+{
+	// If nobody takes the socket, releasing it closes the stream
+	if(owner == nil) return;
+	
+	id theDelegate = [owner delegate];
+	if([theDelegate respondsToSelector:@selector(threadedConnection:didAcceptSocket:)])
+	{
+		[theDelegate threadedConnection:owner didAcceptSocket:socket];
+	}
+}
+
+- (void)deliverClose
+{
+	if(owner == nil) return;
+	
+	[owner setOpen:NO multiplexed:[owner isMultiplexed]];
+	
+	id theDelegate = [owner delegate];
+	if([theDelegate respondsToSelector:@selector(threadedConnectionDidClose:)])
+	{
+		[theDelegate threadedConnectionDidClose:owner];
+	}
+}
+
+@end
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark -
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+@implementation PseudoTcpThreadedConnection
+
+- (id)initWithUdpSocket:(AsyncUdpSocket *)udpSocket networkThread:(PseudoTcpNetworkThread *)thread
+{
+	if((self = [super init]))
+	{
+		networkThread = [thread retain];
+		delegate = nil;
+		
+		isOpen = NO;
+		isMultiplexed = NO;
+		
+		core = [[PseudoTcpThreadedConnectionCore alloc] initWithDelegateThread:[NSThread currentThread]];
+		core->owner = self;
+		
+		// The PseudoTcp socket becomes the delegate of the udp socket, on the network thread.
+		// Until then, nothing should be delivered to the old delegate.
+		[udpSocket setDelegate:nil];
+		[udpSocket moveToRunLoop:[networkThread runLoop]];
+		
+		[networkThread performSelector:@selector(createPseudoTcpWithUdpSocket:)
+		                        target:core
+		                    withObject:udpSocket
+		                 waitUntilDone:YES];
+		
+		if(core->pseudoTcp == nil)
+		{
+			[self release];
+			return nil;
+		}
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	core->owner = nil;
+	
+	// The perform retains the core until it's done
+	[networkThread performSelector:@selector(detach) target:core withObject:nil waitUntilDone:NO];
+	[core release];
+	
+	[networkThread release];
+	[super dealloc];
+}
+
+- (id)delegate
+{
+	return delegate;
+}
+
+- (void)setDelegate:(id)newDelegate
+{
+	delegate = newDelegate;
+}
+
+- (void)configurePseudoTcpWithSelector:(SEL)selector target:(id)target
+{
+	[networkThread performSelector:selector target:target withObject:core->pseudoTcp waitUntilDone:YES];
+}
+
+- (void)activeOpen
+{
+	[networkThread performSelector:@selector(openActively) target:core withObject:nil waitUntilDone:NO];
+}
+
+- (void)passiveOpen
+{
+	[networkThread performSelector:@selector(openPassively) target:core withObject:nil waitUntilDone:NO];
+}
+
+- (BOOL)isOpen
+{
+	return isOpen;
+}
+
+- (BOOL)isMultiplexed
+{
+	return isMultiplexed;
+}
+
+- (PseudoTcpThreadedSocket *)openSocket
+{
+	if(!isOpen) return nil;
+	
+	// The network thread never waits on us, so it's safe to wait on it
+	[networkThread performSelector:@selector(openSocket) target:core withObject:nil waitUntilDone:YES];
+	
+	PseudoTcpThreadedSocket *result = core->openedSocket;
+	core->openedSocket = nil;
+	
+	return [result autorelease];
+}
+
+- (void)close
+{
+	[networkThread performSelector:@selector(close) target:core withObject:nil waitUntilDone:NO];
+}
+
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+#pragma mark Private API
+////////////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+
+- (void)setOpen:(BOOL)openFlag multiplexed:(BOOL)multiplexedFlag
+{
+	isOpen = openFlag;
+	isMultiplexed = multiplexedFlag;
+}
+
+@end
@@ -13,15 +13,53 @@
 //    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 //  4 |                     Acknowledgment Number                     |
 //    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
-//    |               |   |S|A|P|R|S|F|                               |
-//  8 |    Control    |   |A|C|S|S|Y|I|            Window             |
-//    |               |   |K|K|H|T|N|N|                               |
+//    |               | |O|S|A|P|R|S|F|                               |
+//  8 |    Control    | |P|A|C|S|S|Y|I|            Window             |
+//    |               | |T|K|K|H|T|N|N|                               |
 //    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 // 12 |                             data                              |
 //    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
 // 
 // 
 // Note: All numbers are in network order.
+// 
+// If the SACK flag is set, the data is preceeded by the 32-bit sequence number being selectively acknowledged.
+// This only allows a single segment to be acknowledged per packet. Newer implementations instead use the
+// SACK option, which can describe several blocks of received data at once.
+// 
+// If the OPT flag is set, the data (and sack sequence, if any) is preceeded by an options block:
+// 
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+//    |    Length     |     Kind      |  Kind Length  |   Value ...   |
+//    +-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+-+
+// 
+// The length is the size of the entire options block, including the length byte itself.
+// Each option is then encoded as a kind, the length of the option (including the kind and length bytes), and a value.
+// Unknown options are skipped.
+// 
+// Older implementations ignore the OPT flag, and ignore any data that arrives on SYN packets.
+// So options may always be sent on SYN packets, but should only be sent on other packets if the remote host
+// set the OPT flag in its own SYN packet.
+
+// Option kinds
+#define PSEUDO_TCP_OPT_WSCALE   1    // Window scale shift count (1 byte)
+#define PSEUDO_TCP_OPT_MSS      2    // Maximum segment size the sender is able to receive (2 bytes)
+#define PSEUDO_TCP_OPT_SACK     3    // SACK blocks, as per RFC 2018 (8 bytes per block: left edge, right edge)
+#define PSEUDO_TCP_OPT_TS       4    // Timestamp value and echo reply, as per RFC 7323 (8 bytes)
+#define PSEUDO_TCP_OPT_FEC      5    // Parity group: segment count (1 byte), then each segment length (2 bytes each)
+#define PSEUDO_TCP_OPT_MUX      6    // The sender frames its data as multiplexed streams (no value, SYN only)
+
+// The maximum window scale shift count, as per RFC 1323
+#define PSEUDO_TCP_MAX_WSCALE  14
+
+// The maximum number of SACK blocks in a single packet, limited by the size of the options block.
+// If the packet also carries a timestamp, there's only room for 3.
+#define PSEUDO_TCP_MAX_SACK_BLOCKS     4
+#define PSEUDO_TCP_MAX_SACK_BLOCKS_TS  3
+
+// The maximum number of segments protected by a single parity packet.
+// The FEC option for a full group (19 bytes) still fits alongside a timestamp.
+#define PSEUDO_TCP_MAX_FEC_GROUP  8
 
 // The size of the Pseudo TCP header
 #define PSEUDO_TCP_HEADER_SIZE  12
@@ -29,63 +67,112 @@
 // The minimum size of a TCP packet, which includes just the headers
 #define MIN_PSEUDO_TCP_PACKET_SIZE    PSEUDO_TCP_HEADER_SIZE
 
+// The maximum size of an options block (same limit as real TCP)
+#define PSEUDO_TCP_MAX_OPTIONS_SIZE  40
+
+// The maximum number of bytes a packet may add to its data: header, sack sequence, and options
+#define PSEUDO_TCP_MAX_OVERHEAD  (PSEUDO_TCP_HEADER_SIZE + 4 + PSEUDO_TCP_MAX_OPTIONS_SIZE)
+
 
-@interface PseudoTcpPacket : NSObject
+// Flags, as they appear in the header
+#define PSEUDO_TCP_FLAG_FIN   (1 << 0)
+#define PSEUDO_TCP_FLAG_SYN   (1 << 1)
+#define PSEUDO_TCP_FLAG_RST   (1 << 2)
+#define PSEUDO_TCP_FLAG_PSH   (1 << 3)
+#define PSEUDO_TCP_FLAG_ACK   (1 << 4)
+#define PSEUDO_TCP_FLAG_SACK  (1 << 5)
+#define PSEUDO_TCP_FLAG_OPT   (1 << 6)
+
+// Indicates which options are present in a packet
+#define PSEUDO_TCP_HAS_WSCALE  (1 << 0)
+#define PSEUDO_TCP_HAS_MSS     (1 << 1)
+#define PSEUDO_TCP_HAS_SACK    (1 << 2)
+#define PSEUDO_TCP_HAS_TS      (1 << 3)
+#define PSEUDO_TCP_HAS_FEC     (1 << 4)
+#define PSEUDO_TCP_HAS_MUX     (1 << 5)
+
+/**
+ * A decoded Pseudo TCP packet.
+ * 
+ * This is a plain struct so packets can live on the stack, and be encoded directly into a preallocated
+ * datagram buffer (or decoded directly from a received datagram) without any heap allocations.
+ * 
+ * The payload is never owned by the packet.
+ * For a decoded packet, it points into the received datagram, and is only valid as long as the datagram is.
+**/
+struct PseudoTcpPacket
 {
 	UInt32 sequence;
 	UInt32 acknowledgement;
-	UInt8  control;
 	UInt8  flags;
 	UInt16 window;
 	UInt32 sackSequence;
 	
-	NSData *data;
+	UInt8  options;
+	UInt8  windowScale;
+	UInt16 maxSegmentSize;
+	UInt8  sackBlockCount;
+	UInt32 sackBlocks[PSEUDO_TCP_MAX_SACK_BLOCKS * 2];  // Pairs of left edge, right edge
+	UInt32 timestampValue;
+	UInt32 timestampEcho;
+	UInt8  fecCount;  // Zero in a SYN, which just offers parity support
+	UInt16 fecLengths[PSEUDO_TCP_MAX_FEC_GROUP];
 	
-	NSDate *firstSent;
-}
-
-- (id)initWithData:(NSData *)udpData;
-- (id)init;
-
-- (UInt32)sequence;
-- (void)setSequence:(UInt32)num;
-
-- (UInt32)acknowledgement;
-- (void)setAcknowledgement:(UInt32)num;
-
-- (UInt16)window;
-- (void)setWindow:(UInt16)num;
+	const void *data;
+	UInt32 dataLength;
+};
+typedef struct PseudoTcpPacket PseudoTcpPacket;
 
-- (BOOL)isSyn;
-- (void)setIsSyn:(BOOL)flag;
-
-- (BOOL)isAck;
-- (void)setIsAck:(BOOL)flag;
-
-- (BOOL)isRst;
-- (void)setIsRst:(BOOL)flag;
-
-- (BOOL)isSack;
-- (void)setIsSack:(BOOL)flag;
+/**
+ * Clears all fields of the packet.
+**/
+void PseudoTcpPacketInit(PseudoTcpPacket *packet);
 
-- (UInt32)sackSequence;
-- (void)setSackSequence:(UInt32)num;
+/**
+ * Decodes the given datagram into the packet.
+ * The packet's data will point into the given bytes.
+ * Returns NO if the datagram is too small to be a Pseudo TCP packet.
+**/
+BOOL PseudoTcpPacketDecode(PseudoTcpPacket *packet, const void *bytes, UInt32 length);
 
-- (NSData *)data;
-- (void)setData:(NSData *)payload;
+/**
+ * Returns the number of bytes the header (including sack sequence and options) will occupy when encoded.
+ * The data follows immediately after.
+**/
+UInt32 PseudoTcpPacketHeaderLength(const PseudoTcpPacket *packet);
 
-- (NSData *)packetData;
+/**
+ * Encodes the header (including sack sequence and options) into the given buffer,
+ * which must be at least PseudoTcpPacketHeaderLength bytes long. The OPT flag is set automatically.
+ * Returns the number of bytes written. The caller is responsible for appending the data.
+**/
+UInt32 PseudoTcpPacketEncodeHeader(const PseudoTcpPacket *packet, void *buffer);
 
-- (NSDate *)firstSent;
-- (void)setFirstSent:(NSDate *)date;
+void PseudoTcpPacketSetWindowScale(PseudoTcpPacket *packet, UInt8 shift);
+void PseudoTcpPacketSetMaxSegmentSize(PseudoTcpPacket *packet, UInt16 mss);
+void PseudoTcpPacketSetTimestamp(PseudoTcpPacket *packet, UInt32 value, UInt32 echo);
 
-- (BOOL)wasRetransmitted;
-- (void)setWasRetransmitted:(BOOL)flag;
+/**
+ * Marks the packet as a parity packet, protecting the given number of consecutive segments,
+ * starting at the packet's sequence number. The packet's data is the XOR of the segments' data,
+ * each padded with zeros to the length of the longest one.
+ * 
+ * A count of zero is used in SYN packets, to tell the remote host we understand parity packets.
+**/
+void PseudoTcpPacketSetFecGroup(PseudoTcpPacket *packet, UInt8 count, const UInt16 *lengths);
 
-- (BOOL)isEmptyWindowProbe;
-- (void)setIsEmptyWindowProbe:(BOOL)flag;
+/**
+ * Offers to multiplex streams over the connection (see PseudoTcpMultiplexer).
+ * Only used in SYN packets.
+**/
+void PseudoTcpPacketSetMultiplexing(PseudoTcpPacket *packet);
 
-- (BOOL)isRxQ;
-- (void)setIsRxQ:(BOOL)flag;
+/**
+ * Adds a SACK block covering the sequence numbers from the left edge up to (but not including) the right edge.
+ * Returns NO if the packet already contains the maximum number of blocks.
+ * 
+ * If the packet carries a timestamp, only the first PSEUDO_TCP_MAX_SACK_BLOCKS_TS blocks are encoded.
+ * So the most important blocks should be added first.
+**/
+BOOL PseudoTcpPacketAddSackBlock(PseudoTcpPacket *packet, UInt32 leftEdge, UInt32 rightEdge);
 
-@end
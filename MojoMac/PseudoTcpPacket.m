@@ -5,271 +5,356 @@
 **/
 
 #import "PseudoTcpPacket.h"
-#import "DDNumber.h"
+#import <arpa/inet.h>
 
 
-enum PseudoTcpPacketFlags
+static inline UInt32 ReadUInt32(const UInt8 *bytes)
 {
-	TCP_FIN  =  1 << 0,
-	TCP_SYN  =  1 << 1,
-	TCP_RST  =  1 << 2,
-	TCP_PSH  =  1 << 3,
-	TCP_ACK  =  1 << 4,
-	TCP_SACK =  1 << 5,
-};
+	UInt32 num;
+	memcpy(&num, bytes, sizeof(num));
+	return ntohl(num);
+}
 
-enum PseudoTcpPacketControlFlags
+static inline UInt16 ReadUInt16(const UInt8 *bytes)
 {
-	CTRL_RXMIT = 1 << 0,  // Was the packet retransmitted, or is this the first time sending it.
-	CTRL_PROBE = 1 << 1,  // Is this an empty window probe.
-	CTRL_ISRXQ = 1 << 2,  // Is this packet part of the retransmissionQueueEffectiveSize
-};
+	UInt16 num;
+	memcpy(&num, bytes, sizeof(num));
+	return ntohs(num);
+}
 
+static inline void WriteUInt32(UInt8 *bytes, UInt32 num)
+{
+	num = htonl(num);
+	memcpy(bytes, &num, sizeof(num));
+}
 
-@implementation PseudoTcpPacket
+static inline void WriteUInt16(UInt8 *bytes, UInt16 num)
+{
+	num = htons(num);
+	memcpy(bytes, &num, sizeof(num));
+}
 
-- (id)initWithData:(NSData *)udpData
+/**
+ * Parses the options block of a received packet.
+ * The given bytes point to the options length byte.
+**/
+static void ParseOptions(PseudoTcpPacket *packet, const UInt8 *bytes, UInt32 length)
 {
-	if((self = [super init]))
+	UInt32 offset = 1;
+	
+	while(offset + 2 <= length)
 	{
-		if([udpData length] >= MIN_PSEUDO_TCP_PACKET_SIZE)
+		UInt8 kind = bytes[offset];
+		UInt8 kindLength = bytes[offset + 1];
+		
+		if((kindLength < 2) || (offset + kindLength > length))
 		{
-			sequence         = [NSNumber extractUInt32FromData:udpData atOffset: 0 andConvertFromNetworkOrder:YES];
-			acknowledgement  = [NSNumber extractUInt32FromData:udpData atOffset: 4 andConvertFromNetworkOrder:YES];
-			
-			control          = [NSNumber extractUInt8FromData:udpData atOffset:8];
-			flags            = [NSNumber extractUInt8FromData:udpData atOffset:9];
-			
-			window           = [NSNumber extractUInt16FromData:udpData atOffset:10 andConvertFromNetworkOrder:YES];
+			// Malformed option - ignore the rest of the options block
+			break;
+		}
+		
+		if((kind == PSEUDO_TCP_OPT_WSCALE) && (kindLength == 3))
+		{
+			packet->options |= PSEUDO_TCP_HAS_WSCALE;
+			packet->windowScale = MIN(bytes[offset + 2], PSEUDO_TCP_MAX_WSCALE);
+		}
+		else if((kind == PSEUDO_TCP_OPT_MSS) && (kindLength == 4))
+		{
+			packet->options |= PSEUDO_TCP_HAS_MSS;
+			packet->maxSegmentSize = ReadUInt16(bytes + offset + 2);
+		}
+		else if((kind == PSEUDO_TCP_OPT_SACK) && (kindLength >= 10) && (((kindLength - 2) % 8) == 0))
+		{
+			packet->options |= PSEUDO_TCP_HAS_SACK;
+			packet->sackBlockCount = MIN((kindLength - 2) / 8, PSEUDO_TCP_MAX_SACK_BLOCKS);
 			
-			if([udpData length] > MIN_PSEUDO_TCP_PACKET_SIZE)
+			UInt32 i;
+			for(i = 0; i < packet->sackBlockCount * 2; i++)
 			{
-				if(flags & TCP_SACK)
-				{
-					if([udpData length] >= MIN_PSEUDO_TCP_PACKET_SIZE + 4)
-					{
-						sackSequence = [NSNumber extractUInt32FromData:udpData
-															  atOffset:12
-											andConvertFromNetworkOrder:YES];
-					}
-					if([udpData length] > MIN_PSEUDO_TCP_PACKET_SIZE + 4)
-					{
-						void *dataBytes = (void *)([udpData bytes] + 16);
-						data = [[NSData alloc] initWithBytes:dataBytes length:([udpData length] - 16)];
-					}
-				}
-				else
+				packet->sackBlocks[i] = ReadUInt32(bytes + offset + 2 + (i * 4));
+			}
+		}
+		else if((kind == PSEUDO_TCP_OPT_TS) && (kindLength == 10))
+		{
+			packet->options |= PSEUDO_TCP_HAS_TS;
+			packet->timestampValue = ReadUInt32(bytes + offset + 2);
+			packet->timestampEcho  = ReadUInt32(bytes + offset + 6);
+		}
+		else if((kind == PSEUDO_TCP_OPT_FEC) && (kindLength == 2))
+		{
+			packet->options |= PSEUDO_TCP_HAS_FEC;
+			packet->fecCount = 0;
+		}
+		else if((kind == PSEUDO_TCP_OPT_FEC) && (kindLength >= 5) && (kindLength == 3 + (bytes[offset + 2] * 2)))
+		{
+			if(bytes[offset + 2] <= PSEUDO_TCP_MAX_FEC_GROUP)
+			{
+				packet->options |= PSEUDO_TCP_HAS_FEC;
+				packet->fecCount = bytes[offset + 2];
+				
+				UInt32 i;
+				for(i = 0; i < packet->fecCount; i++)
 				{
-					void *dataBytes = (void *)([udpData bytes] + 12);
-					data = [[NSData alloc] initWithBytes:dataBytes length:([udpData length] - 12)];
+					packet->fecLengths[i] = ReadUInt16(bytes + offset + 3 + (i * 2));
 				}
 			}
 		}
+		else if((kind == PSEUDO_TCP_OPT_MUX) && (kindLength == 2))
+		{
+			packet->options |= PSEUDO_TCP_HAS_MUX;
+		}
+		
+		offset += kindLength;
 	}
-	return self;
-}
-
-- (id)init
-{
-	if((self = [super init]))
-	{
-		sequence         = 0;
-		acknowledgement  = 0;
-		control          = 0;
-		flags            = 0;
-		window           = 0;
-		sackSequence     = 0;
-	}
-	return self;
 }
 
-- (void)dealloc
-{
-	[data release];
-	[firstSent release];
-	[super dealloc];
-}
-
-- (UInt32)sequence {
-	return sequence;
-}
-- (void)setSequence:(UInt32)num {
-	sequence = num;
-}
-
-- (UInt32)acknowledgement {
-	return acknowledgement;
-}
-- (void)setAcknowledgement:(UInt32)num {
-	acknowledgement = num;
-}
-
-- (UInt16)window {
-	return window;
-}
-- (void)setWindow:(UInt16)num {
-	window = num;
-}
-
-- (BOOL)isSyn {
-	return (flags & TCP_SYN);
-}
-- (void)setIsSyn:(BOOL)flag
+/**
+ * Returns the number of sack blocks that fit in the options block, alongside the other options.
+**/
+static UInt32 EncodedSackBlockCount(const PseudoTcpPacket *packet)
 {
-	if(flag)
-		flags |= TCP_SYN;
+	if(packet->options & PSEUDO_TCP_HAS_TS)
+		return MIN(packet->sackBlockCount, PSEUDO_TCP_MAX_SACK_BLOCKS_TS);
 	else
-		flags &= ~TCP_SYN;
+		return packet->sackBlockCount;
 }
 
-- (BOOL)isAck {
-	return (flags & TCP_ACK);
-}
-- (void)setIsAck:(BOOL)flag
+/**
+ * Returns the size of the options block that will be included in the packet.
+ * If there are no options, returns zero.
+**/
+static UInt32 OptionsLength(const PseudoTcpPacket *packet)
 {
-	if(flag)
-		flags |= TCP_ACK;
-	else
-		flags &= ~TCP_ACK;
+	UInt32 length = 0;
+	
+	if(packet->options & PSEUDO_TCP_HAS_WSCALE) length += 3;
+	if(packet->options & PSEUDO_TCP_HAS_MSS)    length += 4;
+	if(packet->options & PSEUDO_TCP_HAS_SACK)   length += 2 + (EncodedSackBlockCount(packet) * 8);
+	if(packet->options & PSEUDO_TCP_HAS_TS)     length += 10;
+	if(packet->options & PSEUDO_TCP_HAS_FEC)    length += (packet->fecCount > 0) ? (3 + packet->fecCount * 2) : 2;
+	if(packet->options & PSEUDO_TCP_HAS_MUX)    length += 2;
+	
+	return (length > 0) ? (1 + length) : 0;
 }
 
-- (BOOL)isRst {
-	return (flags & TCP_RST);
-}
-- (void)setIsRst:(BOOL)flag
+/**
+ * Writes the options block into the given buffer, which must be at least OptionsLength bytes long.
+**/
+static void WriteOptions(const PseudoTcpPacket *packet, UInt8 *bytes)
 {
-	if(flag)
-		flags |= TCP_RST;
-	else
-		flags &= ~TCP_RST;
+	UInt32 offset = 1;
+	
+	if(packet->options & PSEUDO_TCP_HAS_WSCALE)
+	{
+		bytes[offset++] = PSEUDO_TCP_OPT_WSCALE;
+		bytes[offset++] = 3;
+		bytes[offset++] = packet->windowScale;
+	}
+	
+	if(packet->options & PSEUDO_TCP_HAS_MSS)
+	{
+		bytes[offset++] = PSEUDO_TCP_OPT_MSS;
+		bytes[offset++] = 4;
+		WriteUInt16(bytes + offset, packet->maxSegmentSize);
+		offset += 2;
+	}
+	
+	if(packet->options & PSEUDO_TCP_HAS_SACK)
+	{
+		UInt32 blockCount = EncodedSackBlockCount(packet);
+		
+		bytes[offset++] = PSEUDO_TCP_OPT_SACK;
+		bytes[offset++] = 2 + (blockCount * 8);
+		
+		UInt32 i;
+		for(i = 0; i < blockCount * 2; i++)
+		{
+			WriteUInt32(bytes + offset, packet->sackBlocks[i]);
+			offset += 4;
+		}
+	}
+	
+	if(packet->options & PSEUDO_TCP_HAS_TS)
+	{
+		bytes[offset++] = PSEUDO_TCP_OPT_TS;
+		bytes[offset++] = 10;
+		WriteUInt32(bytes + offset, packet->timestampValue);
+		WriteUInt32(bytes + offset + 4, packet->timestampEcho);
+		offset += 8;
+	}
+	
+	if(packet->options & PSEUDO_TCP_HAS_FEC)
+	{
+		bytes[offset++] = PSEUDO_TCP_OPT_FEC;
+		
+		if(packet->fecCount > 0)
+		{
+			bytes[offset++] = 3 + (packet->fecCount * 2);
+			bytes[offset++] = packet->fecCount;
+			
+			UInt32 i;
+			for(i = 0; i < packet->fecCount; i++)
+			{
+				WriteUInt16(bytes + offset, packet->fecLengths[i]);
+				offset += 2;
+			}
+		}
+		else
+		{
+			bytes[offset++] = 2;
+		}
+	}
+	
+	if(packet->options & PSEUDO_TCP_HAS_MUX)
+	{
+		bytes[offset++] = PSEUDO_TCP_OPT_MUX;
+		bytes[offset++] = 2;
+	}
+	
+	bytes[0] = (UInt8)offset;
 }
 
-- (BOOL)isSack {
-	return (flags & TCP_SACK);
-}
-- (void)setIsSack:(BOOL)flag
+void PseudoTcpPacketInit(PseudoTcpPacket *packet)
 {
-	if(flag)
-		flags |= TCP_SACK;
-	else
-		flags &= ~TCP_SACK;
+	bzero(packet, sizeof(PseudoTcpPacket));
 }
 
-- (UInt32)sackSequence {
-	return sackSequence;
-}
-- (void)setSackSequence:(UInt32)num {
-	sackSequence = num;
-}
-
-- (NSData *)data {
-	return data;
-}
-- (void)setData:(NSData *)payload
+BOOL PseudoTcpPacketDecode(PseudoTcpPacket *packet, const void *datagram, UInt32 length)
 {
-	if(data != payload)
+	PseudoTcpPacketInit(packet);
+	
+	if(length < MIN_PSEUDO_TCP_PACKET_SIZE)
 	{
-		[data release];
-		data = [payload retain]; // Retain, do NOT copy
-		
-		// Note: Do NOT copy the given data!!!
-		// When we generate the data objects from the send buffer, we create NSMutableData objects and copy the
-		// appropriate bytes into the mutable object.  If we perform a copy at this point, we'll be copying the
-		// bytes all over again just so we can store them in an immutable NSData object.  There's no need to do this,
-		// as after we set the data, the PseudoTcpPacket is the only object with a reference to the data.
+		return NO;
 	}
-}
-
-- (NSData *)packetData
-{
-	// If we create an NSMutableData object here, then it will get copied when it gets sent to AsyncUdpSocket.
-	// Since we know the size of the packet we're creating, we can easily create an NSData object instead.
-	
-	UInt16 dataLength = [data length];
-	UInt16 optionsLength = [self isSack] ? 4 : 0;
 	
-	UInt32 packetSize = PSEUDO_TCP_HEADER_SIZE + optionsLength + dataLength;
-	void *byteBuffer = malloc(packetSize);
+	const UInt8 *bytes = (const UInt8 *)datagram;
 	
-	UInt32 seq = htonl(sequence);
-	memcpy(byteBuffer+0, &seq, sizeof(seq));
+	packet->sequence         = ReadUInt32(bytes + 0);
+	packet->acknowledgement  = ReadUInt32(bytes + 4);
 	
-	UInt32 ack = htonl(acknowledgement);
-	memcpy(byteBuffer+4, &ack, sizeof(ack));
+	// Remember: control byte is reserved
 	
-	// Remember: control bits are for internal use only
+	packet->flags            = bytes[9];
+	packet->window           = ReadUInt16(bytes + 10);
 	
-	UInt8 zero = 0;
-	memcpy(byteBuffer+8, &zero, sizeof(zero));
-	memcpy(byteBuffer+9, &flags, sizeof(flags));
+	UInt32 offset = PSEUDO_TCP_HEADER_SIZE;
 	
-	UInt16 wnd = htons(window);
-	memcpy(byteBuffer+10, &wnd, sizeof(wnd));
-	
-	if([self isSack])
+	if(packet->flags & PSEUDO_TCP_FLAG_SACK)
 	{
-		UInt32 sak = htonl(sackSequence);
-		memcpy(byteBuffer+12, &sak, sizeof(sak));
-		
-		if(data)
+		if(length >= offset + 4)
 		{
-			memcpy(byteBuffer+16, [data bytes], dataLength);
+			packet->sackSequence = ReadUInt32(bytes + offset);
 		}
+		offset += 4;
 	}
-	else
+	
+	if((packet->flags & PSEUDO_TCP_FLAG_OPT) && (length > offset))
 	{
-		if(data)
-		{
-			memcpy(byteBuffer+12, [data bytes], dataLength);
-		}
+		// The options length includes the length byte itself, so it can never be zero
+		UInt8 optionsLength = MAX(1, bytes[offset]);
+		
+		ParseOptions(packet, bytes + offset, MIN(optionsLength, length - offset));
+		
+		offset += optionsLength;
 	}
 	
-	return [NSData dataWithBytesNoCopy:byteBuffer length:packetSize freeWhenDone:YES];
+	if(length > offset)
+	{
+		packet->data = bytes + offset;
+		packet->dataLength = length - offset;
+	}
+	
+	return YES;
 }
 
-- (NSDate *)firstSent {
-	return firstSent;
+UInt32 PseudoTcpPacketHeaderLength(const PseudoTcpPacket *packet)
+{
+	UInt32 sackLength = (packet->flags & PSEUDO_TCP_FLAG_SACK) ? 4 : 0;
+	
+	return PSEUDO_TCP_HEADER_SIZE + sackLength + OptionsLength(packet);
 }
-- (void)setFirstSent:(NSDate *)date
+
+UInt32 PseudoTcpPacketEncodeHeader(const PseudoTcpPacket *packet, void *buffer)
 {
-	if(firstSent != date)
+	UInt8 *bytes = (UInt8 *)buffer;
+	UInt32 optionsLength = OptionsLength(packet);
+	
+	WriteUInt32(bytes + 0, packet->sequence);
+	WriteUInt32(bytes + 4, packet->acknowledgement);
+	
+	// Remember: control byte is reserved
+	bytes[8] = 0;
+	
+	// The OPT flag is set automatically, depending on whether or not we have any options to send
+	if(optionsLength > 0)
+		bytes[9] = packet->flags | PSEUDO_TCP_FLAG_OPT;
+	else
+		bytes[9] = packet->flags & ~PSEUDO_TCP_FLAG_OPT;
+	
+	WriteUInt16(bytes + 10, packet->window);
+	
+	UInt32 offset = PSEUDO_TCP_HEADER_SIZE;
+	
+	if(packet->flags & PSEUDO_TCP_FLAG_SACK)
+	{
+		WriteUInt32(bytes + offset, packet->sackSequence);
+		offset += 4;
+	}
+	
+	if(optionsLength > 0)
 	{
-		[firstSent release];
-		firstSent = [date retain];
+		WriteOptions(packet, bytes + offset);
+		offset += optionsLength;
 	}
+	
+	return offset;
 }
 
-- (BOOL)wasRetransmitted {
-	return (control & CTRL_RXMIT);
-}
-- (void)setWasRetransmitted:(BOOL)flag
+void PseudoTcpPacketSetWindowScale(PseudoTcpPacket *packet, UInt8 shift)
 {
-	if(flag)
-		control |= CTRL_RXMIT;
-	else
-		control &= ~CTRL_RXMIT;
+	packet->options |= PSEUDO_TCP_HAS_WSCALE;
+	packet->windowScale = MIN(shift, PSEUDO_TCP_MAX_WSCALE);
 }
 
-- (BOOL)isEmptyWindowProbe {
-	return (control & CTRL_PROBE);
+void PseudoTcpPacketSetMaxSegmentSize(PseudoTcpPacket *packet, UInt16 mss)
+{
+	packet->options |= PSEUDO_TCP_HAS_MSS;
+	packet->maxSegmentSize = mss;
 }
-- (void)setIsEmptyWindowProbe:(BOOL)flag
+
+void PseudoTcpPacketSetTimestamp(PseudoTcpPacket *packet, UInt32 value, UInt32 echo)
 {
-	if(flag)
-		control |= CTRL_PROBE;
-	else
-		control &= ~CTRL_PROBE;
+	packet->options |= PSEUDO_TCP_HAS_TS;
+	packet->timestampValue = value;
+	packet->timestampEcho = echo;
 }
 
-- (BOOL)isRxQ {
-	return (control & CTRL_ISRXQ);
+void PseudoTcpPacketSetFecGroup(PseudoTcpPacket *packet, UInt8 count, const UInt16 *lengths)
+{
+	packet->options |= PSEUDO_TCP_HAS_FEC;
+	packet->fecCount = MIN(count, PSEUDO_TCP_MAX_FEC_GROUP);
+	
+	UInt32 i;
+	for(i = 0; i < packet->fecCount; i++)
+	{
+		packet->fecLengths[i] = lengths[i];
+	}
 }
-- (void)setIsRxQ:(BOOL)flag
+
+void PseudoTcpPacketSetMultiplexing(PseudoTcpPacket *packet)
 {
-	if(flag)
-		control |= CTRL_ISRXQ;
-	else
-		control &= ~CTRL_ISRXQ;
+	packet->options |= PSEUDO_TCP_HAS_MUX;
 }
 
-@end
+BOOL PseudoTcpPacketAddSackBlock(PseudoTcpPacket *packet, UInt32 leftEdge, UInt32 rightEdge)
+{
+	if(packet->sackBlockCount >= PSEUDO_TCP_MAX_SACK_BLOCKS) return NO;
+	
+	packet->sackBlocks[(packet->sackBlockCount * 2)]     = leftEdge;
+	packet->sackBlocks[(packet->sackBlockCount * 2) + 1] = rightEdge;
+	packet->sackBlockCount++;
+	
+	packet->options |= PSEUDO_TCP_HAS_SACK;
+	return YES;
+}
@@ -0,0 +1,101 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import <Foundation/Foundation.h>
+
+// A hierarchical timer wheel, shared by all the PseudoTcp connections on a thread.
+//
+// Every connection needs several timers (delayed ack, retransmission, persist, keep-alive),
+// and most of them get re-armed or cancelled on nearly every packet. Doing this with NSTimer means
+// creating, scheduling and invalidating run loop timers constantly, which adds up with many connections.
+//
+// Instead, each connection embeds PseudoTcpTimer structs, and the wheel links them into a slot according to
+// when they expire. Scheduling and cancelling a timer is simply linking and unlinking it from a list.
+// A single run loop timer drives the wheel, and only fires when there's something to do.
+//
+// The wheel has a resolution of 10 milliseconds.
+// The first level has 256 slots of one tick each (2.56 seconds), and each of the upper two levels has 64 slots,
+// each of which covers the entire level below it (about 164 seconds and 3 hours respectively).
+// Timers in the upper levels are cascaded down into the lower levels as their time approaches.
+// Longer timers are clamped to the maximum.
+
+#define PSEUDO_TCP_WHEEL_L0_BITS  8
+#define PSEUDO_TCP_WHEEL_LN_BITS  6
+#define PSEUDO_TCP_WHEEL_SLOTS    ((1 << PSEUDO_TCP_WHEEL_L0_BITS) + (2 * (1 << PSEUDO_TCP_WHEEL_LN_BITS)))
+
+/**
+ * A timer managed by a PseudoTcpTimerWheel.
+ * It's meant to be embedded in the object that owns it, so scheduling a timer never requires an allocation.
+ *
+ * The target is not retained, so the owner must cancel its timers before it's deallocated.
+ * All fields should be treated as private.
+**/
+struct PseudoTcpTimer
+{
+	struct PseudoTcpTimer *next;
+	struct PseudoTcpTimer *prev;
+	UInt64 expires;  // Tick at which the timer fires
+	id target;
+	SEL selector;
+};
+typedef struct PseudoTcpTimer PseudoTcpTimer;
+
+/**
+ * Prepares a timer for use.
+ * When the timer fires, the given selector (which takes no arguments) is invoked on the target.
+**/
+void PseudoTcpTimerInit(PseudoTcpTimer *timer, id target, SEL selector);
+
+/**
+ * Returns whether the timer is currently scheduled.
+**/
+BOOL PseudoTcpTimerIsScheduled(const PseudoTcpTimer *timer);
+
+/**
+ * Returns the current monotonic time, in nanoseconds.
+ * Unlike NSDate or CFAbsoluteTimeGetCurrent, this doesn't jump around if the user changes the clock,
+ * and doesn't require any allocations.
+**/
+UInt64 PseudoTcpMonotonicTime(void);
+
+
+@interface PseudoTcpTimerWheel : NSObject
+{
+	PseudoTcpTimer slots[PSEUDO_TCP_WHEEL_SLOTS];  // List heads
+	UInt32 timerCount;
+	
+	UInt64 epoch;     // Monotonic time of tick zero
+	UInt64 nextTick;  // The next tick to be processed
+	
+	NSTimer *driverTimer;
+	UInt64 driverTick;  // Tick at which the driverTimer is set to fire, or UINT64_MAX if it isn't
+	
+	NSMutableArray *runLoopModes;
+}
+
+/**
+ * Returns the timer wheel for the current thread, creating it if needed.
+ * The wheel is driven by the current thread's run loop.
+**/
++ (PseudoTcpTimerWheel *)currentTimerWheel;
+
+/**
+ * The wheel runs in the default run loop mode, plus any modes added here.
+**/
+- (void)addRunLoopModes:(NSArray *)modes;
+
+/**
+ * Schedules the timer to fire after the given interval.
+ * If the timer is already scheduled, it's rescheduled.
+**/
+- (void)scheduleTimer:(PseudoTcpTimer *)timer withTimeInterval:(NSTimeInterval)interval;
+
+/**
+ * Cancels the timer. Does nothing if the timer isn't scheduled.
+**/
+- (void)cancelTimer:(PseudoTcpTimer *)timer;
+
+@end
@@ -0,0 +1,388 @@
+/**
+ * Created by Robbie Hanson of Deusty, LLC.
+ * This file is distributed under the GPL license.
+ * Commercial licenses are available from deusty.com.
+**/
+
+#import "PseudoTcpTimerWheel.h"
+#import <mach/mach_time.h>
+
+// Debug levels: 0-off, 1-error, 2-warn, 3-info, 4-verbose
+#ifdef CONFIGURATION_DEBUG
+  #define DEBUG_LEVEL 2
+#else
+  #define DEBUG_LEVEL 2
+#endif
+#include "DDLog.h"
+
+#define TICK_NANOS  10000000  // 10 milliseconds
+
+#define L0_SIZE  (1 << PSEUDO_TCP_WHEEL_L0_BITS)
+#define LN_SIZE  (1 << PSEUDO_TCP_WHEEL_LN_BITS)
+#define L0_MASK  (L0_SIZE - 1)
+#define LN_MASK  (LN_SIZE - 1)
+
+#define L1_OFFSET  (L0_SIZE)
+#define L2_OFFSET  (L0_SIZE + LN_SIZE)
+
+#define MAX_TICKS  ((UInt64)1 << (PSEUDO_TCP_WHEEL_L0_BITS + (2 * PSEUDO_TCP_WHEEL_LN_BITS)))
+
+#define THREAD_DICTIONARY_KEY  @"PseudoTcpTimerWheel"
+
+
+void PseudoTcpTimerInit(PseudoTcpTimer *timer, id target, SEL selector)
+{
+	timer->next = NULL;
+	timer->prev = NULL;
+	timer->expires = 0;
+	timer->target = target;
+	timer->selector = selector;
+}
+
+BOOL PseudoTcpTimerIsScheduled(const PseudoTcpTimer *timer)
+{
+	return (timer->next != NULL);
+}
+
+UInt64 PseudoTcpMonotonicTime(void)
+{
+	static mach_timebase_info_data_t timebase;
+	
+	if(timebase.denom == 0)
+	{
+		mach_timebase_info(&timebase);
+	}
+	
+	UInt64 now = mach_absolute_time();
+	
+	if(timebase.numer == timebase.denom)
+		return now;
+	else
+		return (UInt64)((double)now * timebase.numer / timebase.denom);
+}
+
+/**
+ * Each slot is a circular doubly linked list, with the slot itself acting as the list head.
+**/
+static inline void ListInit(PseudoTcpTimer *head)
+{
+	head->next = head;
+	head->prev = head;
+}
+
+static inline BOOL ListIsEmpty(const PseudoTcpTimer *head)
+{
+	return (head->next == head);
+}
+
+static inline void ListAppend(PseudoTcpTimer *head, PseudoTcpTimer *timer)
+{
+	timer->prev = head->prev;
+	timer->next = head;
+	head->prev->next = timer;
+	head->prev = timer;
+}
+
+static inline void ListRemove(PseudoTcpTimer *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = NULL;
+	timer->prev = NULL;
+}
+
+/**
+ * Moves all the timers in the source list to the (empty) destination list.
+**/
+static inline void ListMove(PseudoTcpTimer *src, PseudoTcpTimer *dst)
+{
+	if(ListIsEmpty(src))
+	{
+		ListInit(dst);
+	}
+	else
+	{
+		dst->next = src->next;
+		dst->prev = src->prev;
+		dst->next->prev = dst;
+		dst->prev->next = dst;
+		ListInit(src);
+	}
+}
+
+@interface PseudoTcpTimerWheel (PrivateAPI)
+- (UInt64)currentTick;
+- (void)addTimer:(PseudoTcpTimer *)timer;
+- (void)cascadeSlot:(UInt32)slot;
+- (void)processTick:(UInt64)tick;
+- (void)rescheduleDriverTimer;
+- (void)doDriverTimer:(NSTimer *)aTimer;
+@end
+
+@implementation PseudoTcpTimerWheel
+
++ (PseudoTcpTimerWheel *)currentTimerWheel
+{
+	NSMutableDictionary *threadDictionary = [[NSThread currentThread] threadDictionary];
+	
+	PseudoTcpTimerWheel *wheel = [threadDictionary objectForKey:THREAD_DICTIONARY_KEY];
+	if(wheel == nil)
+	{
+		wheel = [[[PseudoTcpTimerWheel alloc] init] autorelease];
+		[threadDictionary setObject:wheel forKey:THREAD_DICTIONARY_KEY];
+	}
+	
+	return wheel;
+}
+
+- (id)init
+{
+	if((self = [super init]))
+	{
+		UInt32 i;
+		for(i = 0; i < PSEUDO_TCP_WHEEL_SLOTS; i++)
+		{
+			ListInit(&slots[i]);
+		}
+		timerCount = 0;
+		
+		epoch = PseudoTcpMonotonicTime();
+		nextTick = 0;
+		
+		// The driver timer is rescheduled via its fire date, so the repeat interval is irrelevant.
+		// It simply needs to be a repeating timer so it remains valid after firing.
+		driverTimer = [[NSTimer timerWithTimeInterval:(60.0 * 60.0 * 24.0 * 365.0)
+											   target:self
+											 selector:@selector(doDriverTimer:)
+											 userInfo:nil
+											  repeats:YES] retain];
+		[driverTimer setFireDate:[NSDate distantFuture]];
+		driverTick = UINT64_MAX;
+		
+		runLoopModes = [[NSMutableArray alloc] initWithCapacity:1];
+		[self addRunLoopModes:[NSArray arrayWithObject:NSDefaultRunLoopMode]];
+	}
+	return self;
+}
+
+- (void)dealloc
+{
+	// Note: The driver timer retains us, and the thread dictionary retains us as well.
+	// So in practice the wheel lives as long as its thread.
+	[driverTimer invalidate];
+	[driverTimer release];
+	[runLoopModes release];
+	[super dealloc];
+}
+
+- (void)addRunLoopModes:(NSArray *)modes
+{
+	CFRunLoopRef runLoop = [[NSRunLoop currentRunLoop] getCFRunLoop];
+	
+	unsigned int i, count = [modes count];
+	for(i = 0; i < count; i++)
+	{
+		NSString *mode = [modes objectAtIndex:i];
+		
+		if(![runLoopModes containsObject:mode])
+		{
+			[runLoopModes addObject:mode];
+			CFRunLoopAddTimer(runLoop, (CFRunLoopTimerRef)driverTimer, (CFStringRef)mode);
+		}
+	}
+}
+
+- (UInt64)currentTick
+{
+	return (PseudoTcpMonotonicTime() - epoch) / TICK_NANOS;
+}
+
+/**
+ * Links the timer into the slot appropriate for its expiration tick.
+ * The expiration tick must not be before nextTick.
+**/
+- (void)addTimer:(PseudoTcpTimer *)timer
+{
+	UInt64 delta = timer->expires - nextTick;
+	UInt32 slot;
+	
+	if(delta < L0_SIZE)
+	{
+		slot = (UInt32)(timer->expires & L0_MASK);
+	}
+	else if(delta < (L0_SIZE * LN_SIZE))
+	{
+		slot = L1_OFFSET + (UInt32)((timer->expires >> PSEUDO_TCP_WHEEL_L0_BITS) & LN_MASK);
+	}
+	else
+	{
+		if(delta >= MAX_TICKS)
+		{
+			timer->expires = nextTick + MAX_TICKS - 1;
+		}
+		
+		UInt32 shift = PSEUDO_TCP_WHEEL_L0_BITS + PSEUDO_TCP_WHEEL_LN_BITS;
+		slot = L2_OFFSET + (UInt32)((timer->expires >> shift) & LN_MASK);
+	}
+	
+	ListAppend(&slots[slot], timer);
+}
+
+- (void)scheduleTimer:(PseudoTcpTimer *)timer withTimeInterval:(NSTimeInterval)interval
+{
+	if(timer->next)
+	{
+		ListRemove(timer);
+		timerCount--;
+	}
+	
+	UInt64 now = [self currentTick];
+	
+	if(timerCount == 0)
+	{
+		// The wheel has been idle, so there's no need to step through all the ticks that passed in the meantime
+		nextTick = MAX(nextTick, now);
+	}
+	
+	// Round up, so the timer never fires early
+	UInt64 ticks = (UInt64)((MAX(interval, 0.0) * 1000000000.0 + (TICK_NANOS - 1)) / TICK_NANOS);
+	
+	timer->expires = MAX(now + MAX(ticks, 1), nextTick);
+	
+	[self addTimer:timer];
+	timerCount++;
+	
+	if(timer->expires < driverTick)
+	{
+		[self rescheduleDriverTimer];
+	}
+}
+
+- (void)cancelTimer:(PseudoTcpTimer *)timer
+{
+	if(timer->next)
+	{
+		ListRemove(timer);
+		timerCount--;
+	}
+	
+	// We don't bother rescheduling the driver timer.
+	// If it fires with nothing to do, it'll simply reschedule itself.
+}
+
+/**
+ * Moves every timer in the given upper level slot down into the lower levels.
+**/
+- (void)cascadeSlot:(UInt32)slot
+{
+	PseudoTcpTimer list;
+	ListMove(&slots[slot], &list);
+	
+	while(!ListIsEmpty(&list))
+	{
+		PseudoTcpTimer *timer = list.next;
+		ListRemove(timer);
+		
+		[self addTimer:timer];
+	}
+}
+
+/**
+ * Cascades the upper levels if needed, and fires all the timers that expire at the given tick.
+ * This must be called for every tick in order.
+**/
+- (void)processTick:(UInt64)tick
+{
+	UInt32 index = (UInt32)(tick & L0_MASK);
+	
+	if(index == 0)
+	{
+		UInt32 l1Index = (UInt32)((tick >> PSEUDO_TCP_WHEEL_L0_BITS) & LN_MASK);
+		
+		[self cascadeSlot:(L1_OFFSET + l1Index)];
+		
+		if(l1Index == 0)
+		{
+			UInt32 l2Index = (UInt32)((tick >> (PSEUDO_TCP_WHEEL_L0_BITS + PSEUDO_TCP_WHEEL_LN_BITS)) & LN_MASK);
+			
+			[self cascadeSlot:(L2_OFFSET + l2Index)];
+		}
+	}
+	
+	// Move the expired timers to a separate list before firing any of them.
+	// This way, the target is free to schedule or cancel any timer (including those in the expired list).
+	
+	PseudoTcpTimer expired;
+	ListMove(&slots[index], &expired);
+	
+	while(!ListIsEmpty(&expired))
+	{
+		PseudoTcpTimer *timer = expired.next;
+		ListRemove(timer);
+		timerCount--;
+		
+		id target = [timer->target retain];
+		
+		[target performSelector:timer->selector];
+		
+		[target release];
+	}
+}
+
+/**
+ * Sets the driver timer to fire at the next tick that has something to do.
+**/
+- (void)rescheduleDriverTimer
+{
+	if(timerCount == 0)
+	{
+		driverTick = UINT64_MAX;
+		[driverTimer setFireDate:[NSDate distantFuture]];
+		return;
+	}
+	
+	// We need to wake up for the first non-empty slot in the first level,
+	// or for the next cascade, whichever comes first.
+	
+	UInt64 cascadeTick = (nextTick & L0_MASK) ? ((nextTick | L0_MASK) + 1) : nextTick;
+	UInt64 fireTick = cascadeTick;
+	
+	UInt64 tick;
+	for(tick = nextTick; tick < cascadeTick; tick++)
+	{
+		if(!ListIsEmpty(&slots[tick & L0_MASK]))
+		{
+			fireTick = tick;
+			break;
+		}
+	}
+	
+	if(fireTick != driverTick)
+	{
+		driverTick = fireTick;
+		
+		UInt64 fireTime = epoch + (fireTick * TICK_NANOS);
+		UInt64 now = PseudoTcpMonotonicTime();
+		
+		NSTimeInterval interval = (fireTime > now) ? ((double)(fireTime - now) / 1000000000.0) : 0.0;
+		
+		CFRunLoopTimerSetNextFireDate((CFRunLoopTimerRef)driverTimer, CFAbsoluteTimeGetCurrent() + interval);
+	}
+}
+
+- (void)doDriverTimer:(NSTimer *)aTimer
+{
+	driverTick = UINT64_MAX;
+	
+	UInt64 now = [self currentTick];
+	
+	while((nextTick <= now) && (timerCount > 0))
+	{
+		[self processTick:nextTick];
+		nextTick++;
+	}
+	
+	[self rescheduleDriverTimer];
+}
+
+@end